@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "indexer.h"
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+static void addChunk(stringArena *arena, char *chunk) {
+    if (arena->chunkCount == arena->chunkCapacity) {
+        arena->chunkCapacity = arena->chunkCapacity ? arena->chunkCapacity * 2 : 16;
+        arena->chunks = realloc(arena->chunks, arena->chunkCapacity * sizeof(char *));
+        if (arena->chunks == NULL) ERR("realloc");
+    }
+    arena->chunks[arena->chunkCount++] = chunk;
+}
+
+char *arenaCopy(stringArena *arena, const char *s, size_t length) {
+    if (length + 1 > arena->available - arena->used) {
+        // strings longer than a chunk get a chunk of their own
+        size_t size = length + 1 > ARENA_CHUNK_SIZE ? length + 1 : ARENA_CHUNK_SIZE;
+        char *chunk = malloc(size);
+        if (chunk == NULL) ERR("malloc");
+        addChunk(arena, chunk);
+        arena->used = 0;
+        arena->available = size;
+    }
+    char *copy = arena->chunks[arena->chunkCount - 1] + arena->used;
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    arena->used += length + 1;
+    return copy;
+}
+
+void arenaMerge(stringArena *to, stringArena *from) {
+    if (from->chunkCount == 0) return;
+    // last chunk of from becomes the last one, so its free space is used by next copies
+    for (size_t i = 0; i < from->chunkCount; i++) addChunk(to, from->chunks[i]);
+    to->used = from->used;
+    to->available = from->available;
+    free(from->chunks);
+    memset(from, 0, sizeof(stringArena));
+}
+
+void freeArena(stringArena *arena) {
+    for (size_t i = 0; i < arena->chunkCount; i++) free(arena->chunks[i]);
+    free(arena->chunks);
+    memset(arena, 0, sizeof(stringArena));
+}
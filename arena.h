@@ -0,0 +1,24 @@
+#ifndef FILE_INDEXER_ARENA_H
+#define FILE_INDEXER_ARENA_H
+
+#include <stddef.h>
+
+// storage for strings that keep their address until the arena is freed
+typedef struct stringArena_s {
+    char **chunks;
+    size_t chunkCount;
+    size_t chunkCapacity;
+    // bytes used and available in the last chunk
+    size_t used;
+    size_t available;
+} stringArena;
+
+// copies length bytes of s and terminates the copy with NUL
+char *arenaCopy(stringArena *arena, const char *s, size_t length);
+
+// moves all strings of from into to, from is left empty
+void arenaMerge(stringArena *to, stringArena *from);
+
+void freeArena(stringArena *arena);
+
+#endif //FILE_INDEXER_ARENA_H
@@ -0,0 +1,503 @@
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "indexer.h"
+#include "index.h"
+#include "walk.h"
+#include "snapshot.h"
+#include "query.h"
+
+#define DEFAULT_TREE_FILES 10000
+#define DEFAULT_QUERY_SIZES "10000,1000000"
+#define DEFAULT_ITERATIONS 101
+#define DEFAULT_DEPTH 4
+#define DEFAULT_FANOUT 8
+#define DEFAULT_SEED 42
+#define MAX_QUERY_SIZES 16
+#define SYNTHETIC_OWNERS 16
+#define SYNTHETIC_FIRST_UID 1000
+#define MAX_FILE_SIZE 65536
+// generated trees hold jpeg, png, zip and gzip files, the types indexed by default
+#define BENCH_TYPES (TYPE_GZIP + 1)
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s [-n files] [-s sizes] [-D depth] [-F fanout] [-x mix] [-i iterations] "
+                    "[-j threads] [-r seed] [-d dir] [-o output] [-k]\n", name);
+    fprintf(stderr, "n - number of files of the generated tree used to measure index build, 0 skips it\n");
+    fprintf(stderr, "s - comma separated numbers of entries of synthetic indexes used to measure queries,\n");
+    fprintf(stderr, "\tby default %s, e.g. 10000,1000000,10000000\n", DEFAULT_QUERY_SIZES);
+    fprintf(stderr, "D, F - depth of directory tree and number of subdirectories of each directory\n");
+    fprintf(stderr, "x - percent of jpeg,png,zip,gzip files, the rest have other content (default 10,40,10,10)\n");
+    fprintf(stderr, "i - number of runs of every query\n");
+    fprintf(stderr, "j - number of threads traversing the directory\n");
+    fprintf(stderr, "r - seed of generated tree, same seed gives the same tree\n");
+    fprintf(stderr, "d - directory in which the tree and index files are created, by default $TMPDIR or /tmp\n");
+    fprintf(stderr, "o - file results are written to as JSON lines, by default stdout\n");
+    fprintf(stderr, "k - keep generated tree and index files\n");
+    exit(EXIT_FAILURE);
+}
+
+typedef struct treeSpec_s {
+    int depth;
+    int fanout;
+    size_t files;
+    // percent of files of each indexed type, the rest are of type not indexed
+    int mix[BENCH_TYPES];
+    uint64_t seed;
+} treeSpec;
+
+typedef struct benchOptions_s {
+    treeSpec tree;
+    size_t querySizes[MAX_QUERY_SIZES];
+    int querySizeCount;
+    int iterations;
+    int threads;
+    const char *directory;
+    FILE *output;
+    int keep;
+} benchOptions;
+
+static const char *words[] = {"photo", "scan", "backup", "report", "img", "archive", "holiday", "data"};
+
+static const char *extensions[BENCH_TYPES + 1] = {"", "jpg", "png", "zip", "gz", "txt"};
+
+static const unsigned char magics[BENCH_TYPES + 1][4] = {
+        {0},
+        {0xff, 0xd8, 0xff, 0xe0},
+        {0x89, 0x50, 0x4e, 0x47},
+        {0x50, 0x4b, 0x03, 0x04},
+        {0x1f, 0x8b, 0x08, 0x00},
+        {'t', 'e', 'x', 't'},
+};
+
+// formats path into buffer of size bytes, a path that does not fit ends the benchmark
+static void formatPath(char *path, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(path, size, format, args);
+    va_end(args);
+    if (length < 0 || (size_t) length >= size) {
+        fprintf(stderr, "Path too long: %s...\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// splitmix64, same seed gives the same sequence on every platform
+static uint64_t nextRandom(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double systemSeconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int pickType(const treeSpec *spec, uint64_t *state) {
+    int roll = (int) (nextRandom(state) % 100);
+    for (int type = TYPE_JPEG; type < BENCH_TYPES; type++) {
+        if (roll < spec->mix[type]) return type;
+        roll -= spec->mix[type];
+    }
+    return TYPE_NONE;
+}
+
+static void addGenerated(indexedFile **entries, size_t *count, size_t *capacity, stringArena *strings,
+                         const char *path, int type) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        *entries = realloc(*entries, *capacity * sizeof(indexedFile));
+        if (*entries == NULL) ERR("realloc");
+    }
+    indexedFile *entry = &(*entries)[(*count)++];
+    memset(entry, 0, sizeof(indexedFile));
+    entry->path = arenaCopy(strings, path, strlen(path));
+    entry->fileName = strrchr(entry->path, '/') + 1;
+    entry->fileType = type;
+}
+
+// full tree of directories below root followed by files spread over them at random;
+// files of type not indexed are generated with TYPE_NONE
+static size_t generateTree(const treeSpec *spec, const char *root, indexedFile **entries, stringArena *strings) {
+    uint64_t state = spec->seed;
+    size_t count = 0, capacity = 0;
+    char path[4096];
+    *entries = NULL;
+
+    formatPath(path, sizeof(path), "%s/root", root);
+    addGenerated(entries, &count, &capacity, strings, path, TYPE_DIRECTORY);
+    size_t levelStart = 0, levelEnd = 1;
+    for (int level = 0; level < spec->depth; level++) {
+        for (size_t parent = levelStart; parent < levelEnd; parent++) {
+            for (int child = 0; child < spec->fanout; child++) {
+                formatPath(path, sizeof(path), "%s/%s%d", (*entries)[parent].path,
+                           words[nextRandom(&state) % (sizeof(words) / sizeof(words[0]))], child);
+                addGenerated(entries, &count, &capacity, strings, path, TYPE_DIRECTORY);
+            }
+        }
+        levelStart = levelEnd;
+        levelEnd = count;
+    }
+
+    size_t directories = count;
+    for (size_t i = 0; i < spec->files; i++) {
+        int type = pickType(spec, &state);
+        const char *directory = (*entries)[nextRandom(&state) % directories].path;
+        const char *word = words[nextRandom(&state) % (sizeof(words) / sizeof(words[0]))];
+        formatPath(path, sizeof(path), "%s/%s_%zu.%s", directory, word, i,
+                   extensions[type == TYPE_NONE ? BENCH_TYPES : type]);
+        addGenerated(entries, &count, &capacity, strings, path, type);
+        indexedFile *entry = &(*entries)[count - 1];
+        entry->size = (off_t) (nextRandom(&state) % MAX_FILE_SIZE);
+        entry->UID = SYNTHETIC_FIRST_UID + (uid_t) (nextRandom(&state) % SYNTHETIC_OWNERS);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        (*entries)[i].device = 1;
+        (*entries)[i].inode = i + 1;
+        if ((*entries)[i].fileType == TYPE_DIRECTORY) (*entries)[i].size = 4096;
+    }
+    return count;
+}
+
+// files get their magic number and are extended to their size without writing it
+static void materializeTree(const indexedFile *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const indexedFile *entry = &entries[i];
+        if (entry->fileType == TYPE_DIRECTORY) {
+            if (mkdir(entry->path, 0755) < 0) ERR("mkdir");
+            continue;
+        }
+        int fd = open(entry->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) ERR("open");
+        const unsigned char *magic = magics[entry->fileType == TYPE_NONE ? BENCH_TYPES : entry->fileType];
+        if (write(fd, magic, 4) != 4) ERR("write");
+        if (entry->size > 4 && ftruncate(fd, entry->size) < 0) ERR("ftruncate");
+        close(fd);
+    }
+}
+
+static int removeEntry(const char *path, const struct stat *s, int flag, struct FTW *ftw) {
+    (void) s, (void) flag, (void) ftw;
+    if (remove(path) < 0) perror(path);
+    return 0;
+}
+
+static void removeTree(const char *path) {
+    nftw(path, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static void buildBenchmark(const benchOptions *options, const char *root) {
+    indexedFile *entries;
+    stringArena strings = {0};
+    size_t count = generateTree(&options->tree, root, &entries, &strings);
+    materializeTree(entries, count);
+    free(entries);
+    freeArena(&strings);
+
+    char treeRoot[4096], indexPath[4096];
+    formatPath(treeRoot, sizeof(treeRoot), "%s/root", root);
+    formatPath(indexPath, sizeof(indexPath), "%s/build-index", root);
+
+    // cold traversal reads magic number of every file, warm one reuses types of unchanged files
+    walkResult cold, warm;
+    double systemStart = systemSeconds(), start = now();
+    if (parallelWalk(treeRoot, options->threads, NULL, NULL, NULL, NULL, NULL, &cold) < 0) ERR("parallelWalk");
+    double coldSeconds = now() - start, coldSystem = systemSeconds() - systemStart;
+
+    typeCache cache;
+    buildTypeCache(&cache, cold.entries, cold.count, cold.skipped, cold.skippedCount);
+    systemStart = systemSeconds();
+    start = now();
+    if (parallelWalk(treeRoot, options->threads, &cache, NULL, NULL, NULL, NULL, &warm) < 0) ERR("parallelWalk");
+    double warmSeconds = now() - start, warmSystem = systemSeconds() - systemStart;
+    freeTypeCache(&cache);
+
+    start = now();
+    if (writeIndexFile(indexPath, cold.entries, cold.count) < 0) ERR("writeIndexFile");
+    double writeSeconds = now() - start;
+
+    indexFile file;
+    start = now();
+    if (loadIndexFile(indexPath, &file) < 0) ERR("loadIndexFile");
+    double loadSeconds = now() - start;
+    size_t indexBytes = file.mapLength;
+    closeIndexFile(&file);
+
+    size_t seen = cold.count + cold.skippedCount;
+    fprintf(options->output, "{\"benchmark\":\"build\",\"format_version\":%d,\"threads\":%d,\"seen\":%zu,"
+                             "\"entries\":%zu,\"cold_seconds\":%.6f,\"cold_files_per_sec\":%.0f,"
+                             "\"cold_magic_reads\":%zu,\"cold_system_seconds\":%.6f,\"warm_seconds\":%.6f,"
+                             "\"warm_files_per_sec\":%.0f,\"warm_magic_reads\":%zu,\"warm_system_seconds\":%.6f,"
+                             "\"write_seconds\":%.6f,\"load_seconds\":%.6f,\"index_bytes\":%zu}\n",
+            INDEX_VERSION, options->threads, seen, cold.count, coldSeconds, seen / coldSeconds, cold.magicReads,
+            coldSystem, warmSeconds, seen / warmSeconds, warm.magicReads, warmSystem, writeSeconds, loadSeconds,
+            indexBytes);
+    freeWalkResult(&cold);
+    freeWalkResult(&warm);
+    if (!options->keep) removeTree(treeRoot);
+}
+
+enum benchQuery {
+    BENCH_COUNT,
+    BENCH_LARGERTHAN,
+    BENCH_NAMEPART,
+    BENCH_NAMEPART_SHORT,
+    BENCH_OWNER,
+    BENCH_SCAN,
+    BENCH_QUERY_COUNT
+};
+
+static const char *queryNames[BENCH_QUERY_COUNT] = {"count", "largerthan", "namepart", "namepart_short", "owner",
+                                                     "find_scan"};
+
+// disjunction cannot be served by any index, so it is answered by a full scan
+#define BENCH_SCAN_QUERY "name _7 or size < 100 count"
+
+// runs query the way commands do, with full paths of results rebuilt, returns number of results
+static size_t runBenchQuery(const snapshot *s, int query, queryPlan *scanPlan, size_t *sink) {
+    pathCache paths;
+    size_t found = 0;
+    int i;
+    initSnapshotPathCache(s, &paths);
+    switch (query) {
+        case BENCH_COUNT:
+            for (int type = 0; type < TYPE_COUNT; type++) found += snapshotTypeCount(s, type);
+            break;
+        case BENCH_LARGERTHAN: {
+            sizeCursor cursor;
+            snapshotSizeRange(s, MAX_FILE_SIZE - MAX_FILE_SIZE / 100, INT64_MAX, &cursor);
+            while ((i = snapshotSizeNext(s, &cursor)) >= 0) {
+                *sink += strlen(snapshotEntryPath(s, &paths, i));
+                found++;
+            }
+            freeSizeCursor(&cursor);
+            break;
+        }
+        case BENCH_NAMEPART:
+        case BENCH_NAMEPART_SHORT: {
+            nameCursor cursor;
+            snapshotNameSearch(s, query == BENCH_NAMEPART ? "holiday_12" : "_7", &cursor);
+            while ((i = snapshotNameNext(s, &cursor)) >= 0) {
+                *sink += strlen(snapshotEntryPath(s, &paths, i));
+                found++;
+            }
+            break;
+        }
+        case BENCH_OWNER: {
+            postingCursor cursor;
+            uid_t uid = SYNTHETIC_FIRST_UID + 3;
+            snapshotPostings(s, TYPE_PNG, &uid, &cursor);
+            while ((i = snapshotPostingNext(s, &cursor)) >= 0) {
+                *sink += strlen(snapshotEntryPath(s, &paths, i));
+                found++;
+            }
+            break;
+        }
+        case BENCH_SCAN: {
+            resultWriter w;
+            initWriter(&w, NULL, OUTPUT_TEXT);
+            found = runPlan(&w, &s, 1, scanPlan);
+            finishWriter(&w);
+            break;
+        }
+        default:
+            break;
+    }
+    freePathCache(&paths);
+    return found;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void queryBenchmark(const benchOptions *options, const char *root, size_t size) {
+    treeSpec spec = options->tree;
+    spec.files = size;
+    indexedFile *generated;
+    stringArena strings = {0};
+    size_t generatedCount = generateTree(&spec, root, &generated, &strings);
+
+    // index holds only entries of indexed types
+    size_t count = 0;
+    for (size_t i = 0; i < generatedCount; i++) {
+        if (generated[i].fileType != TYPE_NONE) generated[count++] = generated[i];
+    }
+    char indexPath[4096];
+    formatPath(indexPath, sizeof(indexPath), "%s/query-index-%zu", root, size);
+    double start = now();
+    if (writeIndexFile(indexPath, generated, count) < 0) ERR("writeIndexFile");
+    double writeSeconds = now() - start;
+    free(generated);
+    freeArena(&strings);
+
+    indexFile file;
+    start = now();
+    if (loadIndexFile(indexPath, &file) < 0) ERR("loadIndexFile");
+    double loadSeconds = now() - start;
+    start = now();
+    if (verifyIndexFile(&file) < 0) ERR("verifyIndexFile");
+    double verifySeconds = now() - start;
+    fprintf(options->output, "{\"benchmark\":\"load\",\"format_version\":%d,\"entries\":%zu,\"index_bytes\":%zu,"
+                             "\"write_seconds\":%.6f,\"load_seconds\":%.6f,\"verify_seconds\":%.6f}\n",
+            INDEX_VERSION, count, file.mapLength, writeSeconds, loadSeconds, verifySeconds);
+    snapshot *s = createSnapshot(createBase(&file));
+
+    double *latencies = malloc(options->iterations * sizeof(double));
+    if (latencies == NULL) ERR("malloc");
+    size_t sink = 0;
+    queryPlan *scanPlan = malloc(sizeof(queryPlan));
+    if (scanPlan == NULL) ERR("malloc");
+    if (parseQuery(BENCH_SCAN_QUERY, scanPlan, stderr) < 0) ERR("parseQuery");
+    for (int query = 0; query < BENCH_QUERY_COUNT; query++) {
+        size_t results = 0;
+        for (int run = 0; run < options->iterations; run++) {
+            start = now();
+            results = runBenchQuery(s, query, scanPlan, &sink);
+            latencies[run] = (now() - start) * 1000;
+        }
+        qsort(latencies, options->iterations, sizeof(double), compareDoubles);
+        fprintf(options->output, "{\"benchmark\":\"query\",\"format_version\":%d,\"entries\":%zu,\"query\":\"%s\","
+                                 "\"iterations\":%d,\"results\":%zu,\"p50_ms\":%.4f,\"p99_ms\":%.4f,"
+                                 "\"max_ms\":%.4f}\n",
+                INDEX_VERSION, count, queryNames[query], options->iterations, results,
+                latencies[options->iterations / 2], latencies[(options->iterations * 99) / 100],
+                latencies[options->iterations - 1]);
+        fflush(options->output);
+    }
+    free(latencies);
+    free(scanPlan);
+    releaseSnapshot(s);
+    if (!options->keep) unlink(indexPath);
+    // keeps the compiler from dropping path rebuilding
+    if (sink == 1) fprintf(stderr, "\n");
+}
+
+static void parseSizes(char *argument, benchOptions *options, char *name) {
+    options->querySizeCount = 0;
+    char *save;
+    for (char *token = strtok_r(argument, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        if (options->querySizeCount == MAX_QUERY_SIZES) usage(name);
+        long long size = atoll(token);
+        if (size <= 0) usage(name);
+        options->querySizes[options->querySizeCount++] = (size_t) size;
+    }
+}
+
+static void parseMix(char *argument, benchOptions *options, char *name) {
+    int total = 0;
+    char *save;
+    char *token = strtok_r(argument, ",", &save);
+    for (int type = TYPE_JPEG; type < BENCH_TYPES; type++) {
+        if (token == NULL) usage(name);
+        options->tree.mix[type] = atoi(token);
+        if (options->tree.mix[type] < 0) usage(name);
+        total += options->tree.mix[type];
+        token = strtok_r(NULL, ",", &save);
+    }
+    if (total > 100) usage(name);
+}
+
+void readArguments(int argc, char **argv, benchOptions *options) {
+    char defaultSizes[] = DEFAULT_QUERY_SIZES;
+    char *output = NULL;
+    parseSizes(defaultSizes, options, argv[0]);
+    int c;
+    while ((c = getopt(argc, argv, "n:s:D:F:x:i:j:r:d:o:k")) != -1)
+        switch (c) {
+            case 'n':
+                options->tree.files = (size_t) atoll(optarg);
+                break;
+            case 's':
+                parseSizes(optarg, options, argv[0]);
+                break;
+            case 'D':
+                options->tree.depth = atoi(optarg);
+                if (options->tree.depth < 0 || options->tree.depth > 16) usage(argv[0]);
+                break;
+            case 'F':
+                options->tree.fanout = atoi(optarg);
+                if (options->tree.fanout < 1) usage(argv[0]);
+                break;
+            case 'x':
+                parseMix(optarg, options, argv[0]);
+                break;
+            case 'i':
+                options->iterations = atoi(optarg);
+                if (options->iterations < 1) usage(argv[0]);
+                break;
+            case 'j':
+                options->threads = atoi(optarg);
+                if (options->threads < 1 || options->threads > WALK_MAX_THREADS) usage(argv[0]);
+                break;
+            case 'r':
+                options->tree.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                options->directory = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'k':
+                options->keep = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    if (output != NULL && (options->output = fopen(output, "w")) == NULL) ERR("fopen");
+}
+
+int main(int argc, char **argv) {
+    benchOptions options = {
+            .tree = {.depth = DEFAULT_DEPTH, .fanout = DEFAULT_FANOUT, .files = DEFAULT_TREE_FILES,
+                    .mix = {[TYPE_JPEG] = 10, [TYPE_PNG] = 40, [TYPE_ZIP] = 10, [TYPE_GZIP] = 10},
+                    .seed = DEFAULT_SEED},
+            .iterations = DEFAULT_ITERATIONS,
+            .threads = defaultWalkThreads(),
+            .output = stdout};
+    readArguments(argc, argv, &options);
+
+    if (options.directory == NULL) {
+        options.directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    }
+    char root[4096];
+    formatPath(root, sizeof(root), "%s/mole-bench-XXXXXX", options.directory);
+    if (mkdtemp(root) == NULL) ERR("mkdtemp");
+
+    if (options.tree.files > 0) buildBenchmark(&options, root);
+    for (int i = 0; i < options.querySizeCount; i++) {
+        queryBenchmark(&options, root, options.querySizes[i]);
+    }
+
+    if (!options.keep) {
+        removeTree(root);
+    } else {
+        fprintf(stderr, "Generated files kept in %s\n", root);
+    }
+    if (options.output != stdout) fclose(options.output);
+    return EXIT_SUCCESS;
+}
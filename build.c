@@ -0,0 +1,696 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "build.h"
+#include "index.h"
+#include "checkpoint.h"
+
+// bytes gathered for each section before they are written at its offset
+#define BUILD_STREAM_BUFFER (256 * 1024)
+// bytes of a section read at a time while its checksum is computed, a multiple of 8
+#define BUILD_CHECKSUM_CHUNK (1024 * 1024)
+// secondary sorters fed while entries are merged: sizes, types, owners, trigrams, rollups and both rollup orders
+#define BUILD_SORTERS 7
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+// '/' sorts before any other byte, so every directory is directly followed by its whole subtree
+static int comparePaths(const void *a, const void *b) {
+    const unsigned char *x = (const unsigned char *) a + sizeof(checkpointEntry);
+    const unsigned char *y = (const unsigned char *) b + sizeof(checkpointEntry);
+    while (*x == *y && *x != '\0') x++, y++;
+    int cx = *x == '/' ? 1 : *x == '\0' ? 0 : *x + 1;
+    int cy = *y == '/' ? 1 : *y == '\0' ? 0 : *y + 1;
+    return cx - cy;
+}
+
+int parseBuildMemory(const char *text, size_t *budget) {
+    char *end;
+    double bytes = strtod(text, &end);
+    if (end == text || bytes <= 0) return -1;
+    const char *suffixes = "KMGT";
+    const char *suffix = *end != '\0' ? strchr(suffixes, toupper((unsigned char) *end)) : NULL;
+    if (suffix != NULL) {
+        for (const char *s = suffixes; s <= suffix; s++) bytes *= 1024;
+        end++;
+    }
+    if (*end != '\0' || bytes < BUILD_MIN_MEMORY || bytes > (double) SIZE_MAX) return -1;
+    *budget = (size_t) bytes;
+    return 0;
+}
+
+void initIndexBuild(indexBuild *build, const char *path, size_t budget) {
+    build->budget = budget;
+    build->directory = spillDirectory(path);
+    if (pthread_mutex_init(&build->lock, NULL) != 0) ERR("pthread_mutex_init");
+    initSpillSorter(&build->entries, build->directory, budget / 8 * 3, comparePaths);
+}
+
+size_t indexBuildWorkerBudget(const indexBuild *build, int threads) {
+    size_t budget = build->budget / 8 / (threads > 0 ? threads : 1);
+    return budget < 64 * 1024 ? 64 * 1024 : budget;
+}
+
+void indexBuildAdd(indexBuild *build, const indexedFile *entries, size_t count) {
+    char *record = NULL;
+    size_t capacity = 0;
+    pthread_mutex_lock(&build->lock);
+    for (size_t i = 0; i < count; i++) {
+        size_t pathLength = strlen(entries[i].path);
+        size_t length = sizeof(checkpointEntry) + pathLength + 1;
+        if (length > capacity) {
+            capacity = length * 2;
+            record = realloc(record, capacity);
+            if (record == NULL) ERR("realloc");
+        }
+        checkpointEntry fixed = {
+                .size = entries[i].size,
+                .modifyTime = entries[i].modifyTime,
+                .changeTime = entries[i].changeTime,
+                .device = entries[i].device,
+                .inode = entries[i].inode,
+                .UID = entries[i].UID,
+                .fileType = entries[i].fileType,
+        };
+        memcpy(record, &fixed, sizeof(fixed));
+        memcpy(record + sizeof(fixed), entries[i].path, pathLength + 1);
+        spillAdd(&build->entries, record, length);
+    }
+    pthread_mutex_unlock(&build->lock);
+    free(record);
+}
+
+void freeIndexBuild(indexBuild *build) {
+    freeSpillSorter(&build->entries);
+    pthread_mutex_destroy(&build->lock);
+    free(build->directory);
+}
+
+// section written sequentially from its offset through a buffer, the first error is kept in *error
+typedef struct sectionStream_s {
+    int fd;
+    off_t offset;
+    char *buffer;
+    size_t used;
+    int *error;
+} sectionStream;
+
+static void openStream(sectionStream *s, int fd, off_t offset, int *error) {
+    s->fd = fd;
+    s->offset = offset;
+    s->used = 0;
+    s->error = error;
+    s->buffer = malloc(BUILD_STREAM_BUFFER);
+    if (s->buffer == NULL) ERR("malloc");
+}
+
+static void flushStream(sectionStream *s) {
+    for (size_t done = 0; done < s->used && *s->error == 0;) {
+        ssize_t written = pwrite(s->fd, s->buffer + done, s->used - done, s->offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            *s->error = errno;
+            break;
+        }
+        done += written;
+        s->offset += written;
+    }
+    s->used = 0;
+}
+
+static void streamWrite(sectionStream *s, const void *data, size_t length) {
+    while (length > 0) {
+        size_t n = BUILD_STREAM_BUFFER - s->used < length ? BUILD_STREAM_BUFFER - s->used : length;
+        memcpy(s->buffer + s->used, data, n);
+        s->used += n;
+        data = (const char *) data + n;
+        length -= n;
+        if (s->used == BUILD_STREAM_BUFFER) flushStream(s);
+    }
+}
+
+static void closeStream(sectionStream *s) {
+    flushStream(s);
+    free(s->buffer);
+    s->buffer = NULL;
+}
+
+typedef struct sizeKey_s {
+    int64_t size;
+    uint32_t entry;
+} sizeKey;
+
+static int compareSizeKeys(const void *a, const void *b) {
+    const sizeKey *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+typedef struct hashKey_s {
+    uint64_t hash;
+    uint32_t rollup;
+} hashKey;
+
+static int compareHashKeys(const void *a, const void *b) {
+    const hashKey *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->rollup < y->rollup ? -1 : x->rollup > y->rollup;
+}
+
+// keys of type, owner and trigram postings and records of rollups start with a key compared as a whole
+static int compareKeys64(const void *a, const void *b) {
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return x < y ? -1 : x > y;
+}
+
+// rollup of a directory with its type and owner lists following it, keyed by rollup number
+typedef struct rollupRecord_s {
+    uint64_t rollup;
+    indexRollup totals;
+    uint32_t typeCount;
+    uint32_t ownerCount;
+} rollupRecord;
+
+static int compareRollupCounts(const void *a, const void *b) {
+    const indexRollupCount *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// directory whose subtree is being merged, or the whole index; its files are summed as they come and
+// subdirectories add their totals when they end
+typedef struct openDirectory_s {
+    size_t pathLength;
+    // level of directory whose totals take this one's in, -1 for whole index
+    int parentLevel;
+    uint32_t rollup;
+    uint32_t entry;
+    uint64_t pathHash;
+    int64_t typeFiles[TYPE_COUNT];
+    int64_t typeBytes[TYPE_COUNT];
+    indexRollupCount *owners;
+    size_t ownerCount;
+    size_t ownerCapacity;
+    // owners before it are sorted and combined
+    size_t ownerMerged;
+} openDirectory;
+
+typedef struct streamBuild_s {
+    // open directories from topmost, each one's path is a prefix of path
+    openDirectory *levels;
+    int depth;
+    int levelCapacity;
+    char *path;
+    size_t pathCapacity;
+    openDirectory total;
+    size_t directories;
+    size_t rollupTypeCount;
+    size_t rollupOwnerCount;
+    spillSorter sizes;
+    spillSorter types;
+    spillSorter owners;
+    spillSorter trigrams;
+    spillSorter rollups;
+    spillSorter rollupOrder;
+    spillSorter rollupPaths;
+    char *record;
+    size_t recordCapacity;
+} streamBuild;
+
+static void mergeOwners(openDirectory *directory) {
+    if (directory->ownerCount == 0) return;
+    qsort(directory->owners, directory->ownerCount, sizeof(indexRollupCount), compareRollupCounts);
+    size_t n = 0;
+    for (size_t j = 0; j < directory->ownerCount; j++) {
+        if (n > 0 && directory->owners[j].key == directory->owners[n - 1].key) {
+            directory->owners[n - 1].files += directory->owners[j].files;
+            directory->owners[n - 1].bytes += directory->owners[j].bytes;
+        } else {
+            directory->owners[n++] = directory->owners[j];
+        }
+    }
+    directory->ownerCount = directory->ownerMerged = n;
+}
+
+static void addOwner(openDirectory *directory, const indexRollupCount *owner) {
+    if (directory->ownerCount == directory->ownerCapacity) {
+        // combining owners first keeps a directory with many files as long as its distinct owners
+        if (directory->ownerCount > 2 * directory->ownerMerged) mergeOwners(directory);
+        if (directory->ownerCount * 2 >= directory->ownerCapacity) {
+            directory->ownerCapacity = directory->ownerCapacity ? directory->ownerCapacity * 2 : 64;
+            directory->owners = realloc(directory->owners, directory->ownerCapacity * sizeof(indexRollupCount));
+            if (directory->owners == NULL) ERR("realloc");
+        }
+    }
+    directory->owners[directory->ownerCount++] = *owner;
+}
+
+static openDirectory *levelOf(streamBuild *b, int level) {
+    return level < 0 ? &b->total : &b->levels[level];
+}
+
+// emits rollup of directory at level and adds its totals to the directory holding it
+static void closeDirectory(streamBuild *b, openDirectory *directory, int isTotal) {
+    mergeOwners(directory);
+    rollupRecord header = {.rollup = directory->rollup, .ownerCount = (uint32_t) directory->ownerCount};
+    header.totals.entry = directory->entry;
+    header.totals.pathHash = directory->pathHash;
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        if (directory->typeFiles[type] == 0) continue;
+        header.typeCount++;
+        header.totals.files += (uint32_t) directory->typeFiles[type];
+        header.totals.bytes += directory->typeBytes[type];
+    }
+    size_t length = sizeof(header) + (header.typeCount + header.ownerCount) * sizeof(indexRollupCount);
+    if (length > b->recordCapacity) {
+        b->recordCapacity = length * 2;
+        b->record = realloc(b->record, b->recordCapacity);
+        if (b->record == NULL) ERR("realloc");
+    }
+    memcpy(b->record, &header, sizeof(header));
+    indexRollupCount *counts = (indexRollupCount *) (b->record + sizeof(header));
+    for (int type = 0, n = 0; type < TYPE_COUNT; type++) {
+        if (directory->typeFiles[type] == 0) continue;
+        counts[n].key = (uint32_t) type;
+        counts[n].files = (uint32_t) directory->typeFiles[type];
+        counts[n++].bytes = directory->typeBytes[type];
+    }
+    if (directory->ownerCount > 0) {
+        memcpy(counts + header.typeCount, directory->owners, directory->ownerCount * sizeof(indexRollupCount));
+    }
+    spillAdd(&b->rollups, b->record, length);
+    b->rollupTypeCount += header.typeCount;
+    b->rollupOwnerCount += header.ownerCount;
+    if (isTotal) return;
+
+    sizeKey order = {.size = -header.totals.bytes, .entry = directory->rollup};
+    hashKey path = {.hash = directory->pathHash, .rollup = directory->rollup};
+    spillAdd(&b->rollupOrder, &order, sizeof(order));
+    spillAdd(&b->rollupPaths, &path, sizeof(path));
+    openDirectory *parent = levelOf(b, directory->parentLevel);
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        parent->typeFiles[type] += directory->typeFiles[type];
+        parent->typeBytes[type] += directory->typeBytes[type];
+    }
+    for (size_t j = 0; j < directory->ownerCount; j++) addOwner(parent, &directory->owners[j]);
+}
+
+static void openLevel(streamBuild *b, const char *path, size_t pathLength, int parentLevel, size_t entry) {
+    if (b->depth == b->levelCapacity) {
+        b->levelCapacity = b->levelCapacity ? b->levelCapacity * 2 : 64;
+        b->levels = realloc(b->levels, b->levelCapacity * sizeof(openDirectory));
+        if (b->levels == NULL) ERR("realloc");
+        memset(b->levels + b->depth, 0, (b->levelCapacity - b->depth) * sizeof(openDirectory));
+    }
+    openDirectory *directory = &b->levels[b->depth++];
+    // owner list of a level is reused by directories opened at it later
+    indexRollupCount *owners = directory->owners;
+    size_t ownerCapacity = directory->ownerCapacity;
+    memset(directory, 0, sizeof(openDirectory));
+    directory->owners = owners;
+    directory->ownerCapacity = ownerCapacity;
+    directory->pathLength = pathLength;
+    directory->parentLevel = parentLevel;
+    directory->rollup = (uint32_t) b->directories++;
+    directory->entry = (uint32_t) entry;
+    directory->pathHash = stringHash(path, pathLength);
+    if (pathLength + 1 > b->pathCapacity) {
+        b->pathCapacity = (pathLength + 1) * 2;
+        b->path = realloc(b->path, b->pathCapacity);
+        if (b->path == NULL) ERR("realloc");
+    }
+    memcpy(b->path, path, pathLength + 1);
+}
+
+// whether directory at level holds path, it is then one of its ancestors
+static int levelHolds(const streamBuild *b, int level, const char *path, size_t pathLength) {
+    size_t length = b->levels[level].pathLength;
+    return pathLength > length && memcmp(path, b->path, length) == 0 &&
+           (path[length] == '/' || b->path[length - 1] == '/');
+}
+
+static void initStreamBuild(streamBuild *b, const indexBuild *build) {
+    memset(b, 0, sizeof(streamBuild));
+    b->total.parentLevel = -1;
+    size_t budget = build->budget / 2 / BUILD_SORTERS;
+    initSpillSorter(&b->sizes, build->directory, budget, compareSizeKeys);
+    initSpillSorter(&b->types, build->directory, budget, compareKeys64);
+    initSpillSorter(&b->owners, build->directory, budget, compareKeys64);
+    initSpillSorter(&b->trigrams, build->directory, budget, compareKeys64);
+    initSpillSorter(&b->rollups, build->directory, budget, compareKeys64);
+    initSpillSorter(&b->rollupOrder, build->directory, budget, compareSizeKeys);
+    initSpillSorter(&b->rollupPaths, build->directory, budget, compareHashKeys);
+}
+
+static void freeStreamBuild(streamBuild *b) {
+    for (int level = 0; level < b->levelCapacity; level++) free(b->levels[level].owners);
+    free(b->levels);
+    free(b->total.owners);
+    free(b->path);
+    free(b->record);
+    freeSpillSorter(&b->sizes);
+    freeSpillSorter(&b->types);
+    freeSpillSorter(&b->owners);
+    freeSpillSorter(&b->trigrams);
+    freeSpillSorter(&b->rollups);
+    freeSpillSorter(&b->rollupOrder);
+    freeSpillSorter(&b->rollupPaths);
+}
+
+static void placeSection(indexSection *sections, uint32_t id, uint64_t offset, uint64_t length) {
+    indexSection *section = &sections[id - 1];
+    section->id = id;
+    section->elementSize = indexElementSize(id);
+    section->offset = offset;
+    section->length = length;
+}
+
+// writes columns of all entries merged in path order and feeds secondary sorters, sections of columns are
+// placed from offset on, returns offset past them
+static uint64_t writeColumns(streamBuild *b, indexBuild *build, int fd, indexSection *sections, uint64_t offset,
+                             int *error) {
+    size_t count = build->entries.total;
+    sectionStream columns[SECTION_STRINGS];
+    for (uint32_t id = SECTION_SIZE; id < SECTION_STRINGS; id++) {
+        placeSection(sections, id, offset, count * indexElementSize(id));
+        openStream(&columns[id], fd, (off_t) offset, error);
+        offset = align8(offset + sections[id - 1].length);
+    }
+    sectionStream strings;
+    openStream(&strings, fd, (off_t) offset, error);
+
+    uint64_t stringOffset = 0;
+    size_t i = 0, recordLength;
+    const char *record;
+    while ((record = spillNext(&build->entries, &recordLength)) != NULL) {
+        checkpointEntry fixed;
+        memcpy(&fixed, record, sizeof(fixed));
+        const char *path = record + sizeof(fixed);
+        size_t pathLength = strlen(path);
+        // directories which do not hold this path have been merged whole
+        while (b->depth > 0 && !levelHolds(b, b->depth - 1, path, pathLength)) {
+            closeDirectory(b, &b->levels[--b->depth], 0);
+        }
+
+        // parent is the deepest open directory when it is the one named by path, as found by writeIndexFile
+        const char *slash = strrchr(path, '/');
+        const char *name = path;
+        uint32_t parent = INDEX_NO_PARENT;
+        int parentLevel = -1;
+        if (slash != NULL && slash[1] != '\0' && b->depth > 0 &&
+            b->levels[b->depth - 1].pathLength == (slash == path ? 1 : (size_t) (slash - path))) {
+            parentLevel = b->depth - 1;
+            parent = b->levels[parentLevel].entry;
+            name = slash + 1;
+        }
+
+        uint8_t type = (uint8_t) fixed.fileType;
+        streamWrite(&columns[SECTION_SIZE], &fixed.size, sizeof(int64_t));
+        streamWrite(&columns[SECTION_UID], &fixed.UID, sizeof(uint32_t));
+        streamWrite(&columns[SECTION_TYPE], &type, sizeof(uint8_t));
+        streamWrite(&columns[SECTION_DEVICE], &fixed.device, sizeof(uint64_t));
+        streamWrite(&columns[SECTION_INODE], &fixed.inode, sizeof(uint64_t));
+        streamWrite(&columns[SECTION_MODIFY_TIME], &fixed.modifyTime, sizeof(int64_t));
+        streamWrite(&columns[SECTION_CHANGE_TIME], &fixed.changeTime, sizeof(int64_t));
+        streamWrite(&columns[SECTION_NAME_OFFSET], &stringOffset, sizeof(uint64_t));
+        streamWrite(&columns[SECTION_PARENT], &parent, sizeof(uint32_t));
+        size_t nameLength = strlen(name);
+        streamWrite(&strings, name, nameLength + 1);
+        stringOffset += nameLength + 1;
+
+        sizeKey size = {.size = fixed.size, .entry = (uint32_t) i};
+        uint64_t typeKey = (uint64_t) type << 32 | i, ownerKey = (uint64_t) fixed.UID << 32 | i;
+        spillAdd(&b->sizes, &size, sizeof(size));
+        spillAdd(&b->types, &typeKey, sizeof(typeKey));
+        spillAdd(&b->owners, &ownerKey, sizeof(ownerKey));
+        const char *fileName = slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+        for (size_t j = 0; fileName[j] != '\0' && fileName[j + 1] != '\0' && fileName[j + 2] != '\0'; j++) {
+            uint64_t trigramKey = (uint64_t) trigramAt(fileName + j) << 32 | i;
+            spillAdd(&b->trigrams, &trigramKey, sizeof(trigramKey));
+        }
+
+        if (fixed.fileType == TYPE_DIRECTORY) {
+            openLevel(b, path, pathLength, parentLevel, i);
+        } else {
+            openDirectory *directory = levelOf(b, parentLevel);
+            directory->typeFiles[type]++;
+            directory->typeBytes[type] += fixed.size;
+            indexRollupCount owner = {.key = fixed.UID, .files = 1, .bytes = fixed.size};
+            addOwner(directory, &owner);
+        }
+        i++;
+    }
+    while (b->depth > 0) closeDirectory(b, &b->levels[--b->depth], 0);
+    b->total.rollup = (uint32_t) b->directories;
+    b->total.entry = (uint32_t) count;
+    closeDirectory(b, &b->total, 1);
+
+    for (uint32_t id = SECTION_SIZE; id < SECTION_STRINGS; id++) closeStream(&columns[id]);
+    closeStream(&strings);
+    placeSection(sections, SECTION_STRINGS, offset, stringOffset);
+    return align8(offset + stringOffset);
+}
+
+// called with the first posting of every key
+typedef void (*keyStart)(uint32_t key, uint32_t start, void *arg);
+
+// writes positions from sorted (key << 32 | position) records as postings at offset, unique drops repeated
+// records; returns number of postings written
+
+static uint64_t writePostings(spillSorter *sorter, int fd, uint64_t offset, int unique, keyStart start, void *arg,
+                              int *error) {
+    if (spillFinish(sorter) == -1) {
+        if (*error == 0) *error = errno;
+        return 0;
+    }
+    sectionStream postings;
+    openStream(&postings, fd, (off_t) offset, error);
+    uint64_t count = 0, previous = 0;
+    size_t length;
+    const void *record;
+    while ((record = spillNext(sorter, &length)) != NULL) {
+        uint64_t key;
+        memcpy(&key, record, sizeof(key));
+        if (unique && count > 0 && key == previous) continue;
+        if (count == 0 || key >> 32 != previous >> 32) start((uint32_t) (key >> 32), (uint32_t) count, arg);
+        uint32_t entry = (uint32_t) key;
+        streamWrite(&postings, &entry, sizeof(entry));
+        previous = key;
+        count++;
+    }
+    closeStream(&postings);
+    freeSpillSorter(sorter);
+    return count;
+}
+
+static void typeStarted(uint32_t key, uint32_t start, void *arg) {
+    uint32_t *typeStart = arg;
+    for (uint32_t type = 0; type <= key; type++) {
+        if (typeStart[type] == UINT32_MAX) typeStart[type] = start;
+    }
+}
+
+// owners and trigrams are tables of (key, start) pairs
+typedef struct keyTable_s {
+    indexOwner *keys;
+    size_t count;
+    size_t capacity;
+} keyTable;
+
+static void keyStarted(uint32_t key, uint32_t start, void *arg) {
+    keyTable *table = arg;
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 1024;
+        table->keys = realloc(table->keys, table->capacity * sizeof(indexOwner));
+        if (table->keys == NULL) ERR("realloc");
+    }
+    table->keys[table->count].uid = key;
+    table->keys[table->count++].start = start;
+}
+
+static void writeAt(int fd, const void *data, size_t length, uint64_t offset, int *error) {
+    sectionStream stream;
+    openStream(&stream, fd, (off_t) offset, error);
+    streamWrite(&stream, data, length);
+    closeStream(&stream);
+}
+
+// writes table with its sentinel as section id at offset, returns offset past it
+static uint64_t writeKeyTable(keyTable *table, uint32_t total, int fd, indexSection *sections, uint32_t id,
+                              uint64_t offset, int *error) {
+    keyStarted(0, total, table);
+    placeSection(sections, id, offset, table->count * sizeof(indexOwner));
+    writeAt(fd, table->keys, table->count * sizeof(indexOwner), offset, error);
+    free(table->keys);
+    memset(table, 0, sizeof(keyTable));
+    return align8(offset + sections[id - 1].length);
+}
+
+// writes rollups in position order with their lists, rollups, types and owners are placed one after another
+static uint64_t writeRollupSections(streamBuild *b, int fd, indexSection *sections, uint64_t offset, int *error) {
+    if (spillFinish(&b->rollups) == -1) {
+        if (*error == 0) *error = errno;
+        return offset;
+    }
+    placeSection(sections, SECTION_ROLLUPS, offset, (b->directories + 1) * sizeof(indexRollup));
+    offset = align8(offset + sections[SECTION_ROLLUPS - 1].length);
+    placeSection(sections, SECTION_ROLLUP_TYPES, offset, b->rollupTypeCount * sizeof(indexRollupCount));
+    offset = align8(offset + sections[SECTION_ROLLUP_TYPES - 1].length);
+    placeSection(sections, SECTION_ROLLUP_OWNERS, offset, b->rollupOwnerCount * sizeof(indexRollupCount));
+    offset = align8(offset + sections[SECTION_ROLLUP_OWNERS - 1].length);
+
+    sectionStream rollups, types, owners;
+    openStream(&rollups, fd, (off_t) sections[SECTION_ROLLUPS - 1].offset, error);
+    openStream(&types, fd, (off_t) sections[SECTION_ROLLUP_TYPES - 1].offset, error);
+    openStream(&owners, fd, (off_t) sections[SECTION_ROLLUP_OWNERS - 1].offset, error);
+    uint32_t typeStart = 0, ownerStart = 0;
+    size_t length;
+    const char *record;
+    while ((record = spillNext(&b->rollups, &length)) != NULL) {
+        rollupRecord header;
+        memcpy(&header, record, sizeof(header));
+        header.totals.typeStart = typeStart;
+        header.totals.ownerStart = ownerStart;
+        streamWrite(&rollups, &header.totals, sizeof(indexRollup));
+        const char *counts = record + sizeof(header);
+        streamWrite(&types, counts, header.typeCount * sizeof(indexRollupCount));
+        streamWrite(&owners, counts + header.typeCount * sizeof(indexRollupCount),
+                    header.ownerCount * sizeof(indexRollupCount));
+        typeStart += header.typeCount;
+        ownerStart += header.ownerCount;
+    }
+    closeStream(&rollups);
+    closeStream(&types);
+    closeStream(&owners);
+    freeSpillSorter(&b->rollups);
+    return offset;
+}
+
+// writes rollup numbers in order of sorter whose records start with a key of 8 bytes followed by the number
+static uint64_t writeRollupOrder(spillSorter *sorter, int fd, indexSection *sections, uint32_t id, uint64_t offset,
+                                 int *error) {
+    placeSection(sections, id, offset, sorter->total * sizeof(uint32_t));
+    if (spillFinish(sorter) == -1) {
+        if (*error == 0) *error = errno;
+        return offset;
+    }
+    sectionStream stream;
+    openStream(&stream, fd, (off_t) offset, error);
+    size_t length;
+    const char *record;
+    while ((record = spillNext(sorter, &length)) != NULL) streamWrite(&stream, record + sizeof(uint64_t), 4);
+    closeStream(&stream);
+    freeSpillSorter(sorter);
+    return align8(offset + sections[id - 1].length);
+}
+
+// checksum of a section read back from the file
+static uint64_t sectionChecksum(int fd, const indexSection *section, char *buffer, int *error) {
+    uint64_t hash = checksumStart(section->length, section->id);
+    for (uint64_t done = 0; done < section->length && *error == 0;) {
+        size_t n = section->length - done < BUILD_CHECKSUM_CHUNK ? section->length - done : BUILD_CHECKSUM_CHUNK;
+        ssize_t got = pread(fd, buffer, n, (off_t) (section->offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 || (size_t) got != n) {
+            *error = got < 0 ? errno : EIO;
+            break;
+        }
+        hash = checksumUpdate(hash, buffer, n);
+        done += n;
+    }
+    return checksumFinish(hash);
+}
+
+int writeIndexBuild(indexBuild *build, const char *path) {
+    size_t count = build->entries.total;
+    if (count >= INDEX_NO_PARENT) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (spillFinish(&build->entries) == -1) return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0660);
+    if (fd < 0) return -1;
+
+    // sections follow header and table in the order they are completed, the table is written last
+    int error = 0;
+    indexSection sections[SECTION_COUNT - 1];
+    memset(sections, 0, sizeof(sections));
+    size_t tableLength = sizeof(indexHeader) + sizeof(sections);
+    streamBuild b;
+    initStreamBuild(&b, build);
+    uint64_t offset = writeColumns(&b, build, fd, sections, align8(tableLength), &error);
+    freeSpillSorter(&build->entries);
+
+    placeSection(sections, SECTION_SIZE_ORDER, offset, count * sizeof(uint32_t));
+    offset = align8(offset + sections[SECTION_SIZE_ORDER - 1].length);
+    if (spillFinish(&b.sizes) == -1 && error == 0) error = errno;
+    if (error == 0) {
+        sectionStream order;
+        openStream(&order, fd, (off_t) sections[SECTION_SIZE_ORDER - 1].offset, &error);
+        size_t length;
+        const sizeKey *key;
+        while ((key = spillNext(&b.sizes, &length)) != NULL) streamWrite(&order, &key->entry, sizeof(uint32_t));
+        closeStream(&order);
+    }
+    freeSpillSorter(&b.sizes);
+
+    uint32_t typeStart[TYPE_COUNT + 1];
+    memset(typeStart, 0xff, sizeof(typeStart));
+    uint64_t postings = writePostings(&b.types, fd, offset, 0, typeStarted, typeStart, &error);
+    placeSection(sections, SECTION_TYPE_POSTINGS, offset, postings * sizeof(uint32_t));
+    offset = align8(offset + sections[SECTION_TYPE_POSTINGS - 1].length);
+    typeStarted(TYPE_COUNT, (uint32_t) postings, typeStart);
+    placeSection(sections, SECTION_TYPE_START, offset, sizeof(typeStart));
+    writeAt(fd, typeStart, sizeof(typeStart), offset, &error);
+    offset = align8(offset + sizeof(typeStart));
+
+    keyTable table = {0};
+    postings = writePostings(&b.owners, fd, offset, 0, keyStarted, &table, &error);
+    placeSection(sections, SECTION_OWNER_POSTINGS, offset, postings * sizeof(uint32_t));
+    offset = writeKeyTable(&table, (uint32_t) postings, fd, sections, SECTION_OWNERS,
+                           align8(offset + postings * sizeof(uint32_t)), &error);
+
+    postings = writePostings(&b.trigrams, fd, offset, 1, keyStarted, &table, &error);
+    if (postings >= UINT32_MAX && error == 0) error = EOVERFLOW;
+    placeSection(sections, SECTION_TRIGRAM_POSTINGS, offset, postings * sizeof(uint32_t));
+    offset = writeKeyTable(&table, (uint32_t) postings, fd, sections, SECTION_TRIGRAMS,
+                           align8(offset + postings * sizeof(uint32_t)), &error);
+
+    offset = writeRollupSections(&b, fd, sections, offset, &error);
+    offset = writeRollupOrder(&b.rollupOrder, fd, sections, SECTION_ROLLUP_ORDER, offset, &error);
+    offset = writeRollupOrder(&b.rollupPaths, fd, sections, SECTION_ROLLUP_PATHS, offset, &error);
+    freeStreamBuild(&b);
+
+    // padding after the last section stays zero as in a file laid out in memory
+    if (error == 0 && ftruncate(fd, (off_t) offset) == -1) error = errno;
+    char *buffer = malloc(BUILD_CHECKSUM_CHUNK > tableLength ? BUILD_CHECKSUM_CHUNK : tableLength);
+    if (buffer == NULL) ERR("malloc");
+    for (size_t i = 0; i < SECTION_COUNT - 1 && error == 0; i++) {
+        sections[i].checksum = sectionChecksum(fd, &sections[i], buffer, &error);
+    }
+    indexHeader header = {.version = INDEX_VERSION, .sectionCount = SECTION_COUNT - 1, .entryCount = count};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), sections, sizeof(sections));
+    header.checksum = checksum64(buffer, tableLength, 0);
+    memcpy(buffer, &header, sizeof(header));
+    if (error == 0) writeAt(fd, buffer, tableLength, 0, &error);
+    free(buffer);
+    if (error == 0 && fsync(fd) == -1) error = errno;
+    if (close(fd) == -1 && error == 0) error = errno;
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef FILE_INDEXER_BUILD_H
+#define FILE_INDEXER_BUILD_H
+
+#include <pthread.h>
+
+#include "indexer.h"
+#include "spill.h"
+
+// smallest memory budget of a build
+#define BUILD_MIN_MEMORY (16 * 1024 * 1024)
+
+// index written within a memory budget: entries are sorted by path in runs spilled next to the index, one merge
+// of the runs writes all columns and feeds secondary structures (size order, postings, rollups) to sorters
+// of their own, which are merged into their sections afterwards
+typedef struct indexBuild_s {
+    size_t budget;
+    char *directory;
+    // traversal workers add entries concurrently
+    pthread_mutex_t lock;
+    spillSorter entries;
+} indexBuild;
+
+// parses budget given as bytes which may end with K, M, G or T, returns -1 if it is not valid or below minimum
+int parseBuildMemory(const char *text, size_t *budget);
+
+// runs are written next to the index at path
+void initIndexBuild(indexBuild *build, const char *path, size_t budget);
+
+// copies entries with their paths, may be called by many threads at once
+void indexBuildAdd(indexBuild *build, const indexedFile *entries, size_t count);
+
+// bytes of entries a traversal worker may hold before adding them, so that workers and the build together
+// stay within budget
+size_t indexBuildWorkerBudget(const indexBuild *build, int threads);
+
+// writes index file at path from added entries in the format of writeIndexFile with entries ordered by path,
+// returns -1 and sets errno on failure
+int writeIndexBuild(indexBuild *build, const char *path);
+
+void freeIndexBuild(indexBuild *build);
+
+#endif //FILE_INDEXER_BUILD_H
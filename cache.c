@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "cache.h"
+#include "indexer.h"
+#include "index.h"
+
+#define QUERY_CACHE_INITIAL_BUCKETS 256
+
+int parseCacheMemory(const char *text, size_t *budget) {
+    char *end;
+    double bytes = strtod(text, &end);
+    if (end == text || bytes < 0) return -1;
+    const char *suffixes = "KMGT";
+    const char *suffix = *end != '\0' ? strchr(suffixes, toupper((unsigned char) *end)) : NULL;
+    if (suffix != NULL) {
+        for (const char *s = suffixes; s <= suffix; s++) bytes *= 1024;
+        end++;
+    }
+    if (*end != '\0' || bytes > (double) SIZE_MAX) return -1;
+    *budget = (size_t) bytes;
+    return 0;
+}
+
+void initQueryCache(queryCache *c, size_t budget) {
+    memset(c, 0, sizeof(queryCache));
+    c->budget = budget;
+    if (pthread_mutex_init(&c->lock, NULL) != 0) ERR("pthread_mutex_init");
+    c->bucketCount = QUERY_CACHE_INITIAL_BUCKETS;
+    c->buckets = calloc(c->bucketCount, sizeof(cachedQuery *));
+    if (c->buckets == NULL) ERR("calloc");
+}
+
+static cachedQuery **findSlot(queryCache *c, const char *key, uint64_t hash) {
+    cachedQuery **slot = &c->buckets[hash & (c->bucketCount - 1)];
+    while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) slot = &(*slot)->chain;
+    return slot;
+}
+
+static void unlinkUse(queryCache *c, cachedQuery *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+    e->newer = e->older = NULL;
+}
+
+static void linkNewest(queryCache *c, cachedQuery *e) {
+    e->older = c->newest;
+    e->newer = NULL;
+    if (c->newest != NULL) {
+        c->newest->newer = e;
+    } else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+static void removeEntry(queryCache *c, cachedQuery *e) {
+    *findSlot(c, e->key, e->hash) = e->chain;
+    unlinkUse(c, e);
+    c->used -= e->bytes;
+    c->count--;
+    free(e->key);
+    free(e->ids);
+    free(e);
+}
+
+// keeps chains short, entries are moved to buckets of a table twice as large
+static void growBuckets(queryCache *c) {
+    size_t count = c->bucketCount * 2;
+    cachedQuery **buckets = calloc(count, sizeof(cachedQuery *));
+    if (buckets == NULL) ERR("calloc");
+    for (size_t b = 0; b < c->bucketCount; b++) {
+        for (cachedQuery *e = c->buckets[b], *next; e != NULL; e = next) {
+            next = e->chain;
+            e->chain = buckets[e->hash & (count - 1)];
+            buckets[e->hash & (count - 1)] = e;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->bucketCount = count;
+}
+
+int queryCacheGet(queryCache *c, const char *key, uint64_t **ids, size_t *count) {
+    uint64_t hash = stringHash(key, strlen(key));
+    pthread_mutex_lock(&c->lock);
+    cachedQuery *e = *findSlot(c, key, hash);
+    if (e == NULL) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    unlinkUse(c, e);
+    linkNewest(c, e);
+    // entry may be evicted by another thread while results are written
+    *count = e->count;
+    *ids = malloc((e->count > 0 ? e->count : 1) * sizeof(uint64_t));
+    if (*ids == NULL) ERR("malloc");
+    if (e->count > 0) memcpy(*ids, e->ids, e->count * sizeof(uint64_t));
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+void queryCachePut(queryCache *c, const char *key, uint64_t *ids, size_t count) {
+    size_t length = strlen(key);
+    size_t bytes = sizeof(cachedQuery) + length + 1 + count * sizeof(uint64_t);
+    if (bytes > c->budget / 4) {
+        free(ids);
+        return;
+    }
+    cachedQuery *e = malloc(sizeof(cachedQuery));
+    if (e == NULL) ERR("malloc");
+    e->key = strdup(key);
+    if (e->key == NULL) ERR("strdup");
+    e->hash = stringHash(key, length);
+    e->ids = ids;
+    e->count = count;
+    e->bytes = bytes;
+
+    pthread_mutex_lock(&c->lock);
+    // the same query answered by two threads at once is kept once
+    cachedQuery *previous = *findSlot(c, key, e->hash);
+    if (previous != NULL) removeEntry(c, previous);
+    while (c->used + bytes > c->budget && c->oldest != NULL) removeEntry(c, c->oldest);
+    if (c->count >= c->bucketCount) growBuckets(c);
+    cachedQuery **slot = &c->buckets[e->hash & (c->bucketCount - 1)];
+    e->chain = *slot;
+    *slot = e;
+    linkNewest(c, e);
+    c->used += bytes;
+    c->count++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void queryCacheClear(queryCache *c) {
+    pthread_mutex_lock(&c->lock);
+    while (c->oldest != NULL) removeEntry(c, c->oldest);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void freeQueryCache(queryCache *c) {
+    queryCacheClear(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    c->buckets = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef FILE_INDEXER_CACHE_H
+#define FILE_INDEXER_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// memory of query cache unless -c is given
+#define QUERY_CACHE_DEFAULT_MEMORY (64 * 1024 * 1024)
+
+// results of one query kept as ids of entries, key is normalized query followed by generations of snapshots
+// it was answered from, so a key of an older index is never asked for again
+typedef struct cachedQuery_s {
+    char *key;
+    uint64_t hash;
+    uint64_t *ids;
+    size_t count;
+    size_t bytes;
+    // next entry of the same bucket
+    struct cachedQuery_s *chain;
+    // neighbours in order of use
+    struct cachedQuery_s *newer;
+    struct cachedQuery_s *older;
+} cachedQuery;
+
+// answers of recent queries within a memory budget, least recently used ones are evicted first;
+// shared by all threads answering commands
+typedef struct queryCache_s {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t used;
+    cachedQuery **buckets;
+    size_t bucketCount;
+    size_t count;
+    cachedQuery *newest;
+    cachedQuery *oldest;
+} queryCache;
+
+// parses budget given as bytes which may end with K, M, G or T, 0 disables cache; returns -1 if it is not valid
+int parseCacheMemory(const char *text, size_t *budget);
+
+void initQueryCache(queryCache *c, size_t budget);
+
+// copies ids of results kept under key and marks them as used, returns -1 if there are none
+int queryCacheGet(queryCache *c, const char *key, uint64_t **ids, size_t *count);
+
+// keeps ids allocated with malloc under key, least recently used entries are evicted to make room;
+// results which would take more than a quarter of budget are dropped
+void queryCachePut(queryCache *c, const char *key, uint64_t *ids, size_t count);
+
+// drops every entry, called whenever a new snapshot is published
+void queryCacheClear(queryCache *c);
+
+void freeQueryCache(queryCache *c);
+
+#endif //FILE_INDEXER_CACHE_H
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "index.h"
+#include "signature.h"
+
+#define CHECKPOINT_INITIAL_CAPACITY 1024
+
+static uint64_t indexedTypeMask(void) {
+    uint64_t mask = 0;
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        if (typeIndexed(type)) mask |= 1ULL << type;
+    }
+    return mask;
+}
+
+static uint64_t headerChecksum(checkpointHeader header, const char *root) {
+    header.checksum = 0;
+    return checksum64(root, header.rootLength, checksum64(&header, sizeof(header), 0));
+}
+
+// records, skipped files and paths are covered one after another, the way they are written
+static uint64_t blockChecksum(checkpointBlockHeader header, const void *entries, const void *skipped,
+                              const void *paths, size_t pathsLength) {
+    header.checksum = 0;
+    uint64_t checksum = checksum64(&header, sizeof(header), 0);
+    checksum = checksum64(entries, header.entryCount * sizeof(checkpointEntry), checksum);
+    checksum = checksum64(skipped, header.skippedCount * sizeof(checkpointSkipped), checksum);
+    return checksum64(paths, pathsLength, checksum);
+}
+
+static int readAt(int fd, void *buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buffer = (char *) buffer + n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const void *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        buffer = (const char *) buffer + n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void addResumedEntry(walkCheckpoint *checkpoint, size_t *capacity, const checkpointEntry *record,
+                            const char *path, size_t length) {
+    walkResult *resumed = &checkpoint->resumed;
+    if (resumed->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : CHECKPOINT_INITIAL_CAPACITY;
+        resumed->entries = realloc(resumed->entries, *capacity * sizeof(indexedFile));
+        if (resumed->entries == NULL) ERR("realloc");
+    }
+    indexedFile *entry = &resumed->entries[resumed->count++];
+    entry->path = arenaCopy(&resumed->strings, path, length);
+    const char *p = strrchr(entry->path, '/');
+    entry->fileName = (p != NULL && p[1] != '\0') ? p + 1 : entry->path;
+    entry->size = record->size;
+    entry->UID = record->UID;
+    entry->fileType = record->fileType;
+    entry->device = record->device;
+    entry->inode = record->inode;
+    entry->modifyTime = record->modifyTime;
+    entry->changeTime = record->changeTime;
+}
+
+static void addResumedSkipped(walkCheckpoint *checkpoint, size_t *capacity, const checkpointSkipped *record) {
+    walkResult *resumed = &checkpoint->resumed;
+    if (resumed->skippedCount == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : CHECKPOINT_INITIAL_CAPACITY;
+        resumed->skipped = realloc(resumed->skipped, *capacity * sizeof(skippedFile));
+        if (resumed->skipped == NULL) ERR("realloc");
+    }
+    skippedFile *file = &resumed->skipped[resumed->skippedCount++];
+    file->device = record->device;
+    file->inode = record->inode;
+    file->stamp = record->stamp;
+}
+
+// returns 0 if paths holds exactly count NUL-terminated strings
+static int pathsValid(const char *paths, size_t length, uint64_t count) {
+    const char *end = paths + length;
+    for (uint64_t i = 0; i < count; i++) {
+        const char *nul = memchr(paths, '\0', end - paths);
+        if (nul == NULL || nul == paths) return -1;
+        paths = nul + 1;
+    }
+    return paths == end ? 0 : -1;
+}
+
+// reads complete blocks following the header, returns end of the last one
+static off_t readBlocks(walkCheckpoint *checkpoint, off_t offset, off_t fileLength) {
+    size_t entryCapacity = 0, skippedCapacity = 0;
+    stringArena frontierStrings = {0};
+    checkpointBlockHeader header;
+    while (fileLength - offset >= (off_t) sizeof(header) && readAt(checkpoint->fd, &header, sizeof(header), offset) == 0) {
+        uint64_t fixed = header.entryCount * sizeof(checkpointEntry) + header.skippedCount * sizeof(checkpointSkipped);
+        if (header.length > (uint64_t) (fileLength - offset) - sizeof(header) || fixed > header.length ||
+            header.frontierCount == 0) {
+            break;
+        }
+        char *payload = malloc(header.length);
+        if (payload == NULL) ERR("malloc");
+        const checkpointEntry *entries = (const checkpointEntry *) payload;
+        const checkpointSkipped *skipped = (const checkpointSkipped *) (payload + header.entryCount *
+                                                                                   sizeof(checkpointEntry));
+        const char *paths = payload + fixed;
+        size_t pathsLength = header.length - fixed;
+        if (readAt(checkpoint->fd, payload, header.length, offset + (off_t) sizeof(header)) < 0 ||
+            blockChecksum(header, entries, skipped, paths, pathsLength) != header.checksum ||
+            pathsValid(paths, pathsLength, header.entryCount + header.frontierCount) < 0) {
+            free(payload);
+            break;
+        }
+
+        for (uint64_t i = 0; i < header.entryCount; i++) {
+            size_t length = strlen(paths);
+            addResumedEntry(checkpoint, &entryCapacity, &entries[i], paths, length);
+            paths += length + 1;
+        }
+        for (uint64_t i = 0; i < header.skippedCount; i++) {
+            addResumedSkipped(checkpoint, &skippedCapacity, &skipped[i]);
+        }
+        // only frontier of the latest block is still to be scanned
+        freeArena(&frontierStrings);
+        checkpoint->frontier = realloc(checkpoint->frontier, header.frontierCount * sizeof(const char *));
+        if (checkpoint->frontier == NULL) ERR("realloc");
+        checkpoint->frontierCount = header.frontierCount;
+        for (uint64_t i = 0; i < header.frontierCount; i++) {
+            size_t length = strlen(paths);
+            checkpoint->frontier[i] = arenaCopy(&frontierStrings, paths, length);
+            paths += length + 1;
+        }
+        free(payload);
+        offset += (off_t) (sizeof(header) + header.length);
+    }
+    arenaMerge(&checkpoint->resumed.strings, &frontierStrings);
+    return offset;
+}
+
+// returns end of progress saved for root, 0 if there is none
+static off_t readCheckpoint(walkCheckpoint *checkpoint, const char *root) {
+    struct stat s;
+    checkpointHeader header;
+    if (fstat(checkpoint->fd, &s) < 0 || s.st_size < (off_t) sizeof(header) ||
+        readAt(checkpoint->fd, &header, sizeof(header), 0) < 0) {
+        return 0;
+    }
+    size_t rootLength = strlen(root);
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header.version != CHECKPOINT_VERSION || header.rootLength != rootLength ||
+        header.types != indexedTypeMask() || s.st_size < (off_t) (sizeof(header) + rootLength)) {
+        return 0;
+    }
+    char *savedRoot = malloc(rootLength + 1);
+    if (savedRoot == NULL) ERR("malloc");
+    int same = readAt(checkpoint->fd, savedRoot, rootLength, sizeof(header)) == 0 &&
+               memcmp(savedRoot, root, rootLength) == 0 && headerChecksum(header, root) == header.checksum;
+    free(savedRoot);
+    if (!same) return 0;
+    return readBlocks(checkpoint, (off_t) (sizeof(header) + rootLength), s.st_size);
+}
+
+// empties file and writes header of a new checkpoint, returns its length or -1 on failure
+static off_t startCheckpoint(int fd, const char *root) {
+    checkpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.rootLength = (uint32_t) strlen(root);
+    header.types = indexedTypeMask();
+    header.checksum = headerChecksum(header, root);
+    if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0 || writeAll(fd, &header, sizeof(header)) < 0 ||
+        writeAll(fd, root, header.rootLength) < 0 || fdatasync(fd) < 0) {
+        return -1;
+    }
+    return (off_t) (sizeof(header) + header.rootLength);
+}
+
+static void dropResumed(walkCheckpoint *checkpoint) {
+    freeWalkResult(&checkpoint->resumed);
+    free(checkpoint->frontier);
+    checkpoint->frontier = NULL;
+    checkpoint->frontierCount = 0;
+}
+
+int openCheckpoint(walkCheckpoint *checkpoint, const char *root) {
+    memset(&checkpoint->resumed, 0, sizeof(walkResult));
+    checkpoint->frontier = NULL;
+    checkpoint->frontierCount = 0;
+    checkpoint->saves = 0;
+    checkpoint->length = 0;
+    checkpoint->fd = open(checkpoint->path, O_RDWR | O_CREAT | O_CLOEXEC, (mode_t) 0660);
+    if (checkpoint->fd < 0) return -1;
+
+    off_t length = readCheckpoint(checkpoint, root);
+    if (length == 0 || checkpoint->frontierCount == 0) {
+        dropResumed(checkpoint);
+        length = startCheckpoint(checkpoint->fd, root);
+    } else if (ftruncate(checkpoint->fd, length) < 0) {
+        // a torn block which cannot be cut off would hide every save appended after it
+        length = -1;
+    }
+    if (length < 0 || lseek(checkpoint->fd, length, SEEK_SET) < 0) {
+        dropResumed(checkpoint);
+        close(checkpoint->fd);
+        checkpoint->fd = -1;
+        return -1;
+    }
+    checkpoint->length = length;
+    return checkpoint->frontierCount > 0;
+}
+
+void closeCheckpoint(walkCheckpoint *checkpoint) {
+    if (checkpoint->fd >= 0) close(checkpoint->fd);
+    checkpoint->fd = -1;
+    dropResumed(checkpoint);
+}
+
+void initCheckpointBlock(checkpointBlock *block) {
+    memset(block, 0, sizeof(checkpointBlock));
+}
+
+static void addPath(checkpointBlock *block, const char *path) {
+    size_t length = strlen(path) + 1;
+    if (block->pathsLength + length > block->pathsCapacity) {
+        while (block->pathsLength + length > block->pathsCapacity) {
+            block->pathsCapacity = block->pathsCapacity ? block->pathsCapacity * 2 : 64 * CHECKPOINT_INITIAL_CAPACITY;
+        }
+        block->paths = realloc(block->paths, block->pathsCapacity);
+        if (block->paths == NULL) ERR("realloc");
+    }
+    memcpy(block->paths + block->pathsLength, path, length);
+    block->pathsLength += length;
+}
+
+void checkpointEntries(checkpointBlock *block, const indexedFile *entries, size_t count) {
+    if (block->header.entryCount + count > block->entryCapacity) {
+        while (block->header.entryCount + count > block->entryCapacity) {
+            block->entryCapacity = block->entryCapacity ? block->entryCapacity * 2 : CHECKPOINT_INITIAL_CAPACITY;
+        }
+        block->entries = realloc(block->entries, block->entryCapacity * sizeof(checkpointEntry));
+        if (block->entries == NULL) ERR("realloc");
+    }
+    for (size_t i = 0; i < count; i++) {
+        checkpointEntry *record = &block->entries[block->header.entryCount++];
+        memset(record, 0, sizeof(checkpointEntry));
+        record->size = entries[i].size;
+        record->modifyTime = entries[i].modifyTime;
+        record->changeTime = entries[i].changeTime;
+        record->device = entries[i].device;
+        record->inode = entries[i].inode;
+        record->UID = entries[i].UID;
+        record->fileType = entries[i].fileType;
+        addPath(block, entries[i].path);
+    }
+}
+
+void checkpointSkippedFiles(checkpointBlock *block, const skippedFile *skipped, size_t count) {
+    if (block->header.skippedCount + count > block->skippedCapacity) {
+        while (block->header.skippedCount + count > block->skippedCapacity) {
+            block->skippedCapacity = block->skippedCapacity ? block->skippedCapacity * 2 : CHECKPOINT_INITIAL_CAPACITY;
+        }
+        block->skipped = realloc(block->skipped, block->skippedCapacity * sizeof(checkpointSkipped));
+        if (block->skipped == NULL) ERR("realloc");
+    }
+    for (size_t i = 0; i < count; i++) {
+        checkpointSkipped *record = &block->skipped[block->header.skippedCount++];
+        record->device = skipped[i].device;
+        record->inode = skipped[i].inode;
+        record->stamp = skipped[i].stamp;
+    }
+}
+
+void checkpointFrontier(checkpointBlock *block, const char *directory) {
+    block->header.frontierCount++;
+    addPath(block, directory);
+}
+
+int appendCheckpoint(walkCheckpoint *checkpoint, checkpointBlock *block) {
+    if (checkpoint->fd < 0) return -1;
+    checkpointBlockHeader *header = &block->header;
+    size_t entriesLength = header->entryCount * sizeof(checkpointEntry);
+    size_t skippedLength = header->skippedCount * sizeof(checkpointSkipped);
+    header->length = entriesLength + skippedLength + block->pathsLength;
+    header->checksum = blockChecksum(*header, block->entries, block->skipped, block->paths, block->pathsLength);
+
+    struct iovec parts[4] = {{header, sizeof(checkpointBlockHeader)}, {block->entries, entriesLength},
+                             {block->skipped, skippedLength}, {block->paths, block->pathsLength}};
+    int first = 0;
+    while (first < 4) {
+        ssize_t n = writev(checkpoint->fd, parts + first, 4 - first);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        // skips parts written whole and the written start of the next one
+        while (first < 4 && (size_t) n >= parts[first].iov_len) n -= (ssize_t) parts[first++].iov_len;
+        if (first < 4) {
+            parts[first].iov_base = (char *) parts[first].iov_base + n;
+            parts[first].iov_len -= n;
+        }
+    }
+    if (first < 4 || fdatasync(checkpoint->fd) < 0) {
+        // partial block is cut off so that later saves are appended after the last complete one
+        if (ftruncate(checkpoint->fd, checkpoint->length) < 0 || lseek(checkpoint->fd, checkpoint->length, SEEK_SET) < 0) {
+            close(checkpoint->fd);
+            checkpoint->fd = -1;
+        }
+        return -1;
+    }
+    checkpoint->length += (off_t) (sizeof(checkpointBlockHeader) + header->length);
+    checkpoint->saves++;
+    return 0;
+}
+
+void freeCheckpointBlock(checkpointBlock *block) {
+    free(block->entries);
+    free(block->skipped);
+    free(block->paths);
+    memset(block, 0, sizeof(checkpointBlock));
+}
@@ -0,0 +1,83 @@
+#ifndef FILE_INDEXER_CHECKPOINT_H
+#define FILE_INDEXER_CHECKPOINT_H
+
+#include "walk.h"
+
+#define CHECKPOINT_MAGIC "MOLECKP"
+#define CHECKPOINT_VERSION 1
+
+// on-disk layout: header and root path, then one block per save; a block holds entries and skipped files found
+// since the previous save and the whole frontier, the frontier of the last complete block is the one resumed
+typedef struct checkpointHeader_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t rootLength;
+    // bit per indexed type, progress made with other -T is not resumed
+    uint64_t types;
+    // covers header (with this field zeroed) and root
+    uint64_t checksum;
+} checkpointHeader;
+
+typedef struct checkpointBlockHeader_s {
+    uint64_t entryCount;
+    uint64_t skippedCount;
+    uint64_t frontierCount;
+    // bytes of records and paths following the header
+    uint64_t length;
+    // covers block header (with this field zeroed) and what follows it
+    uint64_t checksum;
+} checkpointBlockHeader;
+
+// fixed part of an entry, paths of entries and then of frontier follow all records NUL-terminated
+typedef struct checkpointEntry_s {
+    int64_t size;
+    int64_t modifyTime;
+    int64_t changeTime;
+    uint64_t device;
+    uint64_t inode;
+    uint32_t UID;
+    int32_t fileType;
+} checkpointEntry;
+
+typedef struct checkpointSkipped_s {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t stamp;
+} checkpointSkipped;
+
+// one save being gathered
+typedef struct checkpointBlock_s {
+    checkpointBlockHeader header;
+    checkpointEntry *entries;
+    size_t entryCapacity;
+    checkpointSkipped *skipped;
+    size_t skippedCapacity;
+    char *paths;
+    size_t pathsLength;
+    size_t pathsCapacity;
+} checkpointBlock;
+
+// reads progress saved at checkpoint->path for traversal of root into checkpoint and opens the file to append
+// further saves, a missing, damaged or foreign checkpoint is started anew; returns 1 if there is progress
+// to resume, 0 if there is none and -1 if progress cannot be saved (fd is left -1)
+int openCheckpoint(walkCheckpoint *checkpoint, const char *root);
+
+// closes file and frees progress the traversal did not take over, the file itself stays
+void closeCheckpoint(walkCheckpoint *checkpoint);
+
+void initCheckpointBlock(checkpointBlock *block);
+
+void checkpointEntries(checkpointBlock *block, const indexedFile *entries, size_t count);
+
+void checkpointSkippedFiles(checkpointBlock *block, const skippedFile *skipped, size_t count);
+
+// directory which was not scanned yet, frontier has to be added after all entries
+void checkpointFrontier(checkpointBlock *block, const char *directory);
+
+// appends block to checkpoint file and waits until it is on disk, returns -1 on failure, the file then ends
+// with the previous save as before
+int appendCheckpoint(walkCheckpoint *checkpoint, checkpointBlock *block);
+
+void freeCheckpointBlock(checkpointBlock *block);
+
+#endif //FILE_INDEXER_CHECKPOINT_H
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "indexer.h"
+#include "server.h"
+
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s -s [socket-path] [command]\n", name);
+    fprintf(stderr, "s - path of socket of running file-indexer, if not provided $MOLE_SOCKET is used\n");
+    fprintf(stderr, "command - command sent to file-indexer, when not given commands are read from stdin\n");
+    exit(EXIT_FAILURE);
+}
+
+int connectSocket(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) ERR("socket");
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) ERR("connect");
+    return fd;
+}
+
+// copies answer to stdout up to the empty line ending it, returns -1 if server closed connection first;
+// a line is written once the next one is read, since the newline server added after NUL separated results
+// is dropped from the last line of the answer
+int printAnswer(FILE *server) {
+    char *lines[2] = {NULL, NULL};
+    size_t capacities[2] = {0, 0};
+    ssize_t length, held = -1;
+    int current = 0, ret = -1;
+    while ((length = getline(&lines[current], &capacities[current], server)) > 0) {
+        if (strcmp(lines[current], "\n") == 0) {
+            ret = 0;
+            break;
+        }
+        if (held >= 0) fwrite(lines[1 - current], 1, held, stdout);
+        held = length;
+        current = 1 - current;
+    }
+    if (held >= 0) {
+        const char *line = lines[1 - current];
+        if (ret == 0 && held >= 2 && line[held - 2] == '\0' && line[held - 1] == '\n') held--;
+        fwrite(line, 1, held, stdout);
+    }
+    free(lines[0]);
+    free(lines[1]);
+    fflush(stdout);
+    return ret;
+}
+
+int sendCommand(int fd, FILE *server, const char *command) {
+    size_t length = strlen(command);
+    if (write(fd, command, length) != (ssize_t) length || write(fd, "\n", 1) != 1) ERR("write");
+    return printAnswer(server);
+}
+
+int main(int argc, char **argv) {
+    char *path = getenv("MOLE_SOCKET");
+    int c;
+    while ((c = getopt(argc, argv, "s:")) != -1)
+        switch (c) {
+            case 's':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    if (path == NULL) usage(argv[0]);
+
+    int fd = connectSocket(path);
+    FILE *server = fdopen(fd, "r");
+    if (server == NULL) ERR("fdopen");
+
+    // remaining arguments form one command, e.g. namepart holiday photo
+    if (optind < argc) {
+        char command[SERVER_MAX_LINE] = "";
+        for (int i = optind; i < argc; i++) {
+            if (strlen(command) + strlen(argv[i]) + 2 > sizeof(command)) usage(argv[0]);
+            if (i > optind) strcat(command, " ");
+            strcat(command, argv[i]);
+        }
+        int ret = sendCommand(fd, server, command);
+        fclose(server);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stdin)) > 0) {
+        if (line[length - 1] == '\n') line[length - 1] = '\0';
+        if (strcmp(line, "exit") == 0) break;
+        if (sendCommand(fd, server, line) < 0) {
+            fprintf(stderr, "Connection closed by server\n");
+            free(line);
+            fclose(server);
+            return EXIT_FAILURE;
+        }
+    }
+    free(line);
+    fclose(server);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1266 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "index.h"
+
+// record of index files written before the format had a header
+#define LEGACY_FILENAME_LENGTH 100
+#define LEGACY_PATH_LENGTH 300
+
+typedef struct legacyIndexedFile_s {
+    char fileName[LEGACY_FILENAME_LENGTH + 1];
+    char path[LEGACY_PATH_LENGTH + 1];
+    off_t size;
+    uid_t UID;
+    char fileType[8];
+} legacyIndexedFile;
+
+static const char *typeNames[TYPE_COUNT] = {
+        [TYPE_DIRECTORY] = "0",
+        [TYPE_JPEG] = "jpeg",
+        [TYPE_PNG] = "png",
+        [TYPE_ZIP] = "zip",
+        [TYPE_GZIP] = "gzip",
+        [TYPE_PDF] = "pdf",
+        [TYPE_ELF] = "elf",
+        [TYPE_TAR] = "tar",
+        [TYPE_ZSTD] = "zstd",
+        [TYPE_XZ] = "xz",
+        [TYPE_BZIP2] = "bzip2",
+        [TYPE_MP4] = "mp4",
+        [TYPE_HEIC] = "heic",
+        [TYPE_AVIF] = "avif",
+        [TYPE_WEBP] = "webp",
+        [TYPE_GIF] = "gif",
+        [TYPE_BMP] = "bmp",
+        [TYPE_TIFF] = "tiff",
+        [TYPE_7Z] = "7z",
+        [TYPE_RAR] = "rar",
+        [TYPE_MP3] = "mp3",
+        [TYPE_OGG] = "ogg",
+        [TYPE_FLAC] = "flac",
+        [TYPE_WAV] = "wav",
+        [TYPE_AVI] = "avi",
+        [TYPE_MKV] = "mkv",
+        [TYPE_MIDI] = "midi",
+        [TYPE_SQLITE] = "sqlite",
+        [TYPE_WASM] = "wasm",
+        [TYPE_PE] = "pe",
+        [TYPE_MACHO] = "macho",
+        [TYPE_CLASS] = "class",
+        [TYPE_PSD] = "psd",
+        [TYPE_PS] = "ps",
+        [TYPE_RTF] = "rtf",
+        [TYPE_LZ4] = "lz4",
+        [TYPE_DEB] = "deb",
+        [TYPE_RPM] = "rpm",
+        [TYPE_WOFF] = "woff",
+        [TYPE_WOFF2] = "woff2",
+        [TYPE_ICO] = "ico",
+};
+
+static const uint32_t elementSizes[SECTION_COUNT] = {
+        [SECTION_SIZE] = sizeof(int64_t),
+        [SECTION_UID] = sizeof(uint32_t),
+        [SECTION_TYPE] = sizeof(uint8_t),
+        [SECTION_DEVICE] = sizeof(uint64_t),
+        [SECTION_INODE] = sizeof(uint64_t),
+        [SECTION_MODIFY_TIME] = sizeof(int64_t),
+        [SECTION_CHANGE_TIME] = sizeof(int64_t),
+        [SECTION_NAME_OFFSET] = sizeof(uint64_t),
+        [SECTION_PARENT] = sizeof(uint32_t),
+        [SECTION_STRINGS] = sizeof(char),
+        [SECTION_SIZE_ORDER] = sizeof(uint32_t),
+        [SECTION_TYPE_START] = sizeof(uint32_t),
+        [SECTION_TYPE_POSTINGS] = sizeof(uint32_t),
+        [SECTION_OWNERS] = sizeof(indexOwner),
+        [SECTION_OWNER_POSTINGS] = sizeof(uint32_t),
+        [SECTION_TRIGRAMS] = sizeof(indexTrigram),
+        [SECTION_TRIGRAM_POSTINGS] = sizeof(uint32_t),
+        [SECTION_ROLLUPS] = sizeof(indexRollup),
+        [SECTION_ROLLUP_TYPES] = sizeof(indexRollupCount),
+        [SECTION_ROLLUP_OWNERS] = sizeof(indexRollupCount),
+        [SECTION_ROLLUP_ORDER] = sizeof(uint32_t),
+        [SECTION_ROLLUP_PATHS] = sizeof(uint32_t),
+};
+
+const char *typeName(int type) {
+    return type >= 0 && type < TYPE_COUNT ? typeNames[type] : "?";
+}
+
+int typeFromName(const char *name) {
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        if (strcmp(typeNames[i], name) == 0) return i;
+    }
+    return TYPE_NONE;
+}
+
+uint32_t indexElementSize(uint32_t id) {
+    return id < SECTION_COUNT ? elementSizes[id] : 0;
+}
+
+uint64_t stringHash(const char *s, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// directories among entries being written keyed by their path, used to find parent of every entry
+typedef struct directoryTable_s {
+    const indexedFile *entries;
+    size_t *slots;
+    size_t capacity;
+} directoryTable;
+
+#define NO_SLOT ((size_t) -1)
+
+static void buildDirectoryTable(directoryTable *table, const indexedFile *entries, size_t count) {
+    table->entries = entries;
+    table->capacity = 16;
+    while (table->capacity < 2 * count) table->capacity *= 2;
+    table->slots = malloc(table->capacity * sizeof(size_t));
+    if (table->slots == NULL) ERR("malloc");
+    memset(table->slots, 0xff, table->capacity * sizeof(size_t));
+
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].fileType != TYPE_DIRECTORY) continue;
+        size_t slot = stringHash(entries[i].path, strlen(entries[i].path)) & (table->capacity - 1);
+        while (table->slots[slot] != NO_SLOT) slot = (slot + 1) & (table->capacity - 1);
+        table->slots[slot] = i;
+    }
+}
+
+static size_t findDirectory(const directoryTable *table, const char *path, size_t length) {
+    for (size_t slot = stringHash(path, length) & (table->capacity - 1); table->slots[slot] != NO_SLOT;
+         slot = (slot + 1) & (table->capacity - 1)) {
+        const char *candidate = table->entries[table->slots[slot]].path;
+        if (strncmp(candidate, path, length) == 0 && candidate[length] == '\0') return table->slots[slot];
+    }
+    return NO_SLOT;
+}
+
+// parent directory of path if it is indexed, sets name to the part of path stored for the entry
+static uint32_t findParent(const directoryTable *table, size_t i, const char **name) {
+    const char *path = table->entries[i].path;
+    const char *slash = strrchr(path, '/');
+    *name = path;
+    if (slash == NULL || slash[1] == '\0') return INDEX_NO_PARENT;
+    // parent of entries directly under root directory is "/" itself
+    size_t parentLength = slash == path ? 1 : (size_t) (slash - path);
+    size_t parent = findDirectory(table, path, parentLength);
+    if (parent == NO_SLOT || parent == i) return INDEX_NO_PARENT;
+    *name = slash + 1;
+    return (uint32_t) parent;
+}
+
+typedef struct sizeKey_s {
+    int64_t size;
+    uint32_t entry;
+} sizeKey;
+
+static int compareSizeKeys(const void *a, const void *b) {
+    const sizeKey *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+static void sortBySize(uint32_t *order, const indexedFile *entries, size_t count) {
+    sizeKey *keys = malloc((count + 1) * sizeof(sizeKey));
+    if (keys == NULL) ERR("malloc");
+    for (size_t i = 0; i < count; i++) {
+        keys[i].size = entries[i].size;
+        keys[i].entry = (uint32_t) i;
+    }
+    qsort(keys, count, sizeof(sizeKey), compareSizeKeys);
+    for (size_t i = 0; i < count; i++) order[i] = keys[i].entry;
+    free(keys);
+}
+
+// positions grouped by type, counting sort keeps them ascending within a type
+static void buildTypePostings(uint32_t *start, uint32_t *postings, const indexedFile *entries, size_t count) {
+    memset(start, 0, (TYPE_COUNT + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) start[entries[i].fileType + 1]++;
+    for (int type = 0; type < TYPE_COUNT; type++) start[type + 1] += start[type];
+    uint32_t next[TYPE_COUNT];
+    memcpy(next, start, sizeof(next));
+    for (size_t i = 0; i < count; i++) postings[next[entries[i].fileType]++] = (uint32_t) i;
+}
+
+// (uid, position) pairs sorted by both, grouped into owner lists when written
+static int compareOwnerKeys(const void *a, const void *b) {
+    const indexOwner *x = a, *y = b;
+    if (x->uid != y->uid) return x->uid < y->uid ? -1 : 1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static size_t sortByOwner(indexOwner *keys, const indexedFile *entries, size_t count) {
+    size_t owners = 0;
+    for (size_t i = 0; i < count; i++) {
+        keys[i].uid = entries[i].UID;
+        keys[i].start = (uint32_t) i;
+    }
+    qsort(keys, count, sizeof(indexOwner), compareOwnerKeys);
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || keys[i].uid != keys[i - 1].uid) owners++;
+    }
+    return owners;
+}
+
+static void buildOwnerPostings(indexOwner *owners, uint32_t *postings, const indexOwner *keys, size_t count) {
+    size_t owner = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || keys[i].uid != keys[i - 1].uid) {
+            owners[owner].uid = keys[i].uid;
+            owners[owner++].start = (uint32_t) i;
+        }
+        postings[i] = keys[i].start;
+    }
+    owners[owner].uid = 0;
+    owners[owner].start = (uint32_t) count;
+}
+
+uint32_t trigramAt(const char *s) {
+    return (uint32_t) (unsigned char) s[0] << 16 | (uint32_t) (unsigned char) s[1] << 8 | (unsigned char) s[2];
+}
+
+static int compareKeys64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// (trigram, position) pairs of all names sorted by both with duplicates dropped, returns their number
+static size_t sortByTrigram(uint64_t **keys, size_t *trigramCount, const indexedFile *entries, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(entries[i].fileName);
+        if (length >= 3) total += length - 2;
+    }
+    *keys = malloc((total + 1) * sizeof(uint64_t));
+    if (*keys == NULL) ERR("malloc");
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = entries[i].fileName;
+        for (size_t j = 0; name[j] != '\0' && name[j + 1] != '\0' && name[j + 2] != '\0'; j++) {
+            (*keys)[n++] = (uint64_t) trigramAt(name + j) << 32 | i;
+        }
+    }
+    qsort(*keys, n, sizeof(uint64_t), compareKeys64);
+
+    size_t unique = 0;
+    *trigramCount = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique > 0 && (*keys)[unique - 1] == (*keys)[i]) continue;
+        if (unique == 0 || (*keys)[unique - 1] >> 32 != (*keys)[i] >> 32) (*trigramCount)++;
+        (*keys)[unique++] = (*keys)[i];
+    }
+    return unique;
+}
+
+static void buildTrigramPostings(indexTrigram *trigrams, uint32_t *postings, const uint64_t *keys, size_t count) {
+    size_t trigram = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || keys[i] >> 32 != keys[i - 1] >> 32) {
+            trigrams[trigram].trigram = (uint32_t) (keys[i] >> 32);
+            trigrams[trigram++].start = (uint32_t) i;
+        }
+        postings[i] = (uint32_t) keys[i];
+    }
+    trigrams[trigram].trigram = 0;
+    trigrams[trigram].start = (uint32_t) count;
+}
+
+#define NO_ROLLUP UINT32_MAX
+
+// rollups of directories being written, the last one of whole index; their type and owner lists are kept
+// in order of computation and laid out in position order when the file is written
+typedef struct rollupBuild_s {
+    size_t count;
+    indexRollup *rollups;
+    uint32_t *typeFrom;
+    uint32_t *typeLength;
+    uint32_t *ownerFrom;
+    uint32_t *ownerLength;
+    indexRollupCount *types;
+    size_t typeCount;
+    size_t typeCapacity;
+    indexRollupCount *owners;
+    size_t ownerCount;
+    size_t ownerCapacity;
+} rollupBuild;
+
+static indexRollupCount *appendRollupCount(indexRollupCount **list, size_t *count, size_t *capacity) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        *list = realloc(*list, *capacity * sizeof(indexRollupCount));
+        if (*list == NULL) ERR("realloc");
+    }
+    return &(*list)[(*count)++];
+}
+
+static int compareRollupCounts(const void *a, const void *b) {
+    const indexRollupCount *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// sums files among children of rollup r and lists of its subdirectories, which are already summed
+static void sumRollup(rollupBuild *build, uint32_t r, const uint32_t *children, size_t childCount,
+                      const uint32_t *rollupOf, const indexedFile *entries, indexRollupCount **owners,
+                      size_t *ownerCapacity) {
+    int64_t typeFiles[TYPE_COUNT] = {0}, typeBytes[TYPE_COUNT] = {0};
+    size_t ownerCount = 0;
+    for (size_t c = 0; c < childCount; c++) {
+        uint32_t child = children[c];
+        if (rollupOf[child] == NO_ROLLUP) {
+            const indexedFile *entry = &entries[child];
+            typeFiles[entry->fileType]++;
+            typeBytes[entry->fileType] += entry->size;
+            indexRollupCount *owner = appendRollupCount(owners, &ownerCount, ownerCapacity);
+            owner->key = entry->UID;
+            owner->files = 1;
+            owner->bytes = entry->size;
+            continue;
+        }
+        uint32_t sub = rollupOf[child];
+        for (uint32_t j = 0; j < build->typeLength[sub]; j++) {
+            const indexRollupCount *type = &build->types[build->typeFrom[sub] + j];
+            typeFiles[type->key] += type->files;
+            typeBytes[type->key] += type->bytes;
+        }
+        for (uint32_t j = 0; j < build->ownerLength[sub]; j++) {
+            *appendRollupCount(owners, &ownerCount, ownerCapacity) = build->owners[build->ownerFrom[sub] + j];
+        }
+    }
+
+    indexRollup *rollup = &build->rollups[r];
+    build->typeFrom[r] = (uint32_t) build->typeCount;
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        if (typeFiles[type] == 0) continue;
+        indexRollupCount *total = appendRollupCount(&build->types, &build->typeCount, &build->typeCapacity);
+        total->key = (uint32_t) type;
+        total->files = (uint32_t) typeFiles[type];
+        total->bytes = typeBytes[type];
+        rollup->files += total->files;
+        rollup->bytes += total->bytes;
+    }
+    build->typeLength[r] = (uint32_t) (build->typeCount - build->typeFrom[r]);
+
+    if (ownerCount > 0) qsort(*owners, ownerCount, sizeof(indexRollupCount), compareRollupCounts);
+    build->ownerFrom[r] = (uint32_t) build->ownerCount;
+    for (size_t j = 0; j < ownerCount; j++) {
+        if (j > 0 && (*owners)[j].key == (*owners)[j - 1].key) {
+            indexRollupCount *last = &build->owners[build->ownerCount - 1];
+            last->files += (*owners)[j].files;
+            last->bytes += (*owners)[j].bytes;
+        } else {
+            *appendRollupCount(&build->owners, &build->ownerCount, &build->ownerCapacity) = (*owners)[j];
+        }
+    }
+    build->ownerLength[r] = (uint32_t) (build->ownerCount - build->ownerFrom[r]);
+}
+
+// totals of files below every directory; directories are summed children first, each one adds its own files
+// to totals of its subdirectories, so every entry is read once; entries without parent make up the whole index
+static void buildRollups(rollupBuild *build, const indexedFile *entries, const uint32_t *parents, size_t count) {
+    memset(build, 0, sizeof(rollupBuild));
+    uint32_t *rollupOf = malloc((count + 1) * sizeof(uint32_t));
+    if (rollupOf == NULL) ERR("malloc");
+    for (size_t i = 0; i < count; i++) {
+        rollupOf[i] = entries[i].fileType == TYPE_DIRECTORY ? (uint32_t) build->count++ : NO_ROLLUP;
+    }
+    size_t dirs = build->count;
+    build->rollups = calloc(dirs + 1, sizeof(indexRollup));
+    build->typeFrom = malloc((dirs + 1) * sizeof(uint32_t));
+    build->typeLength = malloc((dirs + 1) * sizeof(uint32_t));
+    build->ownerFrom = malloc((dirs + 1) * sizeof(uint32_t));
+    build->ownerLength = malloc((dirs + 1) * sizeof(uint32_t));
+    if (build->rollups == NULL || build->typeFrom == NULL || build->typeLength == NULL || build->ownerFrom == NULL ||
+        build->ownerLength == NULL) ERR("malloc");
+
+    // children of each directory grouped by counting sort, entries without parent are children of whole index
+    uint32_t *childStart = calloc(dirs + 2, sizeof(uint32_t));
+    uint32_t *next = malloc((dirs + 1) * sizeof(uint32_t));
+    uint32_t *children = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *queue = malloc((dirs + 1) * sizeof(uint32_t));
+    if (childStart == NULL || next == NULL || children == NULL || queue == NULL) ERR("malloc");
+    for (size_t i = 0; i < count; i++) {
+        if (rollupOf[i] != NO_ROLLUP) {
+            build->rollups[rollupOf[i]].entry = (uint32_t) i;
+            build->rollups[rollupOf[i]].pathHash = stringHash(entries[i].path, strlen(entries[i].path));
+        }
+        childStart[(parents[i] == INDEX_NO_PARENT ? dirs : rollupOf[parents[i]]) + 1]++;
+    }
+    build->rollups[dirs].entry = (uint32_t) count;
+    for (size_t r = 0; r <= dirs; r++) childStart[r + 1] += childStart[r];
+    memcpy(next, childStart, (dirs + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        children[next[parents[i] == INDEX_NO_PARENT ? dirs : rollupOf[parents[i]]]++] = (uint32_t) i;
+    }
+
+    // breadth-first from topmost directories, walked backwards it reaches subdirectories before their parents
+    size_t tail = 0;
+    for (size_t head = 0, r = dirs;; r = queue[head++]) {
+        for (uint32_t c = childStart[r]; c < childStart[r + 1]; c++) {
+            if (rollupOf[children[c]] != NO_ROLLUP) queue[tail++] = rollupOf[children[c]];
+        }
+        if (head == tail) break;
+    }
+    indexRollupCount *owners = NULL;
+    size_t ownerCapacity = 0;
+    while (tail > 0) {
+        uint32_t r = queue[--tail];
+        sumRollup(build, r, children + childStart[r], childStart[r + 1] - childStart[r], rollupOf, entries, &owners,
+                  &ownerCapacity);
+    }
+    sumRollup(build, (uint32_t) dirs, children + childStart[dirs], childStart[dirs + 1] - childStart[dirs], rollupOf,
+              entries, &owners, &ownerCapacity);
+    free(owners);
+    free(queue);
+    free(children);
+    free(next);
+    free(childStart);
+    free(rollupOf);
+}
+
+typedef struct hashKey_s {
+    uint64_t hash;
+    uint32_t rollup;
+} hashKey;
+
+static int compareHashKeys(const void *a, const void *b) {
+    const hashKey *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->rollup < y->rollup ? -1 : x->rollup > y->rollup;
+}
+
+// lays rollups out in position order with their lists, their order by descending bytes and by path hash
+static void writeRollups(const rollupBuild *build, indexRollup *rollups, indexRollupCount *types,
+                         indexRollupCount *owners, uint32_t *order, uint32_t *paths) {
+    uint32_t typeStart = 0, ownerStart = 0;
+    for (size_t r = 0; r <= build->count; r++) {
+        rollups[r] = build->rollups[r];
+        rollups[r].typeStart = typeStart;
+        rollups[r].ownerStart = ownerStart;
+        // an empty index has no counts at all
+        if (build->typeLength[r] > 0) {
+            memcpy(types + typeStart, build->types + build->typeFrom[r],
+                   build->typeLength[r] * sizeof(indexRollupCount));
+        }
+        if (build->ownerLength[r] > 0) {
+            memcpy(owners + ownerStart, build->owners + build->ownerFrom[r],
+                   build->ownerLength[r] * sizeof(indexRollupCount));
+        }
+        typeStart += build->typeLength[r];
+        ownerStart += build->ownerLength[r];
+    }
+
+    sizeKey *keys = malloc((build->count + 1) * sizeof(sizeKey));
+    hashKey *hashes = malloc((build->count + 1) * sizeof(hashKey));
+    if (keys == NULL || hashes == NULL) ERR("malloc");
+    for (size_t r = 0; r < build->count; r++) {
+        keys[r].size = -rollups[r].bytes;
+        keys[r].entry = (uint32_t) r;
+        hashes[r].hash = rollups[r].pathHash;
+        hashes[r].rollup = (uint32_t) r;
+    }
+    qsort(keys, build->count, sizeof(sizeKey), compareSizeKeys);
+    qsort(hashes, build->count, sizeof(hashKey), compareHashKeys);
+    for (size_t r = 0; r < build->count; r++) {
+        order[r] = keys[r].entry;
+        paths[r] = hashes[r].rollup;
+    }
+    free(keys);
+    free(hashes);
+}
+
+static void freeRollupBuild(rollupBuild *build) {
+    free(build->rollups);
+    free(build->typeFrom);
+    free(build->typeLength);
+    free(build->ownerFrom);
+    free(build->ownerLength);
+    free(build->types);
+    free(build->owners);
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+uint64_t checksumStart(size_t length, uint64_t seed) {
+    return seed ^ (length * 0x9e3779b97f4a7c15ULL);
+}
+
+uint64_t checksumUpdate(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *p = data;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+        length--;
+    }
+    return hash;
+}
+
+uint64_t checksumFinish(uint64_t hash) {
+    return hash ^ (hash >> 32);
+}
+
+uint64_t checksum64(const void *data, size_t length, uint64_t seed) {
+    return checksumFinish(checksumUpdate(checksumStart(length, seed), data, length));
+}
+
+// creates file at path with buffer as its content in one sequential write and waits until it is on disk
+static int writeFileDurably(const char *path, const char *buffer, size_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, (mode_t) 0660);
+    if (fd < 0) return -1;
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    if (fsync(fd) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return close(fd);
+}
+
+int writeIndexFile(const char *path, const indexedFile *entries, size_t count) {
+    if (count >= INDEX_NO_PARENT) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    directoryTable directories;
+    buildDirectoryTable(&directories, entries, count);
+    uint32_t *parents = malloc((count + 1) * sizeof(uint32_t));
+    const char **names = malloc((count + 1) * sizeof(char *));
+    if (parents == NULL || names == NULL) ERR("malloc");
+    size_t stringsLength = 0;
+    for (size_t i = 0; i < count; i++) {
+        parents[i] = findParent(&directories, i, &names[i]);
+        stringsLength += strlen(names[i]) + 1;
+    }
+    free(directories.slots);
+    rollupBuild rollups;
+    buildRollups(&rollups, entries, parents, count);
+    indexOwner *ownerKeys = malloc((count + 1) * sizeof(indexOwner));
+    if (ownerKeys == NULL) ERR("malloc");
+    size_t ownerCount = sortByOwner(ownerKeys, entries, count);
+    uint64_t *trigramKeys;
+    size_t trigramCount;
+    size_t trigramPostings = sortByTrigram(&trigramKeys, &trigramCount, entries, count);
+    if (trigramPostings >= UINT32_MAX) {
+        freeRollupBuild(&rollups);
+        free(ownerKeys);
+        free(trigramKeys);
+        free(parents);
+        free(names);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    size_t lengths[SECTION_COUNT];
+    for (uint32_t id = 1; id < SECTION_COUNT; id++) lengths[id] = count * elementSizes[id];
+    lengths[SECTION_STRINGS] = stringsLength;
+    lengths[SECTION_TYPE_START] = (TYPE_COUNT + 1) * elementSizes[SECTION_TYPE_START];
+    lengths[SECTION_OWNERS] = (ownerCount + 1) * elementSizes[SECTION_OWNERS];
+    lengths[SECTION_TRIGRAMS] = (trigramCount + 1) * elementSizes[SECTION_TRIGRAMS];
+    lengths[SECTION_TRIGRAM_POSTINGS] = trigramPostings * elementSizes[SECTION_TRIGRAM_POSTINGS];
+    lengths[SECTION_ROLLUPS] = (rollups.count + 1) * elementSizes[SECTION_ROLLUPS];
+    lengths[SECTION_ROLLUP_TYPES] = rollups.typeCount * elementSizes[SECTION_ROLLUP_TYPES];
+    lengths[SECTION_ROLLUP_OWNERS] = rollups.ownerCount * elementSizes[SECTION_ROLLUP_OWNERS];
+    lengths[SECTION_ROLLUP_ORDER] = rollups.count * elementSizes[SECTION_ROLLUP_ORDER];
+    lengths[SECTION_ROLLUP_PATHS] = rollups.count * elementSizes[SECTION_ROLLUP_PATHS];
+
+    indexSection sections[SECTION_COUNT - 1];
+    size_t tableLength = sizeof(indexHeader) + sizeof(sections);
+    size_t offset = align8(tableLength);
+    for (uint32_t id = 1; id < SECTION_COUNT; id++) {
+        indexSection *section = &sections[id - 1];
+        section->id = id;
+        section->elementSize = elementSizes[id];
+        section->offset = offset;
+        section->length = lengths[id];
+        offset = align8(offset + section->length);
+    }
+    size_t fileLength = offset;
+
+    // whole file is laid out in memory, padding between sections stays zero
+    char *map = calloc(1, fileLength);
+    if (map == NULL) ERR("calloc");
+
+    int64_t *size = (int64_t *) (map + sections[SECTION_SIZE - 1].offset);
+    uint32_t *uid = (uint32_t *) (map + sections[SECTION_UID - 1].offset);
+    uint8_t *type = (uint8_t *) (map + sections[SECTION_TYPE - 1].offset);
+    uint64_t *device = (uint64_t *) (map + sections[SECTION_DEVICE - 1].offset);
+    uint64_t *inode = (uint64_t *) (map + sections[SECTION_INODE - 1].offset);
+    int64_t *modifyTime = (int64_t *) (map + sections[SECTION_MODIFY_TIME - 1].offset);
+    int64_t *changeTime = (int64_t *) (map + sections[SECTION_CHANGE_TIME - 1].offset);
+    uint64_t *nameOffset = (uint64_t *) (map + sections[SECTION_NAME_OFFSET - 1].offset);
+    uint32_t *parent = (uint32_t *) (map + sections[SECTION_PARENT - 1].offset);
+    char *strings = map + sections[SECTION_STRINGS - 1].offset;
+    uint32_t *sizeOrder = (uint32_t *) (map + sections[SECTION_SIZE_ORDER - 1].offset);
+
+    uint64_t stringOffset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const indexedFile *entry = &entries[i];
+        size[i] = entry->size;
+        uid[i] = entry->UID;
+        type[i] = (uint8_t) entry->fileType;
+        device[i] = entry->device;
+        inode[i] = entry->inode;
+        modifyTime[i] = entry->modifyTime;
+        changeTime[i] = entry->changeTime;
+
+        size_t length = strlen(names[i]);
+        memcpy(strings + stringOffset, names[i], length + 1);
+        nameOffset[i] = stringOffset;
+        parent[i] = parents[i];
+        stringOffset += length + 1;
+    }
+    free(parents);
+    free(names);
+    sortBySize(sizeOrder, entries, count);
+    buildTypePostings((uint32_t *) (map + sections[SECTION_TYPE_START - 1].offset),
+                      (uint32_t *) (map + sections[SECTION_TYPE_POSTINGS - 1].offset), entries, count);
+    buildOwnerPostings((indexOwner *) (map + sections[SECTION_OWNERS - 1].offset),
+                       (uint32_t *) (map + sections[SECTION_OWNER_POSTINGS - 1].offset), ownerKeys, count);
+    free(ownerKeys);
+    buildTrigramPostings((indexTrigram *) (map + sections[SECTION_TRIGRAMS - 1].offset),
+                         (uint32_t *) (map + sections[SECTION_TRIGRAM_POSTINGS - 1].offset), trigramKeys,
+                         trigramPostings);
+    free(trigramKeys);
+    writeRollups(&rollups, (indexRollup *) (map + sections[SECTION_ROLLUPS - 1].offset),
+                 (indexRollupCount *) (map + sections[SECTION_ROLLUP_TYPES - 1].offset),
+                 (indexRollupCount *) (map + sections[SECTION_ROLLUP_OWNERS - 1].offset),
+                 (uint32_t *) (map + sections[SECTION_ROLLUP_ORDER - 1].offset),
+                 (uint32_t *) (map + sections[SECTION_ROLLUP_PATHS - 1].offset));
+    freeRollupBuild(&rollups);
+
+    for (size_t i = 0; i < SECTION_COUNT - 1; i++) {
+        sections[i].checksum = checksum64(map + sections[i].offset, sections[i].length, sections[i].id);
+    }
+    indexHeader header = {.version = INDEX_VERSION, .sectionCount = SECTION_COUNT - 1, .entryCount = count};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    memcpy(map, &header, sizeof(header));
+    memcpy(map + sizeof(header), sections, sizeof(sections));
+    header.checksum = checksum64(map, tableLength, 0);
+    memcpy(map, &header, sizeof(header));
+
+    int ret = writeFileDurably(path, map, fileLength);
+    free(map);
+    return ret;
+}
+
+int replaceIndexFile(const char *tempPath, const char *path) {
+    if (rename(tempPath, path) == -1) return -1;
+    // rename is durable only once the directory holding both names is synced
+    char *directory = strdup(path);
+    if (directory == NULL) ERR("strdup");
+    char *slash = strrchr(directory, '/');
+    if (slash == directory) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        strcpy(directory, ".");
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    free(directory);
+    if (fd < 0) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+void closeIndexFile(indexFile *file) {
+    if (file->map != NULL && munmap(file->map, file->mapLength) == -1) perror("error unmapping");
+    if (file->fileDescriptor >= 0) close(file->fileDescriptor);
+    memset(file, 0, sizeof(indexFile));
+    file->fileDescriptor = -1;
+}
+
+// one-shot conversion of fixed 432-byte records whose end is marked by the first record of size 0
+static int convertLegacyIndex(const char *path, int fd, size_t fileLength) {
+    legacyIndexedFile *records = mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (records == MAP_FAILED) return -1;
+    size_t capacity = fileLength / sizeof(legacyIndexedFile);
+    size_t count = 0;
+    while (count < capacity && records[count].size != 0) count++;
+
+    indexedFile *entries = calloc(count + 1, sizeof(indexedFile));
+    char *paths = malloc(count * (LEGACY_PATH_LENGTH + 1) + 1);
+    if (entries == NULL || paths == NULL) ERR("malloc");
+    for (size_t i = 0; i < count; i++) {
+        char *entryPath = paths + i * (LEGACY_PATH_LENGTH + 1);
+        size_t length = strnlen(records[i].path, LEGACY_PATH_LENGTH);
+        memcpy(entryPath, records[i].path, length);
+        entryPath[length] = '\0';
+        char fileType[sizeof(records[i].fileType) + 1] = {0};
+        memcpy(fileType, records[i].fileType, sizeof(records[i].fileType));
+
+        const char *p = strrchr(entryPath, '/');
+        entries[i].path = entryPath;
+        entries[i].fileName = (p != NULL && p[1] != '\0') ? p + 1 : entryPath;
+        entries[i].size = records[i].size;
+        entries[i].UID = records[i].UID;
+        // records hold only indexed types
+        entries[i].fileType = typeFromName(fileType) != TYPE_NONE ? typeFromName(fileType) : TYPE_DIRECTORY;
+    }
+    munmap(records, fileLength);
+
+    size_t tempLength = strlen(path) + strlen("-legacy") + 1;
+    char *tempPath = malloc(tempLength);
+    if (tempPath == NULL) ERR("malloc");
+    snprintf(tempPath, tempLength, "%s-legacy", path);
+    int ret = writeIndexFile(tempPath, entries, count);
+    if (ret == 0) ret = replaceIndexFile(tempPath, path);
+    if (ret == 0) fprintf(stdout, "Index file converted to format version %d\n", INDEX_VERSION);
+    free(tempPath);
+    free(paths);
+    free(entries);
+    return ret;
+}
+
+static const indexSection *findSection(const indexSection *sections, uint32_t count, uint32_t id) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (sections[i].id == id) return &sections[i];
+    }
+    return NULL;
+}
+
+static int sectionLengthValid(uint32_t id, uint64_t length, uint64_t count) {
+    switch (id) {
+        case SECTION_STRINGS:
+            return 1;
+        case SECTION_TYPE_START:
+            // files written before types were added have fewer lists
+            return length >= 2 * elementSizes[id] && length <= (TYPE_COUNT + 1) * elementSizes[id] &&
+                   length % elementSizes[id] == 0;
+        case SECTION_OWNERS:
+        case SECTION_TRIGRAMS:
+        case SECTION_ROLLUPS:
+            return length >= elementSizes[id] && length % elementSizes[id] == 0;
+        case SECTION_TRIGRAM_POSTINGS:
+        case SECTION_ROLLUP_TYPES:
+        case SECTION_ROLLUP_OWNERS:
+        case SECTION_ROLLUP_ORDER:
+        case SECTION_ROLLUP_PATHS:
+            return length % elementSizes[id] == 0;
+        default:
+            return length == count * elementSizes[id];
+    }
+}
+
+// every list of postings is ascending and holds entries of its key only
+static int postingsValid(const indexFile *file) {
+    for (int type = 0; type < file->typeCount; type++) {
+        if (file->typeStart[type] > file->typeStart[type + 1]) return 0;
+    }
+    if (file->typeStart[0] != 0 || file->typeStart[file->typeCount] != file->count) return 0;
+    for (int type = 0; type < file->typeCount; type++) {
+        for (uint32_t j = file->typeStart[type]; j < file->typeStart[type + 1]; j++) {
+            uint32_t i = file->typePostings[j];
+            if (i >= file->count || file->type[i] != type ||
+                (j > file->typeStart[type] && file->typePostings[j - 1] >= i)) return 0;
+        }
+    }
+    if (file->owners[0].start != 0 || file->owners[file->ownerCount].start != file->count) return 0;
+    for (size_t owner = 0; owner < file->ownerCount; owner++) {
+        const indexOwner *o = &file->owners[owner];
+        if (o->start > o[1].start || (owner > 0 && o[-1].uid >= o->uid)) return 0;
+        for (uint32_t j = o->start; j < o[1].start; j++) {
+            uint32_t i = file->ownerPostings[j];
+            if (i >= file->count || file->uid[i] != o->uid || (j > o->start && file->ownerPostings[j - 1] >= i))
+                return 0;
+        }
+    }
+    // names are not checked to hold their trigrams, a wrong list only costs verification
+    if (file->trigrams[0].start != 0) return 0;
+    for (size_t t = 0; t < file->trigramCount; t++) {
+        const indexTrigram *trigram = &file->trigrams[t];
+        if (trigram->start > trigram[1].start || (t > 0 && trigram[-1].trigram >= trigram->trigram)) return 0;
+        for (uint32_t j = trigram->start; j < trigram[1].start; j++) {
+            if (file->trigramPostings[j] >= file->count ||
+                (j > trigram->start && file->trigramPostings[j - 1] >= file->trigramPostings[j])) return 0;
+        }
+    }
+    return 1;
+}
+
+// hint is applied to whole pages holding the section
+static void adviseSection(const indexFile *file, const indexSection *section, int advice) {
+    static long pageSize;
+    if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = section->offset & ~(size_t) (pageSize - 1);
+    if (section->offset + section->length == start) return;
+    madvise((char *) file->map + start, section->offset + section->length - start, advice);
+}
+
+// checks header and section bounds and fills column pointers, all in time independent of index size;
+// references between sections are checked by referencesValid and checksums by verifyIndexFile
+static int mapSections(indexFile *file) {
+    const char *map = file->map;
+    indexHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (header.version != INDEX_VERSION) {
+        fprintf(stderr, "Index file version %u is not supported\n", header.version);
+        return -1;
+    }
+    size_t tableLength = sizeof(indexHeader) + (size_t) header.sectionCount * sizeof(indexSection);
+    if (header.sectionCount > 1024 || tableLength > file->mapLength) return -1;
+
+    char *table = malloc(tableLength);
+    if (table == NULL) ERR("malloc");
+    memcpy(table, map, tableLength);
+    ((indexHeader *) table)->checksum = 0;
+    uint64_t checksum = checksum64(table, tableLength, 0);
+    free(table);
+    if (checksum != header.checksum) return -1;
+
+    const indexSection *sections = (const indexSection *) (map + sizeof(indexHeader));
+    for (uint32_t id = 1; id < SECTION_COUNT; id++) {
+        const indexSection *section = findSection(sections, header.sectionCount, id);
+        if (section == NULL || section->offset % 8 != 0 || section->offset > file->mapLength ||
+            section->length > file->mapLength - section->offset) return -1;
+        if (!sectionLengthValid(id, section->length, header.entryCount)) return -1;
+        // columns read by most queries are read ahead, posting lists are read a few pages at a time
+        if (id == SECTION_SIZE || id == SECTION_TYPE || id == SECTION_PARENT || id == SECTION_SIZE_ORDER ||
+            id == SECTION_TYPE_START) {
+            adviseSection(file, section, MADV_WILLNEED);
+        } else if (id == SECTION_OWNER_POSTINGS || id == SECTION_TRIGRAM_POSTINGS) {
+            adviseSection(file, section, MADV_RANDOM);
+        }
+    }
+
+    file->count = header.entryCount;
+    file->size = (const int64_t *) (map + findSection(sections, header.sectionCount, SECTION_SIZE)->offset);
+    file->uid = (const uint32_t *) (map + findSection(sections, header.sectionCount, SECTION_UID)->offset);
+    file->type = (const uint8_t *) (map + findSection(sections, header.sectionCount, SECTION_TYPE)->offset);
+    file->device = (const uint64_t *) (map + findSection(sections, header.sectionCount, SECTION_DEVICE)->offset);
+    file->inode = (const uint64_t *) (map + findSection(sections, header.sectionCount, SECTION_INODE)->offset);
+    file->modifyTime = (const int64_t *) (map + findSection(sections, header.sectionCount,
+                                                            SECTION_MODIFY_TIME)->offset);
+    file->changeTime = (const int64_t *) (map + findSection(sections, header.sectionCount,
+                                                            SECTION_CHANGE_TIME)->offset);
+    file->nameOffset = (const uint64_t *) (map + findSection(sections, header.sectionCount,
+                                                             SECTION_NAME_OFFSET)->offset);
+    file->parent = (const uint32_t *) (map + findSection(sections, header.sectionCount, SECTION_PARENT)->offset);
+    const indexSection *strings = findSection(sections, header.sectionCount, SECTION_STRINGS);
+    file->strings = map + strings->offset;
+    file->stringsLength = strings->length;
+    if (file->stringsLength > 0 && file->strings[file->stringsLength - 1] != '\0') return -1;
+    file->sizeOrder = (const uint32_t *) (map + findSection(sections, header.sectionCount,
+                                                            SECTION_SIZE_ORDER)->offset);
+    const indexSection *typeStart = findSection(sections, header.sectionCount, SECTION_TYPE_START);
+    file->typeStart = (const uint32_t *) (map + typeStart->offset);
+    file->typeCount = (int) (typeStart->length / sizeof(uint32_t) - 1);
+    file->typePostings = (const uint32_t *) (map + findSection(sections, header.sectionCount,
+                                                               SECTION_TYPE_POSTINGS)->offset);
+    const indexSection *owners = findSection(sections, header.sectionCount, SECTION_OWNERS);
+    file->owners = (const indexOwner *) (map + owners->offset);
+    file->ownerCount = owners->length / sizeof(indexOwner) - 1;
+    file->ownerPostings = (const uint32_t *) (map + findSection(sections, header.sectionCount,
+                                                                SECTION_OWNER_POSTINGS)->offset);
+    const indexSection *trigrams = findSection(sections, header.sectionCount, SECTION_TRIGRAMS);
+    const indexSection *trigramPostings = findSection(sections, header.sectionCount, SECTION_TRIGRAM_POSTINGS);
+    file->trigrams = (const indexTrigram *) (map + trigrams->offset);
+    file->trigramCount = trigrams->length / sizeof(indexTrigram) - 1;
+    file->trigramPostings = (const uint32_t *) (map + trigramPostings->offset);
+    if (file->trigrams[file->trigramCount].start != trigramPostings->length / sizeof(uint32_t)) return -1;
+    const indexSection *rollups = findSection(sections, header.sectionCount, SECTION_ROLLUPS);
+    const indexSection *rollupTypes = findSection(sections, header.sectionCount, SECTION_ROLLUP_TYPES);
+    const indexSection *rollupOwners = findSection(sections, header.sectionCount, SECTION_ROLLUP_OWNERS);
+    file->rollups = (const indexRollup *) (map + rollups->offset);
+    file->rollupCount = rollups->length / sizeof(indexRollup) - 1;
+    file->rollupTypes = (const indexRollupCount *) (map + rollupTypes->offset);
+    file->rollupTypeCount = rollupTypes->length / sizeof(indexRollupCount);
+    file->rollupOwners = (const indexRollupCount *) (map + rollupOwners->offset);
+    file->rollupOwnerCount = rollupOwners->length / sizeof(indexRollupCount);
+    const indexSection *rollupOrder = findSection(sections, header.sectionCount, SECTION_ROLLUP_ORDER);
+    const indexSection *rollupPaths = findSection(sections, header.sectionCount, SECTION_ROLLUP_PATHS);
+    file->rollupOrder = (const uint32_t *) (map + rollupOrder->offset);
+    file->rollupPaths = (const uint32_t *) (map + rollupPaths->offset);
+    const indexRollup *total = &file->rollups[file->rollupCount];
+    if (total->typeStart > file->rollupTypeCount || total->ownerStart > file->rollupOwnerCount ||
+        rollupOrder->length != file->rollupCount * sizeof(uint32_t) ||
+        rollupPaths->length != file->rollupCount * sizeof(uint32_t)) return -1;
+    return 0;
+}
+
+// one rollup per directory and one of whole index, lists are sorted by key and add up to their totals
+static int rollupsValid(const indexFile *file) {
+    const uint32_t *directories;
+    if (file->rollupCount != indexFileTypeList(file, TYPE_DIRECTORY, &directories)) return 0;
+    if (file->rollups[0].typeStart != 0 || file->rollups[0].ownerStart != 0 ||
+        file->rollups[file->rollupCount].entry != file->count) return 0;
+    for (size_t r = 0; r <= file->rollupCount; r++) {
+        const indexRollup *rollup = &file->rollups[r];
+        if (r < file->rollupCount &&
+            (rollup->entry >= file->count || file->type[rollup->entry] != TYPE_DIRECTORY ||
+             (r > 0 && rollup[-1].entry >= rollup->entry) || rollup->typeStart > rollup[1].typeStart ||
+             rollup->ownerStart > rollup[1].ownerStart)) return 0;
+        const indexRollupCount *types, *owners;
+        size_t typeCount = indexFileRollupTypes(file, rollup, &types);
+        size_t ownerCount = indexFileRollupOwners(file, rollup, &owners);
+        uint64_t typeFiles = 0, ownerFiles = 0;
+        int64_t typeBytes = 0, ownerBytes = 0;
+        for (size_t j = 0; j < typeCount; j++) {
+            if (types[j].key >= TYPE_COUNT || (j > 0 && types[j - 1].key >= types[j].key)) return 0;
+            typeFiles += types[j].files;
+            typeBytes += types[j].bytes;
+        }
+        for (size_t j = 0; j < ownerCount; j++) {
+            if (j > 0 && owners[j - 1].key >= owners[j].key) return 0;
+            ownerFiles += owners[j].files;
+            ownerBytes += owners[j].bytes;
+        }
+        if (typeFiles != rollup->files || ownerFiles != rollup->files || typeBytes != rollup->bytes ||
+            ownerBytes != rollup->bytes) return 0;
+    }
+    for (size_t j = 0; j < file->rollupCount; j++) {
+        uint32_t r = file->rollupOrder[j], p = file->rollupPaths[j];
+        if (r >= file->rollupCount || p >= file->rollupCount ||
+            (j > 0 && file->rollups[file->rollupOrder[j - 1]].bytes < file->rollups[r].bytes) ||
+            (j > 0 && file->rollups[file->rollupPaths[j - 1]].pathHash > file->rollups[p].pathHash)) return 0;
+    }
+    return 1;
+}
+
+int verifyIndexFile(const indexFile *file) {
+    const char *map = file->map;
+    indexHeader header;
+    memcpy(&header, map, sizeof(header));
+    const indexSection *sections = (const indexSection *) (map + sizeof(indexHeader));
+    for (uint32_t id = 1; id < SECTION_COUNT; id++) {
+        const indexSection *section = findSection(sections, header.sectionCount, id);
+        if (checksum64(map + section->offset, section->length, id) != section->checksum) return -1;
+    }
+    return 0;
+}
+
+// parents of entry lead to an entry without parent, state of entries is 0 (not seen), 1 (on current chain)
+// or 2 (leads to top), so every entry is followed once
+static int parentsAcyclic(const indexFile *file, uint8_t *state, uint32_t entry) {
+    uint32_t i = entry;
+    while (i != INDEX_NO_PARENT && state[i] == 0) {
+        state[i] = 1;
+        i = file->parent[i];
+    }
+    if (i != INDEX_NO_PARENT && state[i] == 1) return 0;
+    for (i = entry; i != INDEX_NO_PARENT && state[i] == 1; i = file->parent[i]) state[i] = 2;
+    return 1;
+}
+
+// every id stored in columns, posting lists and rollups refers to an existing entry of the right kind,
+// so queries may follow them as soon as the file is published
+static int referencesValid(const indexFile *file) {
+    if (!postingsValid(file) || !rollupsValid(file)) return 0;
+    // parent always refers to another directory entry
+    for (size_t i = 0; i < file->count; i++) {
+        if (file->nameOffset[i] >= file->stringsLength) return 0;
+        if (file->parent[i] != INDEX_NO_PARENT &&
+            (file->parent[i] >= file->count || file->parent[i] == i ||
+             file->type[file->parent[i]] != TYPE_DIRECTORY)) return 0;
+        if (file->sizeOrder[i] >= file->count ||
+            (i > 0 && file->size[file->sizeOrder[i - 1]] > file->size[file->sizeOrder[i]])) return 0;
+    }
+    uint8_t *state = calloc(file->count + 1, 1);
+    if (state == NULL) ERR("calloc");
+    int valid = 1;
+    for (size_t i = 0; i < file->count && valid; i++) valid = parentsAcyclic(file, state, (uint32_t) i);
+    free(state);
+    return valid;
+}
+
+int loadIndexFile(const char *path, indexFile *file) {
+    memset(file, 0, sizeof(indexFile));
+    file->fileDescriptor = open(path, O_RDONLY);
+    if (file->fileDescriptor < 0) return -1;
+
+    struct stat fileStats;
+    if (fstat(file->fileDescriptor, &fileStats) < 0) ERR("fstat");
+    file->mapLength = fileStats.st_size;
+
+    char magic[8] = {0};
+    if (file->mapLength < sizeof(indexHeader) ||
+        pread(file->fileDescriptor, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        // file without header is either legacy index or not an index at all
+        int converted = file->mapLength > 0 && file->mapLength % sizeof(legacyIndexedFile) == 0 &&
+                        convertLegacyIndex(path, file->fileDescriptor, file->mapLength) == 0;
+        close(file->fileDescriptor);
+        file->fileDescriptor = -1;
+        return converted ? loadIndexFile(path, file) : -2;
+    }
+
+    // readers never write to the file, pages are faulted in on first use
+    file->map = mmap(NULL, file->mapLength, PROT_READ, MAP_SHARED, file->fileDescriptor, 0);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        closeIndexFile(file);
+        return -2;
+    }
+    if (mapSections(file) < 0 || !referencesValid(file)) {
+        closeIndexFile(file);
+        return -2;
+    }
+    return 0;
+}
+
+const char *indexFileName(const indexFile *file, size_t i) {
+    const char *name = file->strings + file->nameOffset[i];
+    if (file->parent[i] == INDEX_NO_PARENT) {
+        const char *p = strrchr(name, '/');
+        if (p != NULL && p[1] != '\0') name = p + 1;
+    }
+    return name;
+}
+
+void indexFileEntry(const indexFile *file, size_t i, indexedFile *entry) {
+    entry->path = NULL;
+    entry->fileName = indexFileName(file, i);
+    entry->size = file->size[i];
+    entry->UID = file->uid[i];
+    entry->fileType = file->type[i];
+    entry->device = file->device[i];
+    entry->inode = file->inode[i];
+    entry->modifyTime = file->modifyTime[i];
+    entry->changeTime = file->changeTime[i];
+}
+
+size_t indexFileTypeList(const indexFile *file, int type, const uint32_t **list) {
+    if (file->typeStart == NULL || type < 0 || type >= file->typeCount) return 0;
+    *list = file->typePostings + file->typeStart[type];
+    return file->typeStart[type + 1] - file->typeStart[type];
+}
+
+size_t indexFileOwnerList(const indexFile *file, uint32_t uid, const uint32_t **list) {
+    size_t low = 0, high = file->ownerCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file->owners[middle].uid < uid) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == file->ownerCount || file->owners[low].uid != uid) return 0;
+    *list = file->ownerPostings + file->owners[low].start;
+    return file->owners[low + 1].start - file->owners[low].start;
+}
+
+size_t indexFileTrigramList(const indexFile *file, uint32_t trigram, const uint32_t **list) {
+    size_t low = 0, high = file->trigramCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file->trigrams[middle].trigram < trigram) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == file->trigramCount || file->trigrams[low].trigram != trigram) return 0;
+    *list = file->trigramPostings + file->trigrams[low].start;
+    return file->trigrams[low + 1].start - file->trigrams[low].start;
+}
+
+// entry whose stored name holds byte at offset of strings, names are stored in position order
+static size_t entryAt(const indexFile *file, size_t offset) {
+    size_t low = 0, high = file->count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (file->nameOffset[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+long indexFileNameScan(const indexFile *file, const char *pattern, size_t length, size_t *offset) {
+    // memmem runs over all names at once, NUL between names never matches
+    while (*offset < file->stringsLength) {
+        const char *match = memmem(file->strings + *offset, file->stringsLength - *offset, pattern, length);
+        if (match == NULL) break;
+        size_t i = entryAt(file, match - file->strings);
+        const char *name = indexFileName(file, i);
+        // match in directories of a path stored whole does not count, its name can still match
+        if (match < name) {
+            *offset = name - file->strings;
+            continue;
+        }
+        *offset = name - file->strings + strlen(name) + 1;
+        return (long) i;
+    }
+    *offset = file->stringsLength;
+    return -1;
+}
+
+void initPathCache(pathCache *cache, const indexFile *file) {
+    memset(cache, 0, sizeof(pathCache));
+    cache->file = file;
+}
+
+static const char *cachedPath(const pathCache *cache, uint32_t entry) {
+    if (cache->capacity == 0) return NULL;
+    for (size_t slot = (entry * 0x9e3779b97f4a7c15ULL) & (cache->capacity - 1); cache->slots[slot].path != NULL;
+         slot = (slot + 1) & (cache->capacity - 1)) {
+        if (cache->slots[slot].entry == entry) return cache->slots[slot].path;
+    }
+    return NULL;
+}
+
+static void cachePath(pathCache *cache, uint32_t entry, const char *path) {
+    // keeping load factor under 1/2
+    if (2 * (cache->count + 1) > cache->capacity) {
+        pathCacheSlot *old = cache->slots;
+        size_t oldCapacity = cache->capacity;
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 256;
+        cache->slots = calloc(cache->capacity, sizeof(pathCacheSlot));
+        if (cache->slots == NULL) ERR("calloc");
+        cache->count = 0;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].path != NULL) cachePath(cache, old[i].entry, old[i].path);
+        }
+        free(old);
+    }
+    size_t slot = (entry * 0x9e3779b97f4a7c15ULL) & (cache->capacity - 1);
+    while (cache->slots[slot].path != NULL) slot = (slot + 1) & (cache->capacity - 1);
+    cache->slots[slot].entry = entry;
+    cache->slots[slot].path = path;
+    cache->count++;
+}
+
+// joins directory path and name in cache buffer
+static size_t joinPath(pathCache *cache, const char *directory, const char *name) {
+    size_t directoryLength = strlen(directory), nameLength = strlen(name);
+    int separator = directoryLength == 0 || directory[directoryLength - 1] != '/';
+    size_t length = directoryLength + separator + nameLength;
+    if (length + 1 > cache->bufferCapacity) {
+        cache->bufferCapacity = 2 * (length + 1);
+        cache->buffer = realloc(cache->buffer, cache->bufferCapacity);
+        if (cache->buffer == NULL) ERR("realloc");
+    }
+    memmove(cache->buffer, directory, directoryLength);
+    if (separator) cache->buffer[directoryLength] = '/';
+    memcpy(cache->buffer + directoryLength + separator, name, nameLength + 1);
+    return length;
+}
+
+static const char *directoryPath(pathCache *cache, uint32_t entry) {
+    const indexFile *file = cache->file;
+    const char *name = file->strings + file->nameOffset[entry];
+    if (file->parent[entry] == INDEX_NO_PARENT) return name;
+    const char *path = cachedPath(cache, entry);
+    if (path != NULL) return path;
+
+    const char *parent = directoryPath(cache, file->parent[entry]);
+    size_t length = joinPath(cache, parent, name);
+    path = arenaCopy(&cache->strings, cache->buffer, length);
+    cachePath(cache, entry, path);
+    return path;
+}
+
+const char *indexFilePath(pathCache *cache, size_t i) {
+    const indexFile *file = cache->file;
+    if (file->parent[i] == INDEX_NO_PARENT || file->type[i] == TYPE_DIRECTORY) {
+        return directoryPath(cache, (uint32_t) i);
+    }
+    joinPath(cache, directoryPath(cache, file->parent[i]), file->strings + file->nameOffset[i]);
+    return cache->buffer;
+}
+
+void freePathCache(pathCache *cache) {
+    free(cache->slots);
+    free(cache->buffer);
+    freeArena(&cache->strings);
+    memset(cache, 0, sizeof(pathCache));
+}
+
+// first position of sizeOrder whose entry is not smaller than size
+static size_t lowerBound(const indexFile *file, int64_t size) {
+    size_t low = 0, high = file->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file->size[file->sizeOrder[middle]] < size) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void indexFileSizeRange(const indexFile *file, int64_t min, int64_t max, size_t *first, size_t *last) {
+    if (min > max) {
+        *first = *last = 0;
+        return;
+    }
+    *first = lowerBound(file, min);
+    *last = max == INT64_MAX ? file->count : lowerBound(file, max + 1);
+}
+
+const indexRollup *indexFileFindRollup(pathCache *cache, const char *path) {
+    const indexFile *file = cache->file;
+    uint64_t hash = stringHash(path, strlen(path));
+    size_t low = 0, high = file->rollupCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (file->rollups[file->rollupPaths[middle]].pathHash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    // paths sharing a hash are told apart by rebuilding them
+    for (; low < file->rollupCount && file->rollups[file->rollupPaths[low]].pathHash == hash; low++) {
+        const indexRollup *rollup = &file->rollups[file->rollupPaths[low]];
+        if (strcmp(indexFilePath(cache, rollup->entry), path) == 0) return rollup;
+    }
+    return NULL;
+}
+
+const indexRollup *indexFileTotal(const indexFile *file) {
+    return file->rollups != NULL ? &file->rollups[file->rollupCount] : NULL;
+}
+
+size_t indexFileRollupTypes(const indexFile *file, const indexRollup *rollup, const indexRollupCount **list) {
+    size_t end = rollup == indexFileTotal(file) ? file->rollupTypeCount : rollup[1].typeStart;
+    *list = file->rollupTypes + rollup->typeStart;
+    return end - rollup->typeStart;
+}
+
+size_t indexFileRollupOwners(const indexFile *file, const indexRollup *rollup, const indexRollupCount **list) {
+    size_t end = rollup == indexFileTotal(file) ? file->rollupOwnerCount : rollup[1].ownerStart;
+    *list = file->rollupOwners + rollup->ownerStart;
+    return end - rollup->ownerStart;
+}
@@ -0,0 +1,236 @@
+#ifndef FILE_INDEXER_INDEX_H
+#define FILE_INDEXER_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "indexer.h"
+#include "arena.h"
+
+#define INDEX_MAGIC "MOLEIDX"
+#define INDEX_VERSION 6
+
+// parent of entries whose parent directory is not indexed, their name is the whole path
+#define INDEX_NO_PARENT UINT32_MAX
+
+// on-disk layout: header, section table, then sections aligned to 8 bytes;
+// numeric columns hold one value per entry, names are NUL-terminated in one arena
+// and full paths are rebuilt by following parent directory ids
+typedef struct indexHeader_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t entryCount;
+    // covers header (with this field zeroed) and section table
+    uint64_t checksum;
+} indexHeader;
+
+typedef struct indexSection_s {
+    uint32_t id;
+    uint32_t elementSize;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t checksum;
+} indexSection;
+
+enum indexSectionId {
+    SECTION_SIZE = 1,
+    SECTION_UID,
+    SECTION_TYPE,
+    SECTION_DEVICE,
+    SECTION_INODE,
+    SECTION_MODIFY_TIME,
+    SECTION_CHANGE_TIME,
+    SECTION_NAME_OFFSET,
+    SECTION_PARENT,
+    SECTION_STRINGS,
+    // entry positions ordered by ascending size
+    SECTION_SIZE_ORDER,
+    // posting lists: sorted positions of entries grouped by type and by owner
+    SECTION_TYPE_START,
+    SECTION_TYPE_POSTINGS,
+    SECTION_OWNERS,
+    SECTION_OWNER_POSTINGS,
+    // posting lists of every three consecutive bytes of file names
+    SECTION_TRIGRAMS,
+    SECTION_TRIGRAM_POSTINGS,
+    // totals of files below each directory, per type and per owner
+    SECTION_ROLLUPS,
+    SECTION_ROLLUP_TYPES,
+    SECTION_ROLLUP_OWNERS,
+    // rollups ordered by descending bytes and by hash of directory path
+    SECTION_ROLLUP_ORDER,
+    SECTION_ROLLUP_PATHS,
+    SECTION_COUNT
+};
+
+// entries owned by uid are ownerPostings[start, start of next owner), last owner is a sentinel
+typedef struct indexOwner_s {
+    uint32_t uid;
+    uint32_t start;
+} indexOwner;
+
+// entries whose name holds trigram are trigramPostings[start, start of next trigram), last one is a sentinel
+typedef struct indexTrigram_s {
+    uint32_t trigram;
+    uint32_t start;
+} indexTrigram;
+
+// regular files anywhere below directory at position entry, directories themselves are not counted;
+// their types are rollupTypes[typeStart, typeStart of next rollup) and owners rollupOwners[ownerStart, ...),
+// last rollup covers the whole index and its entry is the number of entries
+typedef struct indexRollup_s {
+    uint32_t entry;
+    uint32_t typeStart;
+    uint32_t ownerStart;
+    uint32_t files;
+    int64_t bytes;
+    uint64_t pathHash;
+} indexRollup;
+
+// files of one type or owner (key) below a directory
+typedef struct indexRollupCount_s {
+    uint32_t key;
+    uint32_t files;
+    int64_t bytes;
+} indexRollupCount;
+
+// loaded index file, columns point into the mapping
+typedef struct indexFile_s {
+    int fileDescriptor;
+    void *map;
+    size_t mapLength;
+    size_t count;
+    const int64_t *size;
+    const uint32_t *uid;
+    const uint8_t *type;
+    const uint64_t *device;
+    const uint64_t *inode;
+    const int64_t *modifyTime;
+    const int64_t *changeTime;
+    const uint64_t *nameOffset;
+    const uint32_t *parent;
+    const char *strings;
+    size_t stringsLength;
+    const uint32_t *sizeOrder;
+    const uint32_t *typeStart;
+    // types with a posting list, entries of types added later cannot be in the file
+    int typeCount;
+    const uint32_t *typePostings;
+    const indexOwner *owners;
+    size_t ownerCount;
+    const uint32_t *ownerPostings;
+    const indexTrigram *trigrams;
+    size_t trigramCount;
+    const uint32_t *trigramPostings;
+    // one rollup per directory in position order followed by the one of whole index
+    const indexRollup *rollups;
+    size_t rollupCount;
+    const indexRollupCount *rollupTypes;
+    size_t rollupTypeCount;
+    const indexRollupCount *rollupOwners;
+    size_t rollupOwnerCount;
+    const uint32_t *rollupOrder;
+    const uint32_t *rollupPaths;
+} indexFile;
+
+// cheap word-at-a-time hash, detects torn writes and truncation rather than tampering
+uint64_t checksum64(const void *data, size_t length, uint64_t seed);
+
+// checksum64 of data given in pieces, every piece but the last has to be a multiple of 8 bytes long
+uint64_t checksumStart(size_t length, uint64_t seed);
+
+uint64_t checksumUpdate(uint64_t hash, const void *data, size_t length);
+
+uint64_t checksumFinish(uint64_t hash);
+
+// bytes of one element of section id
+uint32_t indexElementSize(uint32_t id);
+
+// hash of a path kept by rollups of directories
+uint64_t stringHash(const char *s, size_t length);
+
+// builds the whole file in memory and writes it to a new file at path with one write followed by fsync,
+// returns -1 and sets errno on failure
+int writeIndexFile(const char *path, const indexedFile *entries, size_t count);
+
+// atomically puts file written by writeIndexFile in place of the one at path, which stays valid until then
+int replaceIndexFile(const char *tempPath, const char *path);
+
+// maps index file read-only checking its header, section table and references between sections but not
+// checksums, an index in legacy fixed-record format is converted once and rewritten in place,
+// returns -1 if file does not exist and -2 if it is damaged
+int loadIndexFile(const char *path, indexFile *file);
+
+// checks checksums of all sections, reads the whole file, returns -1 if loaded file is damaged
+int verifyIndexFile(const indexFile *file);
+
+void closeIndexFile(indexFile *file);
+
+// printed name of entry type
+const char *typeName(int type);
+
+// type with given printed name or TYPE_NONE
+int typeFromName(const char *name);
+
+// sets list to sorted positions of entries of type and returns their number
+size_t indexFileTypeList(const indexFile *file, int type, const uint32_t **list);
+
+// sets list to sorted positions of entries owned by uid and returns their number
+size_t indexFileOwnerList(const indexFile *file, uint32_t uid, const uint32_t **list);
+
+// trigram of three bytes starting at s
+uint32_t trigramAt(const char *s);
+
+// sets list to sorted positions of entries whose name holds trigram and returns their number
+size_t indexFileTrigramList(const indexFile *file, uint32_t trigram, const uint32_t **list);
+
+// position of first entry from *offset of strings on whose name holds pattern, -1 if there is none;
+// *offset is moved past that entry so the scan can be continued
+long indexFileNameScan(const indexFile *file, const char *pattern, size_t length, size_t *offset);
+
+// range [first, last) of sizeOrder holding entries with size in [min, max]
+void indexFileSizeRange(const indexFile *file, int64_t min, int64_t max, size_t *first, size_t *last);
+
+// name of i-th entry, entries without parent store whole path and their name is its last component
+const char *indexFileName(const indexFile *file, size_t i);
+
+// fills entry with i-th entry of file, file name points into the mapping and path is left NULL
+void indexFileEntry(const indexFile *file, size_t i, indexedFile *entry);
+
+typedef struct pathCacheSlot_s {
+    uint32_t entry;
+    const char *path;
+} pathCacheSlot;
+
+// full paths of directories rebuilt by one query, so each ancestor is walked once
+typedef struct pathCache_s {
+    const indexFile *file;
+    pathCacheSlot *slots;
+    size_t capacity;
+    size_t count;
+    stringArena strings;
+    char *buffer;
+    size_t bufferCapacity;
+} pathCache;
+
+void initPathCache(pathCache *cache, const indexFile *file);
+
+// full path of i-th entry of file, valid until the next call with the same cache
+const char *indexFilePath(pathCache *cache, size_t i);
+
+void freePathCache(pathCache *cache);
+
+// rollup of directory at path rebuilding candidate paths with cache, NULL if it is not indexed
+const indexRollup *indexFileFindRollup(pathCache *cache, const char *path);
+
+// rollup of whole index, NULL for an empty one
+const indexRollup *indexFileTotal(const indexFile *file);
+
+// sets list to files of each type below directory of rollup, ascending by type, and returns their number
+size_t indexFileRollupTypes(const indexFile *file, const indexRollup *rollup, const indexRollupCount **list);
+
+// sets list to files of each owner below directory of rollup, ascending by uid, and returns their number
+size_t indexFileRollupOwners(const indexFile *file, const indexRollup *rollup, const indexRollupCount **list);
+
+#endif //FILE_INDEXER_INDEX_H
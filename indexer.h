@@ -0,0 +1,79 @@
+#ifndef FILE_INDEXER_INDEXER_H
+#define FILE_INDEXER_INDEXER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ERR(source) (perror(source),\
+             fprintf(stderr,"%s:%d\n",__FILE__,__LINE__), \
+             exit(EXIT_FAILURE))
+
+// types of indexed entries
+enum fileTypeCode {
+    TYPE_DIRECTORY,
+    TYPE_JPEG,
+    TYPE_PNG,
+    TYPE_ZIP,
+    TYPE_GZIP,
+    // ids are stored in index files, new types are only appended
+    TYPE_PDF,
+    TYPE_ELF,
+    TYPE_TAR,
+    TYPE_ZSTD,
+    TYPE_XZ,
+    TYPE_BZIP2,
+    TYPE_MP4,
+    TYPE_HEIC,
+    TYPE_AVIF,
+    TYPE_WEBP,
+    TYPE_GIF,
+    TYPE_BMP,
+    TYPE_TIFF,
+    TYPE_7Z,
+    TYPE_RAR,
+    TYPE_MP3,
+    TYPE_OGG,
+    TYPE_FLAC,
+    TYPE_WAV,
+    TYPE_AVI,
+    TYPE_MKV,
+    TYPE_MIDI,
+    TYPE_SQLITE,
+    TYPE_WASM,
+    TYPE_PE,
+    TYPE_MACHO,
+    TYPE_CLASS,
+    TYPE_PSD,
+    TYPE_PS,
+    TYPE_RTF,
+    TYPE_LZ4,
+    TYPE_DEB,
+    TYPE_RPM,
+    TYPE_WOFF,
+    TYPE_WOFF2,
+    TYPE_ICO,
+    TYPE_COUNT
+};
+
+// regular file of a type that is not indexed
+#define TYPE_NONE (-1)
+
+// one index entry, strings are owned by whoever produced the entry
+typedef struct indexedFile_s {
+    // points into path, after its last '/'
+    const char *fileName;
+    // NULL for entries read from index file, their path is rebuilt from parent directories
+    const char *path;
+    off_t size;
+    uid_t UID;
+    int fileType;
+    // identity and timestamps (ns) used to tell whether a file changed since last indexing
+    dev_t device;
+    ino_t inode;
+    int64_t modifyTime;
+    int64_t changeTime;
+} indexedFile;
+
+#endif //FILE_INDEXER_INDEXER_H
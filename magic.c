@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "magic.h"
+#include "pool.h"
+#include "signature.h"
+
+// files read by one reader thread at a time
+#define MAGIC_READER_CHUNK 8
+
+static workPool readerPool;
+static pthread_once_t readerPoolOnce = PTHREAD_ONCE_INIT;
+
+static void startReaderPool(void) {
+    startPool(&readerPool, MAGIC_READER_THREADS);
+}
+
+// type of file starting with bytes, files of types which are not indexed are skipped
+static int classifyMagic(const unsigned char *bytes, ssize_t length) {
+    if (length <= 0) return TYPE_NONE;
+    int type = classifySignature(bytes, (size_t) length);
+    return typeIndexed(type) ? type : TYPE_NONE;
+}
+
+int magicNumberAt(walkCounters *counters, int dirFd, const char *name) {
+    counters->openCalls++;
+    int fd = openat(dirFd, name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("error while indexing!");
+        counters->errors++;
+        return TYPE_NONE;
+    }
+    unsigned char bytes[MAGIC_LENGTH];
+    ssize_t length = read(fd, bytes, sizeof(bytes));
+    counters->readCalls++;
+    if (length > 0) counters->bytesRead += length;
+    close(fd);
+    return classifyMagic(bytes, length);
+}
+
+static void closeRing(magicRing *ring) {
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqesLength);
+    if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapLength);
+    if (ring->sqMap != NULL) munmap(ring->sqMap, ring->sqMapLength);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(magicRing));
+    ring->fd = -1;
+}
+
+// whether kernel can open, read and close files with ring, kernels older than 5.6 have rings but cannot open
+// files with them and cannot be probed either
+static int ringSupportsFiles(const magicRing *ring) {
+    size_t length = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, length);
+    if (probe == NULL) return 0;
+    int supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const unsigned opcodes[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    for (size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]) && supported; i++) {
+        supported = opcodes[i] <= probe->last_op && opcodes[i] < probe->ops_len &&
+                    (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+
+// sets up a ring without liburing, leaves fd -1 if kernel does not support io_uring, it is disabled
+// or it cannot open files
+static void openRing(magicRing *ring, unsigned entries) {
+    memset(ring, 0, sizeof(magicRing));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return;
+    }
+    if (!ringSupportsFiles(ring)) {
+        closeRing(ring);
+        return;
+    }
+    ring->entries = params.sq_entries;
+    ring->sqMapLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // both rings share one mapping on kernels which support it
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cqMapLength > ring->sqMapLength) ring->sqMapLength = ring->cqMapLength;
+
+    ring->sqMap = mmap(NULL, ring->sqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        closeRing(ring);
+        return;
+    }
+    if (single) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            ring->cqMap = NULL;
+            closeRing(ring);
+            return;
+        }
+    }
+    ring->sqesLength = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        closeRing(ring);
+        return;
+    }
+
+    char *sq = ring->sqMap, *cq = ring->cqMap;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+}
+
+void initMagicReader(magicReader *reader) {
+    openRing(&reader->ring, MAGIC_BATCH_SIZE);
+}
+
+void freeMagicReader(magicReader *reader) {
+    closeRing(&reader->ring);
+}
+
+// takes a free submission entry, ring is never filled beyond one batch so there always is one
+static struct io_uring_sqe *nextRequest(magicRing *ring, uint64_t file) {
+    unsigned tail = *ring->sqTail;
+    unsigned slot = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = file;
+    ring->sqArray[slot] = slot;
+    atomic_store_explicit((_Atomic unsigned *) ring->sqTail, tail + 1, memory_order_release);
+    return sqe;
+}
+
+// submits count queued requests and passes result of each to done, returns -1 if the ring failed
+static int runRequests(magicRing *ring, unsigned count, magicFile *files, void (*done)(magicFile *, int)) {
+    unsigned submitted = 0, completed = 0;
+    while (completed < count) {
+        unsigned head = *ring->cqHead;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *) ring->cqTail, memory_order_acquire);
+        for (; head != tail; head++, completed++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            done(&files[cqe->user_data], cqe->res);
+        }
+        atomic_store_explicit((_Atomic unsigned *) ring->cqHead, head, memory_order_release);
+        if (completed == count) break;
+
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS,
+                                NULL, 0);
+        if (ret < 0 && errno != EINTR) return -1;
+        if (ret > 0) submitted += ret;
+    }
+    return 0;
+}
+
+static void opened(magicFile *file, int result) {
+    if (result < 0) {
+        file->error = -result;
+    } else {
+        file->fd = result;
+    }
+}
+
+static void readDone(magicFile *file, int result) {
+    file->length = result;
+    if (result < 0) file->error = -result;
+}
+
+static void closed(magicFile *file, int result) {
+    // descriptor is closed directly if the request failed, e.g. it is not supported by kernel
+    if (result < 0) close(file->fd);
+    file->fd = -1;
+}
+
+// open, read and close rounds, each submitted with one system call
+static int readWithRing(magicRing *ring, magicFile *files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = nextRequest(ring, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t) (uintptr_t) files[i].path;
+        sqe->open_flags = O_RDONLY | O_NOCTTY | O_CLOEXEC;
+    }
+    // support of requests was probed when ring was set up, a failed open is an error of that file only
+    if (runRequests(ring, count, files, opened) < 0) return -1;
+
+    unsigned reads = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].fd < 0) continue;
+        struct io_uring_sqe *sqe = nextRequest(ring, i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = files[i].fd;
+        sqe->addr = (uint64_t) (uintptr_t) files[i].bytes;
+        sqe->len = MAGIC_LENGTH;
+        reads++;
+    }
+    if (runRequests(ring, reads, files, readDone) < 0) return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].fd < 0) continue;
+        struct io_uring_sqe *sqe = nextRequest(ring, i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[i].fd;
+    }
+    return runRequests(ring, reads, files, closed);
+}
+
+typedef struct readerBatch_s {
+    magicFile *files;
+    size_t count;
+} readerBatch;
+
+static void readChunkTask(void *arg, int chunk) {
+    readerBatch *batch = arg;
+    size_t end = (size_t) (chunk + 1) * MAGIC_READER_CHUNK;
+    if (end > batch->count) end = batch->count;
+    for (size_t i = (size_t) chunk * MAGIC_READER_CHUNK; i < end; i++) {
+        magicFile *file = &batch->files[i];
+        int fd = open(file->path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            file->error = errno;
+            continue;
+        }
+        file->length = read(fd, file->bytes, MAGIC_LENGTH);
+        if (file->length < 0) file->error = errno;
+        close(fd);
+    }
+}
+
+// blocking reads spread over reader threads, so that many requests are outstanding as well
+static void readWithThreads(magicFile *files, size_t count) {
+    pthread_once(&readerPoolOnce, startReaderPool);
+    readerBatch batch = {.files = files, .count = count};
+    poolRun(&readerPool, (int) ((count + MAGIC_READER_CHUNK - 1) / MAGIC_READER_CHUNK), readChunkTask, &batch);
+}
+
+void readMagicNumbers(magicReader *reader, magicFile *files, size_t count, walkCounters *counters) {
+    for (size_t i = 0; i < count; i++) {
+        files[i].type = TYPE_NONE;
+        files[i].error = 0;
+        files[i].fd = -1;
+        files[i].length = 0;
+    }
+    if (reader->ring.fd >= 0 && readWithRing(&reader->ring, files, count) < 0) {
+        // ring is not used anymore, the whole batch is read again by reader threads
+        closeRing(&reader->ring);
+        for (size_t i = 0; i < count; i++) {
+            if (files[i].fd >= 0) close(files[i].fd);
+            files[i].fd = -1;
+            files[i].error = 0;
+            files[i].length = 0;
+        }
+    }
+    if (reader->ring.fd < 0) readWithThreads(files, count);
+
+    for (size_t i = 0; i < count; i++) {
+        magicFile *file = &files[i];
+        counters->openCalls++;
+        // file which could not be opened was not read, one which could not be read has length -1
+        counters->readCalls += file->error == 0 || file->length < 0;
+        if (file->error != 0) {
+            fprintf(stderr, "error while indexing %s: %s\n", file->path, strerror(file->error));
+            counters->errors++;
+            continue;
+        }
+        counters->bytesRead += file->length;
+        file->type = classifyMagic(file->bytes, file->length);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef FILE_INDEXER_MAGIC_H
+#define FILE_INDEXER_MAGIC_H
+
+#include "walk.h"
+#include "signature.h"
+
+// files whose magic number is read with one round of requests, also depth of io_uring queue
+#define MAGIC_BATCH_SIZE 128
+
+// threads reading files of a batch when io_uring is not available
+#define MAGIC_READER_THREADS 16
+
+// bytes read to tell the type of a file
+#define MAGIC_LENGTH SIGNATURE_READ_LENGTH
+
+// file waiting for its type to be read
+typedef struct magicFile_s {
+    const char *path;
+    // filled by readMagicNumbers, TYPE_NONE for unknown type and files that could not be read
+    int type;
+    // errno of failed open or read, 0 on success
+    int error;
+    int fd;
+    ssize_t length;
+    unsigned char bytes[MAGIC_LENGTH];
+} magicFile;
+
+// submission and completion rings shared with the kernel
+typedef struct magicRing_s {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapLength;
+    void *cqMap;
+    size_t cqMapLength;
+    size_t sqesLength;
+} magicRing;
+
+// one per traversal worker, ring fd is -1 when io_uring is not available and reader threads are used instead
+typedef struct magicReader_s {
+    magicRing ring;
+} magicReader;
+
+void initMagicReader(magicReader *reader);
+
+void freeMagicReader(magicReader *reader);
+
+// reads types of up to MAGIC_BATCH_SIZE files at once: all of them are opened, then read, then closed,
+// system calls and failures are added to counters
+void readMagicNumbers(magicReader *reader, magicFile *files, size_t count, walkCounters *counters);
+
+// reads type of a single file relative to an open directory with blocking system calls
+int magicNumberAt(walkCounters *counters, int dirFd, const char *name);
+
+#endif //FILE_INDEXER_MAGIC_H
@@ -6,42 +6,76 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include <ftw.h>
 
-#define ERR(source) (perror(source),\
-             fprintf(stderr,"%s:%d\n",__FILE__,__LINE__), \
-             exit(EXIT_FAILURE))
+#include "indexer.h"
+#include "index.h"
+#include "walk.h"
+#include "watch.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "server.h"
+#include "query.h"
+#include "signature.h"
+#include "checkpoint.h"
+#include "build.h"
+#include "cache.h"
 
-#define MAXFD 20
-#define FILENAME_LENGTH 100
-#define PATH_LENGTH 300
-#define MAX_INPUT_LENGTH 100
+#define MAX_INPUT_LENGTH QUERY_MAX_LENGTH
 
-#define DATABASE_GROWTH_FACTOR 10
-#define DATABASE_INITIAL_CAPACITY 100
+// index is rewritten once watch mode piles up that many changes on top of it
+#define DELTA_COMPACTION_THRESHOLD 65536
+
+// seconds between rewrites of metrics file given with -p
+#define STATS_DUMP_INTERVAL 15
+
+// seconds between saves of indexing progress
+#define CHECKPOINT_INTERVAL 60
+
+// most directories given with -d, each of them is a shard of the index
+#define MAX_SHARDS 16
 
 void usage(char *name) {
-    fprintf(stderr, "USAGE: %s -d [path] -f [index-path] -t [time-interval]\n", name);
+    fprintf(stderr, "USAGE: %s -d [path] -f [index-path] -t [time-interval] -j [threads] -p [metrics-path] "
+                    "-s [socket-path] -T [types] -r [files[,bytes]] -n [niceness] -b|--build-mem [bytes] "
+                    "-c|--cache-mem [bytes]\n", name);
     fprintf(stderr, "d - path do directory traversed, if not provided $MOLE_DIR is used\n");
-    fprintf(stderr, "\tthis argument or env variable is required for program to start\n");
+    fprintf(stderr, "\tthis argument or env variable is required for program to start, it may be repeated up to %d\n",
+            MAX_SHARDS);
+    fprintf(stderr, "\ttimes: each directory is then a shard with an index file and reindexing of its own\n");
     fprintf(stderr, "m - path to storage of index file, if not present $MOLE_INDEX_PATH is used,\n");
-    fprintf(stderr, "\tif $MOLE_INDEX_PATH not present file is stored in $HOME/.mole-index\n");
+    fprintf(stderr, "\tif $MOLE_INDEX_PATH not present file is stored in $HOME/.mole-index,\n");
+    fprintf(stderr, "\tindex file of each shard is stored at that path followed by -shard- and hash of its directory\n");
     fprintf(stderr, "t - value from range [30,7200], when provided enables rebuilding of index at given interval\n");
+    fprintf(stderr, "j - number of threads traversing the directory, by default number of online CPUs\n");
+    fprintf(stderr, "w - watch indexed directories with inotify and apply changes to index as they happen\n");
+    fprintf(stderr, "p - path of file metrics are written to in Prometheus text format every %d seconds\n",
+            STATS_DUMP_INTERVAL);
+    fprintf(stderr, "s - path of unix socket, when provided program runs as a daemon answering clients of the socket\n");
+    fprintf(stderr, "\tinstead of reading stdin, SIGINT or SIGTERM stops it\n");
+    fprintf(stderr, "T - comma separated types of indexed files or all, by default jpeg,png,zip,gzip\n");
+    fprintf(stderr, "r - files and bytes per second periodic reindexing may read, bytes may end with K, M, G or T,\n");
+    fprintf(stderr, "\tthe pace slows down while queries run or the host waits for I/O, shards split the budget\n");
+    fprintf(stderr, "n - value from range [0,19], nice value and I/O priority of periodic reindexing threads\n");
+    fprintf(stderr, "b - memory an index build may use, at least 16M, may end with K, M, G or T; entries are sorted\n");
+    fprintf(stderr, "\tin runs spilled next to the index file instead of being held whole, types are read anew,\n");
+    fprintf(stderr, "\tshards split the budget but each of them gets at least 16M\n");
+    fprintf(stderr, "c - memory of cache of query results, may end with K, M, G or T, 0 disables it, by default 64M\n");
     exit(EXIT_FAILURE);
 }
 
-typedef struct indexedFile_s {
-    char fileName[FILENAME_LENGTH + 1];
-    char path[PATH_LENGTH + 1];
-    off_t size;
-    uid_t UID;
-    char fileType[8];
-} indexedFile;
+typedef struct dirtyPath_s {
+    char *path;
+    int subtree;
+} dirtyPath;
 
+// one shard of the index: every indexed directory has an index file, snapshots, schedule and reindexing of its own
 typedef struct threadData_s {
     pthread_t threadID;
     time_t lastIndexingTime;
@@ -49,40 +83,80 @@ typedef struct threadData_s {
     char *m;
     char *d;
     int t;
-    int *indexingFlag;
-    int *mFlag;
-    pthread_mutex_t *databaseMutex;
-    pthread_mutex_t *indexingFlagMutex;
-    struct threadData_s *indexingThread;
+    int threads;
+    // if == 0 there is no indexing running, if == 1 there is an indexing in progress
+    int indexingFlag;
+    int mFlag;
+    pthread_mutex_t databaseMutex;
+    pthread_mutex_t indexingFlagMutex;
+    snapshotSlot slot;
+    // set while an index is being built, guarded by dirtyMutex
+    int reindexingFlag;
+    // watch mode changes not published yet, guarded by databaseMutex
+    snapshot *pending;
+    typeCache typeCache;
+    pthread_rwlock_t typeCacheLock;
+    // paths changed while indexing, applied again to the new index once it is swapped in
+    dirtyPath *dirtyPaths;
+    size_t dirtyCount;
+    size_t dirtyCapacity;
+    pthread_mutex_t dirtyMutex;
+    // paces periodic reindexing, manual and overflow ones run at full speed
+    walkThrottle throttle;
+    // whether running reindexing is paced by throttle, guarded by indexingFlagMutex
+    int throttled;
+    // bytes an index build may hold, share of -b, 0 when entries are held whole
+    size_t buildMemory;
 } threadData;
 
-typedef struct database_s {
-    indexedFile *database;
-    int databaseSize;
-    int currentIdx;
-    int fileDescriptor;
-} database;
-
 typedef struct globalVar_s {
-    int reindexingFlag;
-    database mainDatabase;
-    database tempDatabase;
+    int watching;
+    watcher watcher;
+    // shards in order of -d arguments, results of queries follow that order
+    threadData *shards;
+    int shardCount;
+    // results of recent queries, dropped whenever a shard publishes a new snapshot
+    queryCache cache;
 } globalStructure;
 
 globalStructure global;
 
-void readArguments(int argc, char **argv, char **d, char **m, int *t, int *mFlag) {
-    if (argc > 7) usage(argv[0]);
+// whether path is root or lies below it
+int rootHolds(const char *root, const char *path) {
+    size_t length = strlen(root);
+    while (length > 1 && root[length - 1] == '/') length--;
+    if (strncmp(path, root, length) != 0) return 0;
+    return path[length] == '\0' || path[length] == '/' || root[length - 1] == '/';
+}
+
+// shard indexing the directory path lies in, NULL if there is none
+threadData *shardOf(const char *path) {
+    for (int k = 0; k < global.shardCount; k++) {
+        if (rootHolds(global.shards[k].d, path)) return &global.shards[k];
+    }
+    return NULL;
+}
+
+void readArguments(int argc, char **argv, char **d, int *dCount, char **m, int *t, int *j, int *w, char **p,
+                   char **s, double *filesPerSecond, double *bytesPerSecond, int *n, size_t *b, size_t *cacheMemory,
+                   int *mFlag) {
+    if (argc > 24 + 2 * (MAX_SHARDS - 1)) usage(argv[0]);
     int c;
+    static const struct option longOptions[] = {
+            {"build-mem", required_argument, NULL, 'b'},
+            {"cache-mem", required_argument, NULL, 'c'},
+            {NULL, 0, NULL, 0}
+    };
 
-    while ((c = getopt(argc, argv, "d:m:t:")) != -1)
+    while ((c = getopt_long(argc, argv, "d:m:t:j:wp:s:T:r:n:b:c:", longOptions, NULL)) != -1)
         switch (c) {
             case 'd':
                 if (optarg[0] == '-') {
                     fprintf(stderr, "Option -%c requires an argument.\n", c);
                     usage(argv[0]);
                 }
-                *d = optarg;
+                if (*dCount == MAX_SHARDS) usage(argv[0]);
+                d[(*dCount)++] = optarg;
                 break;
             case 'm':
                 if (optarg[0] == '-') {
@@ -98,8 +172,64 @@ void readArguments(int argc, char **argv, char **d, char **m, int *t, int *mFlag
                     usage(argv[0]);
                 }
                 break;
+            case 'j':
+                *j = atoi(optarg);
+                if (*j < 1 || *j > WALK_MAX_THREADS) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
+            case 'w':
+                *w = 1;
+                break;
+            case 'p':
+                if (optarg[0] == '-') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", c);
+                    usage(argv[0]);
+                }
+                *p = optarg;
+                break;
+            case 's':
+                if (optarg[0] == '-') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", c);
+                    usage(argv[0]);
+                }
+                *s = optarg;
+                break;
+            case 'T':
+                if (setIndexedTypes(optarg) < 0) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (parseThrottleBudget(optarg, filesPerSecond, bytesPerSecond) < 0) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                *n = atoi(optarg);
+                if (*n < 0 || *n > 19 || !isdigit((unsigned char) optarg[0])) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                if (parseBuildMemory(optarg, b) < 0) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (parseCacheMemory(optarg, cacheMemory) < 0) {
+                    fprintf(stderr, "Incorrect value for -%c argument.\n", c);
+                    usage(argv[0]);
+                }
+                break;
             case '?':
-                if (optopt == 'd' || optopt == 'm' || optopt == 't') {
+                if (optopt == 'd' || optopt == 'm' || optopt == 't' || optopt == 'j' || optopt == 'p' || optopt == 's' ||
+                    optopt == 'T' || optopt == 'r' || optopt == 'n' || optopt == 'b' || optopt == 'c') {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 } else if (isprint (optopt))
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -111,12 +241,23 @@ void readArguments(int argc, char **argv, char **d, char **m, int *t, int *mFlag
                 usage(argv[0]);
         }
 
-    if (*d == NULL) {
-        *d = getenv("MOLE_DIR");
-        if (d == NULL) {
+    if (*dCount == 0) {
+        d[0] = getenv("MOLE_DIR");
+        if (d[0] == NULL) {
             fprintf(stderr, "$MOLE_DIR not present, please provide path as argument of env variable\n");
             usage(argv[0]);
         }
+        *dCount = 1;
+    }
+
+    // an entry belongs to exactly one shard
+    for (int i = 0; i < *dCount; i++) {
+        for (int k = 0; k < i; k++) {
+            if (rootHolds(d[k], d[i]) || rootHolds(d[i], d[k])) {
+                fprintf(stderr, "Directories %s and %s overlap.\n", d[k], d[i]);
+                usage(argv[0]);
+            }
+        }
     }
 
     if (*m == NULL) {
@@ -132,127 +273,249 @@ void readArguments(int argc, char **argv, char **d, char **m, int *t, int *mFlag
 }
 
 void freeResources(threadData *data) {
-    pthread_mutex_destroy(data->databaseMutex);
-    pthread_mutex_destroy(data->indexingFlagMutex);
-    if (*data->mFlag) {
+    pthread_mutex_destroy(&data->databaseMutex);
+    pthread_mutex_destroy(&data->indexingFlagMutex);
+    // check of loaded index may still be filling it
+    pthread_rwlock_wrlock(&data->typeCacheLock);
+    freeTypeCache(&data->typeCache);
+    pthread_rwlock_unlock(&data->typeCacheLock);
+    if (data->mFlag) {
         free(data->m);
     }
 }
 
-// helper method for handling index file
-void resizeFile(database *db) {
-    int result = ftruncate(db->fileDescriptor, db->databaseSize * sizeof(indexedFile));
-    if (result == -1) {
-        close(db->fileDescriptor);
-        perror("Error calling lseek() to 'stretch' the file");
-        exit(EXIT_FAILURE);
-    }
+// remembers types of files from last traversal so the next one reads only new or changed files
+void refreshTypeCache(threadData *data, walkResult *result) {
+    pthread_rwlock_wrlock(&data->typeCacheLock);
+    freeTypeCache(&data->typeCache);
+    buildTypeCache(&data->typeCache, result->entries, result->count, result->skipped, result->skippedCount);
+    pthread_rwlock_unlock(&data->typeCacheLock);
 }
 
-// helper method to map file
-void mapFile(database *db) {
-    db->database = (indexedFile *) mmap(NULL, sizeof(indexedFile) * db->databaseSize, PROT_READ | PROT_WRITE,
-                                        MAP_SHARED, db->fileDescriptor, 0);
-    if (db->database == MAP_FAILED) {
-        close(db->fileDescriptor);
-        perror("Error mmapping the file!\n");
-        exit(EXIT_FAILURE);
-    }
+void watchVisited(const char *directory, void *arg) {
+    (void) arg;
+    watchDirectory(&global.watcher, directory);
 }
 
-void databaseResize(database *db) {
-    // unmapping file
-    if (munmap(db->database, db->databaseSize * sizeof(indexedFile)) == -1)
-        perror("Error unmapping");
+// traversal reading types from cache, cache is locked so it is not replaced in the meantime;
+// in watch mode directories are watched before they are read, so no change made after that is missed
+int walkTree(threadData *data, const char *root, int threads, walkThrottle *throttle, walkCheckpoint *checkpoint,
+             const walkSpill *spill, walkResult *result) {
+    walkVisit visit = {.visit = watchVisited};
+    pthread_rwlock_rdlock(&data->typeCacheLock);
+    int ret = parallelWalk(root, threads, &data->typeCache, throttle, checkpoint, spill,
+                           global.watching ? &visit : NULL, result);
+    pthread_rwlock_unlock(&data->typeCacheLock);
+    return ret;
+}
 
-    // resizing database and file
-    db->databaseSize *= DATABASE_GROWTH_FACTOR;
-    resizeFile(db);
+char *getCheckpointPath(const char *m) {
+    char *checkpointPath = malloc(strlen(m) + strlen("-checkpoint") + 1);
+    if (checkpointPath == NULL) ERR("malloc");
+    strcpy(checkpointPath, m);
+    return strcat(checkpointPath, "-checkpoint");
+}
 
-    // mapping file of extended size
-    mapFile(db);
+// progress is no longer needed once the index it was building is in place
+void dropCheckpoint(threadData *data) {
+    char *checkpointPath = getCheckpointPath(data->m);
+    unlink(checkpointPath);
+    free(checkpointPath);
 }
 
-// reading magic number
-char *magicNumber(const char *name) {
-    int temp = open(name, O_RDONLY, 0);
-    if (temp < 0) {
-        perror("error while indexing!");
+void spillToBuild(const indexedFile *entries, size_t count, void *arg) {
+    indexBuild *build = arg;
+    indexBuildAdd(build, entries, count);
+}
+
+// traversal of whole indexed tree, its duration and rate are reported by stats, progress is saved
+// so that an interrupted traversal resumes, returns -2 if a throttled traversal was cancelled;
+// with build entries are added to it as they are found, progress is then not saved as it would hold them all
+int walkIndexedTree(threadData *data, indexBuild *build, walkResult *result) {
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    walkThrottle *throttle = data->throttled ? &data->throttle : NULL;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
+    int64_t start = statsNow();
+    int ret;
+    if (build != NULL) {
+        walkSpill spill = {.budget = indexBuildWorkerBudget(build, data->threads), .spill = spillToBuild,
+                .arg = build};
+        ret = walkTree(data, data->d, data->threads, throttle, NULL, &spill, result);
+        statsRecordWalk(result, statsNow() - start);
+        return ret;
+    }
+    char *checkpointPath = getCheckpointPath(data->m);
+    walkCheckpoint checkpoint = {.path = checkpointPath, .interval = CHECKPOINT_INTERVAL * 1000000000LL};
+    if (openCheckpoint(&checkpoint, data->d) > 0) {
+        fprintf(stdout, "Resuming indexing, %zu entries and %zu directories left to scan are known\n",
+                checkpoint.resumed.count, checkpoint.frontierCount);
     }
-    unsigned char bytes[3];
-    read(temp, bytes, 3);
-    close(temp);
+    ret = walkTree(data, data->d, data->threads, throttle, &checkpoint, NULL, result);
+    statsRecordWalk(result, statsNow() - start);
+    closeCheckpoint(&checkpoint);
+    free(checkpointPath);
+    return ret;
+}
 
-    if (bytes[0] == 0xff && bytes[1] == 0xd8 && bytes[2] == 0xff) return "jpeg";
-    if (bytes[0] == 0x89 && bytes[1] == 0x50 && bytes[2] == 0x4e) return "png";
-    if (bytes[0] == 0x50 && bytes[1] == 0x4b) return "zip";
-    if (bytes[0] == 0x1f && bytes[1] == 0x8b) return "gzip";
+int writeIndexTimed(const char *path, const indexedFile *entries, size_t count) {
+    int64_t start = statsNow();
+    int ret = writeIndexFile(path, entries, count);
+    statsRecord(STATS_PHASE_WRITE, statsNow() - start);
+    return ret;
+}
 
-    return NULL;
+int writeIndexBuildTimed(indexBuild *build, const char *path) {
+    int64_t start = statsNow();
+    int ret = writeIndexBuild(build, path);
+    statsRecord(STATS_PHASE_WRITE, statsNow() - start);
+    return ret;
 }
 
-// method for nftw function - this is where indexing happens
-int directoryWalk(const char *name, const struct stat *s, int type, struct FTW *Sf) {
-    database *db;
-    // check if indexing or reindexing and populate correct database
-    if (global.reindexingFlag) {
-        db = &global.tempDatabase;
-    } else {
-        db = &global.mainDatabase;
+// traverses whole indexed tree and writes its index to path, with -b entries are spilled to sorted runs while
+// traversing and result holds none of them; returns -2 if traversal was cancelled and -1 if writing failed
+int buildIndexFile(threadData *data, const char *path, walkResult *result) {
+    indexBuild build;
+    if (data->buildMemory > 0) initIndexBuild(&build, path, data->buildMemory);
+    int walked = walkIndexedTree(data, data->buildMemory > 0 ? &build : NULL, result), written = -2;
+    if (walked == -1) perror("Error traversing directory");
+    // cancelled traversal saw only part of the tree, previous index stays
+    if (walked != -2) {
+        written = data->buildMemory > 0 ? writeIndexBuildTimed(&build, path)
+                                         : writeIndexTimed(path, result->entries, result->count);
     }
+    if (data->buildMemory > 0) freeIndexBuild(&build);
+    return written;
+}
 
-    indexedFile *database = db->database;
-    int *workingIdx = &db->currentIdx;
+// adds inotify watches for every indexed directory
+void watchIndexedDirectories(threadData *data) {
+    snapshot *s = acquireSnapshot(&data->slot);
+    indexedFile entry;
+    pathCache paths;
+    initSnapshotPathCache(s, &paths);
+    for (int i = 0; i < snapshotSize(s); i++) {
+        if (snapshotEntry(s, i, &entry) && entry.fileType == TYPE_DIRECTORY) {
+            watchDirectory(&global.watcher, snapshotEntryPath(s, &paths, i));
+        }
+    }
+    freePathCache(&paths);
+    releaseSnapshot(s);
+}
 
-    // if directory omit magic number check
-    if (type == FTW_D) {
-        strcpy(database[*workingIdx].fileType, "0");
+// loads finished index file into a snapshot and makes it visible to queries,
+// databaseMutex has to be held
+void publishIndex(threadData *data, const char *path) {
+    int64_t start = statsNow();
+    indexFile file;
+    if (loadIndexFile(path, &file) < 0) {
+        fprintf(stderr, "Error loading new index file %s\n", path);
+        return;
     }
+    // changes not published yet were made on top of previous index
+    if (data->pending != NULL) {
+        releaseSnapshot(data->pending);
+        data->pending = NULL;
+    }
+    publishSnapshot(&data->slot, createSnapshot(createBase(&file)));
+    queryCacheClear(&global.cache);
+    statsRecord(STATS_PHASE_PUBLISH, statsNow() - start);
+}
 
-    // check magic number of file
-    if (type == FTW_F) {
-        char *fileType = magicNumber(name);
-        if (fileType != NULL) {
-            strcpy(database[*workingIdx].fileType, fileType);
-        } else {
-            return 0;
+// brings index entries for path in line with the file system
+void applyRefresh(threadData *data, const char *path, int subtree) {
+    walkResult result = {0};
+    indexedFile entry;
+    int found;
+    statsAdd(STATS_WATCH_REFRESHES, 1);
+    if (subtree) {
+        found = walkTree(data, path, data->threads, NULL, NULL, NULL, &result) == 0;
+    } else {
+        pthread_rwlock_rdlock(&data->typeCacheLock);
+        found = statEntry(path, &data->typeCache, &entry, &result.counters);
+        pthread_rwlock_unlock(&data->typeCacheLock);
+    }
+    statsAddWalkCounters(&result.counters);
+
+    statsLock(&data->databaseMutex);
+    if (data->pending == NULL) {
+        snapshot *s = acquireSnapshot(&data->slot);
+        data->pending = cloneSnapshot(s);
+        releaseSnapshot(s);
+    }
+    if (subtree || !found) {
+        snapshotRemoveSubtree(data->pending, path);
+    }
+    if (subtree) {
+        for (size_t i = 0; i < result.count; i++) {
+            snapshotPut(data->pending, &result.entries[i]);
         }
+    } else if (found) {
+        snapshotPut(data->pending, &entry);
     }
+    pthread_mutex_unlock(&data->databaseMutex);
+    freeWalkResult(&result);
+}
 
-    // copy filename out of full path
-    char *currentName = malloc(strlen(name) + 1);
-    if(currentName == NULL) ERR("malloc");
-    memcpy(currentName, name, strlen(name) + 1);
+// while set, changes seen by watch mode are remembered to be applied again on top of the index being built
+void setReindexing(threadData *data, int reindexing) {
+    pthread_mutex_lock(&data->dirtyMutex);
+    data->reindexingFlag = reindexing;
+    pthread_mutex_unlock(&data->dirtyMutex);
+}
 
-    char *p = strrchr(name, '/');
-    char *filename = p + 1;
-    if (strlen(filename) > FILENAME_LENGTH) {
-        fprintf(stdout, "filename length over limit! cropping to %d characters", FILENAME_LENGTH);
-        strncpy(database[*workingIdx].fileName, filename, FILENAME_LENGTH);
-        database[*workingIdx].fileName[FILENAME_LENGTH] = '\0';
+void rememberDirtyPath(threadData *data, const char *path, int subtree) {
+    pthread_mutex_lock(&data->dirtyMutex);
+    if (data->reindexingFlag) {
+        if (data->dirtyCount == data->dirtyCapacity) {
+            data->dirtyCapacity = data->dirtyCapacity ? data->dirtyCapacity * 2 : 64;
+            data->dirtyPaths = realloc(data->dirtyPaths, data->dirtyCapacity * sizeof(dirtyPath));
+            if (data->dirtyPaths == NULL) ERR("realloc");
+        }
+        data->dirtyPaths[data->dirtyCount].path = strdup(path);
+        if (data->dirtyPaths[data->dirtyCount].path == NULL) ERR("strdup");
+        data->dirtyPaths[data->dirtyCount++].subtree = subtree;
     }
-    strcpy(database[*workingIdx].fileName, filename);
+    pthread_mutex_unlock(&data->dirtyMutex);
+}
 
-    // copy path
-    if (strlen(currentName) > PATH_LENGTH) {
-        fprintf(stdout, "path length over limit! cropping to %d characters", PATH_LENGTH);
-        strncpy(database[*workingIdx].path, currentName, PATH_LENGTH);
-        database[*workingIdx].path[PATH_LENGTH] = '\0';
+// changes seen during reindexing could have been missed by the traversal
+void replayDirtyPaths(threadData *data) {
+    pthread_mutex_lock(&data->dirtyMutex);
+    dirtyPath *paths = data->dirtyPaths;
+    size_t count = data->dirtyCount;
+    data->dirtyPaths = NULL;
+    data->dirtyCount = data->dirtyCapacity = 0;
+    pthread_mutex_unlock(&data->dirtyMutex);
+
+    for (size_t i = 0; i < count; i++) {
+        applyRefresh(data, paths[i].path, paths[i].subtree);
+        free(paths[i].path);
     }
-    strcpy(database[*workingIdx].path, currentName);
-    free(currentName);
+    free(paths);
+}
 
-    // uid and file size
-    database[*workingIdx].UID = s->st_uid;
-    database[*workingIdx].size = s->st_size;
+// change is applied to the shard it was seen in only
+void watchRefresh(const char *path, int subtree, void *arg) {
+    (void) arg;
+    threadData *data = shardOf(path);
+    if (data == NULL) return;
+    rememberDirtyPath(data, path, subtree);
+    applyRefresh(data, path, subtree);
+}
 
-    // moving to the next entry & resize file if needed
-    (*workingIdx)++;
-    if (*workingIdx == db->databaseSize) {
-        databaseResize(db);
+// publishes changes gathered from one batch of events, returns number of changes on top of index file
+int publishPending(threadData *data) {
+    statsLock(&data->databaseMutex);
+    if (data->pending != NULL) {
+        publishSnapshot(&data->slot, data->pending);
+        data->pending = NULL;
+        queryCacheClear(&global.cache);
     }
-
-    return 0;
+    snapshot *s = acquireSnapshot(&data->slot);
+    int delta = snapshotDeltaSize(s);
+    releaseSnapshot(s);
+    pthread_mutex_unlock(&data->databaseMutex);
+    return delta;
 }
 
 char *getTempFilePath(threadData *data) {
@@ -265,54 +528,37 @@ char *getTempFilePath(threadData *data) {
 
 void swapFiles(threadData *data, char *tempfile) {
     char *tempFilePath = tempfile;
+    int64_t start = statsNow();
 
-    // remove old file
-    int del = remove(data->m);
-    if (del) {
-        perror("Error deleting old database. Aborting!\n");
-        free(tempFilePath);
-        pthread_mutex_unlock(data->databaseMutex);
-        pthread_mutex_lock(data->indexingFlagMutex);
-        *data->indexingFlag = 0;
-        global.reindexingFlag = 0;
-        pthread_mutex_unlock(data->indexingFlagMutex);
-        return;
-    }
-
-    // rename new file
-    int ren = rename(tempFilePath, data->m);
+    // new file replaces the old one in a single rename, there is always a complete index on disk
+    int ren = replaceIndexFile(tempFilePath, data->m);
     if (ren) {
         perror("Error renaming new database. Exiting!\n");
         free(tempFilePath);
-        pthread_mutex_unlock(data->databaseMutex);
+        pthread_mutex_unlock(&data->databaseMutex);
         freeResources(data);
         exit(EXIT_FAILURE);
     }
+    statsRecord(STATS_PHASE_SWAP_FILES, statsNow() - start);
 }
 
 void shutdownProcedure(void *voidPtr) {
     threadData *data = voidPtr;
 
-    // unmap database
-    if (global.mainDatabase.database != NULL) {
-        if (munmap(global.mainDatabase.database, global.mainDatabase.databaseSize * sizeof(indexedFile)) == -1)
-            perror("error unmapping");
-        close(global.mainDatabase.fileDescriptor);
-    }
+    // unmap database once the last query using it is finished
+    publishSnapshot(&data->slot, createSnapshot(createBase(NULL)));
 
-    // if there was reindexing in process
-    if (global.reindexingFlag) {
-        // unmap temp database
-        if (munmap(global.tempDatabase.database, global.tempDatabase.databaseSize * sizeof(indexedFile)) == -1)
-            perror("error unmapping");
-
-        // close temp file
-        close(global.tempDatabase.fileDescriptor);
+    // if there was reindexing in process its unfinished file is dropped, previous index stays
+    pthread_mutex_lock(&data->dirtyMutex);
+    int reindexing = data->reindexingFlag;
+    pthread_mutex_unlock(&data->dirtyMutex);
+    if (reindexing) {
         char *tempFilePath = getTempFilePath(data);
-        swapFiles(data, tempFilePath);
+        unlink(tempFilePath);
         free(tempFilePath);
     }
 
+    dumpStats();
     freeResources(data);
 }
 
@@ -321,295 +567,943 @@ void *indexFiles(void *voidPtr) {
     threadData *data = (threadData *) voidPtr;
     pthread_cleanup_push(shutdownProcedure, voidPtr) ;
     time(&data->lastIndexingTime);
+    setReindexing(data, 1);
 
-    pthread_mutex_lock(data->databaseMutex);
-    global.mainDatabase.currentIdx = 0;
-
-    nftw(data->d, directoryWalk, MAXFD, FTW_PHYS);
+    // written aside and renamed, a crash never leaves a partial index file behind
+    char *tempFilePath = getTempFilePath(data);
+    walkResult result;
+    if (buildIndexFile(data, tempFilePath, &result) < 0 || replaceIndexFile(tempFilePath, data->m) < 0) {
+        perror("Error writing index file");
+        unlink(tempFilePath);
+    } else {
+        dropCheckpoint(data);
+    }
+    free(tempFilePath);
 
-    pthread_mutex_unlock(data->databaseMutex);
+    statsLock(&data->databaseMutex);
+    publishIndex(data, data->m);
+    pthread_mutex_unlock(&data->databaseMutex);
+    refreshTypeCache(data, &result);
+    freeWalkResult(&result);
+    setReindexing(data, 0);
+    // directories of resumed traversal were read by previous run, changes seen while building were dropped
+    // together with snapshot they were made on
+    if (global.watching) {
+        watchIndexedDirectories(data);
+        replayDirtyPaths(data);
+        publishPending(data);
+    }
     fprintf(stdout, "Indexing finished!\n");
 
-    pthread_mutex_lock(data->indexingFlagMutex);
-    *data->indexingFlag = 0;
-    pthread_mutex_unlock(data->indexingFlagMutex);
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    data->indexingFlag = 0;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
     pthread_cleanup_pop(0);
     return NULL;
 }
 
-// method to find how many entries there are in index file after loading it for the first time
-void findLastIndex() {
-    int i = 0;
-    while (global.mainDatabase.database[i].size != 0) {
-        i++;
-    }
-    global.mainDatabase.currentIdx = i;
-}
-
-void openFile(char *m, threadData *indexingThread) {
-    global.mainDatabase.fileDescriptor = open(m, O_RDWR, (mode_t) 0660);
-    if (global.mainDatabase.fileDescriptor < 0) {
-        return;
-    }
-
-    // loading file stats to determine size of database and save mod time
-    struct stat fileStats;
-    fstat(global.mainDatabase.fileDescriptor, &fileStats);
-    global.mainDatabase.databaseSize = fileStats.st_size / sizeof(indexedFile);
-    indexingThread->fileLastModificationTime = fileStats.st_mtim.tv_sec;
-
-    mapFile(&global.mainDatabase);
-    findLastIndex();
-}
-
-void createFile(char *m, threadData *indexingThread) {
-    global.mainDatabase.fileDescriptor = open(m, O_RDWR | O_CREAT, (mode_t) 0660);
-    if (global.mainDatabase.fileDescriptor < 0) {
-        perror("Error creating file. Exiting!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // set size, resize file and map it
-    global.mainDatabase.databaseSize = DATABASE_INITIAL_CAPACITY;
-    resizeFile(&global.mainDatabase);
-    mapFile(&global.mainDatabase);
+void createFile(threadData *indexingThread) {
+    // queries see an empty index until the first indexing is finished
+    publishSnapshot(&indexingThread->slot, createSnapshot(createBase(NULL)));
 
     // start indexing
-    pthread_mutex_lock(indexingThread->indexingFlagMutex);
-    *indexingThread->indexingFlag = 1;
-    pthread_mutex_unlock(indexingThread->indexingFlagMutex);
+    pthread_mutex_lock(&indexingThread->indexingFlagMutex);
+    indexingThread->indexingFlag = 1;
+    pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
     int err = pthread_create(&indexingThread->threadID, NULL, indexFiles, indexingThread);
     if (err != 0) ERR("pthread_create");
 }
 
 void finishReindexing(threadData *data, char *tempFilePath) {
     free(tempFilePath);
-    pthread_mutex_unlock(data->databaseMutex);
-    pthread_mutex_lock(data->indexingFlagMutex);
-    *data->indexingFlag = 0;
-    global.reindexingFlag = 0;
-    pthread_mutex_unlock(data->indexingFlagMutex);
+    pthread_mutex_unlock(&data->databaseMutex);
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    data->indexingFlag = 0;
+    data->throttled = 0;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
+    setReindexing(data, 0);
 }
 
 void *reindexFiles(void *voidPtr) {
     printf("Starting reindexing!\n");
     threadData *data = voidPtr;
-    pthread_mutex_lock(data->indexingFlagMutex);
-    global.reindexingFlag = 1;
-    *data->indexingFlag = 1;
-    pthread_mutex_unlock(data->indexingFlagMutex);
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    data->indexingFlag = 1;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
+    setReindexing(data, 1);
     pthread_cleanup_push(shutdownProcedure, voidPtr);
 
-    // init tempDatabase variables
-    global.tempDatabase.databaseSize = global.mainDatabase.databaseSize;
-    global.tempDatabase.currentIdx = 0;
-
-    // creating temporary file
+    // index into temporary file
     char *tempFilePath = getTempFilePath(data);
-    global.tempDatabase.fileDescriptor = open(tempFilePath, O_RDWR | O_CREAT, (mode_t) 0660);
-    if (global.tempDatabase.fileDescriptor < 0) {
+    walkResult result;
+    int written = buildIndexFile(data, tempFilePath, &result);
+    if (written != -2) refreshTypeCache(data, &result);
+    freeWalkResult(&result);
+
+    // lock database, old file stays mapped until queries using it finish
+    statsLock(&data->databaseMutex);
+
+    // swap files and databases
+    if (written == -2) {
+        fprintf(stdout, "Reindexing cancelled!\n");
+    } else if (written < 0) {
         perror("Error creating temporary file. Aborting!\n");
-        free(tempFilePath);
-        return NULL;
+        unlink(tempFilePath);
+    } else {
+        swapFiles(data, tempFilePath);
+        dropCheckpoint(data);
+        publishIndex(data, data->m);
     }
 
-    // resize, map & index temp db
-    resizeFile(&global.tempDatabase);
-    mapFile(&global.tempDatabase);
-    nftw(data->d, directoryWalk, MAXFD, FTW_PHYS);
+    // exit
+    finishReindexing(data, tempFilePath);
+    if (global.watching) {
+        watchIndexedDirectories(data);
+        replayDirtyPaths(data);
+        publishPending(data);
+    }
+    if (written != -2) fprintf(stdout, "Reindexing finished!\n");
+    pthread_cleanup_pop(0);
+    return NULL;
+}
+
+// starts reindexing in background, returns -1 if an indexing is already in progress
+int startReindexing(threadData *indexingThread) {
+    pthread_mutex_lock(&indexingThread->indexingFlagMutex);
+    if (indexingThread->indexingFlag == 1) {
+        pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
+        return -1;
+    }
+    indexingThread->indexingFlag = 1;
+    indexingThread->throttled = 0;
+    pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
 
-    // lock database
-    pthread_mutex_lock(data->databaseMutex);
+    time(&indexingThread->lastIndexingTime);
+    int err = pthread_create(&indexingThread->threadID, NULL, reindexFiles, indexingThread);
+    if (err != 0) ERR("pthread_create");
+    return 0;
+}
 
-    // unmap and close old file
-    if (munmap(global.mainDatabase.database, global.mainDatabase.databaseSize * sizeof(indexedFile)) == -1) {
-        perror("Error unmapping old database. Aborting!\n");
-        finishReindexing(data, tempFilePath);
+// reads loaded index file once in background: verifies its checksums and remembers types of its files,
+// a damaged index is rebuilt
+void *checkLoadedIndex(void *voidPtr) {
+    threadData *data = voidPtr;
+    // pinned snapshot keeps the file mapped even if reindexing replaces it meanwhile
+    snapshot *s = acquireSnapshot(&data->slot);
+    const indexFile *file = &s->base->file;
+    if (verifyIndexFile(file) < 0) {
+        fprintf(stderr, "Index file %s is damaged, reindexing!\n", data->m);
+        releaseSnapshot(s);
+        startReindexing(data);
         return NULL;
     }
-    close(global.mainDatabase.fileDescriptor);
 
-    // swap files and databases
-    swapFiles(data, tempFilePath);
-    global.mainDatabase = global.tempDatabase;
+    // a bounded build does not hold types of all files, every traversal reads them anew
+    if (data->buildMemory > 0) {
+        releaseSnapshot(s);
+        return NULL;
+    }
 
-    // exit
-    finishReindexing(data, tempFilePath);
-    fprintf(stdout, "Reindexing finished!\n");
-    pthread_cleanup_pop(0);
+    // types of indexed files are known up front, files of other types are read once by first reindexing
+    typeCache cache;
+    indexedFile entry;
+    initTypeCache(&cache, file->count);
+    for (size_t i = 0; i < file->count; i++) {
+        indexFileEntry(file, i, &entry);
+        cacheEntryType(&cache, &entry);
+    }
+    releaseSnapshot(s);
+    pthread_rwlock_wrlock(&data->typeCacheLock);
+    // a finished traversal already left a newer cache
+    if (data->typeCache.slots == NULL) {
+        data->typeCache = cache;
+    } else {
+        freeTypeCache(&cache);
+    }
+    pthread_rwlock_unlock(&data->typeCacheLock);
     return NULL;
 }
 
+// returns -1 if there is no usable index file yet
+int openFile(char *m, threadData *indexingThread) {
+    indexFile file;
+    int ret = loadIndexFile(m, &file);
+    if (ret == -2) fprintf(stderr, "Index file %s is damaged!\n", m);
+    if (ret < 0) return -1;
+
+    // saving mod time of index file
+    struct stat fileStats;
+    fstat(file.fileDescriptor, &fileStats);
+    indexingThread->fileLastModificationTime = fileStats.st_mtim.tv_sec;
+
+    // queries are answered right away, reading the whole file is left to a background thread
+    publishSnapshot(&indexingThread->slot, createSnapshot(createBase(&file)));
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, checkLoadedIndex, indexingThread);
+    if (err != 0) ERR("pthread_create");
+    pthread_detach(thread);
+    return 0;
+}
+
+// events were lost, every shard is rescanned now or right after its running reindexing
+void watchOverflow(void *arg) {
+    (void) arg;
+    for (int k = 0; k < global.shardCount; k++) {
+        threadData *data = &global.shards[k];
+        fprintf(stderr, "inotify queue overflow, rescanning %s\n", data->d);
+        if (startReindexing(data) < 0) {
+            rememberDirtyPath(data, data->d, 1);
+        }
+    }
+}
+
+// rewrites index file with changes made by watch mode, queries keep using the previous snapshot meanwhile
+void compactIndex(threadData *data) {
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    if (data->indexingFlag == 1) {
+        pthread_mutex_unlock(&data->indexingFlagMutex);
+        return;
+    }
+    data->indexingFlag = 1;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
+
+    statsLock(&data->databaseMutex);
+    snapshot *s = acquireSnapshot(&data->slot);
+    char *tempFilePath = getTempFilePath(data);
+    int written;
+    // writer needs full paths to find parent directories again
+    pathCache paths;
+    initSnapshotPathCache(s, &paths);
+    if (data->buildMemory > 0) {
+        indexBuild build;
+        indexedFile entry;
+        initIndexBuild(&build, tempFilePath, data->buildMemory);
+        for (int i = 0; i < snapshotSize(s); i++) {
+            if (snapshotEntry(s, i, &entry)) {
+                entry.path = snapshotEntryPath(s, &paths, i);
+                indexBuildAdd(&build, &entry, 1);
+            }
+        }
+        freePathCache(&paths);
+        written = writeIndexBuildTimed(&build, tempFilePath);
+        freeIndexBuild(&build);
+    } else {
+        indexedFile *entries = malloc((snapshotLiveCount(s) + 1) * sizeof(indexedFile));
+        if (entries == NULL) ERR("malloc");
+        size_t count = 0;
+        stringArena strings = {0};
+        for (int i = 0; i < snapshotSize(s); i++) {
+            if (snapshotEntry(s, i, &entries[count])) {
+                const char *path = snapshotEntryPath(s, &paths, i);
+                entries[count++].path = arenaCopy(&strings, path, strlen(path));
+            }
+        }
+        freePathCache(&paths);
+        written = writeIndexTimed(tempFilePath, entries, count);
+        free(entries);
+        freeArena(&strings);
+    }
+    if (written < 0) {
+        perror("Error creating temporary file. Aborting!\n");
+        unlink(tempFilePath);
+    } else {
+        swapFiles(data, tempFilePath);
+        publishIndex(data, data->m);
+    }
+    releaseSnapshot(s);
+    free(tempFilePath);
+    pthread_mutex_unlock(&data->databaseMutex);
+
+    pthread_mutex_lock(&data->indexingFlagMutex);
+    data->indexingFlag = 0;
+    pthread_mutex_unlock(&data->indexingFlagMutex);
+}
+
+void watchFlush(void *arg) {
+    (void) arg;
+    for (int k = 0; k < global.shardCount; k++) {
+        if (publishPending(&global.shards[k]) > DELTA_COMPACTION_THRESHOLD) {
+            compactIndex(&global.shards[k]);
+        }
+    }
+}
+
+// writes changes made by watch mode to index files of shards once watcher is stopped
+void stopWatching() {
+    stopWatcher(&global.watcher);
+    for (int k = 0; k < global.shardCount; k++) {
+        if (publishPending(&global.shards[k]) > 0) compactIndex(&global.shards[k]);
+    }
+}
+
+// every shard has a schedule of its own, thread sleeps until the earliest one is due
 void *periodicIndexing(void *voidPtr) {
     threadData *data = voidPtr;
-    threadData *indexingThread = data->indexingThread;
 
     while (1) {
         time_t currentTime;
         time(&currentTime);
-
-        // compare current time with last modification or lastindexing time
-        if ((indexingThread->lastIndexingTime == 0 &&
-             difftime(currentTime, indexingThread->fileLastModificationTime) > data->t)
-            || (indexingThread->lastIndexingTime != 0 &&
-                difftime(currentTime, indexingThread->lastIndexingTime) > data->t)) {
-            pthread_mutex_lock(indexingThread->indexingFlagMutex);
-            if (*data->indexingFlag == 0) {
-                pthread_mutex_unlock(indexingThread->indexingFlagMutex);
-                time(&data->indexingThread->lastIndexingTime);
-                int err = pthread_create(&indexingThread->threadID, NULL, reindexFiles, indexingThread);
-                if (err != 0) ERR("pthread_create");
+        double wait = data->t;
+
+        for (int k = 0; k < global.shardCount; k++) {
+            threadData *indexingThread = &global.shards[k];
+            // compare current time with last modification or lastindexing time
+            time_t previous = indexingThread->lastIndexingTime != 0 ? indexingThread->lastIndexingTime
+                                                                    : indexingThread->fileLastModificationTime;
+            if (difftime(currentTime, previous) > data->t) {
+                pthread_mutex_lock(&indexingThread->indexingFlagMutex);
+                if (indexingThread->indexingFlag == 0) {
+                    // directories changed since previous indexing are scanned first
+                    resetThrottle(&indexingThread->throttle, (int64_t) previous * 1000000000LL);
+                    indexingThread->throttled = throttleEnabled(&indexingThread->throttle);
+                    indexingThread->indexingFlag = 1;
+                    time(&indexingThread->lastIndexingTime);
+                    previous = indexingThread->lastIndexingTime;
+                    int err = pthread_create(&indexingThread->threadID, NULL, reindexFiles, indexingThread);
+                    if (err != 0) ERR("pthread_create");
+                }
+                pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
             }
-            pthread_mutex_unlock(indexingThread->indexingFlagMutex);
+            double left = data->t - difftime(currentTime, previous);
+            if (left < wait) wait = left;
         }
+        // shard still being reindexed is looked at again shortly
+        sleep(wait >= 1 ? (unsigned) wait : 1);
+    }
+}
 
-        time_t time;
-        if (indexingThread->lastIndexingTime == 0) {
-            time = indexingThread->fileLastModificationTime;
-        } else {
-            time = indexingThread->lastIndexingTime;
+// snapshot keeps counters of each type, no entry is read; indexed types are listed even if there are no files
+// of them, others only if the index holds some
+void countTypes(FILE *stream) {
+    int counts[TYPE_COUNT] = {0};
+    for (int k = 0; k < global.shardCount; k++) {
+        snapshot *s = acquireSnapshot(&global.shards[k].slot);
+        for (int type = 0; type < TYPE_COUNT; type++) counts[type] += snapshotTypeCount(s, type);
+        releaseSnapshot(s);
+    }
+
+    for (int type = TYPE_DIRECTORY + 1; type < TYPE_COUNT; type++) {
+        if (!typeIndexed(type) && counts[type] == 0) continue;
+        fprintf(stream, "%s Count: %d\n", type == TYPE_JPEG ? "jpg" : typeName(type), counts[type]);
+    }
+    fprintf(stream, "folder Count: %d\n", counts[TYPE_DIRECTORY]);
+}
+
+enum queryType {
+    QUERY_SIZE = 1,
+    QUERY_NAME,
+    QUERY_POSTINGS,
+    QUERY_LARGEST,
+    QUERY_FIND,
+    QUERY_DU,
+    QUERY_TOPDIRS,
+    QUERY_USAGE
+};
+
+// parsed command, only fields used by its type are set
+typedef struct query_s {
+    int type;
+    int64_t minSize;
+    int64_t maxSize;
+    char *name;
+    int hasOwner;
+    uid_t UID;
+    int fileType;
+    int count;
+    queryPlan *plan;
+    // arguments of find as typed
+    const char *text;
+} query;
+
+// bytes and files below directory followed by the same for each type and owner
+int writeDirectoryUsage(resultWriter *w, snapshot *s, pathCache *paths, const char *path) {
+    directoryUsage usage;
+    if (snapshotDirectoryUsage(s, paths, path, &usage) < 0) {
+        writeText(w, "%s is not an indexed directory\n", path);
+        return 0;
+    }
+    writeText(w, "%s %lld %lld\n", path, (long long) usage.bytes, (long long) usage.files);
+    for (int type = TYPE_DIRECTORY + 1; type < TYPE_COUNT; type++) {
+        if (usage.typeFiles[type] == 0) continue;
+        writeText(w, "type %s %lld %lld\n", typeName(type), (long long) usage.typeBytes[type],
+                  (long long) usage.typeFiles[type]);
+    }
+    for (int j = 0; j < usage.ownerCount; j++) {
+        if (usage.owners[j].files == 0) continue;
+        writeText(w, "owner %u %lld %lld\n", (unsigned) usage.owners[j].UID, (long long) usage.owners[j].bytes,
+                  (long long) usage.owners[j].files);
+    }
+    freeDirectoryUsage(&usage);
+    return 1;
+}
+
+// size queries of all shards are merged in size order
+int runSizeQuery(resultWriter *w, snapshot **shards, pathCache *paths, const query *q) {
+    int count = global.shardCount, found = 0;
+    sizeCursor *cursors = malloc(count * sizeof(sizeCursor));
+    indexedFile *heads = malloc(count * sizeof(indexedFile));
+    int *positions = malloc(count * sizeof(int));
+    if (cursors == NULL || heads == NULL || positions == NULL) ERR("malloc");
+    for (int k = 0; k < count; k++) {
+        snapshotSizeRange(shards[k], q->minSize, q->maxSize, &cursors[k]);
+        positions[k] = snapshotSizeNext(shards[k], &cursors[k]);
+        if (positions[k] >= 0) snapshotEntry(shards[k], positions[k], &heads[k]);
+    }
+    while (1) {
+        int next = -1;
+        for (int k = 0; k < count; k++) {
+            if (positions[k] >= 0 && (next < 0 || heads[k].size < heads[next].size)) next = k;
         }
-        sleep(data->t - difftime(currentTime, time));
+        if (next < 0) break;
+        writeEntry(w, shards[next], &paths[next], positions[next], &heads[next]);
+        found++;
+        positions[next] = snapshotSizeNext(shards[next], &cursors[next]);
+        if (positions[next] >= 0) snapshotEntry(shards[next], positions[next], &heads[next]);
     }
+    for (int k = 0; k < count; k++) freeSizeCursor(&cursors[k]);
+    free(cursors);
+    free(heads);
+    free(positions);
+    return found;
 }
 
-void countTypes(pthread_mutex_t *databaseMutex) {
-    int jpgCount = 0, pngCount = 0, zipCount = 0, gzipCount = 0, folderCount = 0;
+// entry of one shard, used to merge results of shards
+typedef struct shardEntry_s {
+    int shard;
+    int position;
+    int64_t files;
+    int64_t bytes;
+} shardEntry;
+
+// larger first, equal ones in shard order
+int compareShardEntries(const void *a, const void *b) {
+    const shardEntry *x = a, *y = b;
+    if (x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+    if (x->shard != y->shard) return x->shard > y->shard ? 1 : -1;
+    return 0;
+}
 
-    pthread_mutex_lock(databaseMutex);
+// number of results a shard can give at most, so that buffers are never larger than the snapshot
+int shardTopCount(const snapshot *s, const query *q) {
+    int size = q->type == QUERY_LARGEST ? snapshotLiveCount(s) : snapshotSize(s);
+    return q->count < size ? q->count : size;
+}
 
-    for (int i = 0; i < global.mainDatabase.currentIdx; ++i) {
-        if (strcmp(global.mainDatabase.database[i].fileType, "jpeg") == 0) {
-            jpgCount++;
-        } else if (strcmp(global.mainDatabase.database[i].fileType, "png") == 0) {
-            pngCount++;
-        } else if (strcmp(global.mainDatabase.database[i].fileType, "zip") == 0) {
-            zipCount++;
-        } else if (strcmp(global.mainDatabase.database[i].fileType, "gzip") == 0) {
-            gzipCount++;
-        } else
-            folderCount++;
+// k largest files or directories of each shard are enough to find k largest of all of them
+int runTopQuery(resultWriter *w, snapshot **shards, pathCache *paths, const query *q) {
+    int total = 0, most = 0, found = 0;
+    for (int k = 0; k < global.shardCount; k++) {
+        int count = shardTopCount(shards[k], q);
+        total += count;
+        if (count > most) most = count;
+    }
+    shardEntry *merged = malloc((total > 0 ? total : 1) * sizeof(shardEntry));
+    int *positions = malloc((most > 0 ? most : 1) * sizeof(int));
+    directoryTotal *totals = malloc((most > 0 ? most : 1) * sizeof(directoryTotal));
+    if (merged == NULL || positions == NULL || totals == NULL) ERR("malloc");
+    indexedFile entry;
+    int count = 0;
+    for (int k = 0; k < global.shardCount; k++) {
+        snapshot *s = shards[k];
+        if (q->type == QUERY_LARGEST) {
+            int n = snapshotLargest(s, shardTopCount(s, q), positions);
+            for (int j = 0; j < n; j++) {
+                snapshotEntry(s, positions[j], &entry);
+                merged[count++] = (shardEntry) {.shard = k, .position = positions[j], .bytes = entry.size};
+            }
+        } else {
+            int n = snapshotTopDirectories(s, &paths[k], shardTopCount(s, q), totals);
+            for (int j = 0; j < n; j++) {
+                merged[count++] = (shardEntry) {.shard = k, .position = totals[j].entry, .files = totals[j].files,
+                        .bytes = totals[j].bytes};
+            }
+        }
+    }
+    // each shard is in order already, stable order of equal ones comes from shard index
+    qsort(merged, count, sizeof(shardEntry), compareShardEntries);
+    for (; found < count && found < q->count; found++) {
+        const shardEntry *e = &merged[found];
+        snapshot *s = shards[e->shard];
+        if (q->type == QUERY_LARGEST) {
+            snapshotEntry(s, e->position, &entry);
+            writeEntry(w, s, &paths[e->shard], e->position, &entry);
+        } else {
+            writeText(w, "%s %lld %lld\n", snapshotEntryPath(s, &paths[e->shard], e->position), (long long) e->bytes,
+                      (long long) e->files);
+        }
+    }
+    free(merged);
+    free(positions);
+    free(totals);
+    return found;
+}
+
+// writes results and returns their number; size queries are served from the size order of index file, owner and type from posting lists,
+// name and find queries from whichever access path planner expects to be the most selective,
+// du, topdirs and usage from rollups of directories; every shard answers and their results are merged,
+// du is answered by the shard holding the directory
+int runQuery(resultWriter *w, snapshot **shards, const query *q) {
+    int count = global.shardCount;
+    if (q->type == QUERY_FIND) {
+        return runPlan(w, (const snapshot *const *) shards, count, q->plan);
+    }
+    if (q->type == QUERY_NAME) {
+        queryPlan *plan = malloc(sizeof(queryPlan));
+        if (plan == NULL) ERR("malloc");
+        namePlan(plan, q->name);
+        int found = runPlan(w, (const snapshot *const *) shards, count, plan);
+        free(plan);
+        return found;
     }
-    fprintf(stdout, "jpg Count: %d\n", jpgCount);
-    fprintf(stdout, "png Count: %d\n", pngCount);
-    fprintf(stdout, "zip Count: %d\n", zipCount);
-    fprintf(stdout, "gzip Count: %d\n", gzipCount);
-    fprintf(stdout, "folder Count: %d\n", folderCount);
 
-    pthread_mutex_unlock(databaseMutex);
+    indexedFile entry;
+    pathCache *paths = malloc(count * sizeof(pathCache));
+    if (paths == NULL) ERR("malloc");
+    int found = 0;
+    for (int k = 0; k < count; k++) initSnapshotPathCache(shards[k], &paths[k]);
+
+    if (q->type == QUERY_SIZE) {
+        found = runSizeQuery(w, shards, paths, q);
+    } else if (q->type == QUERY_POSTINGS) {
+        for (int k = 0; k < count; k++) {
+            postingCursor cursor;
+            snapshotPostings(shards[k], q->fileType, q->hasOwner ? &q->UID : NULL, &cursor);
+            int i;
+            while ((i = snapshotPostingNext(shards[k], &cursor)) >= 0) {
+                snapshotEntry(shards[k], i, &entry);
+                writeEntry(w, shards[k], &paths[k], i, &entry);
+                found++;
+            }
+        }
+    } else if (q->type == QUERY_LARGEST || q->type == QUERY_TOPDIRS) {
+        found = runTopQuery(w, shards, paths, q);
+    } else if (q->type == QUERY_DU) {
+        threadData *shard = shardOf(q->name);
+        if (shard == NULL) {
+            writeText(w, "%s is not an indexed directory\n", q->name);
+        } else {
+            int k = (int) (shard - global.shards);
+            found = writeDirectoryUsage(w, shards[k], &paths[k], q->name);
+        }
+    } else if (q->type == QUERY_USAGE) {
+        int64_t files = 0, bytes = 0;
+        for (int k = 0; k < count; k++) {
+            int64_t shardFiles, shardBytes;
+            snapshotOwnerUsage(shards[k], q->UID, &shardFiles, &shardBytes);
+            files += shardFiles;
+            bytes += shardBytes;
+        }
+        writeText(w, "owner %u %lld %lld\n", (unsigned) q->UID, (long long) bytes, (long long) files);
+        found = files > 0;
+    }
+    for (int k = 0; k < count; k++) freePathCache(&paths[k]);
+    free(paths);
+    return found;
 }
 
-int compareSize(int i, int *size) {
-    if (size == NULL) return 0;
-    if (global.mainDatabase.database[i].size > *size) {
-        return 1;
+// reads "owner uid" and "type name" filters in any order, returns -1 if input is malformed
+int parseFilters(char *input, query *q) {
+    char *save;
+    for (char *key = strtok_r(input, " ", &save); key != NULL; key = strtok_r(NULL, " ", &save)) {
+        char *value = strtok_r(NULL, " ", &save);
+        if (value == NULL) return -1;
+        if (strcmp(key, "owner") == 0) {
+            q->hasOwner = 1;
+            q->UID = atoi(value);
+        } else if (strcmp(key, "type") == 0) {
+            q->fileType = strcmp(value, "directory") == 0 ? TYPE_DIRECTORY : typeFromName(value);
+            if (q->fileType == TYPE_NONE) return -1;
+        } else {
+            return -1;
+        }
     }
     return 0;
 }
 
-int compareName(int i, char* name) {
-    if (name == NULL) return 0;
-    if (strstr(global.mainDatabase.database[i].fileName, name) != NULL) {
-        return 1;
+// key of query in cache: its parsed form, equal for commands asking the same (e.g. owner 5 type png and type png
+// owner 5), followed by generations of shards it is answered from; NULL for queries answered from counters
+// or rollups in time independent of index size and for find output holding anything but results
+char *queryCacheKey(const query *q, snapshot **shards) {
+    char *key = NULL;
+    size_t length;
+    FILE *stream = open_memstream(&key, &length);
+    if (stream == NULL) ERR("open_memstream");
+    int cached = 1;
+    if (q->type == QUERY_SIZE) {
+        fprintf(stream, "size %lld %lld", (long long) q->minSize, (long long) q->maxSize);
+    } else if (q->type == QUERY_NAME) {
+        fprintf(stream, "name %s", q->name);
+    } else if (q->type == QUERY_POSTINGS) {
+        fprintf(stream, "postings %d %d %u", q->fileType, q->hasOwner, q->hasOwner ? (unsigned) q->UID : 0);
+    } else if (q->type == QUERY_LARGEST) {
+        fprintf(stream, "largest %d", q->count);
+    } else if (q->type == QUERY_FIND && !q->plan->explain && !q->plan->countOnly && !q->plan->hasCursor) {
+        // runs of blanks outside quotes do not change the query
+        fprintf(stream, "find");
+        int quoted = 0, blank = 1;
+        for (const char *c = q->text; *c != '\0'; c++) {
+            if (*c == '"') quoted = !quoted;
+            if (!quoted && isspace((unsigned char) *c)) {
+                blank = 1;
+                continue;
+            }
+            if (blank) fputc(' ', stream);
+            blank = 0;
+            fputc(*c, stream);
+        }
+    } else {
+        cached = 0;
     }
-    return 0;
+    for (int k = 0; k < global.shardCount; k++) fprintf(stream, " @%lu", shards[k]->generation);
+    fclose(stream);
+    if (!cached) {
+        free(key);
+        return NULL;
+    }
+    return key;
 }
 
-int compareUID(int i, uid_t* UID) {
-    if (UID == NULL) return 0;
-    if (global.mainDatabase.database[i].UID == *UID) {
-        return 1;
+// writes results of a cached query again from their ids, nothing but output is done
+void writeRecordedResults(resultWriter *w, snapshot **shards, const uint64_t *ids, size_t count) {
+    pathCache *paths = malloc(global.shardCount * sizeof(pathCache));
+    if (paths == NULL) ERR("malloc");
+    for (int k = 0; k < global.shardCount; k++) initSnapshotPathCache(shards[k], &paths[k]);
+    indexedFile entry;
+    for (size_t j = 0; j < count; j++) {
+        int k = (int) (ids[j] >> 32), i = (int) (uint32_t) ids[j];
+        snapshotEntry(shards[k], i, &entry);
+        writeEntry(w, shards[k], &paths[k], i, &entry);
     }
-    return 0;
+    for (int k = 0; k < global.shardCount; k++) freePathCache(&paths[k]);
+    free(paths);
 }
 
-void printCommand(FILE *stream, int type, int* size, char* name, uid_t* UID) {
-    for (int i = 0; i < global.mainDatabase.currentIdx; i++) {
-        if ((type == 1 && compareSize(i, size)) || (type == 2 && compareName(i, name)) ||
-            (type == 3 && compareUID(i, UID))) {
-            fprintf(stream, "%s %ld %s \n",
-                    global.mainDatabase.database[i].path,
-                    global.mainDatabase.database[i].size,
-                    global.mainDatabase.database[i].fileType);
+// snapshots of all shards stay pinned while results are paged, reindexing is free to publish a new one meanwhile;
+// query runs once, only interactive output switches to $PAGER after its first few lines
+void executeCommand(const query *q, FILE *stream, int interactive) {
+    char *pager = getenv("PAGER");
+    int format = q->type == QUERY_FIND ? q->plan->format : OUTPUT_TEXT;
+    resultWriter w;
+
+    snapshot **shards = malloc(global.shardCount * sizeof(snapshot *));
+    if (shards == NULL) ERR("malloc");
+    for (int k = 0; k < global.shardCount; k++) shards[k] = acquireSnapshot(&global.shards[k].slot);
+    if (interactive && pager != NULL) {
+        initPagedWriter(&w, pager, format);
+    } else {
+        initWriter(&w, stream, format);
+    }
+    char *key = global.cache.budget > 0 ? queryCacheKey(q, shards) : NULL;
+    uint64_t *ids;
+    size_t count;
+    if (key != NULL && queryCacheGet(&global.cache, key, &ids, &count) == 0) {
+        statsAdd(STATS_QUERY_CACHE_HITS, 1);
+        writeRecordedResults(&w, shards, ids, count);
+        free(ids);
+    } else {
+        resultRecord record = {.shards = (const snapshot *const *) shards, .shardCount = global.shardCount,
+                .limit = global.cache.budget / 4 / sizeof(uint64_t)};
+        if (key != NULL) {
+            statsAdd(STATS_QUERY_CACHE_MISSES, 1);
+            w.record = &record;
+        }
+        runQuery(&w, shards, q);
+        // a cursor or a message printed with results would not be written again
+        if (key != NULL && !record.overflowed && w.texts == 0) {
+            queryCachePut(&global.cache, key, record.ids, record.count);
+        } else {
+            free(record.ids);
         }
     }
+    free(key);
+    finishWriter(&w);
+    for (int k = 0; k < global.shardCount; k++) releaseSnapshot(shards[k]);
+    free(shards);
 }
 
-void executeCommand(int type, int* size, char* name, uid_t* UID, pthread_mutex_t *databaseMutex) {
-    char *pager = getenv("PAGER");
-    FILE *f;
-    int lines = 0;
+// input starts with command name followed by its arguments or nothing
+int isCommand(const char *input, const char *name) {
+    size_t length = strlen(name);
+    return strncmp(input, name, length) == 0 && (input[length] == ' ' || input[length] == '\0');
+}
+
+// positive number of results asked for, returns -1 if text is not one
+int parseCount(const char *text, int *count) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value <= 0 || value > INT_MAX) return -1;
+    *count = (int) value;
+    return 0;
+}
 
-    pthread_mutex_lock(databaseMutex);
-    for (int i = 0; i < global.mainDatabase.currentIdx; i++) {
-        if ((type == 1 && compareSize(i, size)) || (type == 2 && compareName(i, name)) ||
-            (type == 3 && compareUID(i, UID))) {
-            lines++;
-            if (lines > 3) break;
+// text following command name, NULL if command was given no argument
+char *commandArgument(char *input) {
+    char *p = strchr(input, ' ');
+    return p != NULL && p[1] != '\0' ? p + 1 : NULL;
+}
+
+// answers every command except exit, used for stdin and for clients of the socket at the same time
+void handleCommand(char *input, FILE *stream, int interactive) {
+    int64_t commandStart = statsNow();
+    // periodic reindexing backs off while queries run
+    for (int k = 0; k < global.shardCount; k++) throttleQueryStarted(&global.shards[k].throttle);
+    int command = -1;
+    char *argument = commandArgument(input);
+
+    if (isCommand(input, "index")) {
+        command = STATS_COMMAND_INDEX;
+        // with a path only the shard holding it is rebuilt
+        threadData *shard = argument != NULL ? shardOf(argument) : NULL;
+        int started = 0;
+        if (argument != NULL && shard == NULL) {
+            fprintf(stream, "%s is not in an indexed directory\n", argument);
+        } else {
+            for (int k = 0; k < global.shardCount; k++) {
+                if (shard != NULL && shard != &global.shards[k]) continue;
+                if (startReindexing(&global.shards[k]) == 0) started++;
+            }
+            if (started == 0) {
+                fprintf(stream, "Indexing already in progress, please wait!\n");
+            } else if (!interactive) {
+                fprintf(stream, "Indexing started!\n");
+            }
+        }
+    } else if (strcmp(input, "count") == 0) {
+        command = STATS_COMMAND_COUNT;
+        countTypes(stream);
+    } else if (strcmp(input, "stats") == 0) {
+        command = STATS_COMMAND_STATS;
+        printStats(stream);
+    } else if (isCommand(input, "largerthan")) {
+        command = STATS_COMMAND_LARGERTHAN;
+        if (argument == NULL) {
+            fprintf(stream, "Usage: largerthan size\n");
+        } else {
+            query q = {.type = QUERY_SIZE, .minSize = atoll(argument) + 1, .maxSize = INT64_MAX};
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "smallerthan")) {
+        command = STATS_COMMAND_SMALLERTHAN;
+        if (argument == NULL) {
+            fprintf(stream, "Usage: smallerthan size\n");
+        } else {
+            query q = {.type = QUERY_SIZE, .minSize = INT64_MIN, .maxSize = atoll(argument) - 1};
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "sizebetween")) {
+        command = STATS_COMMAND_SIZEBETWEEN;
+        long long min, max;
+        if (sscanf(input, "sizebetween %lld %lld", &min, &max) != 2) {
+            fprintf(stream, "Usage: sizebetween min max\n");
+        } else {
+            query q = {.type = QUERY_SIZE, .minSize = min, .maxSize = max};
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "largest")) {
+        command = STATS_COMMAND_LARGEST;
+        query q = {.type = QUERY_LARGEST};
+        if (argument == NULL || parseCount(argument, &q.count) < 0) {
+            fprintf(stream, "Usage: largest count, count is a positive number\n");
+        } else {
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "namepart")) {
+        command = STATS_COMMAND_NAMEPART;
+        if (argument == NULL) {
+            fprintf(stream, "Usage: namepart part\n");
+        } else {
+            query q = {.type = QUERY_NAME, .name = argument};
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "find")) {
+        command = STATS_COMMAND_FIND;
+        queryPlan *plan = malloc(sizeof(queryPlan));
+        if (plan == NULL) ERR("malloc");
+        if (parseQuery(argument != NULL ? argument : "", plan, stream) == 0) {
+            query q = {.type = QUERY_FIND, .plan = plan, .text = argument != NULL ? argument : ""};
+            executeCommand(&q, stream, interactive);
+        }
+        free(plan);
+    } else if (isCommand(input, "du")) {
+        command = STATS_COMMAND_DU;
+        if (argument == NULL) {
+            fprintf(stream, "Usage: du path\n");
+        } else {
+            // directories are stored without trailing slash
+            size_t length = strlen(argument);
+            while (length > 1 && argument[length - 1] == '/') argument[--length] = '\0';
+            query q = {.type = QUERY_DU, .name = argument};
+            executeCommand(&q, stream, interactive);
         }
+    } else if (isCommand(input, "topdirs")) {
+        command = STATS_COMMAND_TOPDIRS;
+        query q = {.type = QUERY_TOPDIRS};
+        if (argument == NULL || parseCount(argument, &q.count) < 0) {
+            fprintf(stream, "Usage: topdirs count, count is a positive number\n");
+        } else {
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (isCommand(input, "usage")) {
+        command = STATS_COMMAND_USAGE;
+        if (argument == NULL) {
+            fprintf(stream, "Usage: usage uid\n");
+        } else {
+            query q = {.type = QUERY_USAGE, .UID = atoi(argument)};
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (strncmp(input, "owner ", 6) == 0 || strncmp(input, "type ", 5) == 0) {
+        command = STATS_COMMAND_FILTER;
+        query q = {.type = QUERY_POSTINGS, .fileType = TYPE_NONE};
+        if (parseFilters(input, &q) < 0) {
+            fprintf(stream, "Usage: [owner uid] [type t], t is a type name (see -T) or directory\n");
+        } else {
+            executeCommand(&q, stream, interactive);
+        }
+    } else if (input[0] != '\0') {
+        fprintf(stream, "Unknown command: %s\n", input);
     }
 
-    if (lines > 3 && pager != NULL) {
-        if ((f = popen(pager, "w")) == NULL) ERR("popen");
-        printCommand(f, type, size, name, UID);
-        pthread_mutex_unlock(databaseMutex);
-        pclose(f);
-    } else {
-        printCommand(stdout, type, size, name, UID);
-        pthread_mutex_unlock(databaseMutex);
+    for (int k = 0; k < global.shardCount; k++) throttleQueryFinished(&global.shards[k].throttle);
+    if (command >= 0) statsRecord(command, statsNow() - commandStart);
+}
+
+void serverCommand(char *line, FILE *stream, void *arg) {
+    (void) arg;
+    handleCommand(line, stream, 0);
+}
+
+// waits for running indexing and writes changes made by watch mode before the program ends,
+// periodic reindexing is cancelled instead since it may be paced far below full speed
+void exitProcedure(int verbose) {
+    for (int k = 0; k < global.shardCount; k++) {
+        threadData *indexingThread = &global.shards[k];
+        pthread_mutex_lock(&indexingThread->indexingFlagMutex);
+        if (indexingThread->indexingFlag == 1) {
+            if (indexingThread->throttled) cancelThrottle(&indexingThread->throttle);
+            pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
+            if (verbose) printf("Indexing of %s in progress. Please wait.\n", indexingThread->d);
+            pthread_join(indexingThread->threadID, NULL);
+        } else {
+            pthread_mutex_unlock(&indexingThread->indexingFlagMutex);
+        }
     }
+    if (global.watching) stopWatching();
+    for (int k = 0; k < global.shardCount; k++) shutdownProcedure(&global.shards[k]);
+    freeQueryCache(&global.cache);
+}
+
+// index file of a shard, a single directory keeps the index path as it is
+char *getShardPath(const char *m, const char *d, int shardCount) {
+    char *path = malloc(strlen(m) + strlen("-shard-") + 16 + 1);
+    if (path == NULL) ERR("malloc");
+    if (shardCount == 1) return strcpy(path, m);
+    sprintf(path, "%s-shard-%016llx", m, (unsigned long long) stringHash(d, strlen(d)));
+    return path;
 }
 
 int main(int argc, char **argv) {
     // program init - arguments handling
-    char *d = NULL;
+    char *d[MAX_SHARDS];
+    int dCount = 0;
     char *m = NULL;
     int t = 0;
+    int j = defaultWalkThreads();
+    int w = 0;
+    char *p = NULL;
+    char *socketPath = NULL;
+    double filesPerSecond = 0, bytesPerSecond = 0;
+    int n = -1;
+    size_t buildMemory = 0;
+    size_t cacheMemory = QUERY_CACHE_DEFAULT_MEMORY;
     int mFlag = 0;
-    readArguments(argc, argv, &d, &m, &t, &mFlag);
+    readArguments(argc, argv, d, &dCount, &m, &t, &j, &w, &p, &socketPath, &filesPerSecond, &bytesPerSecond, &n,
+                  &buildMemory, &cacheMemory, &mFlag);
+    initQueryCache(&global.cache, cacheMemory);
+
+    // in daemon mode SIGINT and SIGTERM are read by the server loop, so no other thread may take them
+    if (socketPath != NULL) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+    if (p != NULL) startStatsDump(p, STATS_DUMP_INTERVAL);
+
+    // shard structures, budgets given with -r and -b are split between them
+    global.shardCount = dCount;
+    global.shards = calloc(dCount, sizeof(threadData));
+    if (global.shards == NULL) ERR("calloc");
+    size_t shardMemory = buildMemory / dCount;
+    if (buildMemory > 0 && shardMemory < BUILD_MIN_MEMORY) shardMemory = BUILD_MIN_MEMORY;
+    for (int k = 0; k < dCount; k++) {
+        threadData *shard = &global.shards[k];
+        shard->d = d[k];
+        shard->m = getShardPath(m, d[k], dCount);
+        shard->mFlag = 1;
+        shard->threads = j;
+        shard->buildMemory = shardMemory;
+        pthread_mutex_init(&shard->indexingFlagMutex, NULL);
+        pthread_mutex_init(&shard->databaseMutex, NULL);
+        pthread_rwlock_init(&shard->typeCacheLock, NULL);
+        pthread_mutex_init(&shard->dirtyMutex, NULL);
+        initThrottle(&shard->throttle, filesPerSecond / dCount, bytesPerSecond / dCount, n);
+    }
+    if (mFlag) free(m);
 
-    // if == 0 there is no indexing running, if == 1 there is an indexing in progress
-    int indexingFlag = 0;
-    global.reindexingFlag = 0;
-
-    // indexing thread structure
-    pthread_mutex_t indexingFlagMutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_t databaseMutex = PTHREAD_MUTEX_INITIALIZER;
-    threadData indexingThread = {.databaseMutex = &databaseMutex,
-            .indexingFlagMutex = &indexingFlagMutex,
-            .d = d,
-            .m = m,
-            .indexingFlag = &indexingFlag,
-            .mFlag = &mFlag};
-
-    // program init - open file or create it
-    pthread_mutex_lock(&databaseMutex);
-    openFile(m, &indexingThread);
-    pthread_mutex_unlock(&databaseMutex);
-
-    if (global.mainDatabase.fileDescriptor > 0) {
-        printf("Index file successfully loaded! Awaiting instructions.\n");
-    } else {
-        printf("File doesn't exist! Creating new file and indexing in progress...\n");
-        createFile(m, &indexingThread);
+    // program init - watching is started first so that indexing watches directories as it reads them
+    if (w) {
+        watchCallbacks callbacks = {.refresh = watchRefresh, .overflow = watchOverflow, .flush = watchFlush};
+        global.watching = startWatcher(&global.watcher, &callbacks) == 0;
+    }
+
+    // program init - open file or create it, shards missing their file are indexed in parallel
+    for (int k = 0; k < dCount; k++) {
+        threadData *indexingThread = &global.shards[k];
+        statsLock(&indexingThread->databaseMutex);
+        int loaded = openFile(indexingThread->m, indexingThread) == 0;
+        pthread_mutex_unlock(&indexingThread->databaseMutex);
+
+        if (loaded) {
+            if (global.watching) watchIndexedDirectories(indexingThread);
+            printf("Index file %s successfully loaded! Awaiting instructions.\n", indexingThread->m);
+            // indexing interrupted last time goes on in background, queries use loaded index until it is done
+            char *checkpointPath = getCheckpointPath(indexingThread->m);
+            if (access(checkpointPath, F_OK) == 0) startReindexing(indexingThread);
+            free(checkpointPath);
+        } else {
+            printf("File %s doesn't exist! Creating new file and indexing in progress...\n", indexingThread->m);
+            createFile(indexingThread);
+        }
     }
 
     // program init - launching periodic indexing if param t is provided
-    threadData periodicIndexer = {.indexingThread = &indexingThread,
-            .indexingFlagMutex = &indexingFlagMutex,
-            .indexingFlag = &indexingFlag,
-            .t = t,
-            .databaseMutex = &databaseMutex};
+    threadData periodicIndexer = {.t = t};
     if (t != 0) {
         int err = pthread_create(&periodicIndexer.threadID, NULL, periodicIndexing, &periodicIndexer);
         if (err != 0) ERR("pthread_create");
     }
 
+    // daemon mode - commands are read from clients of the socket instead of stdin
+    if (socketPath != NULL) {
+        server srv;
+        serverCallbacks callbacks = {.command = serverCommand};
+        if (startServer(&srv, socketPath, defaultWalkThreads(), &callbacks) < 0) ERR("startServer");
+        printf("Serving queries on %s\n", socketPath);
+        fflush(stdout);
+        runServer(&srv);
+        stopServer(&srv);
+        exitProcedure(0);
+        return EXIT_SUCCESS;
+    }
+
     // commands loop
     char input[MAX_INPUT_LENGTH];
     while (1) {
         if (fgets(input, MAX_INPUT_LENGTH, stdin) == NULL) {
-            shutdownProcedure(&indexingThread);
+            if (global.watching) stopWatching();
+            for (int k = 0; k < dCount; k++) shutdownProcedure(&global.shards[k]);
             return EXIT_FAILURE;
         }
 
@@ -621,56 +1515,16 @@ int main(int argc, char **argv) {
             if (t != 0) {
                 pthread_cancel(periodicIndexer.threadID);
             }
-            pthread_cancel(indexingThread.threadID);
+            for (int k = 0; k < dCount; k++) pthread_cancel(global.shards[k].threadID);
+            dumpStats();
             return EXIT_SUCCESS;
         }
 
         if (strcmp(input, "exit") == 0) {
-            pthread_mutex_lock(&indexingFlagMutex);
-            if (indexingFlag == 1) {
-                pthread_mutex_unlock(&indexingFlagMutex);
-                printf("Indexing in progress. Please wait.\n");
-                pthread_join(indexingThread.threadID, NULL);
-            } else {
-                pthread_mutex_unlock(&indexingFlagMutex);
-            }
-            shutdownProcedure(&indexingThread);
+            exitProcedure(1);
             return EXIT_SUCCESS;
         }
 
-        if (strcmp(input, "index") == 0) {
-            pthread_mutex_lock(&indexingFlagMutex);
-            if (indexingFlag == 1) {
-                pthread_mutex_unlock(&indexingFlagMutex);
-                printf("Indexing already in progress, please wait!\n");
-            } else {
-                pthread_mutex_unlock(&indexingFlagMutex);
-                time(&indexingThread.lastIndexingTime);
-                int err = pthread_create(&indexingThread.threadID, NULL, reindexFiles, &indexingThread);
-                if (err != 0) ERR("pthread_create");
-            }
-        }
-
-        if (strcmp(input, "count") == 0) {
-            countTypes(&databaseMutex);
-        }
-
-        if (strstr(input, "largerthan") != NULL) {
-            char *p = strchr(input, ' ');
-            int size = atoi(p + 1);
-            executeCommand(1, &size, NULL, NULL, &databaseMutex);
-        }
-
-        if (strstr(input, "namepart") != NULL) {
-            char *p = strchr(input, ' ');
-            char *filename = p + 1;
-            executeCommand(2, NULL, filename, NULL, &databaseMutex);
-        }
-
-        if (strstr(input, "owner") != NULL) {
-            char *p = strchr(input, ' ');
-            uid_t uid = atoi(p + 1);
-            executeCommand(3, NULL, NULL, &uid, &databaseMutex);
-        }
+        handleCommand(input, stdout, 1);
     }
 }
@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "output.h"
+#include "index.h"
+
+void initWriter(resultWriter *w, FILE *stream, int format) {
+    memset(w, 0, sizeof(resultWriter));
+    w->stream = stream;
+    w->format = format;
+    w->capacity = OUTPUT_BUFFER_SIZE;
+    w->buffer = malloc(w->capacity);
+    if (w->buffer == NULL) ERR("malloc");
+}
+
+void initPagedWriter(resultWriter *w, const char *pager, int format) {
+    initWriter(w, stdout, format);
+    w->pager = pager;
+}
+
+static int holding(const resultWriter *w) {
+    return w->pager != NULL && w->pipe == NULL;
+}
+
+static void flushWriter(resultWriter *w) {
+    if (w->used == 0) return;
+    FILE *target = w->pipe != NULL ? w->pipe : w->stream;
+    if (target != NULL) fwrite(w->buffer, 1, w->used, target);
+    w->used = 0;
+}
+
+// makes room for length more bytes; held output is never written, so the buffer grows instead
+static char *reserve(resultWriter *w, size_t length) {
+    if (w->used + length > w->capacity && !holding(w)) flushWriter(w);
+    if (w->used + length > w->capacity) {
+        while (w->used + length > w->capacity) w->capacity *= 2;
+        w->buffer = realloc(w->buffer, w->capacity);
+        if (w->buffer == NULL) ERR("realloc");
+    }
+    return w->buffer + w->used;
+}
+
+static void endLine(resultWriter *w) {
+    w->lines++;
+    if (holding(w) && w->lines >= PAGER_MIN_LINES) {
+        if ((w->pipe = popen(w->pager, "w")) == NULL) ERR("popen");
+        flushWriter(w);
+    }
+}
+
+static void append(resultWriter *w, const char *s, size_t length) {
+    memcpy(reserve(w, length), s, length);
+    w->used += length;
+}
+
+// digits written backwards from end, returns pointer to the first one
+static char *formatInt(char *end, int64_t value) {
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    do {
+        *--end = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) *--end = '-';
+    return end;
+}
+
+static void appendInt(resultWriter *w, int64_t value) {
+    char digits[24];
+    char *start = formatInt(digits + sizeof(digits), value);
+    append(w, start, digits + sizeof(digits) - start);
+}
+
+// escapes quotes, backslashes and control characters, other bytes are copied as they are
+static void appendJsonString(resultWriter *w, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    append(w, "\"", 1);
+    const char *run = s;
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        append(w, run, s - run);
+        if (c == '"' || c == '\\') {
+            char escaped[2] = {'\\', (char) c};
+            append(w, escaped, 2);
+        } else {
+            char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+            append(w, escaped, 6);
+        }
+        run = s + 1;
+    }
+    append(w, run, s - run);
+    append(w, "\"", 1);
+}
+
+void writeResult(resultWriter *w, const char *path, int64_t size, int fileType) {
+    const char *type = typeName(fileType);
+    if (w->format == OUTPUT_NUL) {
+        append(w, path, strlen(path) + 1);
+    } else if (w->format == OUTPUT_JSON) {
+        append(w, "{\"path\":", 8);
+        appendJsonString(w, path);
+        append(w, ",\"size\":", 8);
+        appendInt(w, size);
+        append(w, ",\"type\":\"", 9);
+        // text output prints directories as 0, names are easier to consume
+        if (fileType == TYPE_DIRECTORY) type = "directory";
+        append(w, type, strlen(type));
+        append(w, "\"}\n", 3);
+    } else {
+        append(w, path, strlen(path));
+        append(w, " ", 1);
+        appendInt(w, size);
+        append(w, " ", 1);
+        append(w, type, strlen(type));
+        append(w, " \n", 2);
+    }
+    endLine(w);
+}
+
+void writeText(resultWriter *w, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    w->texts++;
+    if (length <= 0) return;
+    va_start(args, format);
+    vsnprintf(reserve(w, length + 1), length + 1, format, args);
+    va_end(args);
+    int lines = 0;
+    for (int i = 0; i < length; i++) lines += w->buffer[w->used + i] == '\n';
+    w->used += length;
+    while (lines-- > 0) endLine(w);
+}
+
+void finishWriter(resultWriter *w) {
+    flushWriter(w);
+    if (w->pipe != NULL) {
+        pclose(w->pipe);
+    } else if (w->stream != NULL) {
+        fflush(w->stream);
+    }
+    free(w->buffer);
+    w->buffer = NULL;
+}
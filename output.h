@@ -0,0 +1,55 @@
+#ifndef FILE_INDEXER_OUTPUT_H
+#define FILE_INDEXER_OUTPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "indexer.h"
+
+// results are formatted into a buffer of that size and written with one call when it fills up
+#define OUTPUT_BUFFER_SIZE 65536
+
+// interactive output longer than that many lines goes through $PAGER
+#define PAGER_MIN_LINES 4
+
+enum outputFormat {
+    // path, size and type separated by spaces, one result per line
+    OUTPUT_TEXT,
+    // paths only, each followed by NUL, for xargs -0
+    OUTPUT_NUL,
+    // one JSON object with path, size and type per line
+    OUTPUT_JSON
+};
+
+typedef struct resultWriter_s {
+    FILE *stream;
+    int format;
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    long lines;
+    // when set, output is held until it has PAGER_MIN_LINES lines, then it goes to pager, otherwise to stream
+    const char *pager;
+    FILE *pipe;
+    // calls of writeText, output made of results only can be written again from their ids
+    long texts;
+    // when set, ids of written results are appended to it
+    struct resultRecord_s *record;
+} resultWriter;
+
+// writer to stream, NULL stream discards output
+void initWriter(resultWriter *w, FILE *stream, int format);
+
+// writer to stdout which switches to pager once output gets long, pager NULL never switches
+void initPagedWriter(resultWriter *w, const char *pager, int format);
+
+// formats one result in format of writer
+void writeResult(resultWriter *w, const char *path, int64_t size, int fileType);
+
+// copies printf-formatted text as is, e.g. messages and counts
+void writeText(resultWriter *w, const char *format, ...);
+
+// writes everything left and closes pager
+void finishWriter(resultWriter *w);
+
+#endif //FILE_INDEXER_OUTPUT_H
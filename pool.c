@@ -0,0 +1,80 @@
+#include <stdlib.h>
+
+#include "indexer.h"
+#include "pool.h"
+
+// takes next chunk of first batch, lock has to be held; batch is unlinked once its last chunk is taken
+static int takeChunk(workPool *pool, poolBatch *batch) {
+    int chunk = batch->next++;
+    if (batch->next == batch->chunks) {
+        poolBatch **link = &pool->first, *previous = NULL;
+        while (*link != batch) {
+            previous = *link;
+            link = &(*link)->nextBatch;
+        }
+        *link = batch->nextBatch;
+        if (pool->last == batch) pool->last = previous;
+    }
+    return chunk;
+}
+
+static void finishChunk(workPool *pool, poolBatch *batch) {
+    pthread_mutex_lock(&pool->lock);
+    if (++batch->done == batch->chunks) pthread_cond_signal(&batch->finished);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *poolWorkerRun(void *voidPtr) {
+    workPool *pool = voidPtr;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->first == NULL) pthread_cond_wait(&pool->work, &pool->lock);
+        poolBatch *batch = pool->first;
+        int chunk = takeChunk(pool, batch);
+        pthread_mutex_unlock(&pool->lock);
+
+        batch->task(batch->arg, chunk);
+        finishChunk(pool, batch);
+    }
+    return NULL;
+}
+
+void startPool(workPool *pool, int threads) {
+    pool->threadCount = threads;
+    pool->first = pool->last = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (pool->threads == NULL) ERR("malloc");
+    for (int i = 0; i < threads; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, poolWorkerRun, pool);
+        if (err != 0) ERR("pthread_create");
+        pthread_detach(pool->threads[i]);
+    }
+}
+
+void poolRun(workPool *pool, int chunks, poolTask task, void *arg) {
+    if (chunks <= 0) return;
+    poolBatch batch = {.task = task, .arg = arg, .chunks = chunks};
+    pthread_cond_init(&batch.finished, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->last != NULL) {
+        pool->last->nextBatch = &batch;
+    } else {
+        pool->first = &batch;
+    }
+    pool->last = &batch;
+    pthread_cond_broadcast(&pool->work);
+
+    while (batch.next < batch.chunks) {
+        int chunk = takeChunk(pool, &batch);
+        pthread_mutex_unlock(&pool->lock);
+        task(arg, chunk);
+        pthread_mutex_lock(&pool->lock);
+        batch.done++;
+    }
+    while (batch.done < batch.chunks) pthread_cond_wait(&batch.finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_cond_destroy(&batch.finished);
+}
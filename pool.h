@@ -0,0 +1,37 @@
+#ifndef FILE_INDEXER_POOL_H
+#define FILE_INDEXER_POOL_H
+
+#include <pthread.h>
+
+// processes one chunk of a batch, chunks of a batch run concurrently
+typedef void (*poolTask)(void *arg, int chunk);
+
+typedef struct poolBatch_s {
+    poolTask task;
+    void *arg;
+    int chunks;
+    // next chunk to be taken and number of finished chunks
+    int next;
+    int done;
+    struct poolBatch_s *nextBatch;
+    pthread_cond_t finished;
+} poolBatch;
+
+// persistent threads shared by all queries, batches of several callers are served in order of arrival
+typedef struct workPool_s {
+    pthread_t *threads;
+    int threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    // batches with chunks not taken yet
+    poolBatch *first;
+    poolBatch *last;
+} workPool;
+
+void startPool(workPool *pool, int threads);
+
+// runs task for every chunk in [0, chunks) and returns once all of them are finished,
+// calling thread processes chunks as well
+void poolRun(workPool *pool, int chunks, poolTask task, void *arg);
+
+#endif //FILE_INDEXER_POOL_H
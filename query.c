@@ -0,0 +1,811 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "indexer.h"
+#include "query.h"
+#include "pool.h"
+
+#define QUERY_MAX_TOKENS 256
+
+// full scans are split into chunks of that many entries, smaller snapshots are scanned by the calling thread only
+#define SCAN_CHUNK_ENTRIES 65536
+#define PARALLEL_SCAN_MIN_ENTRIES (2 * SCAN_CHUNK_ENTRIES)
+
+typedef struct token_s {
+    const char *start;
+    size_t length;
+    int quoted;
+} token;
+
+typedef struct parser_s {
+    token tokens[QUERY_MAX_TOKENS];
+    int count;
+    int next;
+    queryPlan *plan;
+    FILE *stream;
+    int failed;
+} parser;
+
+static void recordResult(resultRecord *r, const snapshot *s, int i) {
+    if (r->overflowed) return;
+    if (r->count == r->limit) {
+        r->overflowed = 1;
+        free(r->ids);
+        r->ids = NULL;
+        return;
+    }
+    if (r->count == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 256;
+        if (r->capacity > r->limit) r->capacity = r->limit;
+        r->ids = realloc(r->ids, r->capacity * sizeof(uint64_t));
+        if (r->ids == NULL) ERR("realloc");
+    }
+    int shard = 0;
+    while (shard < r->shardCount - 1 && r->shards[shard] != s) shard++;
+    r->ids[r->count++] = (uint64_t) shard << 32 | (uint32_t) i;
+}
+
+void writeEntry(resultWriter *w, const snapshot *s, pathCache *paths, int i, const indexedFile *entry) {
+    if (w->record != NULL) recordResult(w->record, s, i);
+    writeResult(w, snapshotEntryPath(s, paths, i), entry->size, entry->fileType);
+}
+
+// words, quoted strings, parentheses and comparison operators; returns -1 if there are too many
+static int tokenize(const char *line, parser *p) {
+    const char *c = line;
+    while (1) {
+        while (isspace((unsigned char) *c)) c++;
+        if (*c == '\0') return 0;
+        if (p->count == QUERY_MAX_TOKENS) return -1;
+        token *t = &p->tokens[p->count++];
+        t->quoted = 0;
+        t->start = c;
+        if (*c == '(' || *c == ')') {
+            c++;
+        } else if (strchr("<>=!", *c) != NULL) {
+            while (*c != '\0' && strchr("<>=!", *c) != NULL) c++;
+        } else if (*c == '"') {
+            t->quoted = 1;
+            t->start = ++c;
+            while (*c != '\0' && *c != '"') c++;
+            t->length = c - t->start;
+            if (*c == '"') c++;
+            continue;
+        } else {
+            while (*c != '\0' && !isspace((unsigned char) *c) && strchr("()<>=!\"", *c) == NULL) c++;
+        }
+        t->length = c - t->start;
+    }
+}
+
+static void fail(parser *p, const char *message) {
+    if (p->failed) return;
+    p->failed = 1;
+    if (p->stream == NULL) return;
+    if (p->next < p->count) {
+        const token *t = &p->tokens[p->next];
+        fprintf(p->stream, "Query error: %s near '%.*s'\n", message, (int) t->length, t->start);
+    } else {
+        fprintf(p->stream, "Query error: %s at end of query\n", message);
+    }
+}
+
+// next token is the unquoted keyword word
+static int peekWord(parser *p, const char *word) {
+    if (p->next >= p->count) return 0;
+    const token *t = &p->tokens[p->next];
+    return !t->quoted && t->length == strlen(word) && strncasecmp(t->start, word, t->length) == 0;
+}
+
+static int acceptWord(parser *p, const char *word) {
+    if (!peekWord(p, word)) return 0;
+    p->next++;
+    return 1;
+}
+
+static const token *nextToken(parser *p, const char *expected) {
+    if (p->next >= p->count) {
+        fail(p, expected);
+        return NULL;
+    }
+    return &p->tokens[p->next++];
+}
+
+static const char *copyText(parser *p, const token *t) {
+    queryPlan *plan = p->plan;
+    // tokens never overlap and are shorter than the line, so they always fit
+    char *copy = plan->buffer + plan->bufferUsed;
+    memcpy(copy, t->start, t->length);
+    copy[t->length] = '\0';
+    plan->bufferUsed += t->length + 1;
+    return copy;
+}
+
+static int addNode(parser *p, int kind, int left, int right) {
+    queryPlan *plan = p->plan;
+    if (plan->nodeCount == QUERY_MAX_NODES) {
+        fail(p, "too many conditions");
+        return -1;
+    }
+    queryNode *node = &plan->nodes[plan->nodeCount];
+    memset(node, 0, sizeof(queryNode));
+    node->kind = kind;
+    node->left = left;
+    node->right = right;
+    return plan->nodeCount++;
+}
+
+// integer with optional K, M, G or T suffix (powers of 1024), returns -1 if token is not one
+static int parseNumber(const token *t, int64_t *value) {
+    char text[32];
+    if (t->length == 0 || t->length >= sizeof(text)) return -1;
+    memcpy(text, t->start, t->length);
+    text[t->length] = '\0';
+    char *end;
+    long long number = strtoll(text, &end, 10);
+    if (end == text) return -1;
+    int shift = 0;
+    switch (toupper((unsigned char) *end)) {
+        case 'K':
+            shift = 10;
+            break;
+        case 'M':
+            shift = 20;
+            break;
+        case 'G':
+            shift = 30;
+            break;
+        case 'T':
+            shift = 40;
+            break;
+    }
+    if (shift != 0) end++;
+    if (shift != 0 && toupper((unsigned char) *end) == 'B') end++;
+    if (*end != '\0') return -1;
+    *value = (int64_t) number * ((int64_t) 1 << shift);
+    return 0;
+}
+
+static int parseSize(parser *p) {
+    const token *op = nextToken(p, "expected comparison after size");
+    const token *number = nextToken(p, "expected size");
+    int64_t value;
+    if (op == NULL || number == NULL) return -1;
+    if (parseNumber(number, &value) < 0) {
+        p->next--;
+        fail(p, "expected size");
+        return -1;
+    }
+    int node = addNode(p, NODE_SIZE, -1, -1);
+    if (node < 0) return -1;
+    queryNode *n = &p->plan->nodes[node];
+    n->min = INT64_MIN;
+    n->max = INT64_MAX;
+    if (op->length == 1 && op->start[0] == '>') {
+        n->min = value + 1;
+    } else if (op->length == 2 && strncmp(op->start, ">=", 2) == 0) {
+        n->min = value;
+    } else if (op->length == 1 && op->start[0] == '<') {
+        n->max = value - 1;
+    } else if (op->length == 2 && strncmp(op->start, "<=", 2) == 0) {
+        n->max = value;
+    } else if ((op->length == 1 && op->start[0] == '=') || (op->length == 2 && strncmp(op->start, "==", 2) == 0)) {
+        n->min = n->max = value;
+    } else {
+        p->next -= 2;
+        fail(p, "expected one of > >= < <= =");
+        return -1;
+    }
+    return node;
+}
+
+static int parseOr(parser *p);
+
+static int parsePrimary(parser *p) {
+    if (acceptWord(p, "(")) {
+        int node = parseOr(p);
+        if (node >= 0 && !acceptWord(p, ")")) {
+            fail(p, "expected )");
+            return -1;
+        }
+        return node;
+    }
+    if (acceptWord(p, "size")) return parseSize(p);
+
+    int kind;
+    if (acceptWord(p, "name")) {
+        kind = NODE_NAME;
+    } else if (acceptWord(p, "path")) {
+        kind = NODE_PATH;
+    } else if (acceptWord(p, "owner")) {
+        kind = NODE_OWNER;
+    } else if (acceptWord(p, "type")) {
+        kind = NODE_TYPE;
+    } else {
+        fail(p, "expected size, name, path, owner or type");
+        return -1;
+    }
+    const token *value = nextToken(p, "expected value");
+    if (value == NULL) return -1;
+    int node = addNode(p, kind, -1, -1);
+    if (node < 0) return -1;
+    queryNode *n = &p->plan->nodes[node];
+    if (kind == NODE_NAME || kind == NODE_PATH) {
+        n->text = copyText(p, value);
+        n->length = value->length;
+        // path prefix matches directory itself and everything below it
+        while (kind == NODE_PATH && n->length > 1 && n->text[n->length - 1] == '/') n->length--;
+    } else if (kind == NODE_OWNER) {
+        int64_t uid;
+        if (parseNumber(value, &uid) < 0 || uid < 0) {
+            p->next--;
+            fail(p, "expected uid");
+            return -1;
+        }
+        n->UID = (uid_t) uid;
+    } else {
+        const char *name = copyText(p, value);
+        n->fileType = strcmp(name, "directory") == 0 ? TYPE_DIRECTORY : typeFromName(name);
+        if (n->fileType == TYPE_NONE) {
+            p->next--;
+            fail(p, "expected a type name (see -T) or directory");
+            return -1;
+        }
+    }
+    return node;
+}
+
+static int parseNot(parser *p) {
+    if (acceptWord(p, "not")) {
+        int child = parseNot(p);
+        return child < 0 ? -1 : addNode(p, NODE_NOT, child, -1);
+    }
+    return parsePrimary(p);
+}
+
+static int parseAnd(parser *p) {
+    int node = parseNot(p);
+    while (node >= 0 && acceptWord(p, "and")) {
+        int right = parseNot(p);
+        node = right < 0 ? -1 : addNode(p, NODE_AND, node, right);
+    }
+    return node;
+}
+
+static int parseOr(parser *p) {
+    int node = parseAnd(p);
+    while (node >= 0 && acceptWord(p, "or")) {
+        int right = parseAnd(p);
+        node = right < 0 ? -1 : addNode(p, NODE_OR, node, right);
+    }
+    return node;
+}
+
+static int isModifier(parser *p) {
+    return p->next >= p->count || peekWord(p, "sort") || peekWord(p, "limit") || peekWord(p, "offset") ||
+           peekWord(p, "after") || peekWord(p, "format") || peekWord(p, "count") || peekWord(p, "explain");
+}
+
+// cursor is generation of snapshot and number of results already printed, e.g. 12.500
+static int parseCursor(const token *t, queryPlan *plan) {
+    char text[48];
+    if (t->length >= sizeof(text)) return -1;
+    memcpy(text, t->start, t->length);
+    text[t->length] = '\0';
+    unsigned long generation;
+    long offset;
+    char end;
+    if (sscanf(text, "%lu.%ld%c", &generation, &offset, &end) != 2 || offset < 0) return -1;
+    plan->hasCursor = 1;
+    plan->cursorGeneration = generation;
+    plan->offset = offset;
+    return 0;
+}
+
+static void parseModifiers(parser *p) {
+    queryPlan *plan = p->plan;
+    while (!p->failed && p->next < p->count) {
+        if (acceptWord(p, "sort")) {
+            if (!acceptWord(p, "by")) {
+                fail(p, "expected by");
+                return;
+            }
+            if (acceptWord(p, "size")) {
+                plan->sort = SORT_SIZE;
+            } else if (acceptWord(p, "name")) {
+                plan->sort = SORT_NAME;
+            } else if (acceptWord(p, "path")) {
+                plan->sort = SORT_PATH;
+            } else {
+                fail(p, "expected size, name or path");
+                return;
+            }
+            if (acceptWord(p, "desc")) {
+                plan->descending = 1;
+            } else {
+                acceptWord(p, "asc");
+            }
+        } else if (acceptWord(p, "limit")) {
+            int64_t limit;
+            if (p->next >= p->count || parseNumber(&p->tokens[p->next], &limit) < 0 || limit < 0) {
+                fail(p, "expected number of results");
+                return;
+            }
+            p->next++;
+            plan->limit = (long) limit;
+        } else if (acceptWord(p, "offset")) {
+            int64_t offset;
+            if (p->next >= p->count || parseNumber(&p->tokens[p->next], &offset) < 0 || offset < 0) {
+                fail(p, "expected number of skipped results");
+                return;
+            }
+            p->next++;
+            plan->offset = (long) offset;
+        } else if (acceptWord(p, "after")) {
+            if (p->next >= p->count || parseCursor(&p->tokens[p->next], plan) < 0) {
+                fail(p, "expected cursor");
+                return;
+            }
+            p->next++;
+        } else if (acceptWord(p, "format")) {
+            if (acceptWord(p, "text")) {
+                plan->format = OUTPUT_TEXT;
+            } else if (acceptWord(p, "nul")) {
+                plan->format = OUTPUT_NUL;
+            } else if (acceptWord(p, "json")) {
+                plan->format = OUTPUT_JSON;
+            } else {
+                fail(p, "expected text, nul or json");
+                return;
+            }
+        } else if (acceptWord(p, "count")) {
+            plan->countOnly = 1;
+        } else if (acceptWord(p, "explain")) {
+            plan->explain = 1;
+        } else {
+            fail(p, "expected sort, limit, offset, after, format, count or explain");
+            return;
+        }
+    }
+}
+
+int parseQuery(const char *line, queryPlan *plan, FILE *stream) {
+    parser *p = calloc(1, sizeof(parser));
+    if (p == NULL) ERR("calloc");
+    memset(plan, 0, sizeof(queryPlan));
+    plan->root = -1;
+    plan->limit = -1;
+    p->plan = plan;
+    p->stream = stream;
+
+    if (strlen(line) >= sizeof(plan->buffer)) {
+        fail(p, "query too long");
+    } else if (tokenize(line, p) < 0) {
+        fail(p, "too many words");
+    } else {
+        // query with modifiers only matches every entry
+        if (!isModifier(p)) plan->root = parseOr(p);
+        parseModifiers(p);
+    }
+    int ret = p->failed ? -1 : 0;
+    free(p);
+    return ret;
+}
+
+// conditions which every result has to meet, i.e. leaves reachable from root through AND nodes only
+static void collectConjuncts(const queryPlan *plan, int node, int *conjuncts, int *count) {
+    if (node < 0) return;
+    const queryNode *n = &plan->nodes[node];
+    if (n->kind == NODE_AND) {
+        collectConjuncts(plan, n->left, conjuncts, count);
+        collectConjuncts(plan, n->right, conjuncts, count);
+    } else {
+        conjuncts[(*count)++] = node;
+    }
+}
+
+static long trigramEstimate(const snapshot *s, const char *name) {
+    size_t length = strlen(name), smallest = SIZE_MAX;
+    for (size_t j = 0; j + 3 <= length; j++) {
+        const uint32_t *list;
+        size_t count = indexFileTrigramList(&s->base->file, trigramAt(name + j), &list);
+        if (count < smallest) smallest = count;
+    }
+    return (long) smallest + s->addedCount;
+}
+
+void planQuery(queryPlan *plan, const snapshot *s) {
+    int conjuncts[QUERY_MAX_NODES], count = 0;
+    collectConjuncts(plan, plan->root, conjuncts, &count);
+
+    plan->minSize = INT64_MIN;
+    plan->maxSize = INT64_MAX;
+    plan->fileType = TYPE_NONE;
+    plan->hasOwner = 0;
+    plan->name = NULL;
+    const char *shortName = NULL;
+    int hasSize = 0;
+    for (int i = 0; i < count; i++) {
+        const queryNode *n = &plan->nodes[conjuncts[i]];
+        if (n->kind == NODE_SIZE) {
+            hasSize = 1;
+            if (n->min > plan->minSize) plan->minSize = n->min;
+            if (n->max < plan->maxSize) plan->maxSize = n->max;
+        } else if (n->kind == NODE_TYPE && plan->fileType == TYPE_NONE) {
+            plan->fileType = n->fileType;
+        } else if (n->kind == NODE_OWNER && !plan->hasOwner) {
+            plan->hasOwner = 1;
+            plan->UID = n->UID;
+        } else if (n->kind == NODE_NAME && n->length >= 3 && (plan->name == NULL || n->length > strlen(plan->name))) {
+            // longer parts have more trigrams to intersect
+            plan->name = n->text;
+        } else if (n->kind == NODE_NAME && n->length < 3) {
+            shortName = n->text;
+        }
+    }
+
+    plan->access = ACCESS_SCAN;
+    plan->estimate = snapshotLiveCount(s);
+    if (hasSize) {
+        size_t first, last;
+        indexFileSizeRange(&s->base->file, plan->minSize, plan->maxSize, &first, &last);
+        long estimate = (long) (last - first) + s->addedCount;
+        if (estimate < plan->estimate) {
+            plan->access = ACCESS_SIZE_ORDER;
+            plan->estimate = estimate;
+        }
+    }
+    if (plan->fileType != TYPE_NONE || plan->hasOwner) {
+        long estimate = LONG_MAX;
+        if (plan->fileType != TYPE_NONE) estimate = snapshotTypeCount(s, plan->fileType);
+        if (plan->hasOwner) {
+            const uint32_t *list;
+            long owned = (long) indexFileOwnerList(&s->base->file, plan->UID, &list) + s->addedCount;
+            if (owned < estimate) estimate = owned;
+        }
+        if (estimate < plan->estimate) {
+            plan->access = ACCESS_POSTINGS;
+            plan->estimate = estimate;
+        }
+    }
+    if (plan->name != NULL) {
+        long estimate = trigramEstimate(s, plan->name);
+        if (estimate < plan->estimate) {
+            plan->access = ACCESS_TRIGRAMS;
+            plan->estimate = estimate;
+        }
+    }
+    // names stored one after another are searched faster than entries are checked one by one,
+    // unless the snapshot is large enough to be scanned by many threads
+    if (plan->access == ACCESS_SCAN && shortName != NULL && snapshotSize(s) < PARALLEL_SCAN_MIN_ENTRIES) {
+        plan->access = ACCESS_NAME_SCAN;
+        plan->name = shortName;
+    }
+}
+
+void namePlan(queryPlan *plan, const char *name) {
+    memset(plan, 0, sizeof(queryPlan));
+    plan->limit = -1;
+    plan->root = 0;
+    plan->nodeCount = 1;
+    plan->nodes[0].kind = NODE_NAME;
+    plan->nodes[0].text = name;
+    plan->nodes[0].length = strlen(name);
+}
+
+static int isBelow(const char *path, const char *prefix, size_t length) {
+    return strncmp(path, prefix, length) == 0 && (path[length] == '\0' || path[length] == '/' ||
+                                                  (length > 0 && prefix[length - 1] == '/'));
+}
+
+static int matches(const queryPlan *plan, int node, const snapshot *s, pathCache *paths, int i,
+                   const indexedFile *entry) {
+    const queryNode *n = &plan->nodes[node];
+    switch (n->kind) {
+        case NODE_AND:
+            return matches(plan, n->left, s, paths, i, entry) && matches(plan, n->right, s, paths, i, entry);
+        case NODE_OR:
+            return matches(plan, n->left, s, paths, i, entry) || matches(plan, n->right, s, paths, i, entry);
+        case NODE_NOT:
+            return !matches(plan, n->left, s, paths, i, entry);
+        case NODE_SIZE:
+            return entry->size >= n->min && entry->size <= n->max;
+        case NODE_NAME:
+            return strstr(entry->fileName, n->text) != NULL;
+        case NODE_OWNER:
+            return entry->UID == n->UID;
+        case NODE_TYPE:
+            return entry->fileType == n->fileType;
+        case NODE_PATH:
+            return isBelow(snapshotEntryPath(s, paths, i), n->text, n->length);
+        default:
+            return 0;
+    }
+}
+
+// one of the cursors of snapshot, chosen by plan
+typedef struct planCursor_s {
+    int next;
+    sizeCursor size;
+    postingCursor postings;
+    nameCursor name;
+} planCursor;
+
+static void startCursor(const queryPlan *plan, const snapshot *s, planCursor *cursor) {
+    cursor->next = 0;
+    if (plan->access == ACCESS_SIZE_ORDER) {
+        snapshotSizeRange(s, plan->minSize, plan->maxSize, &cursor->size);
+    } else if (plan->access == ACCESS_POSTINGS) {
+        snapshotPostings(s, plan->fileType, plan->hasOwner ? &plan->UID : NULL, &cursor->postings);
+    } else if (plan->access == ACCESS_TRIGRAMS || plan->access == ACCESS_NAME_SCAN) {
+        snapshotNameSearch(s, plan->name, &cursor->name);
+    }
+}
+
+static int nextCandidate(const queryPlan *plan, const snapshot *s, planCursor *cursor) {
+    switch (plan->access) {
+        case ACCESS_SIZE_ORDER:
+            return snapshotSizeNext(s, &cursor->size);
+        case ACCESS_POSTINGS:
+            return snapshotPostingNext(s, &cursor->postings);
+        case ACCESS_TRIGRAMS:
+        case ACCESS_NAME_SCAN:
+            return snapshotNameNext(s, &cursor->name);
+        default:
+            return cursor->next < snapshotSize(s) ? cursor->next++ : -1;
+    }
+}
+
+// matching positions of one chunk of a parallel scan, at most cap of them are kept (all if cap < 0)
+typedef struct scanChunk_s {
+    int *positions;
+    size_t count;
+    size_t capacity;
+    long matched;
+} scanChunk;
+
+typedef struct parallelScan_s {
+    const snapshot *s;
+    const queryPlan *plan;
+    long cap;
+    scanChunk *chunks;
+    int chunkCount;
+} parallelScan;
+
+static workPool scanPool;
+static int scanThreads;
+static pthread_once_t scanPoolOnce = PTHREAD_ONCE_INIT;
+
+// pool is started by the first large scan, calling thread is one of the scanning threads
+static void startScanPool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    scanThreads = cpus > 1 ? (int) cpus : 1;
+    if (scanThreads > 1) startPool(&scanPool, scanThreads - 1);
+}
+
+static void scanChunkTask(void *arg, int chunk) {
+    parallelScan *scan = arg;
+    scanChunk *c = &scan->chunks[chunk];
+    int first = chunk * SCAN_CHUNK_ENTRIES, last = snapshotSize(scan->s);
+    if (last - first > SCAN_CHUNK_ENTRIES) last = first + SCAN_CHUNK_ENTRIES;
+
+    indexedFile entry;
+    pathCache paths;
+    initSnapshotPathCache(scan->s, &paths);
+    for (int i = first; i < last; i++) {
+        if (!snapshotEntry(scan->s, i, &entry)) continue;
+        if (scan->plan->root >= 0 && !matches(scan->plan, scan->plan->root, scan->s, &paths, i, &entry)) continue;
+        c->matched++;
+        if (scan->cap >= 0 && (long) c->count >= scan->cap) continue;
+        if (c->count == c->capacity) {
+            c->capacity = c->capacity ? c->capacity * 2 : 256;
+            c->positions = realloc(c->positions, c->capacity * sizeof(int));
+            if (c->positions == NULL) ERR("realloc");
+        }
+        c->positions[c->count++] = i;
+    }
+    freePathCache(&paths);
+}
+
+// candidates of plan which match its expression, in index order
+typedef struct matchCursor_s {
+    planCursor candidates;
+    int parallel;
+    parallelScan scan;
+    int chunk;
+    size_t next;
+} matchCursor;
+
+// full scan of a large snapshot runs on the pool and yields results gathered by chunks, in order of chunks
+static void startMatches(const queryPlan *plan, const snapshot *s, long cap, matchCursor *cursor) {
+    memset(cursor, 0, sizeof(matchCursor));
+    if (plan->access == ACCESS_SCAN && snapshotSize(s) >= PARALLEL_SCAN_MIN_ENTRIES) {
+        pthread_once(&scanPoolOnce, startScanPool);
+        cursor->parallel = scanThreads > 1;
+    }
+    if (!cursor->parallel) {
+        startCursor(plan, s, &cursor->candidates);
+        return;
+    }
+    parallelScan *scan = &cursor->scan;
+    scan->s = s;
+    scan->plan = plan;
+    scan->cap = cap;
+    scan->chunkCount = (snapshotSize(s) + SCAN_CHUNK_ENTRIES - 1) / SCAN_CHUNK_ENTRIES;
+    scan->chunks = calloc(scan->chunkCount, sizeof(scanChunk));
+    if (scan->chunks == NULL) ERR("calloc");
+    poolRun(&scanPool, scan->chunkCount, scanChunkTask, scan);
+}
+
+static int nextMatch(const queryPlan *plan, const snapshot *s, pathCache *paths, matchCursor *cursor,
+                     indexedFile *entry) {
+    int i;
+    if (cursor->parallel) {
+        while (cursor->chunk < cursor->scan.chunkCount) {
+            scanChunk *c = &cursor->scan.chunks[cursor->chunk];
+            if (cursor->next < c->count) {
+                i = c->positions[cursor->next++];
+                snapshotEntry(s, i, entry);
+                return i;
+            }
+            cursor->chunk++;
+            cursor->next = 0;
+        }
+        return -1;
+    }
+    while ((i = nextCandidate(plan, s, &cursor->candidates)) >= 0) {
+        if (!snapshotEntry(s, i, entry)) continue;
+        if (plan->root >= 0 && !matches(plan, plan->root, s, paths, i, entry)) continue;
+        return i;
+    }
+    return -1;
+}
+
+static void freeMatches(matchCursor *cursor) {
+    freeSizeCursor(&cursor->candidates.size);
+    for (int j = 0; j < cursor->scan.chunkCount; j++) free(cursor->scan.chunks[j].positions);
+    free(cursor->scan.chunks);
+}
+
+typedef struct sortKey_s {
+    int shard;
+    int position;
+    int64_t size;
+    const char *text;
+} sortKey;
+
+// equal keys keep index order, shard by shard
+static int compareKeys(const void *a, const void *b) {
+    const sortKey *x = a, *y = b;
+    int order = 0;
+    if (x->text != NULL) {
+        order = strcmp(x->text, y->text);
+    } else {
+        order = (x->size > y->size) - (x->size < y->size);
+    }
+    if (order == 0) order = (x->shard > y->shard) - (x->shard < y->shard);
+    return order != 0 ? order : (x->position > y->position) - (x->position < y->position);
+}
+
+static const char *accessNames[] = {"full scan", "size order", "type and owner posting lists", "name trigrams",
+                                    "scan of names"};
+
+// one past the last printed result was found, next page starts there
+static void writeCursor(resultWriter *w, unsigned long generation, long offset) {
+    if (w->format == OUTPUT_JSON) {
+        writeText(w, "{\"cursor\":\"%lu.%ld\"}\n", generation, offset);
+    } else if (w->format == OUTPUT_TEXT) {
+        writeText(w, "next page: after %lu.%ld\n", generation, offset);
+    }
+}
+
+unsigned long shardsGeneration(const snapshot *const *shards, int shardCount) {
+    unsigned long generation = 0;
+    for (int k = 0; k < shardCount; k++) generation += shards[k]->generation;
+    return generation;
+}
+
+int runPlan(resultWriter *w, const snapshot *const *shards, int shardCount, queryPlan *plan) {
+    if (plan->explain) {
+        for (int k = 0; k < shardCount; k++) {
+            const snapshot *s = shards[k];
+            planQuery(plan, s);
+            if (shardCount > 1) writeText(w, "shard %d: ", k + 1);
+            writeText(w, "access path: %s, about %ld candidates of %d entries", accessNames[plan->access],
+                      plan->estimate, snapshotLiveCount(s));
+            if (plan->access == ACCESS_SCAN && snapshotSize(s) >= PARALLEL_SCAN_MIN_ENTRIES) {
+                writeText(w, ", scanned in chunks of %d entries in parallel", SCAN_CHUNK_ENTRIES);
+            }
+            writeText(w, "\n");
+        }
+        return 1;
+    }
+    // offsets count results of the snapshots the cursor came from, index changed since then
+    unsigned long generation = shardsGeneration(shards, shardCount);
+    if (plan->hasCursor && plan->cursorGeneration != generation && w->format == OUTPUT_TEXT) {
+        writeText(w, "index changed since cursor was issued, results may repeat or be skipped\n");
+    }
+    long limit = plan->limit;
+    // last result to print, one more is looked for to tell whether there is a next page
+    long end = limit < 0 ? -1 : plan->offset + limit;
+
+    indexedFile entry;
+    pathCache *paths = malloc(shardCount * sizeof(pathCache));
+    if (paths == NULL) ERR("malloc");
+    matchCursor cursor;
+    sortKey *keys = NULL;
+    size_t keyCount = 0, keyCapacity = 0;
+    stringArena strings = {0};
+    long matched = 0, position = 0;
+    int found = 0, truncated = 0, i;
+    for (int k = 0; k < shardCount; k++) initSnapshotPathCache(shards[k], &paths[k]);
+    // shards are planned and walked one after another, unsorted results come in shard order
+    for (int k = 0; k < shardCount && !truncated; k++) {
+        const snapshot *s = shards[k];
+        planQuery(plan, s);
+        // chunks of a parallel scan keep only what can be printed: nothing for count, page and one more if unsorted
+        startMatches(plan, s, plan->countOnly ? 0 : plan->sort == SORT_NONE && end >= 0 ? end + 1 : -1, &cursor);
+        for (int j = 0; j < cursor.scan.chunkCount; j++) matched += cursor.scan.chunks[j].matched;
+
+        while ((i = nextMatch(plan, s, &paths[k], &cursor, &entry)) >= 0) {
+            if (plan->countOnly) {
+                matched++;
+            } else if (plan->sort != SORT_NONE) {
+                if (keyCount == keyCapacity) {
+                    keyCapacity = keyCapacity ? keyCapacity * 2 : 256;
+                    keys = realloc(keys, keyCapacity * sizeof(sortKey));
+                    if (keys == NULL) ERR("realloc");
+                }
+                sortKey *key = &keys[keyCount++];
+                key->shard = k;
+                key->position = i;
+                key->size = entry.size;
+                key->text = NULL;
+                if (plan->sort == SORT_NAME) key->text = entry.fileName;
+                if (plan->sort == SORT_PATH) {
+                    const char *path = snapshotEntryPath(s, &paths[k], i);
+                    key->text = arenaCopy(&strings, path, strlen(path));
+                }
+            } else {
+                if (position == end) {
+                    truncated = 1;
+                    break;
+                }
+                if (position++ < plan->offset) continue;
+                writeEntry(w, s, &paths[k], i, &entry);
+                found++;
+            }
+        }
+        freeMatches(&cursor);
+    }
+
+    if (plan->countOnly) {
+        if (w->format == OUTPUT_JSON) {
+            writeText(w, "{\"count\":%ld}\n", matched);
+        } else {
+            writeText(w, w->format == OUTPUT_NUL ? "%ld%c" : "%ld\n", matched, '\0');
+        }
+        found = 1;
+    } else if (plan->sort != SORT_NONE) {
+        qsort(keys, keyCount, sizeof(sortKey), compareKeys);
+        size_t j = (size_t) plan->offset;
+        for (; j < keyCount && (end < 0 || (long) j < end); j++) {
+            const sortKey *key = &keys[plan->descending ? keyCount - 1 - j : j];
+            snapshotEntry(shards[key->shard], key->position, &entry);
+            writeEntry(w, shards[key->shard], &paths[key->shard], key->position, &entry);
+            found++;
+        }
+        truncated = j < keyCount;
+    }
+    if (truncated) writeCursor(w, generation, end);
+    free(keys);
+    freeArena(&strings);
+    for (int k = 0; k < shardCount; k++) freePathCache(&paths[k]);
+    free(paths);
+    return found;
+}
@@ -0,0 +1,121 @@
+#ifndef FILE_INDEXER_QUERY_H
+#define FILE_INDEXER_QUERY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "snapshot.h"
+#include "output.h"
+
+#define QUERY_MAX_NODES 64
+#define QUERY_MAX_LENGTH 4096
+
+enum queryNodeKind {
+    NODE_AND,
+    NODE_OR,
+    NODE_NOT,
+    NODE_SIZE,
+    NODE_NAME,
+    NODE_OWNER,
+    NODE_TYPE,
+    NODE_PATH
+};
+
+// node of expression tree, children are positions in the node array
+typedef struct queryNode_s {
+    int kind;
+    int left;
+    int right;
+    // size in [min, max]
+    int64_t min;
+    int64_t max;
+    // part of name or path prefix, points into buffer of plan
+    const char *text;
+    size_t length;
+    uid_t UID;
+    int fileType;
+} queryNode;
+
+enum querySort {
+    SORT_NONE,
+    SORT_SIZE,
+    SORT_NAME,
+    SORT_PATH
+};
+
+// how candidates are found, the whole expression is then checked on each of them
+enum queryAccess {
+    ACCESS_SCAN,
+    ACCESS_SIZE_ORDER,
+    ACCESS_POSTINGS,
+    ACCESS_TRIGRAMS,
+    // all names searched for a part shorter than a trigram
+    ACCESS_NAME_SCAN
+};
+
+typedef struct queryPlan_s {
+    queryNode nodes[QUERY_MAX_NODES];
+    int nodeCount;
+    int root;
+    int sort;
+    int descending;
+    // -1 for no limit
+    long limit;
+    // results skipped before the first printed one
+    long offset;
+    // set by after, generation of snapshot the cursor was issued for
+    int hasCursor;
+    unsigned long cursorGeneration;
+    int countOnly;
+    int explain;
+    int format;
+    // access path chosen by planQuery for a snapshot and the number of candidates it is expected to yield
+    int access;
+    long estimate;
+    int64_t minSize;
+    int64_t maxSize;
+    int fileType;
+    int hasOwner;
+    uid_t UID;
+    const char *name;
+    // NUL-terminated copies of names and paths of predicates
+    char buffer[QUERY_MAX_LENGTH];
+    size_t bufferUsed;
+} queryPlan;
+
+// parses expression with modifiers, e.g. "type png and size > 10M and not path /tmp sort by size desc limit 10",
+// returns -1 and prints reason to stream if line is malformed; a cursor printed when results were cut by limit
+// is given back with "after cursor" to get the next page
+int parseQuery(const char *line, queryPlan *plan, FILE *stream);
+
+// plan of namepart command, name has to outlive the plan
+void namePlan(queryPlan *plan, const char *name);
+
+// picks the access path expected to yield the fewest candidates from s
+void planQuery(queryPlan *plan, const snapshot *s);
+
+// ids of results written by a query over shards, shard index in upper and position in lower 32 bits;
+// the query cache keeps them in place of the output
+typedef struct resultRecord_s {
+    const snapshot *const *shards;
+    int shardCount;
+    uint64_t *ids;
+    size_t count;
+    size_t capacity;
+    // ids kept at most, recording stops and overflowed is set once output has more results
+    size_t limit;
+    int overflowed;
+} resultRecord;
+
+// writes path, size and type of i-th entry of s, its id is recorded when writer has a record
+void writeEntry(resultWriter *w, const snapshot *s, pathCache *paths, int i, const indexedFile *entry);
+
+// sum of generations of shards, changes whenever one of them publishes a new snapshot
+unsigned long shardsGeneration(const snapshot *const *shards, int shardCount);
+
+// plans query for each of shards in turn and writes results from all of them, returns their number; a full scan
+// of a large snapshot is split into chunks checked by a pool of threads and their results are printed in index
+// order, unsorted results of shards follow each other and sorted ones are merged
+int runPlan(resultWriter *w, const snapshot *const *shards, int shardCount, queryPlan *plan);
+
+#endif //FILE_INDEXER_QUERY_H
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "indexer.h"
+#include "server.h"
+
+#define SERVER_MAX_EVENTS 64
+
+// results are written in blocks of that size
+#define SERVER_STREAM_BUFFER 65536
+
+// writing blocks while the client's socket buffer is full, so a slow client slows down only its own query
+static ssize_t connectionWrite(void *cookie, const char *buffer, size_t size) {
+    connection *c = cookie;
+    size_t written = 0;
+    if (size > 0) c->last = buffer[size - 1];
+    while (!c->broken && written < size) {
+        ssize_t n = send(c->fd, buffer + written, size - written, MSG_NOSIGNAL);
+        if (n > 0) {
+            written += n;
+        } else if (n < 0 && errno == EAGAIN) {
+            struct pollfd p = {.fd = c->fd, .events = POLLOUT};
+            if (poll(&p, 1, SERVER_WRITE_TIMEOUT_MS) <= 0 || (p.revents & (POLLERR | POLLHUP))) c->broken = 1;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            c->broken = 1;
+        }
+    }
+    return c->broken ? -1 : (ssize_t) size;
+}
+
+static void closeConnection(connection *c) {
+    fclose(c->stream);
+    close(c->fd);
+    free(c);
+}
+
+static void enqueue(server *s, connection *c) {
+    pthread_mutex_lock(&s->lock);
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 64;
+        connection **queue = malloc(capacity * sizeof(connection *));
+        if (queue == NULL) ERR("malloc");
+        for (size_t i = 0; i < s->count; i++) queue[i] = s->queue[(s->head + i) % s->capacity];
+        free(s->queue);
+        s->queue = queue;
+        s->head = 0;
+        s->capacity = capacity;
+    }
+    s->queue[(s->head + s->count++) % s->capacity] = c;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// runs every complete line of buffer, returns -1 if connection has to be closed
+static int answerLines(server *s, connection *c) {
+    char *start = c->buffer, *end;
+    while ((end = memchr(start, '\n', c->buffer + c->used - start)) != NULL) {
+        *end = '\0';
+        if (end > start && end[-1] == '\r') end[-1] = '\0';
+        s->callbacks.command(start, c->stream, s->callbacks.arg);
+        // NUL separated results end without a newline, the empty line could not be told apart from them
+        fflush(c->stream);
+        if (c->last != '\n') fputc('\n', c->stream);
+        fputc('\n', c->stream);
+        fflush(c->stream);
+        if (c->broken) return -1;
+        start = end + 1;
+    }
+    c->used -= start - c->buffer;
+    memmove(c->buffer, start, c->used);
+    if (c->used == sizeof(c->buffer)) {
+        fprintf(c->stream, "Command too long\n\n");
+        fflush(c->stream);
+        return -1;
+    }
+    return 0;
+}
+
+// reads everything client sent so far, connection is watched again once it is drained
+static void serveConnection(server *s, connection *c) {
+    while (1) {
+        ssize_t n = recv(c->fd, c->buffer + c->used, sizeof(c->buffer) - c->used, 0);
+        if (n > 0) {
+            c->used += n;
+            if (answerLines(s, c) < 0) break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c};
+            if (epoll_ctl(s->epollFd, EPOLL_CTL_MOD, c->fd, &event) == 0) return;
+            break;
+        } else {
+            break;
+        }
+    }
+    closeConnection(c);
+}
+
+static void *serverWorkerRun(void *voidPtr) {
+    server *s = voidPtr;
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        while (s->count == 0 && !s->stopping) pthread_cond_wait(&s->ready, &s->lock);
+        if (s->count == 0) {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        connection *c = s->queue[s->head];
+        s->head = (s->head + 1) % s->capacity;
+        s->count--;
+        pthread_mutex_unlock(&s->lock);
+        serveConnection(s, c);
+    }
+}
+
+// a socket file which nobody listens on is left by a server which did not exit cleanly
+static int removeStaleSocket(const struct sockaddr_un *address) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int alive = connect(fd, (const struct sockaddr *) address, sizeof(*address)) == 0;
+    close(fd);
+    if (alive) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (unlink(address->sun_path) < 0 && errno != ENOENT) return -1;
+    return 0;
+}
+
+int startServer(server *s, const char *path, int workers, const serverCallbacks *callbacks) {
+    memset(s, 0, sizeof(server));
+    s->callbacks = *callbacks;
+    s->listenFd = s->epollFd = s->signalFd = -1;
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    if (removeStaleSocket(&address) < 0) return -1;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if ((s->signalFd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0) return -1;
+    if ((s->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+    if ((s->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (bind(s->listenFd, (struct sockaddr *) &address, sizeof(address)) < 0) return -1;
+    if (listen(s->listenFd, SOMAXCONN) < 0) return -1;
+    s->path = strdup(path);
+    if (s->path == NULL) ERR("strdup");
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &s->listenFd};
+    if (epoll_ctl(s->epollFd, EPOLL_CTL_ADD, s->listenFd, &event) < 0) return -1;
+    event.data.ptr = &s->signalFd;
+    if (epoll_ctl(s->epollFd, EPOLL_CTL_ADD, s->signalFd, &event) < 0) return -1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    s->workerCount = workers;
+    s->workers = malloc(workers * sizeof(pthread_t));
+    if (s->workers == NULL) ERR("malloc");
+    for (int i = 0; i < workers; i++) {
+        int err = pthread_create(&s->workers[i], NULL, serverWorkerRun, s);
+        if (err != 0) ERR("pthread_create");
+    }
+    return 0;
+}
+
+static void acceptClients(server *s) {
+    int fd;
+    while ((fd = accept4(s->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        connection *c = calloc(1, sizeof(connection));
+        if (c == NULL) ERR("calloc");
+        c->fd = fd;
+        c->last = '\n';
+        c->stream = fopencookie(c, "w", (cookie_io_functions_t) {.write = connectionWrite});
+        if (c->stream == NULL) ERR("fopencookie");
+        setvbuf(c->stream, NULL, _IOFBF, SERVER_STREAM_BUFFER);
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c};
+        if (epoll_ctl(s->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl");
+            closeConnection(c);
+        }
+    }
+    if (errno != EAGAIN && errno != EINTR) perror("accept");
+}
+
+void runServer(server *s) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(s->epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &s->signalFd) {
+                return;
+            } else if (events[i].data.ptr == &s->listenFd) {
+                acceptClients(s);
+            } else {
+                enqueue(s, events[i].data.ptr);
+            }
+        }
+    }
+}
+
+void stopServer(server *s) {
+    close(s->listenFd);
+    unlink(s->path);
+    free(s->path);
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,61 @@
+#ifndef FILE_INDEXER_SERVER_H
+#define FILE_INDEXER_SERVER_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// longest command line accepted from a client
+#define SERVER_MAX_LINE 4096
+
+// client which does not read its results for that long is disconnected
+#define SERVER_WRITE_TIMEOUT_MS 30000
+
+// how command lines read from clients are answered, called from worker threads at the same time
+typedef struct serverCallbacks_s {
+    // writes answer to line into stream, the server terminates it with an empty line
+    void (*command)(char *line, FILE *stream, void *arg);
+    void *arg;
+} serverCallbacks;
+
+typedef struct connection_s {
+    int fd;
+    FILE *stream;
+    // set once client stopped reading or went away, the rest of the answer is dropped
+    int broken;
+    // last byte sent, an answer not ending with a newline gets one before the empty line ending it
+    char last;
+    char buffer[SERVER_MAX_LINE];
+    size_t used;
+} connection;
+
+// connections are watched with epoll by one thread and handed to a pool of workers when they have input,
+// each connection is served by one worker at a time so its answers keep the order of its commands
+typedef struct server_s {
+    int listenFd;
+    int epollFd;
+    int signalFd;
+    char *path;
+    pthread_t *workers;
+    int workerCount;
+    // connections with input waiting for a worker
+    connection **queue;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int stopping;
+    serverCallbacks callbacks;
+} server;
+
+// listens on unix socket at path and starts workers, returns -1 and sets errno on failure;
+// SIGINT and SIGTERM have to be blocked in all threads, runServer returns once one of them arrives
+int startServer(server *s, const char *path, int workers, const serverCallbacks *callbacks);
+
+// accepts clients and dispatches their input until SIGINT or SIGTERM
+void runServer(server *s);
+
+// stops accepting clients and removes socket file, commands being answered are left to finish
+void stopServer(server *s);
+
+#endif //FILE_INDEXER_SERVER_H
@@ -0,0 +1,302 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "signature.h"
+#include "index.h"
+
+// signatures matched at once, sets of them are bitmaps of that many bits
+#define SIGNATURE_SET_WORDS 2
+#define MAX_SIGNATURES (64 * SIGNATURE_SET_WORDS)
+
+// bytes at offset identifying a type, '.' in mask marks bytes which may hold anything
+typedef struct fileSignature_s {
+    int type;
+    unsigned offset;
+    const char *bytes;
+    unsigned length;
+    const char *mask;
+} fileSignature;
+
+#define SIGNATURE(type, offset, bytes) {type, offset, bytes, sizeof(bytes) - 1, NULL}
+#define MASKED_SIGNATURE(type, offset, bytes, mask) {type, offset, bytes, sizeof(bytes) - 1, mask}
+
+// several signatures of one type are alternatives, string literals are split where a hex escape would eat a letter
+static const fileSignature signatures[] = {
+        SIGNATURE(TYPE_JPEG, 0, "\xff\xd8\xff"),
+        SIGNATURE(TYPE_PNG, 0, "\x89PN"),
+        SIGNATURE(TYPE_ZIP, 0, "PK"),
+        SIGNATURE(TYPE_GZIP, 0, "\x1f\x8b"),
+        SIGNATURE(TYPE_PDF, 0, "%PDF-"),
+        SIGNATURE(TYPE_ELF, 0, "\x7f" "ELF"),
+        SIGNATURE(TYPE_TAR, 257, "ustar"),
+        SIGNATURE(TYPE_ZSTD, 0, "\x28\xb5\x2f\xfd"),
+        SIGNATURE(TYPE_XZ, 0, "\xfd" "7zXZ\0"),
+        SIGNATURE(TYPE_BZIP2, 0, "BZh"),
+        SIGNATURE(TYPE_MP4, 4, "ftyp"),
+        SIGNATURE(TYPE_HEIC, 4, "ftypheic"),
+        SIGNATURE(TYPE_HEIC, 4, "ftypheix"),
+        SIGNATURE(TYPE_AVIF, 4, "ftypavif"),
+        MASKED_SIGNATURE(TYPE_WEBP, 0, "RIFF....WEBP", "xxxx....xxxx"),
+        SIGNATURE(TYPE_GIF, 0, "GIF8"),
+        SIGNATURE(TYPE_BMP, 0, "BM"),
+        SIGNATURE(TYPE_TIFF, 0, "II*\0"),
+        SIGNATURE(TYPE_TIFF, 0, "MM\0*"),
+        SIGNATURE(TYPE_7Z, 0, "7z\xbc\xaf\x27\x1c"),
+        SIGNATURE(TYPE_RAR, 0, "Rar!\x1a\x07"),
+        SIGNATURE(TYPE_MP3, 0, "ID3"),
+        SIGNATURE(TYPE_OGG, 0, "OggS"),
+        SIGNATURE(TYPE_FLAC, 0, "fLaC"),
+        MASKED_SIGNATURE(TYPE_WAV, 0, "RIFF....WAVE", "xxxx....xxxx"),
+        MASKED_SIGNATURE(TYPE_AVI, 0, "RIFF....AVI ", "xxxx....xxxx"),
+        SIGNATURE(TYPE_MKV, 0, "\x1a\x45\xdf\xa3"),
+        SIGNATURE(TYPE_MIDI, 0, "MThd"),
+        SIGNATURE(TYPE_SQLITE, 0, "SQLite format 3\0"),
+        SIGNATURE(TYPE_WASM, 0, "\0asm"),
+        SIGNATURE(TYPE_PE, 0, "MZ"),
+        SIGNATURE(TYPE_MACHO, 0, "\xcf\xfa\xed\xfe"),
+        SIGNATURE(TYPE_MACHO, 0, "\xce\xfa\xed\xfe"),
+        SIGNATURE(TYPE_MACHO, 0, "\xfe\xed\xfa\xcf"),
+        SIGNATURE(TYPE_MACHO, 0, "\xfe\xed\xfa\xce"),
+        SIGNATURE(TYPE_CLASS, 0, "\xca\xfe\xba\xbe"),
+        SIGNATURE(TYPE_PSD, 0, "8BPS"),
+        SIGNATURE(TYPE_PS, 0, "%!PS"),
+        SIGNATURE(TYPE_RTF, 0, "{\\rtf"),
+        SIGNATURE(TYPE_LZ4, 0, "\x04\x22\x4d\x18"),
+        SIGNATURE(TYPE_DEB, 0, "!<arch>\ndebian"),
+        SIGNATURE(TYPE_RPM, 0, "\xed\xab\xee\xdb"),
+        SIGNATURE(TYPE_WOFF, 0, "wOFF"),
+        SIGNATURE(TYPE_WOFF2, 0, "wOF2"),
+        SIGNATURE(TYPE_ICO, 0, "\0\0\1\0"),
+};
+
+#define SIGNATURE_COUNT ((int) (sizeof(signatures) / sizeof(signatures[0])))
+
+typedef struct signatureSet_s {
+    uint64_t bits[SIGNATURE_SET_WORDS];
+} signatureSet;
+
+// state of matching all signatures at once: which ones still match and the longest one already matched;
+// node inspects byte at offset and follows the edge for its value, or otherwise for bytes without an edge
+typedef struct trieNode_s {
+    unsigned offset;
+    int type;
+    int firstEdge;
+    int edgeCount;
+    int otherwise;
+    // identity of node while the tree is built
+    signatureSet alive;
+    int best;
+} trieNode;
+
+typedef struct trieEdge_s {
+    unsigned char byte;
+    int child;
+} trieEdge;
+
+typedef struct signatureTrie_s {
+    trieNode *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    trieEdge *edges;
+    int edgeCount;
+    int edgeCapacity;
+    int root;
+} signatureTrie;
+
+static signatureTrie trie;
+static pthread_once_t trieOnce = PTHREAD_ONCE_INIT;
+
+static int indexedTypes[TYPE_COUNT] = {[TYPE_JPEG] = 1, [TYPE_PNG] = 1, [TYPE_ZIP] = 1, [TYPE_GZIP] = 1};
+
+static int inSet(const signatureSet *set, int i) {
+    return (set->bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void addToSet(signatureSet *set, int i) {
+    set->bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static int setEmpty(const signatureSet *set) {
+    for (int w = 0; w < SIGNATURE_SET_WORDS; w++) {
+        if (set->bits[w] != 0) return 0;
+    }
+    return 1;
+}
+
+static unsigned signatureEnd(int i) {
+    return signatures[i].offset + signatures[i].length;
+}
+
+// whether signature i requires a particular byte at offset
+static int exactAt(int i, unsigned offset) {
+    const fileSignature *s = &signatures[i];
+    if (offset < s->offset || offset >= signatureEnd(i)) return 0;
+    return s->mask == NULL || s->mask[offset - s->offset] != '.';
+}
+
+// longer match is more specific, on equal end the one with more required bytes
+static int betterMatch(int candidate, int best) {
+    if (best < 0) return 1;
+    if (signatureEnd(candidate) != signatureEnd(best)) return signatureEnd(candidate) > signatureEnd(best);
+    unsigned candidateBytes = 0, bestBytes = 0;
+    for (unsigned j = 0; j < SIGNATURE_READ_LENGTH; j++) {
+        candidateBytes += exactAt(candidate, j);
+        bestBytes += exactAt(best, j);
+    }
+    return candidateBytes > bestBytes;
+}
+
+static int findNode(unsigned offset, const signatureSet *alive, int best) {
+    for (int n = 0; n < trie.nodeCount; n++) {
+        const trieNode *node = &trie.nodes[n];
+        if (node->offset == offset && node->best == best && memcmp(&node->alive, alive, sizeof(signatureSet)) == 0) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static int addNode(unsigned offset, const signatureSet *alive, int best) {
+    if (trie.nodeCount == trie.nodeCapacity) {
+        trie.nodeCapacity = trie.nodeCapacity ? trie.nodeCapacity * 2 : 256;
+        trie.nodes = realloc(trie.nodes, trie.nodeCapacity * sizeof(trieNode));
+        if (trie.nodes == NULL) ERR("realloc");
+    }
+    trieNode *node = &trie.nodes[trie.nodeCount];
+    memset(node, 0, sizeof(trieNode));
+    node->offset = offset;
+    node->alive = *alive;
+    node->best = best;
+    node->type = best >= 0 ? signatures[best].type : TYPE_NONE;
+    node->otherwise = -1;
+    return trie.nodeCount++;
+}
+
+// node for signatures alive before offset; offset is moved past bytes none of them requires
+// and signatures ending before it are matched
+static int buildNode(unsigned offset, signatureSet alive, int best) {
+    while (1) {
+        unsigned next = SIGNATURE_READ_LENGTH;
+        for (int i = 0; i < SIGNATURE_COUNT; i++) {
+            if (!inSet(&alive, i)) continue;
+            if (signatureEnd(i) <= offset) {
+                alive.bits[i / 64] &= ~(1ULL << (i % 64));
+                if (betterMatch(i, best)) best = i;
+                continue;
+            }
+            // signature ending with bytes of any value is matched once its end is reached
+            unsigned j = offset;
+            while (j < signatureEnd(i) && !exactAt(i, j)) j++;
+            if (j < next) next = j;
+        }
+        if (setEmpty(&alive)) {
+            offset = SIGNATURE_READ_LENGTH;
+            break;
+        }
+        if (next == offset) break;
+        offset = next;
+    }
+
+    int n = findNode(offset, &alive, best);
+    if (n >= 0) return n;
+    n = addNode(offset, &alive, best);
+    if (offset == SIGNATURE_READ_LENGTH) return n;
+
+    // signatures which accept any value of the byte follow every edge
+    signatureSet any = {{0}};
+    int hasByte[256] = {0};
+    for (int i = 0; i < SIGNATURE_COUNT; i++) {
+        if (!inSet(&alive, i)) continue;
+        if (exactAt(i, offset)) {
+            hasByte[(unsigned char) signatures[i].bytes[offset - signatures[i].offset]] = 1;
+        } else {
+            addToSet(&any, i);
+        }
+    }
+    trieEdge children[256];
+    int childCount = 0;
+    for (int byte = 0; byte < 256; byte++) {
+        if (!hasByte[byte]) continue;
+        signatureSet next = any;
+        for (int i = 0; i < SIGNATURE_COUNT; i++) {
+            if (inSet(&alive, i) && exactAt(i, offset) &&
+                (unsigned char) signatures[i].bytes[offset - signatures[i].offset] == byte) {
+                addToSet(&next, i);
+            }
+        }
+        children[childCount].byte = (unsigned char) byte;
+        children[childCount++].child = buildNode(offset + 1, next, best);
+    }
+    int otherwise = buildNode(offset + 1, any, best);
+
+    if (trie.edgeCount + childCount > trie.edgeCapacity) {
+        while (trie.edgeCount + childCount > trie.edgeCapacity) {
+            trie.edgeCapacity = trie.edgeCapacity ? trie.edgeCapacity * 2 : 1024;
+        }
+        trie.edges = realloc(trie.edges, trie.edgeCapacity * sizeof(trieEdge));
+        if (trie.edges == NULL) ERR("realloc");
+    }
+    memcpy(trie.edges + trie.edgeCount, children, childCount * sizeof(trieEdge));
+    trie.nodes[n].firstEdge = trie.edgeCount;
+    trie.nodes[n].edgeCount = childCount;
+    trie.nodes[n].otherwise = otherwise;
+    trie.edgeCount += childCount;
+    return n;
+}
+
+static void buildTrie(void) {
+    if (SIGNATURE_COUNT > MAX_SIGNATURES) ERR("too many signatures");
+    signatureSet all = {{0}};
+    for (int i = 0; i < SIGNATURE_COUNT; i++) {
+        if (signatureEnd(i) > SIGNATURE_READ_LENGTH) ERR("signature ends beyond read length");
+        addToSet(&all, i);
+    }
+    trie.root = buildNode(0, all, -1);
+}
+
+int classifySignature(const unsigned char *bytes, size_t length) {
+    pthread_once(&trieOnce, buildTrie);
+    const trieNode *node = &trie.nodes[trie.root];
+    // bytes are inspected only where some signature still needs them, so cost does not grow with their number
+    while (node->otherwise >= 0 && node->offset < length) {
+        const trieEdge *edges = trie.edges + node->firstEdge;
+        int low = 0, high = node->edgeCount, child = node->otherwise;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (edges[middle].byte < bytes[node->offset]) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low < node->edgeCount && edges[low].byte == bytes[node->offset]) child = edges[low].child;
+        node = &trie.nodes[child];
+    }
+    return node->type;
+}
+
+int setIndexedTypes(const char *list) {
+    int selected[TYPE_COUNT] = {0};
+    if (strcmp(list, "all") == 0) {
+        for (int type = TYPE_DIRECTORY + 1; type < TYPE_COUNT; type++) selected[type] = 1;
+    } else {
+        char name[32];
+        while (*list != '\0') {
+            size_t length = strcspn(list, ",");
+            if (length == 0 || length >= sizeof(name)) return -1;
+            memcpy(name, list, length);
+            name[length] = '\0';
+            int type = typeFromName(name);
+            if (type == TYPE_NONE || type == TYPE_DIRECTORY) return -1;
+            selected[type] = 1;
+            list += length;
+            if (*list == ',') list++;
+        }
+    }
+    memcpy(indexedTypes, selected, sizeof(indexedTypes));
+    return 0;
+}
+
+int typeIndexed(int type) {
+    return type > TYPE_DIRECTORY && type < TYPE_COUNT && indexedTypes[type];
+}
@@ -0,0 +1,22 @@
+#ifndef FILE_INDEXER_SIGNATURE_H
+#define FILE_INDEXER_SIGNATURE_H
+
+#include <stddef.h>
+
+#include "indexer.h"
+
+// bytes read from the start of a file, every signature ends within them
+#define SIGNATURE_READ_LENGTH 512
+
+// type of file starting with bytes, the longest matching signature wins, TYPE_NONE if none matches;
+// signatures are matched all at once by walking a decision tree built on first use
+int classifySignature(const unsigned char *bytes, size_t length);
+
+// restricts indexed types to a comma separated list of type names, or all of them for "all",
+// returns -1 if a name is unknown
+int setIndexedTypes(const char *list);
+
+// whether files of type are indexed, jpeg, png, zip and gzip are by default
+int typeIndexed(int type);
+
+#endif //FILE_INDEXER_SIGNATURE_H
@@ -0,0 +1,852 @@
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "snapshot.h"
+
+#define DELTA_INITIAL_CAPACITY 64
+
+indexBase *createBase(indexFile *file) {
+    indexBase *base = calloc(1, sizeof(indexBase));
+    if (base == NULL) ERR("calloc");
+    atomic_init(&base->refs, 1);
+    if (file != NULL) {
+        base->file = *file;
+    } else {
+        base->file.fileDescriptor = -1;
+    }
+    return base;
+}
+
+static void releaseBase(indexBase *base) {
+    if (atomic_fetch_sub(&base->refs, 1) != 1) return;
+    closeIndexFile(&base->file);
+    free(base->map.slots);
+    free(base->map.start);
+    free(base->map.entries);
+    free(base);
+}
+
+static int baseCount(const indexBase *base) {
+    return (int) base->file.count;
+}
+
+// name stored for entry, whole path for entries without indexed parent
+static const char *baseName(const indexBase *base, int i) {
+    return base->file.strings + base->file.nameOffset[i];
+}
+
+static uint64_t nameHash(uint32_t parent, const char *name, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (parent * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+snapshot *createSnapshot(indexBase *base) {
+    snapshot *s = calloc(1, sizeof(snapshot));
+    if (s == NULL) ERR("calloc");
+    atomic_init(&s->refs, 1);
+    s->base = base;
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        const uint32_t *list;
+        s->typeCounts[type] = (int) indexFileTypeList(&base->file, type, &list);
+    }
+    return s;
+}
+
+static size_t bitmapBytes(const indexBase *base) {
+    return (baseCount(base) + 7) / 8;
+}
+
+// owner record of usage, inserted in uid order if there is none yet
+static ownerUsage *usageOwner(directoryUsage *usage, uid_t UID) {
+    int low = 0, high = usage->ownerCount;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (usage->owners[middle].UID < UID) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < usage->ownerCount && usage->owners[low].UID == UID) return &usage->owners[low];
+    if (usage->ownerCount == usage->ownerCapacity) {
+        usage->ownerCapacity = usage->ownerCapacity ? usage->ownerCapacity * 2 : 4;
+        usage->owners = realloc(usage->owners, usage->ownerCapacity * sizeof(ownerUsage));
+        if (usage->owners == NULL) ERR("realloc");
+    }
+    memmove(&usage->owners[low + 1], &usage->owners[low], (usage->ownerCount - low) * sizeof(ownerUsage));
+    usage->ownerCount++;
+    usage->owners[low] = (ownerUsage) {.UID = UID};
+    return &usage->owners[low];
+}
+
+static void addUsage(directoryUsage *usage, int type, uid_t UID, int64_t files, int64_t bytes) {
+    usage->files += files;
+    usage->bytes += bytes;
+    usage->typeFiles[type] += files;
+    usage->typeBytes[type] += bytes;
+    ownerUsage *owner = usageOwner(usage, UID);
+    owner->files += files;
+    owner->bytes += bytes;
+}
+
+static void addRollup(directoryUsage *usage, const indexFile *file, const indexRollup *rollup) {
+    const indexRollupCount *list;
+    usage->files += rollup->files;
+    usage->bytes += rollup->bytes;
+    size_t count = indexFileRollupTypes(file, rollup, &list);
+    for (size_t j = 0; j < count; j++) {
+        usage->typeFiles[list[j].key] += list[j].files;
+        usage->typeBytes[list[j].key] += list[j].bytes;
+    }
+    count = indexFileRollupOwners(file, rollup, &list);
+    for (size_t j = 0; j < count; j++) {
+        ownerUsage *owner = usageOwner(usage, list[j].key);
+        owner->files += list[j].files;
+        owner->bytes += list[j].bytes;
+    }
+}
+
+static void addDelta(directoryUsage *usage, const directoryUsage *delta) {
+    usage->files += delta->files;
+    usage->bytes += delta->bytes;
+    for (int type = 0; type < TYPE_COUNT; type++) {
+        usage->typeFiles[type] += delta->typeFiles[type];
+        usage->typeBytes[type] += delta->typeBytes[type];
+    }
+    for (int j = 0; j < delta->ownerCount; j++) {
+        ownerUsage *owner = usageOwner(usage, delta->owners[j].UID);
+        owner->files += delta->owners[j].files;
+        owner->bytes += delta->owners[j].bytes;
+    }
+}
+
+static void copyUsage(directoryUsage *to, const directoryUsage *from) {
+    *to = *from;
+    to->owners = NULL;
+    to->ownerCapacity = from->ownerCount;
+    if (from->ownerCount == 0) return;
+    to->owners = malloc(from->ownerCount * sizeof(ownerUsage));
+    if (to->owners == NULL) ERR("malloc");
+    memcpy(to->owners, from->owners, from->ownerCount * sizeof(ownerUsage));
+}
+
+void freeDirectoryUsage(directoryUsage *usage) {
+    free(usage->owners);
+    usage->owners = NULL;
+    usage->ownerCount = usage->ownerCapacity = 0;
+}
+
+static size_t rollupSlotMask(const snapshot *s) {
+    return 2 * (size_t) s->rollupDeltaCapacity - 1;
+}
+
+static rollupDelta *findRollupDelta(const snapshot *s, const char *path, size_t length) {
+    if (s->rollupDeltaCount == 0) return NULL;
+    size_t mask = rollupSlotMask(s);
+    for (size_t slot = nameHash(0, path, length) & mask; s->rollupSlots[slot] >= 0; slot = (slot + 1) & mask) {
+        rollupDelta *delta = &s->rollupDeltas[s->rollupSlots[slot]];
+        if (strncmp(delta->path, path, length) == 0 && delta->path[length] == '\0') return delta;
+    }
+    return NULL;
+}
+
+static void slotRollupDelta(snapshot *s, int i) {
+    size_t mask = rollupSlotMask(s);
+    const char *path = s->rollupDeltas[i].path;
+    size_t slot = nameHash(0, path, strlen(path)) & mask;
+    while (s->rollupSlots[slot] >= 0) slot = (slot + 1) & mask;
+    s->rollupSlots[slot] = i;
+}
+
+// change of rollup of directory at first length bytes of path, created empty if there is none
+static rollupDelta *rollupDeltaFor(snapshot *s, const char *path, size_t length) {
+    rollupDelta *delta = findRollupDelta(s, path, length);
+    if (delta != NULL) return delta;
+    if (s->rollupDeltaCount == s->rollupDeltaCapacity) {
+        s->rollupDeltaCapacity = s->rollupDeltaCapacity ? s->rollupDeltaCapacity * 2 : DELTA_INITIAL_CAPACITY;
+        s->rollupDeltas = realloc(s->rollupDeltas, s->rollupDeltaCapacity * sizeof(rollupDelta));
+        free(s->rollupSlots);
+        s->rollupSlots = malloc((rollupSlotMask(s) + 1) * sizeof(int));
+        if (s->rollupDeltas == NULL || s->rollupSlots == NULL) ERR("malloc");
+        memset(s->rollupSlots, -1, (rollupSlotMask(s) + 1) * sizeof(int));
+        for (int i = 0; i < s->rollupDeltaCount; i++) slotRollupDelta(s, i);
+    }
+    delta = &s->rollupDeltas[s->rollupDeltaCount];
+    memset(delta, 0, sizeof(rollupDelta));
+    delta->path = arenaCopy(&s->strings, path, length);
+    slotRollupDelta(s, s->rollupDeltaCount++);
+    return delta;
+}
+
+// adds file at path to changes of whole index and of each directory above it, sign -1 takes it away
+static void updateRollups(snapshot *s, const char *path, int type, uid_t UID, int64_t size, int sign) {
+    if (type == TYPE_DIRECTORY) return;
+    addUsage(&s->totalDelta, type, UID, sign, sign * size);
+    for (const char *p = strchr(path, '/'); p != NULL && p[1] != '\0'; p = strchr(p + 1, '/')) {
+        size_t length = p == path ? 1 : (size_t) (p - path);
+        addUsage(&rollupDeltaFor(s, path, length)->usage, type, UID, sign, sign * size);
+    }
+}
+
+static size_t addedSlotMask(const snapshot *s) {
+    return 2 * (size_t) s->addedCapacity - 1;
+}
+
+// slot holding added entry with path or the empty slot where it would go
+static size_t findAddedSlot(const snapshot *s, const char *path) {
+    size_t mask = addedSlotMask(s);
+    size_t slot = nameHash(0, path, strlen(path)) & mask;
+    while (s->addedSlots[slot] >= 0 && strcmp(s->added[s->addedSlots[slot]].path, path) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// position of added entry with path in added, -1 if there is none
+static int findAdded(const snapshot *s, const char *path) {
+    if (s->addedCount == 0) return -1;
+    return s->addedSlots[findAddedSlot(s, path)];
+}
+
+// table is rebuilt for capacity of added
+static void slotAllAdded(snapshot *s) {
+    free(s->addedSlots);
+    s->addedSlots = malloc((addedSlotMask(s) + 1) * sizeof(int));
+    if (s->addedSlots == NULL) ERR("malloc");
+    memset(s->addedSlots, -1, (addedSlotMask(s) + 1) * sizeof(int));
+    for (int i = 0; i < s->addedCount; i++) s->addedSlots[findAddedSlot(s, s->added[i].path)] = i;
+}
+
+// empties slot, entries probed past it are moved back so that no lookup stops early
+static void unslotAdded(snapshot *s, size_t slot) {
+    size_t mask = addedSlotMask(s);
+    s->addedSlots[slot] = -1;
+    for (size_t next = (slot + 1) & mask; s->addedSlots[next] >= 0; next = (next + 1) & mask) {
+        const char *path = s->added[s->addedSlots[next]].path;
+        size_t home = nameHash(0, path, strlen(path)) & mask;
+        // entry stays unless its home lies cyclically after the empty slot and up to its own slot
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            s->addedSlots[slot] = s->addedSlots[next];
+            s->addedSlots[next] = -1;
+            slot = next;
+        }
+    }
+}
+
+snapshot *cloneSnapshot(const snapshot *s) {
+    snapshot *copy = createSnapshot(s->base);
+    atomic_fetch_add(&s->base->refs, 1);
+    copy->generation = s->generation;
+    memcpy(copy->typeCounts, s->typeCounts, sizeof(copy->typeCounts));
+
+    if (s->removed != NULL) {
+        copy->removed = malloc(bitmapBytes(s->base));
+        if (copy->removed == NULL) ERR("malloc");
+        memcpy(copy->removed, s->removed, bitmapBytes(s->base));
+        copy->removedCount = s->removedCount;
+    }
+    if (s->addedCount > 0) {
+        copy->addedCapacity = s->addedCapacity;
+        copy->added = malloc(copy->addedCapacity * sizeof(indexedFile));
+        if (copy->added == NULL) ERR("malloc");
+        memcpy(copy->added, s->added, s->addedCount * sizeof(indexedFile));
+        copy->addedCount = s->addedCount;
+        // strings of s are freed with it, so the copy needs its own
+        for (int i = 0; i < copy->addedCount; i++) {
+            indexedFile *entry = &copy->added[i];
+            size_t nameOffset = entry->fileName - entry->path;
+            entry->path = arenaCopy(&copy->strings, entry->path, strlen(entry->path));
+            entry->fileName = entry->path + nameOffset;
+        }
+        copy->addedSlots = malloc((addedSlotMask(copy) + 1) * sizeof(int));
+        if (copy->addedSlots == NULL) ERR("malloc");
+        memcpy(copy->addedSlots, s->addedSlots, (addedSlotMask(copy) + 1) * sizeof(int));
+    }
+    copyUsage(&copy->totalDelta, &s->totalDelta);
+    if (s->rollupDeltaCount > 0) {
+        copy->rollupDeltaCapacity = s->rollupDeltaCapacity;
+        copy->rollupDeltaCount = s->rollupDeltaCount;
+        copy->rollupDeltas = malloc(copy->rollupDeltaCapacity * sizeof(rollupDelta));
+        copy->rollupSlots = malloc((rollupSlotMask(copy) + 1) * sizeof(int));
+        if (copy->rollupDeltas == NULL || copy->rollupSlots == NULL) ERR("malloc");
+        memcpy(copy->rollupSlots, s->rollupSlots, (rollupSlotMask(copy) + 1) * sizeof(int));
+        for (int i = 0; i < copy->rollupDeltaCount; i++) {
+            const rollupDelta *delta = &s->rollupDeltas[i];
+            copy->rollupDeltas[i].path = arenaCopy(&copy->strings, delta->path, strlen(delta->path));
+            copyUsage(&copy->rollupDeltas[i].usage, &delta->usage);
+        }
+    }
+    return copy;
+}
+
+snapshot *acquireSnapshot(snapshotSlot *slot) {
+    unsigned long e;
+    while (1) {
+        e = atomic_load(&slot->epoch);
+        atomic_fetch_add(&slot->readers[e & 1], 1);
+        if (atomic_load(&slot->epoch) == e) break;
+        atomic_fetch_sub(&slot->readers[e & 1], 1);
+    }
+    snapshot *s = atomic_load(&slot->current);
+    atomic_fetch_add(&s->refs, 1);
+    atomic_fetch_sub(&slot->readers[e & 1], 1);
+    return s;
+}
+
+void releaseSnapshot(snapshot *s) {
+    if (atomic_fetch_sub(&s->refs, 1) != 1) return;
+    releaseBase(s->base);
+    free(s->removed);
+    free(s->added);
+    free(s->addedSlots);
+    for (int i = 0; i < s->rollupDeltaCount; i++) freeDirectoryUsage(&s->rollupDeltas[i].usage);
+    free(s->rollupDeltas);
+    free(s->rollupSlots);
+    freeDirectoryUsage(&s->totalDelta);
+    freeArena(&s->strings);
+    free(s);
+}
+
+void publishSnapshot(snapshotSlot *slot, snapshot *next) {
+    snapshot *previous = atomic_load(&slot->current);
+    next->generation = previous != NULL ? previous->generation + 1 : 1;
+    previous = atomic_exchange(&slot->current, next);
+
+    // readers that loaded previous pointer only need a moment to take their reference
+    unsigned long e = atomic_fetch_add(&slot->epoch, 1);
+    while (atomic_load(&slot->readers[e & 1]) != 0) {
+        sched_yield();
+    }
+    if (previous != NULL) releaseSnapshot(previous);
+}
+
+int snapshotSize(const snapshot *s) {
+    return baseCount(s->base) + s->addedCount;
+}
+
+static int isRemoved(const snapshot *s, int i) {
+    return s->removed != NULL && (s->removed[i / 8] & (1 << (i % 8)));
+}
+
+int snapshotEntry(const snapshot *s, int i, indexedFile *entry) {
+    int count = baseCount(s->base);
+    if (i >= count) {
+        *entry = s->added[i - count];
+        return 1;
+    }
+    if (isRemoved(s, i)) return 0;
+    indexFileEntry(&s->base->file, i, entry);
+    return 1;
+}
+
+// added entry in range of a size cursor
+typedef struct addedSize_s {
+    int64_t size;
+    int position;
+} addedSize;
+
+// smaller first, equal ones in order of positions
+static int compareAddedSizes(const void *a, const void *b) {
+    const addedSize *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+void snapshotSizeRange(const snapshot *s, int64_t min, int64_t max, sizeCursor *cursor) {
+    indexFileSizeRange(&s->base->file, min, max, &cursor->next, &cursor->last);
+    cursor->added = NULL;
+    cursor->addedCount = cursor->addedNext = 0;
+    if (s->addedCount == 0) return;
+    addedSize *keys = malloc(s->addedCount * sizeof(addedSize));
+    if (keys == NULL) ERR("malloc");
+    int count = 0;
+    for (int i = 0; i < s->addedCount; i++) {
+        if (s->added[i].size >= min && s->added[i].size <= max) keys[count++] = (addedSize) {s->added[i].size, i};
+    }
+    if (count > 0) {
+        qsort(keys, count, sizeof(addedSize), compareAddedSizes);
+        cursor->added = malloc(count * sizeof(int));
+        if (cursor->added == NULL) ERR("malloc");
+        for (int i = 0; i < count; i++) cursor->added[i] = keys[i].position;
+        cursor->addedCount = count;
+    }
+    free(keys);
+}
+
+int snapshotSizeNext(const snapshot *s, sizeCursor *cursor) {
+    const indexFile *file = &s->base->file;
+    while (cursor->next < cursor->last && isRemoved(s, (int) file->sizeOrder[cursor->next])) cursor->next++;
+    int hasBase = cursor->next < cursor->last, hasAdded = cursor->addedNext < cursor->addedCount;
+    if (hasBase && (!hasAdded || file->size[file->sizeOrder[cursor->next]] <=
+                                 s->added[cursor->added[cursor->addedNext]].size)) {
+        return (int) file->sizeOrder[cursor->next++];
+    }
+    if (hasAdded) return baseCount(s->base) + cursor->added[cursor->addedNext++];
+    return -1;
+}
+
+void freeSizeCursor(sizeCursor *cursor) {
+    free(cursor->added);
+    cursor->added = NULL;
+}
+
+// keeps the shortest lists when there are more than intersection can hold
+static void addList(listIntersection *x, const uint32_t *list, size_t length) {
+    int slot = x->count;
+    if (slot == INTERSECTION_MAX_LISTS) {
+        slot = 0;
+        for (int j = 1; j < x->count; j++) {
+            if (x->lengths[j] > x->lengths[slot]) slot = j;
+        }
+        if (x->lengths[slot] <= length) return;
+    } else {
+        x->count++;
+    }
+    x->lists[slot] = list;
+    x->lengths[slot] = length;
+    x->next[slot] = 0;
+}
+
+void snapshotPostings(const snapshot *s, int type, const uid_t *UID, postingCursor *cursor) {
+    const uint32_t *list = NULL;
+    memset(cursor, 0, sizeof(postingCursor));
+    cursor->type = type;
+    if (type != TYPE_NONE) {
+        size_t length = indexFileTypeList(&s->base->file, type, &list);
+        addList(&cursor->lists, list, length);
+    }
+    if (UID != NULL) {
+        cursor->hasOwner = 1;
+        cursor->UID = *UID;
+        size_t length = indexFileOwnerList(&s->base->file, *UID, &list);
+        addList(&cursor->lists, list, length);
+    }
+}
+
+// first position from start on holding value not smaller than target
+static size_t gallop(const uint32_t *list, size_t start, size_t length, uint32_t target) {
+    size_t step = 1, low = start, high = start;
+    while (high < length && list[high] < target) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > length) high = length;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (list[middle] < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// lists take turns catching up with the largest position seen until all of them agree
+static int nextCommon(listIntersection *x, uint32_t *position) {
+    if (x->count == 0 || x->next[0] == x->lengths[0]) return 0;
+    uint32_t target = x->lists[0][x->next[0]];
+    int agreeing = 1;
+    for (int j = 1 % x->count; agreeing < x->count; j = (j + 1) % x->count) {
+        x->next[j] = gallop(x->lists[j], x->next[j], x->lengths[j], target);
+        if (x->next[j] == x->lengths[j]) return 0;
+        uint32_t value = x->lists[j][x->next[j]];
+        if (value == target) {
+            agreeing++;
+        } else {
+            target = value;
+            agreeing = 1;
+        }
+    }
+    for (int j = 0; j < x->count; j++) x->next[j]++;
+    *position = target;
+    return 1;
+}
+
+int snapshotPostingNext(const snapshot *s, postingCursor *cursor) {
+    uint32_t i;
+    while (nextCommon(&cursor->lists, &i)) {
+        if (!isRemoved(s, (int) i)) return (int) i;
+    }
+    while (cursor->added < s->addedCount) {
+        const indexedFile *entry = &s->added[cursor->added++];
+        if ((cursor->type == TYPE_NONE || entry->fileType == cursor->type) &&
+            (!cursor->hasOwner || entry->UID == cursor->UID)) {
+            return baseCount(s->base) + cursor->added - 1;
+        }
+    }
+    return -1;
+}
+
+void snapshotNameSearch(const snapshot *s, const char *pattern, nameCursor *cursor) {
+    memset(cursor, 0, sizeof(nameCursor));
+    cursor->pattern = pattern;
+    cursor->length = strlen(pattern);
+    if (cursor->length < 3) return;
+
+    cursor->useTrigrams = 1;
+    for (size_t j = 0; j + 3 <= cursor->length; j++) {
+        const uint32_t *list = NULL;
+        size_t length = indexFileTrigramList(&s->base->file, trigramAt(pattern + j), &list);
+        addList(&cursor->lists, list, length);
+    }
+}
+
+int snapshotNameNext(const snapshot *s, nameCursor *cursor) {
+    const indexFile *file = &s->base->file;
+    if (cursor->useTrigrams) {
+        // trigrams may appear in a different order or apart, so candidates are verified
+        uint32_t i;
+        while (nextCommon(&cursor->lists, &i)) {
+            if (!isRemoved(s, (int) i) && strstr(indexFileName(file, i), cursor->pattern) != NULL) return (int) i;
+        }
+    } else {
+        long i;
+        while ((i = indexFileNameScan(file, cursor->pattern, cursor->length, &cursor->scanOffset)) >= 0) {
+            if (!isRemoved(s, (int) i)) return (int) i;
+        }
+    }
+    while (cursor->added < s->addedCount) {
+        const indexedFile *entry = &s->added[cursor->added++];
+        if (strstr(entry->fileName, cursor->pattern) != NULL) return baseCount(s->base) + cursor->added - 1;
+    }
+    return -1;
+}
+
+int snapshotTypeCount(const snapshot *s, int type) {
+    return s->typeCounts[type];
+}
+
+static int64_t entrySize(const snapshot *s, int i) {
+    int count = baseCount(s->base);
+    return i < count ? s->base->file.size[i] : s->added[i - count].size;
+}
+
+int snapshotLargest(const snapshot *s, int k, int *positions) {
+    int found = 0;
+    if (k <= 0) return 0;
+    for (size_t j = s->base->file.count; j > 0 && found < k; j--) {
+        int i = (int) s->base->file.sizeOrder[j - 1];
+        if (!isRemoved(s, i)) positions[found++] = i;
+    }
+    // entries added on top of index take place of smaller ones, insertion keeps positions sorted
+    for (int a = 0; a < s->addedCount; a++) {
+        int i = baseCount(s->base) + a;
+        int64_t size = s->added[a].size;
+        if (found == k && (k == 0 || entrySize(s, positions[k - 1]) >= size)) continue;
+        int j = found < k ? found++ : k - 1;
+        while (j > 0 && entrySize(s, positions[j - 1]) < size) {
+            positions[j] = positions[j - 1];
+            j--;
+        }
+        positions[j] = i;
+    }
+    return found;
+}
+
+int snapshotLiveCount(const snapshot *s) {
+    return baseCount(s->base) - s->removedCount + s->addedCount;
+}
+
+int snapshotDeltaSize(const snapshot *s) {
+    return s->removedCount + s->addedCount;
+}
+
+// base never changes, so its map is built once when watch mode touches it first
+static void ensurePathMap(indexBase *base) {
+    pathMap *map = &base->map;
+    if (map->slots != NULL) return;
+    map->capacity = 16;
+    while (map->capacity < 2 * (size_t) baseCount(base)) map->capacity *= 2;
+    map->slots = malloc(map->capacity * sizeof(int));
+    if (map->slots == NULL) ERR("malloc");
+    memset(map->slots, -1, map->capacity * sizeof(int));
+
+    for (int i = 0; i < baseCount(base); i++) {
+        const char *name = baseName(base, i);
+        size_t slot = nameHash(base->file.parent[i], name, strlen(name)) & (map->capacity - 1);
+        while (map->slots[slot] >= 0) slot = (slot + 1) & (map->capacity - 1);
+        map->slots[slot] = i;
+    }
+
+    // counting sort of entries by parent, topmost ones are counted under a parent past the last entry
+    int count = baseCount(base);
+    map->start = calloc(count + 2, sizeof(uint32_t));
+    map->entries = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (map->start == NULL || map->entries == NULL) ERR("malloc");
+    for (int i = 0; i < count; i++) {
+        uint32_t parent = base->file.parent[i];
+        map->start[(parent == INDEX_NO_PARENT ? (uint32_t) count : parent) + 1]++;
+    }
+    for (int i = 0; i <= count; i++) map->start[i + 1] += map->start[i];
+    uint32_t *next = malloc((count + 1) * sizeof(uint32_t));
+    if (next == NULL) ERR("malloc");
+    memcpy(next, map->start, (count + 1) * sizeof(uint32_t));
+    for (int i = 0; i < count; i++) {
+        uint32_t parent = base->file.parent[i];
+        map->entries[next[parent == INDEX_NO_PARENT ? (uint32_t) count : parent]++] = (uint32_t) i;
+    }
+    free(next);
+}
+
+// map is keyed by parent id and name of entry
+static int mapFind(indexBase *base, uint32_t parent, const char *name, size_t length) {
+    pathMap *map = &base->map;
+    for (size_t slot = nameHash(parent, name, length) & (map->capacity - 1); map->slots[slot] >= 0;
+         slot = (slot + 1) & (map->capacity - 1)) {
+        int i = map->slots[slot];
+        const char *candidate = baseName(base, i);
+        if (base->file.parent[i] == parent && strncmp(candidate, name, length) == 0 && candidate[length] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// finds first length bytes of path, resolving parent directories first
+static int baseFindPrefix(indexBase *base, const char *path, size_t length) {
+    int idx = mapFind(base, INDEX_NO_PARENT, path, length);
+    if (idx >= 0) return idx;
+
+    size_t slash = length;
+    while (slash > 0 && path[slash - 1] != '/') slash--;
+    if (slash == 0 || slash == length) return -1;
+    // entries directly under root directory have "/" as parent
+    size_t parentLength = slash == 1 ? 1 : slash - 1;
+    int parent = baseFindPrefix(base, path, parentLength);
+    if (parent < 0) return -1;
+    return mapFind(base, (uint32_t) parent, path + slash, length - slash);
+}
+
+static int baseFind(indexBase *base, const char *path) {
+    ensurePathMap(base);
+    return baseFindPrefix(base, path, strlen(path));
+}
+
+// path of entry is needed unless it is a directory
+static void markRemoved(snapshot *s, int i, const char *path) {
+    if (s->removed == NULL) {
+        s->removed = calloc(bitmapBytes(s->base), 1);
+        if (s->removed == NULL) ERR("calloc");
+    }
+    if (!isRemoved(s, i)) {
+        s->removed[i / 8] |= 1 << (i % 8);
+        s->removedCount++;
+        s->typeCounts[s->base->file.type[i]]--;
+        const indexFile *file = &s->base->file;
+        updateRollups(s, path, file->type[i], file->uid[i], file->size[i], -1);
+    }
+}
+
+static int isBelow(const char *path, const char *directory, size_t length) {
+    return strncmp(path, directory, length) == 0 && path[length] == '/';
+}
+
+static void removeAdded(snapshot *s, int i) {
+    const indexedFile *entry = &s->added[i];
+    s->typeCounts[entry->fileType]--;
+    updateRollups(s, entry->path, entry->fileType, entry->UID, entry->size, -1);
+    unslotAdded(s, findAddedSlot(s, entry->path));
+    // last entry takes the freed position
+    if (i != --s->addedCount) {
+        s->added[i] = s->added[s->addedCount];
+        s->addedSlots[findAddedSlot(s, s->added[i].path)] = i;
+    }
+}
+
+void snapshotRemoveSubtree(snapshot *s, const char *path) {
+    int isDirectory = 0;
+    int idx = baseFind(s->base, path);
+    if (idx >= 0 && !isRemoved(s, idx)) {
+        isDirectory = s->base->file.type[idx] == TYPE_DIRECTORY;
+        markRemoved(s, idx, path);
+    }
+    int added = findAdded(s, path);
+    if (added >= 0) {
+        isDirectory = s->added[added].fileType == TYPE_DIRECTORY;
+        removeAdded(s, added);
+    }
+    if (!isDirectory) return;
+
+    // base entries below directory are reached through lists of children, so only the subtree is visited;
+    // a directory missing from base can only hold topmost entries, which store their whole path
+    size_t length = strlen(path);
+    const pathMap *map = &s->base->map;
+    int count = baseCount(s->base);
+    uint32_t *stack = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (stack == NULL) ERR("malloc");
+    size_t depth = 0;
+    uint32_t from = idx >= 0 ? (uint32_t) idx : (uint32_t) count;
+    for (uint32_t c = map->start[from]; c < map->start[from + 1]; c++) {
+        if (idx >= 0 || isBelow(baseName(s->base, map->entries[c]), path, length)) stack[depth++] = map->entries[c];
+    }
+    // paths of removed files are taken off rollups of their ancestors
+    pathCache paths;
+    initPathCache(&paths, &s->base->file);
+    while (depth > 0) {
+        uint32_t j = stack[--depth];
+        // a directory replaced by watch mode keeps its children in base
+        if (!isRemoved(s, (int) j)) {
+            markRemoved(s, (int) j, s->base->file.type[j] == TYPE_DIRECTORY ? NULL : indexFilePath(&paths, j));
+        }
+        for (uint32_t c = map->start[j]; c < map->start[j + 1]; c++) stack[depth++] = map->entries[c];
+    }
+    freePathCache(&paths);
+    free(stack);
+    for (int i = s->addedCount - 1; i >= 0; i--) {
+        if (isBelow(s->added[i].path, path, length)) removeAdded(s, i);
+    }
+}
+
+void snapshotPut(snapshot *s, const indexedFile *entry) {
+    int idx = baseFind(s->base, entry->path);
+    if (idx >= 0) markRemoved(s, idx, entry->path);
+
+    int i = findAdded(s, entry->path);
+    indexedFile *slot = i >= 0 ? &s->added[i] : NULL;
+    if (slot == NULL) {
+        if (s->addedCount == s->addedCapacity) {
+            s->addedCapacity = s->addedCapacity ? s->addedCapacity * 2 : DELTA_INITIAL_CAPACITY;
+            s->added = realloc(s->added, s->addedCapacity * sizeof(indexedFile));
+            if (s->added == NULL) ERR("realloc");
+            slotAllAdded(s);
+        }
+        slot = &s->added[s->addedCount];
+    } else {
+        s->typeCounts[slot->fileType]--;
+        updateRollups(s, slot->path, slot->fileType, slot->UID, slot->size, -1);
+    }
+    s->typeCounts[entry->fileType]++;
+    updateRollups(s, entry->path, entry->fileType, entry->UID, entry->size, 1);
+    // replaced path stays in the arena until the snapshot is freed
+    *slot = *entry;
+    slot->path = arenaCopy(&s->strings, entry->path, strlen(entry->path));
+    slot->fileName = slot->path + (entry->fileName - entry->path);
+    if (i < 0) s->addedSlots[findAddedSlot(s, slot->path)] = s->addedCount++;
+}
+
+void initSnapshotPathCache(const snapshot *s, pathCache *cache) {
+    initPathCache(cache, &s->base->file);
+}
+
+const char *snapshotEntryPath(const snapshot *s, pathCache *cache, int i) {
+    int count = baseCount(s->base);
+    if (i >= count) return s->added[i - count].path;
+    return indexFilePath(cache, i);
+}
+
+// position of live directory at path, -1 if there is none; rollup is set to the one of base directory at path,
+// also when that directory was removed since, or NULL
+static int findLiveDirectory(const snapshot *s, pathCache *paths, const char *path, const indexRollup **rollup) {
+    *rollup = indexFileFindRollup(paths, path);
+    if (*rollup != NULL && !isRemoved(s, (int) (*rollup)->entry)) return (int) (*rollup)->entry;
+    int added = findAdded(s, path);
+    if (added >= 0 && s->added[added].fileType == TYPE_DIRECTORY) return baseCount(s->base) + added;
+    return -1;
+}
+
+int snapshotDirectoryUsage(const snapshot *s, pathCache *paths, const char *path, directoryUsage *usage) {
+    memset(usage, 0, sizeof(directoryUsage));
+    const indexRollup *rollup;
+    if (findLiveDirectory(s, paths, path, &rollup) < 0) return -1;
+    if (rollup != NULL) addRollup(usage, &s->base->file, rollup);
+    const rollupDelta *delta = findRollupDelta(s, path, strlen(path));
+    if (delta != NULL) addDelta(usage, &delta->usage);
+    return 0;
+}
+
+// keeps totals in descending order of bytes, total smaller than all of k kept ones is dropped
+static int insertTotal(directoryTotal *totals, int found, int k, const directoryTotal *total) {
+    if (k <= 0) return 0;
+    if (found == k && totals[k - 1].bytes >= total->bytes) return found;
+    int j = found < k ? found++ : k - 1;
+    while (j > 0 && totals[j - 1].bytes < total->bytes) {
+        totals[j] = totals[j - 1];
+        j--;
+    }
+    totals[j] = *total;
+    return found;
+}
+
+// usage of live directory with a change of its rollup or added on top of base
+static void insertChanged(const snapshot *s, pathCache *paths, const char *path, directoryTotal *totals, int *found,
+                          int k) {
+    const indexRollup *rollup;
+    int entry = findLiveDirectory(s, paths, path, &rollup);
+    if (entry < 0) return;
+    directoryTotal total = {.entry = entry};
+    if (rollup != NULL) {
+        total.files = rollup->files;
+        total.bytes = rollup->bytes;
+    }
+    const rollupDelta *delta = findRollupDelta(s, path, strlen(path));
+    if (delta != NULL) {
+        total.files += delta->usage.files;
+        total.bytes += delta->usage.bytes;
+    }
+    *found = insertTotal(totals, *found, k, &total);
+}
+
+int snapshotTopDirectories(const snapshot *s, pathCache *paths, int k, directoryTotal *totals) {
+    const indexFile *file = &s->base->file;
+    int found = 0;
+    // directories whose rollup changed are out of order of base, they are merged in afterwards
+    for (size_t j = 0; j < file->rollupCount && found < k; j++) {
+        const indexRollup *rollup = &file->rollups[file->rollupOrder[j]];
+        if (isRemoved(s, (int) rollup->entry)) continue;
+        if (s->rollupDeltaCount > 0) {
+            const char *path = indexFilePath(paths, rollup->entry);
+            if (findRollupDelta(s, path, strlen(path)) != NULL) continue;
+        }
+        totals[found++] = (directoryTotal) {.entry = (int) rollup->entry, .files = rollup->files,
+                .bytes = rollup->bytes};
+    }
+    for (int d = 0; d < s->rollupDeltaCount; d++) {
+        insertChanged(s, paths, s->rollupDeltas[d].path, totals, &found, k);
+    }
+    // added directories with nothing below them have no change of rollup
+    for (int i = 0; i < s->addedCount; i++) {
+        const indexedFile *entry = &s->added[i];
+        if (entry->fileType == TYPE_DIRECTORY && findRollupDelta(s, entry->path, strlen(entry->path)) == NULL) {
+            insertChanged(s, paths, entry->path, totals, &found, k);
+        }
+    }
+    return found;
+}
+
+void snapshotOwnerUsage(const snapshot *s, uid_t UID, int64_t *files, int64_t *bytes) {
+    *files = *bytes = 0;
+    const indexFile *file = &s->base->file;
+    const indexRollup *total = indexFileTotal(file);
+    if (total != NULL) {
+        const indexRollupCount *owners;
+        size_t low = 0, high = indexFileRollupOwners(file, total, &owners), count = high;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (owners[middle].key < UID) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low < count && owners[low].key == UID) {
+            *files = owners[low].files;
+            *bytes = owners[low].bytes;
+        }
+    }
+    for (int j = 0; j < s->totalDelta.ownerCount; j++) {
+        if (s->totalDelta.owners[j].UID != UID) continue;
+        *files += s->totalDelta.owners[j].files;
+        *bytes += s->totalDelta.owners[j].bytes;
+    }
+}
@@ -0,0 +1,220 @@
+#ifndef FILE_INDEXER_SNAPSHOT_H
+#define FILE_INDEXER_SNAPSHOT_H
+
+#include <stdatomic.h>
+
+#include "indexer.h"
+#include "arena.h"
+#include "index.h"
+
+// hash table from parent id and name to position in base, built for watch mode only
+typedef struct pathMap_s {
+    int *slots;
+    size_t capacity;
+    // base entries grouped by parent: children of entry i are entries[start[i]] up to entries[start[i + 1]],
+    // topmost entries follow start[count], built with the slots
+    uint32_t *start;
+    uint32_t *entries;
+} pathMap;
+
+// index file shared by all snapshots created from it, unmapped with the last one
+typedef struct indexBase_s {
+    atomic_int refs;
+    indexFile file;
+    pathMap map;
+} indexBase;
+
+// files and bytes of one owner below a directory
+typedef struct ownerUsage_s {
+    uid_t UID;
+    int64_t files;
+    int64_t bytes;
+} ownerUsage;
+
+// regular files below a directory, directories themselves are not counted
+typedef struct directoryUsage_s {
+    int64_t files;
+    int64_t bytes;
+    int64_t typeFiles[TYPE_COUNT];
+    int64_t typeBytes[TYPE_COUNT];
+    // ascending by uid
+    ownerUsage *owners;
+    int ownerCount;
+    int ownerCapacity;
+} directoryUsage;
+
+// change of usage below a directory since base was written
+typedef struct rollupDelta_s {
+    const char *path;
+    directoryUsage usage;
+} rollupDelta;
+
+// usage of one directory, entry is its position in snapshot
+typedef struct directoryTotal_s {
+    int entry;
+    int64_t files;
+    int64_t bytes;
+} directoryTotal;
+
+// immutable view of index, queries pin it for as long as they print results;
+// changes reported by watch mode are kept on top of base until the index is rewritten
+typedef struct snapshot_s {
+    atomic_int refs;
+    unsigned long generation;
+    indexBase *base;
+    // bitmap of base entries deleted or replaced since base was written, NULL if none
+    unsigned char *removed;
+    int removedCount;
+    indexedFile *added;
+    int addedCount;
+    int addedCapacity;
+    // positions of added entries keyed by path, open addressing table twice as large as capacity
+    int *addedSlots;
+    // paths of added entries
+    stringArena strings;
+    // live entries of each type, kept up to date as entries are added and removed
+    int typeCounts[TYPE_COUNT];
+    // changes of rollups of base keyed by directory path, every ancestor of a changed file has one,
+    // found through slots of an open addressing table twice as large as capacity
+    rollupDelta *rollupDeltas;
+    int rollupDeltaCount;
+    int rollupDeltaCapacity;
+    int *rollupSlots;
+    // change of whole index
+    directoryUsage totalDelta;
+} snapshot;
+
+// snapshot published for one shard of the index, every shard has its own generations
+typedef struct snapshotSlot_s {
+    _Atomic(snapshot *) current;
+    // readers register in the counter of current epoch while they take a reference, publisher flips the epoch
+    // and waits only for readers that could still see previous snapshot; each slot has its own, so publishers
+    // of different slots never wait on each other's readers
+    atomic_ulong epoch;
+    atomic_long readers[2];
+} snapshotSlot;
+
+// takes over loaded index file, file == NULL creates an empty base
+indexBase *createBase(indexFile *file);
+
+// new snapshot with no changes on top of base, takes over caller's reference to base
+snapshot *createSnapshot(indexBase *base);
+
+// writable copy of snapshot which can be changed and published
+snapshot *cloneSnapshot(const snapshot *s);
+
+// walks entries with size in a range in ascending size order, entries of index file come first among equal ones
+typedef struct sizeCursor_s {
+    size_t next;
+    size_t last;
+    // positions of added entries in range sorted by size, merged with range of index file
+    int *added;
+    int addedCount;
+    int addedNext;
+} sizeCursor;
+
+#define INTERSECTION_MAX_LISTS 4
+
+// sorted lists of positions walked together, yields positions present in all of them
+typedef struct listIntersection_s {
+    const uint32_t *lists[INTERSECTION_MAX_LISTS];
+    size_t lengths[INTERSECTION_MAX_LISTS];
+    size_t next[INTERSECTION_MAX_LISTS];
+    int count;
+} listIntersection;
+
+// walks entries of given type and owner by intersecting posting lists of index file,
+// entries of index file come first in ascending position order
+typedef struct postingCursor_s {
+    listIntersection lists;
+    int added;
+    int type;
+    int hasOwner;
+    uid_t UID;
+} postingCursor;
+
+// walks entries whose name holds pattern, entries of index file come first in ascending position order
+typedef struct nameCursor_s {
+    const char *pattern;
+    size_t length;
+    // patterns of 3 or more bytes are looked up in trigram lists, shorter ones scan all names
+    int useTrigrams;
+    listIntersection lists;
+    size_t scanOffset;
+    int added;
+} nameCursor;
+
+// pins snapshot currently published in slot, never blocks
+snapshot *acquireSnapshot(snapshotSlot *slot);
+
+void releaseSnapshot(snapshot *s);
+
+// makes next visible to new queries of slot and drops reference to previous snapshot; publishers of different
+// slots may run at once, callers publishing to the same slot concurrently have to be serialized
+void publishSnapshot(snapshotSlot *slot, snapshot *next);
+
+// number of entry slots, some of them may be removed
+int snapshotSize(const snapshot *s);
+
+// fills entry and returns 1, returns 0 if it was removed;
+// strings of entry stay valid as long as snapshot is pinned, path is NULL for entries of index file
+int snapshotEntry(const snapshot *s, int i, indexedFile *entry);
+
+// prepares cache for rebuilding paths of entries of s
+void initSnapshotPathCache(const snapshot *s, pathCache *cache);
+
+// full path of i-th entry, valid until the next call with the same cache
+const char *snapshotEntryPath(const snapshot *s, pathCache *cache, int i);
+
+// starts walking entries with size in [min, max], cursor has to be freed with freeSizeCursor
+void snapshotSizeRange(const snapshot *s, int64_t min, int64_t max, sizeCursor *cursor);
+
+// position of next entry in range that is not removed, -1 after the last one
+int snapshotSizeNext(const snapshot *s, sizeCursor *cursor);
+
+void freeSizeCursor(sizeCursor *cursor);
+
+// starts walking entries of type (TYPE_NONE for any) owned by *UID (NULL for any), at least one has to be given
+void snapshotPostings(const snapshot *s, int type, const uid_t *UID, postingCursor *cursor);
+
+// position of next matching entry that is not removed, -1 after the last one
+int snapshotPostingNext(const snapshot *s, postingCursor *cursor);
+
+// starts walking entries whose name holds pattern, pattern has to outlive the cursor
+void snapshotNameSearch(const snapshot *s, const char *pattern, nameCursor *cursor);
+
+// position of next matching entry that is not removed, -1 after the last one
+int snapshotNameNext(const snapshot *s, nameCursor *cursor);
+
+// number of live entries of type, constant time
+int snapshotTypeCount(const snapshot *s, int type);
+
+// fills positions with up to k largest entries in descending size order, returns their number
+int snapshotLargest(const snapshot *s, int k, int *positions);
+
+// number of entries that are not removed
+int snapshotLiveCount(const snapshot *s);
+
+// number of changes kept on top of base
+int snapshotDeltaSize(const snapshot *s);
+
+// usage below directory at path in base rollups corrected by changes made since, returns -1 if path is not
+// an indexed directory; usage has to be freed with freeDirectoryUsage
+int snapshotDirectoryUsage(const snapshot *s, pathCache *paths, const char *path, directoryUsage *usage);
+
+void freeDirectoryUsage(directoryUsage *usage);
+
+// fills totals with up to k directories holding the most bytes in descending order, returns their number;
+// directories are read from base in order of their rollups, only changed ones are looked at separately
+int snapshotTopDirectories(const snapshot *s, pathCache *paths, int k, directoryTotal *totals);
+
+// files and bytes owned by UID in whole index
+void snapshotOwnerUsage(const snapshot *s, uid_t UID, int64_t *files, int64_t *bytes);
+
+// removes path and, if it is a directory, everything below it from unpublished snapshot
+void snapshotRemoveSubtree(snapshot *s, const char *path);
+
+// adds or replaces entry of unpublished snapshot
+void snapshotPut(snapshot *s, const indexedFile *entry);
+
+#endif //FILE_INDEXER_SNAPSHOT_H
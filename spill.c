@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "spill.h"
+#include "indexer.h"
+
+#define SPILL_PREFIX_LENGTH sizeof(uint64_t)
+
+static size_t padded(size_t length) {
+    return (length + 7) & ~(size_t) 7;
+}
+
+void initSpillSorter(spillSorter *s, const char *directory, size_t budget, spillCompare compare) {
+    memset(s, 0, sizeof(spillSorter));
+    s->compare = compare;
+    s->directory = strdup(directory);
+    if (s->directory == NULL) ERR("strdup");
+    // a quarter of budget at most is kept for read buffers of merged runs
+    s->maxRuns = budget / 4 / SPILL_READ_BUFFER;
+    if (s->maxRuns < SPILL_MIN_RUNS) s->maxRuns = SPILL_MIN_RUNS;
+    if (s->maxRuns > SPILL_MAX_RUNS) s->maxRuns = SPILL_MAX_RUNS;
+    size_t reserved = s->maxRuns * SPILL_READ_BUFFER;
+    budget = budget > reserved ? budget - reserved : 0;
+    // pages of both are touched only as records arrive
+    s->capacity = budget / 4 * 3;
+    s->recordCapacity = budget / 4 / sizeof(char *);
+    if (s->capacity < SPILL_READ_BUFFER) s->capacity = SPILL_READ_BUFFER;
+    if (s->recordCapacity < 16) s->recordCapacity = 16;
+    s->buffer = malloc(s->capacity);
+    s->records = malloc(s->recordCapacity * sizeof(char *));
+    if (s->buffer == NULL || s->records == NULL) ERR("malloc");
+}
+
+static int compareRecords(const void *a, const void *b, void *arg) {
+    return ((spillSorter *) arg)->compare(*(const char *const *) a, *(const char *const *) b);
+}
+
+// creates an unlinked temporary file for a run, returns -1 and sets error if it could not be created
+static int createRun(spillSorter *s) {
+    char *path = malloc(strlen(s->directory) + sizeof("/.mole-spill-XXXXXX"));
+    if (path == NULL) ERR("malloc");
+    sprintf(path, "%s/.mole-spill-XXXXXX", s->directory);
+    int fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    free(path);
+    if (fd < 0) s->error = errno;
+    return fd;
+}
+
+// writes all parts to run, their lengths are added to length; sets error if writing failed
+static void writeParts(spillSorter *s, int fd, struct iovec *parts, int n, off_t *length) {
+    for (int first = 0; first < n;) {
+        ssize_t written = writev(fd, parts + first, n - first);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            s->error = errno;
+            return;
+        }
+        *length += written;
+        while (first < n && (size_t) written >= parts[first].iov_len) written -= (ssize_t) parts[first++].iov_len;
+        if (first < n) {
+            parts[first].iov_base = (char *) parts[first].iov_base + written;
+            parts[first].iov_len -= written;
+        }
+    }
+}
+
+static void addRun(spillSorter *s, int fd, off_t length) {
+    if (s->runCount == s->runCapacity) {
+        s->runCapacity = s->runCapacity ? s->runCapacity * 2 : 16;
+        s->runs = realloc(s->runs, s->runCapacity * sizeof(spillRun));
+        if (s->runs == NULL) ERR("realloc");
+    }
+    spillRun *run = &s->runs[s->runCount++];
+    memset(run, 0, sizeof(spillRun));
+    run->fd = fd;
+    run->length = length;
+}
+
+// sorts records held in memory and writes them with their length prefixes as a new run
+static void writeRun(spillSorter *s) {
+    if (s->count == 0 || s->error != 0) return;
+    qsort_r(s->records, s->count, sizeof(char *), compareRecords, s);
+    int fd = createRun(s);
+    if (fd < 0) return;
+
+    // every record is contiguous with its prefix, so runs are written straight from the buffer
+    off_t length = 0;
+    struct iovec parts[IOV_MAX];
+    for (size_t i = 0; i < s->count && s->error == 0;) {
+        int n = 0;
+        for (; n < IOV_MAX && i < s->count; n++, i++) {
+            const char *record = s->records[i] - SPILL_PREFIX_LENGTH;
+            uint64_t recordLength;
+            memcpy(&recordLength, record, sizeof(recordLength));
+            parts[n].iov_base = (void *) record;
+            parts[n].iov_len = SPILL_PREFIX_LENGTH + padded(recordLength);
+        }
+        writeParts(s, fd, parts, n, &length);
+    }
+    if (s->error != 0) {
+        close(fd);
+        return;
+    }
+    addRun(s, fd, length);
+    s->used = 0;
+    s->count = 0;
+}
+
+// makes at least needed bytes from position on available in buffer, returns -1 if run ends before
+static int fillRun(spillRun *run, size_t needed) {
+    if (run->bufferLength - run->position >= needed) return 0;
+    memmove(run->buffer, run->buffer + run->position, run->bufferLength - run->position);
+    run->bufferLength -= run->position;
+    run->position = 0;
+    if (needed > run->bufferCapacity) {
+        run->bufferCapacity = needed;
+        run->buffer = realloc(run->buffer, run->bufferCapacity);
+        if (run->buffer == NULL) ERR("realloc");
+    }
+    while (run->bufferLength < needed) {
+        ssize_t n = pread(run->fd, run->buffer + run->bufferLength, run->bufferCapacity - run->bufferLength,
+                          run->offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        run->bufferLength += n;
+        run->offset += n;
+    }
+    return 0;
+}
+
+// moves run to its next record, record is NULL once run is exhausted
+static void advanceRun(spillRun *run) {
+    if (run->record != NULL) run->position += SPILL_PREFIX_LENGTH + padded(run->recordLength);
+    run->record = NULL;
+    uint64_t length;
+    if (fillRun(run, SPILL_PREFIX_LENGTH) < 0) return;
+    memcpy(&length, run->buffer + run->position, sizeof(length));
+    if (fillRun(run, SPILL_PREFIX_LENGTH + padded(length)) < 0) return;
+    run->recordLength = length;
+    run->record = run->buffer + run->position + SPILL_PREFIX_LENGTH;
+}
+
+static int runBefore(spillSorter *s, size_t a, size_t b) {
+    return s->compare(s->runs[a].record, s->runs[b].record) < 0;
+}
+
+static void siftDown(spillSorter *s, size_t i) {
+    while (1) {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < s->heapCount && runBefore(s, s->heap[left], s->heap[smallest])) smallest = left;
+        if (right < s->heapCount && runBefore(s, s->heap[right], s->heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        size_t swap = s->heap[i];
+        s->heap[i] = s->heap[smallest];
+        s->heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// reads first record of every run and orders runs by them
+static void startMerge(spillSorter *s) {
+    s->heap = malloc((s->runCount + 1) * sizeof(size_t));
+    if (s->heap == NULL) ERR("malloc");
+    s->heapCount = 0;
+    for (size_t i = 0; i < s->runCount; i++) {
+        spillRun *run = &s->runs[i];
+        run->bufferCapacity = SPILL_READ_BUFFER;
+        run->buffer = malloc(run->bufferCapacity);
+        if (run->buffer == NULL) ERR("malloc");
+        advanceRun(run);
+        if (run->record != NULL) s->heap[s->heapCount++] = i;
+    }
+    for (size_t i = s->heapCount; i-- > 0;) siftDown(s, i);
+    s->next = 0;
+}
+
+static const char *nextMerged(spillSorter *s, size_t *length) {
+    // run which gave the previous record moves on before the smallest one is picked again
+    if (s->next > 0) {
+        advanceRun(&s->runs[s->heap[0]]);
+        if (s->runs[s->heap[0]].record == NULL) s->heap[0] = s->heap[--s->heapCount];
+        siftDown(s, 0);
+    }
+    if (s->heapCount == 0) return NULL;
+    s->next = 1;
+    spillRun *run = &s->runs[s->heap[0]];
+    *length = run->recordLength;
+    return run->record;
+}
+
+static void closeRuns(spillSorter *s) {
+    for (size_t i = 0; i < s->runCount; i++) {
+        close(s->runs[i].fd);
+        free(s->runs[i].buffer);
+    }
+    s->runCount = 0;
+}
+
+// merges all runs into a single one while nothing is held in memory, buffer gathers merged records;
+// a failed write sets error and keeps the runs
+static void mergeRuns(spillSorter *s) {
+    if (s->error != 0) return;
+    int fd = createRun(s);
+    if (fd < 0) return;
+    startMerge(s);
+    off_t length = 0;
+    size_t used = 0, recordLength;
+    const char *record;
+    while (s->error == 0 && (record = nextMerged(s, &recordLength)) != NULL) {
+        // record is contiguous with its prefix in the read buffer of its run
+        struct iovec part = {.iov_base = (void *) (record - SPILL_PREFIX_LENGTH),
+                             .iov_len = SPILL_PREFIX_LENGTH + padded(recordLength)};
+        if (used + part.iov_len > s->capacity) {
+            struct iovec gathered = {.iov_base = s->buffer, .iov_len = used};
+            writeParts(s, fd, &gathered, 1, &length);
+            used = 0;
+        }
+        if (part.iov_len > s->capacity) {
+            writeParts(s, fd, &part, 1, &length);
+        } else {
+            memcpy(s->buffer + used, part.iov_base, part.iov_len);
+            used += part.iov_len;
+        }
+    }
+    if (s->error == 0 && used > 0) {
+        struct iovec gathered = {.iov_base = s->buffer, .iov_len = used};
+        writeParts(s, fd, &gathered, 1, &length);
+    }
+    free(s->heap);
+    s->heap = NULL;
+    s->heapCount = 0;
+    s->next = 0;
+    if (s->error != 0) {
+        close(fd);
+        return;
+    }
+    closeRuns(s);
+    addRun(s, fd, length);
+}
+
+void spillAdd(spillSorter *s, const void *record, size_t length) {
+    size_t needed = SPILL_PREFIX_LENGTH + padded(length);
+    if (s->used + needed > s->capacity || s->count == s->recordCapacity) {
+        writeRun(s);
+        if (s->runCount == s->maxRuns) mergeRuns(s);
+    }
+    if (needed > s->capacity) {
+        // a record longer than the whole budget gets a buffer of its own size
+        s->capacity = needed;
+        s->buffer = realloc(s->buffer, s->capacity);
+        if (s->buffer == NULL) ERR("realloc");
+    }
+    s->total++;
+    // after a failed write records are only counted, reading them back fails anyway
+    if (s->error != 0) return;
+    char *slot = s->buffer + s->used;
+    uint64_t prefix = length;
+    memcpy(slot, &prefix, sizeof(prefix));
+    memcpy(slot + SPILL_PREFIX_LENGTH, record, length);
+    memset(slot + SPILL_PREFIX_LENGTH + length, 0, padded(length) - length);
+    s->records[s->count++] = slot + SPILL_PREFIX_LENGTH;
+    s->used += needed;
+}
+
+int spillFinish(spillSorter *s) {
+    if (s->runCount == 0) {
+        // everything fits in memory, it is read back from there
+        if (s->error == 0) qsort_r(s->records, s->count, sizeof(char *), compareRecords, s);
+    } else {
+        writeRun(s);
+        free(s->buffer);
+        free(s->records);
+        s->buffer = NULL;
+        s->records = NULL;
+        s->capacity = s->recordCapacity = 0;
+    }
+    if (s->error != 0) {
+        errno = s->error;
+        return -1;
+    }
+
+    startMerge(s);
+    return 0;
+}
+
+const void *spillNext(spillSorter *s, size_t *length) {
+    if (s->runCount == 0) {
+        if (s->next == s->count) return NULL;
+        const char *record = s->records[s->next++];
+        uint64_t prefix;
+        memcpy(&prefix, record - SPILL_PREFIX_LENGTH, sizeof(prefix));
+        *length = prefix;
+        return record;
+    }
+    return nextMerged(s, length);
+}
+
+void freeSpillSorter(spillSorter *s) {
+    closeRuns(s);
+    free(s->runs);
+    free(s->heap);
+    free(s->buffer);
+    free(s->records);
+    free(s->directory);
+    memset(s, 0, sizeof(spillSorter));
+}
+
+char *spillDirectory(const char *path) {
+    char *directory = strdup(path);
+    if (directory == NULL) ERR("strdup");
+    char *slash = strrchr(directory, '/');
+    if (slash == directory) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        strcpy(directory, ".");
+    }
+    return directory;
+}
@@ -0,0 +1,76 @@
+#ifndef FILE_INDEXER_SPILL_H
+#define FILE_INDEXER_SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// bytes read ahead from every run while runs are merged
+#define SPILL_READ_BUFFER (64 * 1024)
+// most runs merged at once, more of them are first merged into one run; fewer are merged with a small budget
+#define SPILL_MAX_RUNS 16
+#define SPILL_MIN_RUNS 2
+
+// records are compared by their bytes, which are aligned to 8
+typedef int (*spillCompare)(const void *a, const void *b);
+
+// sorted run written to an unlinked temporary file and read back through a buffer while runs are merged
+typedef struct spillRun_s {
+    int fd;
+    off_t length;
+    // of next read from the file
+    off_t offset;
+    char *buffer;
+    size_t bufferCapacity;
+    size_t bufferLength;
+    // start of current record within buffer, NULL once run is exhausted
+    const char *record;
+    size_t position;
+    size_t recordLength;
+} spillRun;
+
+// sorts records of any length within a memory budget: records are gathered in memory, each time they fill it
+// they are sorted and written as a run, runs are k-way merged when records are read back; once there are maxRuns
+// of them they are merged into a single run, so open files and read buffers stay bounded
+typedef struct spillSorter_s {
+    spillCompare compare;
+    char *directory;
+    // records held in memory, each one is its length (8 bytes) followed by its bytes padded to 8
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    const char **records;
+    size_t count;
+    size_t recordCapacity;
+    spillRun *runs;
+    size_t runCount;
+    size_t runCapacity;
+    // read buffers of this many runs are reserved from budget
+    size_t maxRuns;
+    // records added in total
+    size_t total;
+    // errno of a failed write of a run, 0 if none
+    int error;
+    // runs ordered by their current record, or next record in memory when nothing was spilled
+    size_t *heap;
+    size_t heapCount;
+    size_t next;
+} spillSorter;
+
+// runs are written to directory, budget covers records held in memory and buffers of runs being merged
+void initSpillSorter(spillSorter *s, const char *directory, size_t budget, spillCompare compare);
+
+void spillAdd(spillSorter *s, const void *record, size_t length);
+
+// ends adding records and prepares reading them in order, returns -1 and sets errno if a run could not be written
+int spillFinish(spillSorter *s);
+
+// next record in order or NULL after the last one, it stays valid until the next call
+const void *spillNext(spillSorter *s, size_t *length);
+
+void freeSpillSorter(spillSorter *s);
+
+// directory holding path, where runs of an index being written there are put
+char *spillDirectory(const char *path);
+
+#endif //FILE_INDEXER_SPILL_H
@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "indexer.h"
+#include "stats.h"
+
+typedef struct histogram_s {
+    atomic_uint_fast64_t buckets[STATS_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+} histogram;
+
+// counters are only ever added to, so relaxed atomics are enough; hot loops count locally and add once
+static struct {
+    atomic_uint_fast64_t counters[STATS_COUNTER_COUNT];
+    histogram histograms[STATS_HISTOGRAM_COUNT];
+    atomic_uint_fast64_t lastWalkEntries;
+    atomic_uint_fast64_t lastWalkNanoseconds;
+    char *dumpPath;
+    int dumpInterval;
+    pthread_t dumpThread;
+    pthread_mutex_t dumpMutex;
+} stats = {.dumpMutex = PTHREAD_MUTEX_INITIALIZER};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counterNames[STATS_COUNTER_COUNT] = {
+        [STATS_WALKS] = {"walks", "Traversals of indexed directories"},
+        [STATS_ENTRIES_INDEXED] = {"entries_indexed", "Entries of indexed type found by traversals"},
+        [STATS_FILES_SKIPPED] = {"files_skipped", "Regular files of type which is not indexed"},
+        [STATS_DIRECTORIES] = {"directories_scanned", "Directories read by traversals"},
+        [STATS_STAT_CALLS] = {"stat_calls", "stat calls made by traversals"},
+        [STATS_OPEN_CALLS] = {"open_calls", "Files and directories opened by traversals"},
+        [STATS_READ_CALLS] = {"read_calls", "Reads of magic numbers"},
+        [STATS_BYTES_READ] = {"bytes_read", "Bytes of magic numbers read"},
+        [STATS_ERRORS] = {"errors", "Entries which could not be opened or stat'ed"},
+        [STATS_WATCH_REFRESHES] = {"watch_refreshes", "Paths refreshed by watch mode"},
+        [STATS_THROTTLE_WAITS] = {"throttle_waits", "Times scheduled reindexing waited for its budget"},
+        [STATS_QUERY_CACHE_HITS] = {"query_cache_hits", "Queries answered from cached results"},
+        [STATS_QUERY_CACHE_MISSES] = {"query_cache_misses", "Cacheable queries run against the index"},
+};
+
+// histograms of one family differ by label only
+static const struct {
+    const char *family;
+    const char *label;
+    const char *name;
+    const char *help;
+} histogramNames[STATS_HISTOGRAM_COUNT] = {
+        [STATS_PHASE_WALK] = {"index_phase", "phase=\"walk\"", "walk", "Duration of indexing phases"},
+        [STATS_PHASE_WRITE] = {"index_phase", "phase=\"write\"", "write", NULL},
+        [STATS_PHASE_SWAP_FILES] = {"index_phase", "phase=\"swap_files\"", "swap files", NULL},
+        [STATS_PHASE_PUBLISH] = {"index_phase", "phase=\"publish\"", "publish", NULL},
+        [STATS_DATABASE_WAIT] = {"database_mutex_wait", NULL, "database wait", "Time spent waiting for database lock"},
+        [STATS_COMMAND_INDEX] = {"command", "command=\"index\"", "index", "Latency of commands"},
+        [STATS_COMMAND_COUNT] = {"command", "command=\"count\"", "count", NULL},
+        [STATS_COMMAND_LARGERTHAN] = {"command", "command=\"largerthan\"", "largerthan", NULL},
+        [STATS_COMMAND_SMALLERTHAN] = {"command", "command=\"smallerthan\"", "smallerthan", NULL},
+        [STATS_COMMAND_SIZEBETWEEN] = {"command", "command=\"sizebetween\"", "sizebetween", NULL},
+        [STATS_COMMAND_LARGEST] = {"command", "command=\"largest\"", "largest", NULL},
+        [STATS_COMMAND_NAMEPART] = {"command", "command=\"namepart\"", "namepart", NULL},
+        [STATS_COMMAND_FILTER] = {"command", "command=\"owner_type\"", "owner/type", NULL},
+        [STATS_COMMAND_FIND] = {"command", "command=\"find\"", "find", NULL},
+        [STATS_COMMAND_STATS] = {"command", "command=\"stats\"", "stats", NULL},
+        [STATS_COMMAND_DU] = {"command", "command=\"du\"", "du", NULL},
+        [STATS_COMMAND_TOPDIRS] = {"command", "command=\"topdirs\"", "topdirs", NULL},
+        [STATS_COMMAND_USAGE] = {"command", "command=\"usage\"", "usage", NULL},
+};
+
+int64_t statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void statsAdd(int counter, uint64_t value) {
+    atomic_fetch_add_explicit(&stats.counters[counter], value, memory_order_relaxed);
+}
+
+// bucket b holds durations shorter than 2^b microseconds
+static int bucketOf(int64_t nanoseconds) {
+    uint64_t microseconds = nanoseconds > 0 ? (uint64_t) nanoseconds / 1000 : 0;
+    int bucket = 0;
+    while (microseconds > 0 && bucket < STATS_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void statsRecord(int histogram, int64_t nanoseconds) {
+    struct histogram_s *h = &stats.histograms[histogram];
+    atomic_fetch_add_explicit(&h->buckets[bucketOf(nanoseconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, nanoseconds > 0 ? nanoseconds : 0, memory_order_relaxed);
+}
+
+void statsAddWalkCounters(const walkCounters *counters) {
+    statsAdd(STATS_DIRECTORIES, counters->directories);
+    statsAdd(STATS_STAT_CALLS, counters->statCalls);
+    statsAdd(STATS_OPEN_CALLS, counters->openCalls);
+    statsAdd(STATS_READ_CALLS, counters->readCalls);
+    statsAdd(STATS_BYTES_READ, counters->bytesRead);
+    statsAdd(STATS_ERRORS, counters->errors);
+}
+
+void statsRecordWalk(const walkResult *result, int64_t nanoseconds) {
+    statsAdd(STATS_WALKS, 1);
+    statsAdd(STATS_ENTRIES_INDEXED, result->count + result->spilled);
+    statsAdd(STATS_FILES_SKIPPED, result->skippedCount);
+    statsAddWalkCounters(&result->counters);
+    statsRecord(STATS_PHASE_WALK, nanoseconds);
+    atomic_store_explicit(&stats.lastWalkEntries, result->count + result->spilled + result->skippedCount,
+                          memory_order_relaxed);
+    atomic_store_explicit(&stats.lastWalkNanoseconds, nanoseconds, memory_order_relaxed);
+}
+
+void statsLock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        statsRecord(STATS_DATABASE_WAIT, 0);
+        return;
+    }
+    int64_t start = statsNow();
+    pthread_mutex_lock(mutex);
+    statsRecord(STATS_DATABASE_WAIT, statsNow() - start);
+}
+
+static uint64_t load(atomic_uint_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+// upper bound of bucket holding given fraction of recorded durations, in microseconds
+static uint64_t percentile(histogram *h, double fraction) {
+    uint64_t count = load(&h->count), seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += load(&h->buckets[b]);
+        if (seen > 0 && seen >= fraction * count) return (uint64_t) 1 << b;
+    }
+    return (uint64_t) 1 << (STATS_BUCKETS - 1);
+}
+
+static void printDuration(FILE *stream, double microseconds) {
+    if (microseconds < 1000) {
+        fprintf(stream, " %8.0fus", microseconds);
+    } else if (microseconds < 1000000) {
+        fprintf(stream, " %8.2fms", microseconds / 1000);
+    } else {
+        fprintf(stream, " %8.2fs ", microseconds / 1000000);
+    }
+}
+
+void printStats(FILE *stream) {
+    double walkSeconds = load(&stats.lastWalkNanoseconds) / 1e9;
+    uint64_t walkEntries = load(&stats.lastWalkEntries);
+    fprintf(stream, "Traversals: %lu", (unsigned long) load(&stats.counters[STATS_WALKS]));
+    if (walkSeconds > 0) {
+        fprintf(stream, ", last one saw %lu files in %.3fs (%.0f files/s)", (unsigned long) walkEntries,
+                walkSeconds, walkEntries / walkSeconds);
+    }
+    fprintf(stream, "\n");
+    for (int i = STATS_ENTRIES_INDEXED; i < STATS_COUNTER_COUNT; i++) {
+        fprintf(stream, "%s: %lu\n", counterNames[i].name, (unsigned long) load(&stats.counters[i]));
+    }
+    fprintf(stream, "%-16s %8s %10s %10s %10s\n", "timing", "count", "p50 <", "p99 <", "total");
+    for (int i = 0; i < STATS_HISTOGRAM_COUNT; i++) {
+        histogram *h = &stats.histograms[i];
+        uint64_t count = load(&h->count);
+        if (count == 0) continue;
+        fprintf(stream, "%-16s %8lu", histogramNames[i].name, (unsigned long) count);
+        printDuration(stream, percentile(h, 0.5));
+        printDuration(stream, percentile(h, 0.99));
+        printDuration(stream, load(&h->sum) / 1e3);
+        fprintf(stream, "\n");
+    }
+}
+
+// prints name{labels,le="..."} joining optional label of histogram with the bucket label
+static void printSeries(FILE *stream, int i, const char *suffix, const char *le) {
+    fprintf(stream, "mole_%s_seconds%s", histogramNames[i].family, suffix);
+    const char *label = histogramNames[i].label;
+    if (label == NULL && le == NULL) return;
+    fprintf(stream, "{%s%s", label != NULL ? label : "", label != NULL && le != NULL ? "," : "");
+    if (le != NULL) fprintf(stream, "le=\"%s\"", le);
+    fprintf(stream, "}");
+}
+
+void writeStatsPrometheus(FILE *stream) {
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        fprintf(stream, "# HELP mole_%s_total %s\n", counterNames[i].name, counterNames[i].help);
+        fprintf(stream, "# TYPE mole_%s_total counter\n", counterNames[i].name);
+        fprintf(stream, "mole_%s_total %lu\n", counterNames[i].name, (unsigned long) load(&stats.counters[i]));
+    }
+    fprintf(stream, "# HELP mole_last_walk_files Files seen by the last traversal\n");
+    fprintf(stream, "# TYPE mole_last_walk_files gauge\n");
+    fprintf(stream, "mole_last_walk_files %lu\n", (unsigned long) load(&stats.lastWalkEntries));
+    fprintf(stream, "# HELP mole_last_walk_seconds Duration of the last traversal\n");
+    fprintf(stream, "# TYPE mole_last_walk_seconds gauge\n");
+    fprintf(stream, "mole_last_walk_seconds %.9f\n", load(&stats.lastWalkNanoseconds) / 1e9);
+
+    char le[32];
+    for (int i = 0; i < STATS_HISTOGRAM_COUNT; i++) {
+        histogram *h = &stats.histograms[i];
+        if (histogramNames[i].help != NULL) {
+            fprintf(stream, "# HELP mole_%s_seconds %s\n", histogramNames[i].family, histogramNames[i].help);
+            fprintf(stream, "# TYPE mole_%s_seconds histogram\n", histogramNames[i].family);
+        }
+        uint64_t cumulative = 0;
+        for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+            cumulative += load(&h->buckets[b]);
+            snprintf(le, sizeof(le), "%.9g", (double) ((uint64_t) 1 << b) / 1e6);
+            printSeries(stream, i, "_bucket", le);
+            fprintf(stream, " %lu\n", (unsigned long) cumulative);
+        }
+        uint64_t count = load(&h->count);
+        printSeries(stream, i, "_bucket", "+Inf");
+        fprintf(stream, " %lu\n", (unsigned long) count);
+        printSeries(stream, i, "_sum", NULL);
+        fprintf(stream, " %.9f\n", load(&h->sum) / 1e9);
+        printSeries(stream, i, "_count", NULL);
+        fprintf(stream, " %lu\n", (unsigned long) count);
+    }
+}
+
+void dumpStats(void) {
+    if (stats.dumpPath == NULL) return;
+    pthread_mutex_lock(&stats.dumpMutex);
+    size_t length = strlen(stats.dumpPath);
+    char *tempPath = malloc(length + 6);
+    if (tempPath == NULL) ERR("malloc");
+    memcpy(tempPath, stats.dumpPath, length);
+    strcpy(tempPath + length, "-temp");
+
+    FILE *f = fopen(tempPath, "w");
+    if (f == NULL) {
+        perror("Error writing metrics file");
+    } else {
+        writeStatsPrometheus(f);
+        if (fclose(f) != 0 || rename(tempPath, stats.dumpPath) != 0) {
+            perror("Error writing metrics file");
+            unlink(tempPath);
+        }
+    }
+    free(tempPath);
+    pthread_mutex_unlock(&stats.dumpMutex);
+}
+
+static void *statsDumpRun(void *voidPtr) {
+    (void) voidPtr;
+    while (1) {
+        dumpStats();
+        sleep(stats.dumpInterval);
+    }
+    return NULL;
+}
+
+void startStatsDump(const char *path, int interval) {
+    stats.dumpPath = strdup(path);
+    if (stats.dumpPath == NULL) ERR("strdup");
+    stats.dumpInterval = interval;
+    int err = pthread_create(&stats.dumpThread, NULL, statsDumpRun, NULL);
+    if (err != 0) ERR("pthread_create");
+    pthread_detach(stats.dumpThread);
+}
@@ -0,0 +1,84 @@
+#ifndef FILE_INDEXER_STATS_H
+#define FILE_INDEXER_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "walk.h"
+
+// latencies are counted in buckets of powers of two microseconds, the last one holds everything longer
+#define STATS_BUCKETS 32
+
+enum statsCounter {
+    STATS_WALKS,
+    STATS_ENTRIES_INDEXED,
+    STATS_FILES_SKIPPED,
+    STATS_DIRECTORIES,
+    STATS_STAT_CALLS,
+    STATS_OPEN_CALLS,
+    STATS_READ_CALLS,
+    STATS_BYTES_READ,
+    STATS_ERRORS,
+    STATS_WATCH_REFRESHES,
+    STATS_THROTTLE_WAITS,
+    STATS_QUERY_CACHE_HITS,
+    STATS_QUERY_CACHE_MISSES,
+    STATS_COUNTER_COUNT
+};
+
+enum statsHistogram {
+    // phases of indexing and reindexing
+    STATS_PHASE_WALK,
+    STATS_PHASE_WRITE,
+    STATS_PHASE_SWAP_FILES,
+    STATS_PHASE_PUBLISH,
+    // time spent waiting for databaseMutex
+    STATS_DATABASE_WAIT,
+    // commands, from reading the line to printing the last result
+    STATS_COMMAND_INDEX,
+    STATS_COMMAND_COUNT,
+    STATS_COMMAND_LARGERTHAN,
+    STATS_COMMAND_SMALLERTHAN,
+    STATS_COMMAND_SIZEBETWEEN,
+    STATS_COMMAND_LARGEST,
+    STATS_COMMAND_NAMEPART,
+    STATS_COMMAND_FILTER,
+    STATS_COMMAND_FIND,
+    STATS_COMMAND_STATS,
+    STATS_COMMAND_DU,
+    STATS_COMMAND_TOPDIRS,
+    STATS_COMMAND_USAGE,
+    STATS_HISTOGRAM_COUNT
+};
+
+// monotonic clock in nanoseconds
+int64_t statsNow(void);
+
+void statsAdd(int counter, uint64_t value);
+
+void statsRecord(int histogram, int64_t nanoseconds);
+
+// adds system calls made by a traversal or by a refresh of single path
+void statsAddWalkCounters(const walkCounters *counters);
+
+// adds counters of traversal of whole indexed tree and remembers its rate
+void statsRecordWalk(const walkResult *result, int64_t nanoseconds);
+
+// locks mutex, time spent waiting for it is recorded when it is held by another thread
+void statsLock(pthread_mutex_t *mutex);
+
+// human readable summary printed by stats command
+void printStats(FILE *stream);
+
+// all metrics in Prometheus text exposition format
+void writeStatsPrometheus(FILE *stream);
+
+// starts thread rewriting file at path every interval seconds, file is replaced atomically
+// so a scraper never reads it half written
+void startStatsDump(const char *path, int interval);
+
+// writes file once more, used on exit
+void dumpStats(void);
+
+#endif //FILE_INDEXER_STATS_H
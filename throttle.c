@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "throttle.h"
+#include "stats.h"
+
+// ioprio_set has no libc wrapper
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+void initThrottle(walkThrottle *t, double filesPerSecond, double bytesPerSecond, int niceness) {
+    memset(t, 0, sizeof(walkThrottle));
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wake, NULL);
+    t->filesPerSecond = filesPerSecond;
+    t->bytesPerSecond = bytesPerSecond;
+    t->niceness = niceness;
+    t->pace = 1;
+    atomic_init(&t->cancelled, 0);
+    atomic_init(&t->queriesRunning, 0);
+    atomic_init(&t->queries, 0);
+}
+
+int parseThrottleBudget(const char *text, double *filesPerSecond, double *bytesPerSecond) {
+    char *end;
+    *filesPerSecond = strtod(text, &end);
+    *bytesPerSecond = 0;
+    if (end == text || *filesPerSecond < 0) return -1;
+    if (*end == '\0') return 0;
+    if (*end != ',') return -1;
+    const char *bytes = end + 1;
+    *bytesPerSecond = strtod(bytes, &end);
+    if (end == bytes || *bytesPerSecond < 0) return -1;
+    const char *suffixes = "KMGT";
+    const char *suffix = *end != '\0' ? strchr(suffixes, toupper((unsigned char) *end)) : NULL;
+    if (suffix != NULL) {
+        for (const char *s = suffixes; s <= suffix; s++) *bytesPerSecond *= 1024;
+        end++;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+int throttleEnabled(const walkThrottle *t) {
+    return t->filesPerSecond > 0 || t->bytesPerSecond > 0 || t->niceness >= 0;
+}
+
+void resetThrottle(walkThrottle *t, int64_t changedSince) {
+    pthread_mutex_lock(&t->lock);
+    t->files = t->filesPerSecond;
+    t->bytes = t->bytesPerSecond;
+    t->refilled = t->adjusted = statsNow();
+    t->changedSince = changedSince;
+    atomic_store(&t->cancelled, 0);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// "some avg10" of /proc/pressure/io, 0 where the kernel does not report pressure
+static double ioPressure(void) {
+    FILE *file = fopen("/proc/pressure/io", "r");
+    if (file == NULL) return 0;
+    double pressure = 0;
+    if (fscanf(file, "some avg10=%lf", &pressure) != 1) pressure = 0;
+    fclose(file);
+    return pressure;
+}
+
+// halves pace when queries ran or host waited for I/O since last check, otherwise regains a step of it
+static void adjustPace(walkThrottle *t, int64_t now) {
+    if (now - t->adjusted < THROTTLE_ADJUST_INTERVAL) return;
+    t->adjusted = now;
+    unsigned long queries = atomic_load(&t->queries);
+    int busy = atomic_load(&t->queriesRunning) > 0 || queries != t->queriesSeen ||
+               ioPressure() > THROTTLE_IO_PRESSURE;
+    t->queriesSeen = queries;
+    if (busy) {
+        t->pace = t->pace / 2 > THROTTLE_MIN_PACE ? t->pace / 2 : THROTTLE_MIN_PACE;
+    } else {
+        t->pace = t->pace + THROTTLE_PACE_STEP < 1 ? t->pace + THROTTLE_PACE_STEP : 1;
+    }
+}
+
+// buckets hold at most one second of budget at current pace
+static void refill(walkThrottle *t, int64_t now) {
+    adjustPace(t, now);
+    double seconds = (double) (now - t->refilled) / 1e9;
+    double files = t->filesPerSecond * t->pace, bytes = t->bytesPerSecond * t->pace;
+    t->refilled = now;
+    t->files = t->files + seconds * files < files ? t->files + seconds * files : files;
+    t->bytes = t->bytes + seconds * bytes < bytes ? t->bytes + seconds * bytes : bytes;
+}
+
+// seconds until the larger debt is paid off at current pace
+static double debtSeconds(const walkThrottle *t) {
+    double seconds = 0;
+    if (t->filesPerSecond > 0 && t->files < 0) seconds = -t->files / (t->filesPerSecond * t->pace);
+    if (t->bytesPerSecond > 0 && t->bytes < 0 && -t->bytes / (t->bytesPerSecond * t->pace) > seconds) {
+        seconds = -t->bytes / (t->bytesPerSecond * t->pace);
+    }
+    return seconds;
+}
+
+int throttlePay(walkThrottle *t, double files, double bytes) {
+    if (atomic_load(&t->cancelled)) return -1;
+    if (t->filesPerSecond <= 0 && t->bytesPerSecond <= 0) return 0;
+    pthread_mutex_lock(&t->lock);
+    refill(t, statsNow());
+    t->files -= files;
+    t->bytes -= bytes;
+    double seconds;
+    while (!atomic_load(&t->cancelled) && (seconds = debtSeconds(t)) > 0) {
+        statsAdd(STATS_THROTTLE_WAITS, 1);
+        // wakes up at least every adjust interval so a change of pace applies to sleeping workers too
+        if (seconds > THROTTLE_ADJUST_INTERVAL / 1e9) seconds = THROTTLE_ADJUST_INTERVAL / 1e9;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        int64_t nanoseconds = deadline.tv_nsec + (int64_t) (seconds * 1e9);
+        deadline.tv_sec += nanoseconds / 1000000000;
+        deadline.tv_nsec = nanoseconds % 1000000000;
+        pthread_cond_timedwait(&t->wake, &t->lock, &deadline);
+        refill(t, statsNow());
+    }
+    pthread_mutex_unlock(&t->lock);
+    return atomic_load(&t->cancelled) ? -1 : 0;
+}
+
+void cancelThrottle(walkThrottle *t) {
+    pthread_mutex_lock(&t->lock);
+    atomic_store(&t->cancelled, 1);
+    pthread_cond_broadcast(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+}
+
+int throttleCancelled(walkThrottle *t) {
+    return atomic_load(&t->cancelled);
+}
+
+void throttleThread(const walkThrottle *t) {
+    if (t->niceness < 0) return;
+    // on Linux nice value and I/O priority belong to a thread
+    pid_t thread = (pid_t) syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, (id_t) thread, t->niceness);
+    // best effort level the kernel derives from nice value, from 0 for -20 to 7 for 19
+    int level = (t->niceness + 20) / 5;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread, IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level);
+}
+
+void throttleQueryStarted(walkThrottle *t) {
+    atomic_fetch_add(&t->queriesRunning, 1);
+    atomic_fetch_add(&t->queries, 1);
+}
+
+void throttleQueryFinished(walkThrottle *t) {
+    atomic_fetch_sub(&t->queriesRunning, 1);
+}
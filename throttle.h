@@ -0,0 +1,73 @@
+#ifndef FILE_INDEXER_THROTTLE_H
+#define FILE_INDEXER_THROTTLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// pace never drops below that fraction of budget
+#define THROTTLE_MIN_PACE (1.0 / 64)
+
+// fraction of budget regained in each interval without load
+#define THROTTLE_PACE_STEP (1.0 / 8)
+
+// nanoseconds between checks of load
+#define THROTTLE_ADJUST_INTERVAL 250000000LL
+
+// host is busy while some tasks waited for I/O more than that percent of the last 10 seconds
+#define THROTTLE_IO_PRESSURE 10.0
+
+// budget of scheduled reindexing: files and bytes of magic numbers are paid from token buckets refilled at a pace
+// which halves while queries run or the host waits for I/O and grows back gradually once they stop
+typedef struct walkThrottle_s {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // per second, 0 for no limit
+    double filesPerSecond;
+    double bytesPerSecond;
+    // tokens left, negative while more was used than budget allowed so far
+    double files;
+    double bytes;
+    int64_t refilled;
+    // fraction of budget allowed now
+    double pace;
+    int64_t adjusted;
+    unsigned long queriesSeen;
+    // nice value of traversal threads, their I/O priority follows it, -1 keeps priority of the program
+    int niceness;
+    // directories modified after that time (ns) are scanned before others, 0 for none
+    int64_t changedSince;
+    atomic_int cancelled;
+    atomic_int queriesRunning;
+    atomic_ulong queries;
+} walkThrottle;
+
+void initThrottle(walkThrottle *t, double filesPerSecond, double bytesPerSecond, int niceness);
+
+// reads "files[,bytes]" budget, bytes may end with K, M, G or T (powers of 1024), returns -1 if text is malformed
+int parseThrottleBudget(const char *text, double *filesPerSecond, double *bytesPerSecond);
+
+// whether throttle slows traversal down at all
+int throttleEnabled(const walkThrottle *t);
+
+// fills buckets and clears cancellation before a traversal
+void resetThrottle(walkThrottle *t, int64_t changedSince);
+
+// takes files and bytes used by traversal from budget and waits while more was used than it allows,
+// returns -1 once throttle is cancelled
+int throttlePay(walkThrottle *t, double files, double bytes);
+
+// makes traversal paced by throttle stop as soon as its workers notice
+void cancelThrottle(walkThrottle *t);
+
+int throttleCancelled(walkThrottle *t);
+
+// lowers CPU and I/O priority of calling thread
+void throttleThread(const walkThrottle *t);
+
+// queries mark their start and end, pace backs off while they run
+void throttleQueryStarted(walkThrottle *t);
+
+void throttleQueryFinished(walkThrottle *t);
+
+#endif //FILE_INDEXER_THROTTLE_H
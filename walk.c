@@ -0,0 +1,730 @@
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+#include "magic.h"
+#include "signature.h"
+#include "throttle.h"
+#include "checkpoint.h"
+
+#define DEQUE_INITIAL_CAPACITY 64
+#define WORKER_INITIAL_CAPACITY 1024
+#define IDLE_WAIT_NS 10000000L
+#define PATH_BUFFER_INITIAL_CAPACITY 4096
+// stat calls of a worker paid to throttle at once
+#define THROTTLE_CHUNK 64
+
+// directories waiting to be scanned, owner works on the tail and thieves take from the head
+typedef struct walkDeque_s {
+    pthread_mutex_t lock;
+    const char **jobs;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} walkDeque;
+
+typedef struct walkWorker_s {
+    pthread_t threadID;
+    int id;
+    struct walkContext_s *ctx;
+    walkDeque deque;
+    indexedFile *entries;
+    size_t count;
+    size_t capacity;
+    skippedFile *skipped;
+    size_t skippedCount;
+    size_t skippedCapacity;
+    size_t magicReads;
+    walkCounters counters;
+    stringArena strings;
+    char *pathBuffer;
+    size_t pathCapacity;
+    // files whose type is read once the batch is full or worker runs out of directories
+    magicReader reader;
+    magicFile batch[MAGIC_BATCH_SIZE];
+    struct stat batchStats[MAGIC_BATCH_SIZE];
+    size_t batchCount;
+    stringArena batchPaths;
+    // counters already paid to throttle
+    size_t paidStats;
+    size_t paidBytes;
+    // entries and skipped files written to checkpoint already
+    size_t savedCount;
+    size_t savedSkipped;
+    // child directories changed recently, queued after the rest so they are scanned first
+    const char **recent;
+    size_t recentCount;
+    size_t recentCapacity;
+    // bytes of entries held until they are handed to spill, and entries handed over
+    size_t heldBytes;
+    size_t spilled;
+} walkWorker;
+
+typedef struct walkContext_s {
+    walkWorker *workers;
+    int threads;
+    const typeCache *previous;
+    // NULL when traversal runs at full speed
+    walkThrottle *throttle;
+    // directories queued or being scanned, traversal is done when it drops to 0
+    atomic_long pending;
+    atomic_int idle;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    // NULL when progress is not saved; one worker saves it while the rest wait between directories
+    walkCheckpoint *checkpoint;
+    atomic_llong nextSave;
+    atomic_int pausing;
+    // guarded by pauseLock, paused counts workers waiting in current round
+    int round;
+    int paused;
+    int exited;
+    pthread_mutex_t pauseLock;
+    pthread_cond_t pauseCond;
+    // NULL when entries are gathered until traversal ends
+    const walkSpill *spill;
+    // NULL when nobody is told of directories
+    const walkVisit *visit;
+} walkContext;
+
+int defaultWalkThreads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    if (cpus > WALK_MAX_THREADS) return WALK_MAX_THREADS;
+    return (int) cpus;
+}
+
+static void dequePush(walkDeque *q, const char *job) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        if (q->head > q->capacity / 2) {
+            memmove(q->jobs, q->jobs + q->head, (q->tail - q->head) * sizeof(const char *));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->capacity = q->capacity ? q->capacity * 2 : DEQUE_INITIAL_CAPACITY;
+            q->jobs = realloc(q->jobs, q->capacity * sizeof(const char *));
+            if (q->jobs == NULL) ERR("realloc");
+        }
+    }
+    q->jobs[q->tail++] = job;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static const char *dequePop(walkDeque *q) {
+    const char *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        job = q->jobs[--q->tail];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static const char *dequeSteal(walkDeque *q) {
+    const char *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        job = q->jobs[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static int dequeEmpty(walkDeque *q) {
+    pthread_mutex_lock(&q->lock);
+    int empty = q->tail == q->head;
+    pthread_mutex_unlock(&q->lock);
+    return empty;
+}
+
+static void wakeIdle(walkContext *ctx, int all) {
+    pthread_mutex_lock(&ctx->idleLock);
+    if (all) {
+        pthread_cond_broadcast(&ctx->idleCond);
+    } else {
+        pthread_cond_signal(&ctx->idleCond);
+    }
+    pthread_mutex_unlock(&ctx->idleLock);
+}
+
+// directory path has to stay valid until the traversal ends, entries handed to spill take their paths along
+// so queued directories get a copy of their own then
+static void pushJob(walkWorker *w, const char *directory) {
+    walkContext *ctx = w->ctx;
+    if (ctx->spill != NULL) {
+        directory = strdup(directory);
+        if (directory == NULL) ERR("strdup");
+    }
+    atomic_fetch_add(&ctx->pending, 1);
+    dequePush(&w->deque, directory);
+    if (atomic_load(&ctx->idle) > 0) {
+        wakeIdle(ctx, 0);
+    }
+}
+
+static void finishJob(walkWorker *w) {
+    if (atomic_fetch_sub(&w->ctx->pending, 1) == 1) {
+        wakeIdle(w->ctx, 1);
+    }
+}
+
+static const char *stealJob(walkWorker *w) {
+    walkContext *ctx = w->ctx;
+    for (int i = 1; i < ctx->threads; i++) {
+        const char *job = dequeSteal(&ctx->workers[(w->id + i) % ctx->threads].deque);
+        if (job != NULL) return job;
+    }
+    return NULL;
+}
+
+static int anyWork(walkContext *ctx) {
+    for (int i = 0; i < ctx->threads; i++) {
+        if (!dequeEmpty(&ctx->workers[i].deque)) return 1;
+    }
+    return 0;
+}
+
+static int walkCancelled(walkContext *ctx) {
+    return ctx->throttle != NULL && throttleCancelled(ctx->throttle);
+}
+
+// pays stat calls and bytes read since last payment, waits if budget is used up, returns -1 if traversal is cancelled
+static int payThrottle(walkWorker *w) {
+    if (w->ctx->throttle == NULL) return 0;
+    size_t stats = w->counters.statCalls - w->paidStats, bytes = w->counters.bytesRead - w->paidBytes;
+    w->paidStats = w->counters.statCalls;
+    w->paidBytes = w->counters.bytesRead;
+    return throttlePay(w->ctx->throttle, (double) stats, (double) bytes);
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static int64_t nanoseconds(const struct timespec *ts) {
+    return (int64_t) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// summary of everything that changes when file contents are modified
+static uint64_t fileStamp(int64_t modifyTime, int64_t changeTime, off_t size) {
+    return mix64((uint64_t) modifyTime ^ mix64((uint64_t) changeTime ^ mix64((uint64_t) size)));
+}
+
+static size_t cacheSlot(const typeCache *cache, dev_t device, ino_t inode) {
+    return mix64((uint64_t) inode ^ mix64((uint64_t) device)) & (cache->capacity - 1);
+}
+
+// returns 1 and sets type if file was seen unchanged by previous traversal
+static int cachedType(const typeCache *cache, const struct stat *s, int *type) {
+    if (cache == NULL || cache->count == 0) return 0;
+    uint64_t stamp = fileStamp(nanoseconds(&s->st_mtim), nanoseconds(&s->st_ctim), s->st_size);
+    for (size_t i = cacheSlot(cache, s->st_dev, s->st_ino);; i = (i + 1) & (cache->capacity - 1)) {
+        typeCacheSlot *slot = &cache->slots[i];
+        if (slot->type < 0) return 0;
+        if (slot->device == s->st_dev && slot->inode == s->st_ino) {
+            if (slot->stamp != stamp) return 0;
+            // types left out by -T are skipped even if an index built without it holds them
+            *type = slot->type > 0 && typeIndexed(slot->type) ? slot->type : TYPE_NONE;
+            return 1;
+        }
+    }
+}
+
+static void cacheInsert(typeCache *cache, dev_t device, ino_t inode, uint64_t stamp, int type) {
+    for (size_t i = cacheSlot(cache, device, inode);; i = (i + 1) & (cache->capacity - 1)) {
+        typeCacheSlot *slot = &cache->slots[i];
+        if (slot->type < 0) {
+            cache->count++;
+        } else if (slot->device != device || slot->inode != inode) {
+            continue;
+        }
+        slot->device = device;
+        slot->inode = inode;
+        slot->stamp = stamp;
+        slot->type = type;
+        return;
+    }
+}
+
+void initTypeCache(typeCache *cache, size_t expected) {
+    // keeping load factor under 1/2
+    size_t capacity = 16;
+    while (capacity < 2 * expected) capacity *= 2;
+
+    cache->slots = malloc(capacity * sizeof(typeCacheSlot));
+    if (cache->slots == NULL) ERR("malloc");
+    cache->capacity = capacity;
+    cache->count = 0;
+    for (size_t i = 0; i < capacity; i++) cache->slots[i].type = -1;
+}
+
+void cacheEntryType(typeCache *cache, const indexedFile *entry) {
+    // entries converted from legacy index have no identity
+    if (entry->fileType == TYPE_DIRECTORY || entry->inode == 0) return;
+    cacheInsert(cache, entry->device, entry->inode, fileStamp(entry->modifyTime, entry->changeTime, entry->size),
+                entry->fileType);
+}
+
+void buildTypeCache(typeCache *cache, const indexedFile *entries, size_t count,
+                    const skippedFile *skipped, size_t skippedCount) {
+    initTypeCache(cache, count + skippedCount);
+    for (size_t i = 0; i < count; i++) {
+        cacheEntryType(cache, &entries[i]);
+    }
+    for (size_t i = 0; i < skippedCount; i++) {
+        cacheInsert(cache, skipped[i].device, skipped[i].inode, skipped[i].stamp, 0);
+    }
+}
+
+void freeTypeCache(typeCache *cache) {
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+}
+
+// entry refers to path, which has to outlive it
+static void fillEntry(indexedFile *entry, const char *path, const struct stat *s, int type) {
+    const char *p = strrchr(path, '/');
+    entry->path = path;
+    entry->fileName = (p != NULL && p[1] != '\0') ? p + 1 : path;
+    entry->fileType = type;
+    entry->UID = s->st_uid;
+    entry->size = s->st_size;
+    entry->device = s->st_dev;
+    entry->inode = s->st_ino;
+    entry->modifyTime = nanoseconds(&s->st_mtim);
+    entry->changeTime = nanoseconds(&s->st_ctim);
+}
+
+static const indexedFile *addEntry(walkWorker *w, const char *path, const struct stat *s, int type) {
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : WORKER_INITIAL_CAPACITY;
+        w->entries = realloc(w->entries, w->capacity * sizeof(indexedFile));
+        if (w->entries == NULL) ERR("realloc");
+    }
+    indexedFile *entry = &w->entries[w->count++];
+    size_t length = strlen(path);
+    fillEntry(entry, arenaCopy(&w->strings, path, length), s, type);
+    w->heldBytes += sizeof(indexedFile) + length + 1;
+    return entry;
+}
+
+static void addSkipped(walkWorker *w, const struct stat *s) {
+    if (w->ctx->spill != NULL) return;
+    if (w->skippedCount == w->skippedCapacity) {
+        w->skippedCapacity = w->skippedCapacity ? w->skippedCapacity * 2 : WORKER_INITIAL_CAPACITY;
+        w->skipped = realloc(w->skipped, w->skippedCapacity * sizeof(skippedFile));
+        if (w->skipped == NULL) ERR("realloc");
+    }
+    skippedFile *file = &w->skipped[w->skippedCount++];
+    file->device = s->st_dev;
+    file->inode = s->st_ino;
+    file->stamp = fileStamp(nanoseconds(&s->st_mtim), nanoseconds(&s->st_ctim), s->st_size);
+}
+
+static void flushBatch(walkWorker *w) {
+    if (w->batchCount == 0) return;
+    readMagicNumbers(&w->reader, w->batch, w->batchCount, &w->counters);
+    for (size_t i = 0; i < w->batchCount; i++) {
+        if (w->batch[i].type != TYPE_NONE) {
+            addEntry(w, w->batch[i].path, &w->batchStats[i], w->batch[i].type);
+        } else {
+            addSkipped(w, &w->batchStats[i]);
+        }
+    }
+    w->batchCount = 0;
+    freeArena(&w->batchPaths);
+    payThrottle(w);
+}
+
+// magic number is read only for files which are new or changed since previous traversal,
+// reads are batched so that many of them are in flight at once
+static void addFile(walkWorker *w, const struct stat *s) {
+    int type;
+    if (cachedType(w->ctx->previous, s, &type)) {
+        if (type != TYPE_NONE) {
+            addEntry(w, w->pathBuffer, s, type);
+        } else {
+            addSkipped(w, s);
+        }
+        return;
+    }
+    w->magicReads++;
+    w->batch[w->batchCount].path = arenaCopy(&w->batchPaths, w->pathBuffer, strlen(w->pathBuffer));
+    w->batchStats[w->batchCount++] = *s;
+    if (w->batchCount == MAGIC_BATCH_SIZE) flushBatch(w);
+}
+
+// makes room in worker's path buffer for a path of given length
+static void reservePath(walkWorker *w, size_t length) {
+    if (length + 1 <= w->pathCapacity) return;
+    while (w->pathCapacity < length + 1) {
+        w->pathCapacity = w->pathCapacity ? w->pathCapacity * 2 : PATH_BUFFER_INITIAL_CAPACITY;
+    }
+    w->pathBuffer = realloc(w->pathBuffer, w->pathCapacity);
+    if (w->pathBuffer == NULL) ERR("realloc");
+}
+
+static void addRecent(walkWorker *w, const char *directory) {
+    if (w->recentCount == w->recentCapacity) {
+        w->recentCapacity = w->recentCapacity ? w->recentCapacity * 2 : DEQUE_INITIAL_CAPACITY;
+        w->recent = realloc(w->recent, w->recentCapacity * sizeof(const char *));
+        if (w->recent == NULL) ERR("realloc");
+    }
+    w->recent[w->recentCount++] = directory;
+}
+
+// reads one directory, child directories are queued for any worker to pick up
+static void scanDirectory(walkWorker *w, const char *directory) {
+    if (w->ctx->visit != NULL) w->ctx->visit->visit(directory, w->ctx->visit->arg);
+    w->counters.directories++;
+    w->counters.openCalls++;
+    int dirFd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        w->counters.errors++;
+        return;
+    }
+    DIR *dir = fdopendir(dirFd);
+    if (dir == NULL) {
+        w->counters.errors++;
+        close(dirFd);
+        return;
+    }
+
+    size_t baseLength = strlen(directory);
+    reservePath(w, baseLength + 1);
+    memcpy(w->pathBuffer, directory, baseLength);
+    if (baseLength == 0 || w->pathBuffer[baseLength - 1] != '/') {
+        w->pathBuffer[baseLength++] = '/';
+    }
+
+    walkThrottle *throttle = w->ctx->throttle;
+    int64_t changedSince = throttle != NULL ? throttle->changedSince : 0;
+    w->recentCount = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (w->counters.statCalls - w->paidStats >= THROTTLE_CHUNK && payThrottle(w) < 0) break;
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        struct stat s;
+        w->counters.statCalls++;
+        if (fstatat(dirFd, name, &s, AT_SYMLINK_NOFOLLOW) < 0) {
+            w->counters.errors++;
+            continue;
+        }
+
+        size_t nameLength = strlen(name);
+        reservePath(w, baseLength + nameLength);
+        memcpy(w->pathBuffer + baseLength, name, nameLength + 1);
+
+        if (S_ISDIR(s.st_mode)) {
+            const char *path = addEntry(w, w->pathBuffer, &s, TYPE_DIRECTORY)->path;
+            if (changedSince > 0 && nanoseconds(&s.st_mtim) > changedSince) {
+                addRecent(w, path);
+            } else {
+                pushJob(w, path);
+            }
+        } else if (S_ISREG(s.st_mode)) {
+            addFile(w, &s);
+        }
+    }
+    closedir(dir);
+    // owner pops its deque from the tail, so directories with entries added or removed lately come next
+    for (size_t i = 0; i < w->recentCount; i++) {
+        pushJob(w, w->recent[i]);
+    }
+}
+
+static int64_t monotonicNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// with all workers between directories, queued directories are exactly the ones left to scan
+static void saveCheckpoint(walkContext *ctx) {
+    checkpointBlock block;
+    initCheckpointBlock(&block);
+    for (int i = 0; i < ctx->threads; i++) {
+        walkWorker *w = &ctx->workers[i];
+        checkpointEntries(&block, w->entries + w->savedCount, w->count - w->savedCount);
+        checkpointSkippedFiles(&block, w->skipped + w->savedSkipped, w->skippedCount - w->savedSkipped);
+    }
+    for (int i = 0; i < ctx->threads; i++) {
+        walkDeque *q = &ctx->workers[i].deque;
+        pthread_mutex_lock(&q->lock);
+        for (size_t j = q->head; j < q->tail; j++) checkpointFrontier(&block, q->jobs[j]);
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (appendCheckpoint(ctx->checkpoint, &block) == 0) {
+        for (int i = 0; i < ctx->threads; i++) {
+            ctx->workers[i].savedCount = ctx->workers[i].count;
+            ctx->workers[i].savedSkipped = ctx->workers[i].skippedCount;
+        }
+    }
+    freeCheckpointBlock(&block);
+}
+
+// called between directories: once interval passes the first worker to notice waits for the others to pause
+// and saves progress, the others wait until it is saved
+static void checkpointPause(walkWorker *w) {
+    walkContext *ctx = w->ctx;
+    if (ctx->checkpoint == NULL || ctx->checkpoint->fd < 0) return;
+    if (!atomic_load(&ctx->pausing) && monotonicNow() < atomic_load(&ctx->nextSave)) return;
+    // files waiting for their type are part of progress too
+    flushBatch(w);
+
+    pthread_mutex_lock(&ctx->pauseLock);
+    if (atomic_load(&ctx->pausing)) {
+        int round = ctx->round;
+        ctx->paused++;
+        pthread_cond_broadcast(&ctx->pauseCond);
+        while (atomic_load(&ctx->pausing) && ctx->round == round) {
+            pthread_cond_wait(&ctx->pauseCond, &ctx->pauseLock);
+        }
+    } else if (monotonicNow() >= atomic_load(&ctx->nextSave)) {
+        atomic_store(&ctx->pausing, 1);
+        ctx->round++;
+        ctx->paused = 0;
+        while (ctx->paused + ctx->exited < ctx->threads - 1) {
+            pthread_cond_wait(&ctx->pauseCond, &ctx->pauseLock);
+        }
+        // a cancelled worker may have left a directory half scanned, a finished traversal needs no save
+        if (!walkCancelled(ctx) && atomic_load(&ctx->pending) > 0) saveCheckpoint(ctx);
+        atomic_store(&ctx->nextSave, monotonicNow() + ctx->checkpoint->interval);
+        atomic_store(&ctx->pausing, 0);
+        pthread_cond_broadcast(&ctx->pauseCond);
+    }
+    pthread_mutex_unlock(&ctx->pauseLock);
+}
+
+// returns next directory to scan or NULL once the whole tree is traversed or traversal is cancelled
+static const char *nextJob(walkWorker *w) {
+    walkContext *ctx = w->ctx;
+    while (1) {
+        if (walkCancelled(ctx)) return NULL;
+        checkpointPause(w);
+        const char *job = dequePop(&w->deque);
+        if (job == NULL) job = stealJob(w);
+        if (job != NULL) return job;
+        if (atomic_load(&ctx->pending) == 0) return NULL;
+
+        pthread_mutex_lock(&ctx->idleLock);
+        atomic_fetch_add(&ctx->idle, 1);
+        if (atomic_load(&ctx->pending) != 0 && !anyWork(ctx)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += IDLE_WAIT_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ctx->idleCond, &ctx->idleLock, &deadline);
+        }
+        atomic_fetch_sub(&ctx->idle, 1);
+        pthread_mutex_unlock(&ctx->idleLock);
+    }
+}
+
+// hands entries held by worker over to spill and frees them with their paths
+static void spillEntries(walkWorker *w) {
+    const walkSpill *spill = w->ctx->spill;
+    if (w->count > 0) spill->spill(w->entries, w->count, spill->arg);
+    w->spilled += w->count;
+    w->count = 0;
+    w->heldBytes = 0;
+    freeArena(&w->strings);
+}
+
+static void *walkWorkerRun(void *voidPtr) {
+    walkWorker *w = voidPtr;
+    const walkSpill *spill = w->ctx->spill;
+    if (w->ctx->throttle != NULL) throttleThread(w->ctx->throttle);
+    const char *directory;
+    while ((directory = nextJob(w)) != NULL) {
+        scanDirectory(w, directory);
+        finishJob(w);
+        if (spill != NULL) {
+            free((char *) directory);
+            if (w->heldBytes >= spill->budget) spillEntries(w);
+        }
+    }
+    // a save in progress stops waiting for workers which are done
+    pthread_mutex_lock(&w->ctx->pauseLock);
+    w->ctx->exited++;
+    pthread_cond_broadcast(&w->ctx->pauseCond);
+    pthread_mutex_unlock(&w->ctx->pauseLock);
+    if (walkCancelled(w->ctx)) {
+        w->batchCount = 0;
+        freeArena(&w->batchPaths);
+    } else {
+        flushBatch(w);
+        if (spill != NULL) spillEntries(w);
+    }
+    return NULL;
+}
+
+// worker 0 takes over entries found before, directories left to scan are spread over all workers
+static void resumeWalk(walkContext *ctx, walkCheckpoint *checkpoint) {
+    walkWorker *first = &ctx->workers[0];
+    walkResult *resumed = &checkpoint->resumed;
+    first->entries = resumed->entries;
+    first->count = first->capacity = first->savedCount = resumed->count;
+    first->skipped = resumed->skipped;
+    first->skippedCount = first->skippedCapacity = first->savedSkipped = resumed->skippedCount;
+    arenaMerge(&first->strings, &resumed->strings);
+    resumed->entries = NULL;
+    resumed->skipped = NULL;
+    resumed->count = resumed->skippedCount = 0;
+    for (size_t i = 0; i < checkpoint->frontierCount; i++) {
+        pushJob(&ctx->workers[i % ctx->threads], checkpoint->frontier[i]);
+    }
+}
+
+int parallelWalk(const char *root, int threads, const typeCache *previous, walkThrottle *throttle,
+                 walkCheckpoint *checkpoint, const walkSpill *spill, const walkVisit *visit, walkResult *result) {
+    memset(result, 0, sizeof(walkResult));
+
+    struct stat s;
+    result->counters.statCalls++;
+    if (lstat(root, &s) < 0) {
+        result->counters.errors++;
+        return -1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+
+    walkContext ctx = {.threads = threads, .previous = previous, .throttle = throttle, .checkpoint = checkpoint,
+                       .spill = spill, .visit = visit};
+    atomic_init(&ctx.pending, 0);
+    atomic_init(&ctx.idle, 0);
+    pthread_mutex_init(&ctx.idleLock, NULL);
+    pthread_cond_init(&ctx.idleCond, NULL);
+    atomic_init(&ctx.nextSave, monotonicNow() + (checkpoint != NULL ? checkpoint->interval : 0));
+    atomic_init(&ctx.pausing, 0);
+    pthread_mutex_init(&ctx.pauseLock, NULL);
+    pthread_cond_init(&ctx.pauseCond, NULL);
+    ctx.workers = calloc(threads, sizeof(walkWorker));
+    if (ctx.workers == NULL) ERR("calloc");
+    for (int i = 0; i < threads; i++) {
+        ctx.workers[i].id = i;
+        ctx.workers[i].ctx = &ctx;
+        pthread_mutex_init(&ctx.workers[i].deque.lock, NULL);
+        initMagicReader(&ctx.workers[i].reader);
+    }
+
+    // root is reported the same way nftw reports it, before its contents
+    if (checkpoint != NULL && checkpoint->frontierCount > 0) {
+        resumeWalk(&ctx, checkpoint);
+    } else if (S_ISDIR(s.st_mode)) {
+        pushJob(&ctx.workers[0], addEntry(&ctx.workers[0], root, &s, TYPE_DIRECTORY)->path);
+    } else if (S_ISREG(s.st_mode)) {
+        reservePath(&ctx.workers[0], strlen(root));
+        strcpy(ctx.workers[0].pathBuffer, root);
+        addFile(&ctx.workers[0], &s);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        int err = pthread_create(&ctx.workers[i].threadID, NULL, walkWorkerRun, &ctx.workers[i]);
+        if (err != 0) ERR("pthread_create");
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ctx.workers[i].threadID, NULL);
+    }
+
+    // merging per-thread buffers
+    size_t total = 0, skippedTotal = 0;
+    for (int i = 0; i < threads; i++) {
+        total += ctx.workers[i].count;
+        skippedTotal += ctx.workers[i].skippedCount;
+        result->magicReads += ctx.workers[i].magicReads;
+        result->spilled += ctx.workers[i].spilled;
+        walkCounters *counters = &ctx.workers[i].counters;
+        result->counters.directories += counters->directories;
+        result->counters.statCalls += counters->statCalls;
+        result->counters.openCalls += counters->openCalls;
+        result->counters.readCalls += counters->readCalls;
+        result->counters.bytesRead += counters->bytesRead;
+        result->counters.errors += counters->errors;
+    }
+    if (total > 0) {
+        result->entries = malloc(total * sizeof(indexedFile));
+        if (result->entries == NULL) ERR("malloc");
+    }
+    if (skippedTotal > 0) {
+        result->skipped = malloc(skippedTotal * sizeof(skippedFile));
+        if (result->skipped == NULL) ERR("malloc");
+    }
+    for (int i = 0; i < threads; i++) {
+        walkWorker *w = &ctx.workers[i];
+        if (w->count > 0) {
+            memcpy(result->entries + result->count, w->entries, w->count * sizeof(indexedFile));
+            result->count += w->count;
+        }
+        if (w->skippedCount > 0) {
+            memcpy(result->skipped + result->skippedCount, w->skipped, w->skippedCount * sizeof(skippedFile));
+            result->skippedCount += w->skippedCount;
+        }
+        arenaMerge(&result->strings, &w->strings);
+        free(w->entries);
+        free(w->skipped);
+        free(w->pathBuffer);
+        // a cancelled traversal leaves copies of directories it did not scan
+        for (size_t j = w->deque.head; spill != NULL && j < w->deque.tail; j++) free((char *) w->deque.jobs[j]);
+        free(w->deque.jobs);
+        free(w->recent);
+        pthread_mutex_destroy(&w->deque.lock);
+        freeMagicReader(&w->reader);
+    }
+    free(ctx.workers);
+    pthread_mutex_destroy(&ctx.idleLock);
+    pthread_cond_destroy(&ctx.idleCond);
+    pthread_mutex_destroy(&ctx.pauseLock);
+    pthread_cond_destroy(&ctx.pauseCond);
+    return walkCancelled(&ctx) ? -2 : 0;
+}
+
+int statEntry(const char *path, const typeCache *cache, indexedFile *entry, walkCounters *counters) {
+    struct stat s;
+    counters->statCalls++;
+    if (lstat(path, &s) < 0) return 0;
+    if (S_ISDIR(s.st_mode)) {
+        fillEntry(entry, path, &s, TYPE_DIRECTORY);
+        return 1;
+    }
+    if (!S_ISREG(s.st_mode)) return 0;
+
+    int type;
+    if (!cachedType(cache, &s, &type)) {
+        type = magicNumberAt(counters, AT_FDCWD, path);
+    }
+    if (type == TYPE_NONE) return 0;
+    fillEntry(entry, path, &s, type);
+    return 1;
+}
+
+void freeWalkResult(walkResult *result) {
+    free(result->entries);
+    free(result->skipped);
+    freeArena(&result->strings);
+    memset(result, 0, sizeof(walkResult));
+}
@@ -0,0 +1,127 @@
+#ifndef FILE_INDEXER_WALK_H
+#define FILE_INDEXER_WALK_H
+
+#include <stddef.h>
+
+#include "indexer.h"
+#include "arena.h"
+#include "throttle.h"
+
+#define WALK_MAX_THREADS 256
+
+// regular file whose type is not indexed, remembered so it is not read again
+typedef struct skippedFile_s {
+    dev_t device;
+    ino_t inode;
+    uint64_t stamp;
+} skippedFile;
+
+// system calls and failures of one traversal, each worker counts its own and they are summed at the end
+typedef struct walkCounters_s {
+    size_t directories;
+    size_t statCalls;
+    size_t openCalls;
+    size_t readCalls;
+    size_t bytesRead;
+    // entries which could not be opened or stat'ed
+    size_t errors;
+} walkCounters;
+
+// entries gathered by one traversal, in no particular order
+typedef struct walkResult_s {
+    indexedFile *entries;
+    size_t count;
+    skippedFile *skipped;
+    size_t skippedCount;
+    // paths of entries
+    stringArena strings;
+    // files opened to read their magic number, the rest had their type cached
+    size_t magicReads;
+    // entries handed over to spill instead of being kept in entries
+    size_t spilled;
+    walkCounters counters;
+} walkResult;
+
+// progress of a traversal appended to a file every interval, so that a traversal interrupted by a crash or
+// exit! resumes where the last save left off
+typedef struct walkCheckpoint_s {
+    // file progress is saved to
+    const char *path;
+    // nanoseconds between saves
+    int64_t interval;
+    // open for appending by openCheckpoint, -1 when progress is not saved
+    int fd;
+    // end of the last complete save
+    off_t length;
+    // progress to resume from, empty when traversal starts from root: entries found before and directories
+    // which were not scanned yet, the traversal takes both over
+    walkResult resumed;
+    const char **frontier;
+    size_t frontierCount;
+    // progress saved by the traversal
+    size_t saves;
+} walkCheckpoint;
+
+// entries handed over by workers while traversal runs instead of being gathered in result, so that memory
+// held by a traversal stays bounded; skipped files are not remembered then
+typedef struct walkSpill_s {
+    // bytes of entries and their paths a worker holds before handing them over
+    size_t budget;
+    // called by many workers at once, entries and their paths are valid only during the call
+    void (*spill)(const indexedFile *entries, size_t count, void *arg);
+    void *arg;
+} walkSpill;
+
+// called by many workers at once for every directory before it is read
+typedef struct walkVisit_s {
+    void (*visit)(const char *directory, void *arg);
+    void *arg;
+} walkVisit;
+
+typedef struct typeCacheSlot_s {
+    dev_t device;
+    ino_t inode;
+    uint64_t stamp;
+    // type of file, 0 (never a directory) for files of not indexed type, -1 for empty slot
+    int type;
+} typeCacheSlot;
+
+// types of regular files seen by previous traversal keyed by device and inode
+typedef struct typeCache_s {
+    typeCacheSlot *slots;
+    size_t capacity;
+    size_t count;
+} typeCache;
+
+// traverses root with a pool of threads stealing directories from each other,
+// files unchanged since the traversal which filled previous are not read again,
+// throttle paces the traversal and may cancel it, NULL runs it at full speed,
+// checkpoint opened by openCheckpoint saves progress and may hold progress to resume from, NULL for none,
+// spill takes entries over as they are found, NULL gathers them all in result,
+// visit is told of every directory before it is read, NULL for none,
+// returns 0 on success, -1 if root could not be read and -2 if traversal was cancelled
+int parallelWalk(const char *root, int threads, const typeCache *previous, walkThrottle *throttle,
+                 walkCheckpoint *checkpoint, const walkSpill *spill, const walkVisit *visit, walkResult *result);
+
+void freeWalkResult(walkResult *result);
+
+// fills entry for a single path, entry refers to path instead of copying it, system calls are added to counters,
+// returns 0 if path does not exist or is not of indexed type
+int statEntry(const char *path, const typeCache *cache, indexedFile *entry, walkCounters *counters);
+
+// creates empty cache with room for expected files
+void initTypeCache(typeCache *cache, size_t expected);
+
+// remembers type of entry if it is a regular file of indexed type
+void cacheEntryType(typeCache *cache, const indexedFile *entry);
+
+// fills cache with types of all regular files from entries and skipped files
+void buildTypeCache(typeCache *cache, const indexedFile *entries, size_t count,
+                    const skippedFile *skipped, size_t skippedCount);
+
+void freeTypeCache(typeCache *cache);
+
+// number of worker threads used when -j is not given
+int defaultWalkThreads(void);
+
+#endif //FILE_INDEXER_WALK_H
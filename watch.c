@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "indexer.h"
+#include "watch.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB \
+                    | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define EVENT_BUFFER_SIZE 65536
+#define WATCH_INITIAL_CAPACITY 1024
+
+void watchDirectory(watcher *w, const char *path) {
+    int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC && !w->limitReached) {
+            w->limitReached = 1;
+            fprintf(stderr, "inotify watch limit reached, changes below %s rely on periodic reindexing\n", path);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (wd >= w->capacity) {
+        int capacity = w->capacity ? w->capacity : WATCH_INITIAL_CAPACITY;
+        while (capacity <= wd) capacity *= 2;
+        w->paths = realloc(w->paths, capacity * sizeof(char *));
+        if (w->paths == NULL) ERR("realloc");
+        memset(w->paths + w->capacity, 0, (capacity - w->capacity) * sizeof(char *));
+        w->capacity = capacity;
+    }
+    if (w->paths[wd] == NULL || strcmp(w->paths[wd], path) != 0) {
+        free(w->paths[wd]);
+        w->paths[wd] = strdup(path);
+        if (w->paths[wd] == NULL) ERR("strdup");
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static int isInSubtree(const char *path, const char *directory, size_t length) {
+    return strncmp(path, directory, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+void unwatchSubtree(watcher *w, const char *path) {
+    size_t length = strlen(path);
+    pthread_mutex_lock(&w->lock);
+    for (int wd = 0; wd < w->capacity; wd++) {
+        if (w->paths[wd] != NULL && isInSubtree(w->paths[wd], path, length)) {
+            inotify_rm_watch(w->fd, wd);
+            free(w->paths[wd]);
+            w->paths[wd] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// returns full path of event's subject or NULL if the directory is no longer watched
+static char *eventPath(watcher *w, const struct inotify_event *event) {
+    char *path = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (event->wd >= 0 && event->wd < w->capacity && w->paths[event->wd] != NULL) {
+        const char *directory = w->paths[event->wd];
+        size_t directoryLength = strlen(directory);
+        size_t nameLength = strlen(event->name);
+        path = malloc(directoryLength + nameLength + 2);
+        if (path == NULL) ERR("malloc");
+        memcpy(path, directory, directoryLength);
+        path[directoryLength] = '/';
+        memcpy(path + directoryLength + 1, event->name, nameLength + 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return path;
+}
+
+static void forgetWatch(watcher *w, int wd) {
+    pthread_mutex_lock(&w->lock);
+    if (wd >= 0 && wd < w->capacity) {
+        free(w->paths[wd]);
+        w->paths[wd] = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void handleEvent(watcher *w, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        w->callbacks.overflow(w->callbacks.arg);
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        forgetWatch(w, event->wd);
+        return;
+    }
+    // events about watched directory itself are reported by its parent too
+    if (event->len == 0) return;
+
+    char *path = eventPath(w, event);
+    if (path == NULL) return;
+
+    int isDirectory = (event->mask & IN_ISDIR) != 0;
+    if (isDirectory && (event->mask & (IN_DELETE | IN_MOVED_FROM))) {
+        unwatchSubtree(w, path);
+    }
+    int subtree = isDirectory && (event->mask & (IN_CREATE | IN_MOVED_TO));
+    w->callbacks.refresh(path, subtree, w->callbacks.arg);
+    free(path);
+}
+
+static void *watchEvents(void *voidPtr) {
+    watcher *w = voidPtr;
+    char buffer[EVENT_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t length = read(w->fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            perror("Error reading inotify events");
+            return NULL;
+        }
+
+        // index is locked while events are applied, cancelling there would leave it locked
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        for (char *p = buffer; p < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            handleEvent(w, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        w->callbacks.flush(w->callbacks.arg);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+int startWatcher(watcher *w, const watchCallbacks *callbacks) {
+    memset(w, 0, sizeof(watcher));
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd < 0) {
+        perror("Error initializing inotify");
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->callbacks = *callbacks;
+
+    int err = pthread_create(&w->threadID, NULL, watchEvents, w);
+    if (err != 0) ERR("pthread_create");
+    return 0;
+}
+
+void stopWatcher(watcher *w) {
+    pthread_cancel(w->threadID);
+    pthread_join(w->threadID, NULL);
+    close(w->fd);
+    for (int wd = 0; wd < w->capacity; wd++) {
+        free(w->paths[wd]);
+    }
+    free(w->paths);
+    pthread_mutex_destroy(&w->lock);
+}
@@ -0,0 +1,39 @@
+#ifndef FILE_INDEXER_WATCH_H
+#define FILE_INDEXER_WATCH_H
+
+#include <pthread.h>
+
+// how the index is updated when events arrive, all called from the watching thread
+typedef struct watchCallbacks_s {
+    // path was created, removed or modified, when subtree is set whole directory has to be rescanned
+    void (*refresh)(const char *path, int subtree, void *arg);
+    // events were lost because inotify queue overflowed
+    void (*overflow)(void *arg);
+    // all events read at once were passed to refresh
+    void (*flush)(void *arg);
+    void *arg;
+} watchCallbacks;
+
+typedef struct watcher_s {
+    int fd;
+    pthread_t threadID;
+    pthread_mutex_t lock;
+    // watched directory paths indexed by watch descriptor
+    char **paths;
+    int capacity;
+    int limitReached;
+    watchCallbacks callbacks;
+} watcher;
+
+// initializes inotify and starts the thread applying events, returns -1 if inotify is not available
+int startWatcher(watcher *w, const watchCallbacks *callbacks);
+
+// adds directory to watched set, watching the same directory again only updates its path
+void watchDirectory(watcher *w, const char *path);
+
+// stops watching directory and all directories below it
+void unwatchSubtree(watcher *w, const char *path);
+
+void stopWatcher(watcher *w);
+
+#endif //FILE_INDEXER_WATCH_H